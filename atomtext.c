@@ -0,0 +1,309 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// atomtext.h: Searching packed atom text
+
+#include <stdint.h>
+#include <string.h>
+
+#include "atomtext.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ATOM_TEXT_X86
+#include <immintrin.h>
+#endif
+
+#define NOT_FOUND SIZE_MAX
+
+// Something to look for in packed atom text: the given text at the start of an
+// atom, and if whole is set, nothing else in the atom
+typedef struct atom_pattern {
+    const char *text;
+    size_t length;
+    int whole;
+} atom_pattern;
+
+// The operations that differ between kernels
+//
+// find() returns the first position at or after start where the pattern
+// matches, or NOT_FOUND if it doesn't match anywhere in the first used bytes.
+typedef struct atom_kernel {
+    size_t (*find)(const char *buf, size_t used, size_t start, const atom_pattern *pattern);
+    size_t (*count_nuls)(const char *buf, size_t used);
+} atom_kernel;
+
+size_t find_scalar(const char *buf, size_t used, size_t start, const atom_pattern *pattern);
+size_t count_nuls_scalar(const char *buf, size_t used);
+
+#ifdef ATOM_TEXT_X86
+size_t find_sse2(const char *buf, size_t used, size_t start, const atom_pattern *pattern);
+size_t count_nuls_sse2(const char *buf, size_t used);
+size_t find_avx2(const char *buf, size_t used, size_t start, const atom_pattern *pattern);
+size_t count_nuls_avx2(const char *buf, size_t used);
+#endif
+
+// Get the kernel in use, picking one if we haven't yet
+const atom_kernel *current_kernel(void);
+// Get the number of positions at the start of a buffer where a pattern could
+// begin without running off the end
+size_t pattern_limit(size_t used, const atom_pattern *pattern);
+// Return 1 if the pattern matches at the given position
+int pattern_matches(const char *buf, size_t position, const atom_pattern *pattern);
+
+static const atom_kernel kernels[] = {
+    [ATOM_KERNEL_SCALAR] = { find_scalar, count_nuls_scalar },
+#ifdef ATOM_TEXT_X86
+    [ATOM_KERNEL_SSE2] = { find_sse2, count_nuls_sse2 },
+    [ATOM_KERNEL_AVX2] = { find_avx2, count_nuls_avx2 },
+#endif
+};
+
+static const atom_kernel *kernel_in_use = 0;
+
+long atom_text_find(const char *buf, size_t used, const char *text, size_t length) {
+    if (length == 0)
+        return -1;
+
+    atom_pattern pattern = { text, length, 1 };
+    size_t position = current_kernel()->find(buf, used, 0, &pattern);
+
+    return position == NOT_FOUND ? -1 : (long)position;
+}
+
+size_t atom_text_find_prefix(const char *buf, size_t used, const char *prefix, size_t length,
+    size_t *results, size_t max_results) {
+
+    size_t found = 0;
+
+    if (length == 0) {
+        for (size_t position = 0; position < used; position += strlen(buf + position) + 1) {
+            if (found < max_results)
+                results[found] = position;
+            found++;
+        }
+
+        return found;
+    }
+
+    const atom_kernel *kernel = current_kernel();
+    atom_pattern pattern = { prefix, length, 0 };
+    size_t position = 0;
+
+    while ((position = kernel->find(buf, used, position, &pattern)) != NOT_FOUND) {
+        if (found < max_results)
+            results[found] = position;
+        found++;
+
+        // The next atom can't start until after this one's prefix.
+        position += length;
+    }
+
+    return found;
+}
+
+size_t atom_text_count(const char *buf, size_t used) {
+    return current_kernel()->count_nuls(buf, used);
+}
+
+int atom_text_kernel() {
+    return current_kernel() - kernels;
+}
+
+const char *atom_text_kernel_name(int kernel) {
+    switch (kernel) {
+    case ATOM_KERNEL_SCALAR: return "scalar";
+    case ATOM_KERNEL_SSE2: return "sse2";
+    case ATOM_KERNEL_AVX2: return "avx2";
+    default: return "unknown";
+    }
+}
+
+int atom_text_use_kernel(int kernel) {
+    switch (kernel) {
+    case ATOM_KERNEL_SCALAR:
+        break;
+#ifdef ATOM_TEXT_X86
+    case ATOM_KERNEL_SSE2:
+        if (!__builtin_cpu_supports("sse2"))
+            return 0;
+        break;
+    case ATOM_KERNEL_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return 0;
+        break;
+#endif
+    default:
+        return 0;
+    }
+
+    kernel_in_use = &kernels[kernel];
+    return 1;
+}
+
+const atom_kernel *current_kernel() {
+    if (!kernel_in_use) {
+        if (!atom_text_use_kernel(ATOM_KERNEL_AVX2) && !atom_text_use_kernel(ATOM_KERNEL_SSE2))
+            atom_text_use_kernel(ATOM_KERNEL_SCALAR);
+    }
+
+    return kernel_in_use;
+}
+
+size_t pattern_limit(size_t used, const atom_pattern *pattern) {
+    size_t span = pattern->length + (pattern->whole ? 1 : 0);
+    return used >= span ? used - span + 1 : 0;
+}
+
+int pattern_matches(const char *buf, size_t position, const atom_pattern *pattern) {
+    if (position > 0 && buf[position - 1] != 0)
+        return 0;
+
+    if (pattern->whole && buf[position + pattern->length] != 0)
+        return 0;
+
+    return memcmp(buf + position, pattern->text, pattern->length) == 0;
+}
+
+size_t find_scalar(const char *buf, size_t used, size_t start, const atom_pattern *pattern) {
+    size_t limit = pattern_limit(used, pattern);
+
+    for (size_t i = start; i < limit; i++) {
+        if (buf[i] == pattern->text[0] && pattern_matches(buf, i, pattern))
+            return i;
+    }
+
+    return NOT_FOUND;
+}
+
+size_t count_nuls_scalar(const char *buf, size_t used) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < used; i++)
+        count += buf[i] == 0;
+
+    return count;
+}
+
+#ifdef ATOM_TEXT_X86
+
+// The vector kernels check four bytes for each position at once: the one
+// before it must be a NUL, the first and last bytes must match the text, and
+// for a whole atom, the one after the text must be a NUL. Only positions
+// passing all four get compared properly. They look at the byte before each
+// position, so they leave position 0 and whatever doesn't fill a whole vector
+// at the end to a narrower kernel.
+
+__attribute__((target("sse2")))
+size_t find_sse2(const char *buf, size_t used, size_t start, const atom_pattern *pattern) {
+    size_t limit = pattern_limit(used, pattern);
+    size_t i = start;
+
+    if (i == 0) {
+        if (limit > 0 && buf[0] == pattern->text[0] && pattern_matches(buf, 0, pattern))
+            return 0;
+        i = 1;
+    }
+
+    size_t last_offset = pattern->length - 1;
+    __m128i zeros = _mm_setzero_si128();
+    __m128i firsts = _mm_set1_epi8(pattern->text[0]);
+    __m128i lasts = _mm_set1_epi8(pattern->text[last_offset]);
+    __m128i ends = _mm_set1_epi8(pattern->whole ? 0 : -1);
+
+    for (; i + 16 <= limit; i += 16) {
+        __m128i before = _mm_loadu_si128((const __m128i *)(buf + i - 1));
+        __m128i head = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(buf + i + last_offset));
+        __m128i after = _mm_loadu_si128((const __m128i *)(buf + i + last_offset + pattern->whole));
+
+        __m128i hits = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(before, zeros), _mm_cmpeq_epi8(head, firsts)),
+            _mm_and_si128(_mm_cmpeq_epi8(tail, lasts), _mm_or_si128(_mm_cmpeq_epi8(after, zeros), ends)));
+        unsigned mask = _mm_movemask_epi8(hits);
+
+        while (mask) {
+            size_t position = i + __builtin_ctz(mask);
+            if (memcmp(buf + position, pattern->text, pattern->length) == 0)
+                return position;
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(buf, used, i, pattern);
+}
+
+__attribute__((target("sse2")))
+size_t count_nuls_sse2(const char *buf, size_t used) {
+    __m128i zeros = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= used; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(buf + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zeros)));
+    }
+
+    return count + count_nuls_scalar(buf + i, used - i);
+}
+
+__attribute__((target("avx2")))
+size_t find_avx2(const char *buf, size_t used, size_t start, const atom_pattern *pattern) {
+    size_t limit = pattern_limit(used, pattern);
+    size_t i = start;
+
+    if (i == 0) {
+        if (limit > 0 && buf[0] == pattern->text[0] && pattern_matches(buf, 0, pattern))
+            return 0;
+        i = 1;
+    }
+
+    size_t last_offset = pattern->length - 1;
+    __m256i zeros = _mm256_setzero_si256();
+    __m256i firsts = _mm256_set1_epi8(pattern->text[0]);
+    __m256i lasts = _mm256_set1_epi8(pattern->text[last_offset]);
+    __m256i ends = _mm256_set1_epi8(pattern->whole ? 0 : -1);
+
+    for (; i + 32 <= limit; i += 32) {
+        __m256i before = _mm256_loadu_si256((const __m256i *)(buf + i - 1));
+        __m256i head = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(buf + i + last_offset));
+        __m256i after = _mm256_loadu_si256((const __m256i *)(buf + i + last_offset + pattern->whole));
+
+        __m256i hits = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(before, zeros), _mm256_cmpeq_epi8(head, firsts)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(tail, lasts), _mm256_or_si256(_mm256_cmpeq_epi8(after, zeros), ends)));
+        unsigned mask = _mm256_movemask_epi8(hits);
+
+        while (mask) {
+            size_t position = i + __builtin_ctz(mask);
+            if (memcmp(buf + position, pattern->text, pattern->length) == 0)
+                return position;
+            mask &= mask - 1;
+        }
+    }
+
+    return find_sse2(buf, used, i, pattern);
+}
+
+__attribute__((target("avx2")))
+size_t count_nuls_avx2(const char *buf, size_t used) {
+    __m256i zeros = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= used; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(buf + i));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zeros)));
+    }
+
+    return count + count_nuls_sse2(buf + i, used - i);
+}
+
+#endif
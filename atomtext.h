@@ -0,0 +1,62 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// atomtext.h: Searching packed atom text
+
+// Atom text is stored as a run of NUL-terminated strings packed end to end, so
+// that an atom starts at the beginning of the buffer or right after a NUL. The
+// functions here search such a buffer a vector at a time instead of a byte at a
+// time: a position is only worth comparing against the text we're looking for
+// if the byte before it is a NUL and its first and last bytes match; and when
+// looking for a whole atom, the byte after the text must be a NUL too. Checking
+// those bytes for 16 or 32 positions at once rules out nearly every position
+// without calling memcmp().
+//
+// There are three kernels: a scalar one which works anywhere, an SSE2 one, and
+// an AVX2 one. The best one the CPU supports is picked the first time any of
+// these functions is called.
+
+#ifndef ATOMTEXT_H
+#define ATOMTEXT_H
+
+#include <stddef.h>
+
+#define ATOM_KERNEL_SCALAR 0
+#define ATOM_KERNEL_SSE2 1
+#define ATOM_KERNEL_AVX2 2
+
+// Find the given text as an atom in a buffer of packed atom text; return its
+// offset, or -1 if it isn't there
+//
+// Only the first used bytes of the buffer are searched.
+long atom_text_find(const char *buf, size_t used, const char *text, size_t length);
+
+// Find the atoms in a buffer of packed atom text which start with the given
+// prefix
+//
+// The offsets of the first max_results of them are stored in results, in
+// order. Return the number of atoms found, which may be more than max_results.
+size_t atom_text_find_prefix(const char *buf, size_t used, const char *prefix, size_t length,
+    size_t *results, size_t max_results);
+
+// Count the atoms in a buffer of packed atom text
+size_t atom_text_count(const char *buf, size_t used);
+
+// Get the kernel that the functions above are using
+int atom_text_kernel(void);
+// Get the name of a kernel
+const char *atom_text_kernel_name(int kernel);
+// Make the functions above use the given kernel; return 0 if this CPU doesn't
+// support it
+//
+// This isn't thread-safe; it's meant for tests and benchmarks.
+int atom_text_use_kernel(int kernel);
+
+#endif
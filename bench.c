@@ -0,0 +1,924 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// bench.c: Some benchmarks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atomtext.h"
+#include "commands.h"
+#include "dump.h"
+#include "equal.h"
+#include "gc.h"
+#include "heap.h"
+#include "heapinfo.h"
+#include "histogram.h"
+#include "map.h"
+#include "nursery.h"
+#include "panic.h"
+#include "persist.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "rawheap.h"
+#include "rcheap.h"
+#include "region.h"
+#include "scan.h"
+#include "shmheap.h"
+#include "txn.h"
+#include "weak.h"
+#include "wire.h"
+
+
+
+// Hash and compare a long list.
+void bench_equal_deep(void);
+// Hash and compare a balanced tree with no sharing.
+void bench_equal_wide(void);
+// Hash and compare a tree built with heavy sharing.
+void bench_equal_shared(void);
+// Build persistent vectors, with and without a transient.
+void bench_pvec(void);
+// Build persistent maps, with and without a transient.
+void bench_pmap(void);
+// Run map lookups through the text and binary protocols, and through the text
+// protocol while profiling.
+void bench_protocols(void);
+// Build lists inside and outside of transactions.
+void bench_transactions(void);
+// Search a buffer of 10 million atoms with each kernel.
+void bench_atom_text(void);
+// Scan and verify a heap of 100 million cells.
+void bench_scan(void);
+// Collect a heap of 32 million cells with different numbers of threads.
+void bench_gc(void);
+// Make garbage with incremental collection running, with different slice
+// sizes.
+void bench_incremental_gc(void);
+// Make short-lived garbage next to a large live tree, collecting it with minor
+// collections and with full ones.
+void bench_nursery(void);
+// Build and throw away temporary lists, freeing them cell by cell and with
+// regions.
+void bench_regions(void);
+// Make and follow weak references, and use a weak-keyed map as a cache whose
+// keys keep going away.
+void bench_weak(void);
+// Get information about a fragmented heap of 10 million cells.
+void bench_heapinfo(void);
+// Attach to a shared heap of 4 million cells, take its locks, and build lists
+// in it and in a private heap.
+void bench_shm_heap(void);
+// Dump a heap of 10 million cells holding lists of atoms, with and without
+// compression, and load it back.
+void bench_dump(void);
+// Run a million shell commands from a file one at a time, as the shell does,
+// and through the pipeline.
+void bench_pipeline(void);
+// Build, walk, change and free lists filling a heap of a million cells, which
+// in a fixed-size build is the static one.
+void bench_fixed(void);
+// Dump a heap into memory, returning the dump's size
+size_t dump_to_memory(heap_p heap, int flags, char **data);
+// Make the given number of pairs of conses pointing at each other
+void make_cycles(heap_p heap, int pairs, int item, int nil);
+
+
+
+#define RUN_BENCH(bench, ...) do { \
+    printf("Running %s...\n", #bench); \
+    bench(__VA_ARGS__); \
+} while (0)
+
+int main(int argc, char **argv) {
+    // The other benchmarks need heaps of other sizes, or more than one heap.
+#ifdef FIXED_CELLS
+    RUN_BENCH(bench_fixed);
+    return 0;
+#endif
+
+    RUN_BENCH(bench_equal_deep);
+    RUN_BENCH(bench_equal_wide);
+    RUN_BENCH(bench_equal_shared);
+    RUN_BENCH(bench_pvec);
+    RUN_BENCH(bench_pmap);
+    RUN_BENCH(bench_protocols);
+    RUN_BENCH(bench_transactions);
+    RUN_BENCH(bench_atom_text);
+    RUN_BENCH(bench_scan);
+    RUN_BENCH(bench_gc);
+    RUN_BENCH(bench_incremental_gc);
+    RUN_BENCH(bench_nursery);
+    RUN_BENCH(bench_regions);
+    RUN_BENCH(bench_weak);
+    RUN_BENCH(bench_heapinfo);
+    RUN_BENCH(bench_shm_heap);
+    RUN_BENCH(bench_dump);
+    RUN_BENCH(bench_pipeline);
+    RUN_BENCH(bench_fixed);
+}
+
+// Get the current time in seconds
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Print how long it took to do some number of things
+void report(const char *what, long count, double seconds) {
+    printf("    %-32s %10ld in %8.3f ms (%7.1f ns each)\n",
+        what, count, seconds * 1e3, seconds * 1e9 / count);
+}
+
+// Time an expression which handles some number of things
+#define TIME(what, count, expr) do { \
+    double TIME_start = now_seconds(); \
+    expr; \
+    report((what), (count), now_seconds() - TIME_start); \
+} while (0)
+
+// Build a list of the given length out of the given atoms
+int build_list(heap_p heap, int length, int item, int nil) {
+    int list = nil;
+
+    for (int i = 0; i < length; i++)
+        list = rc_cons(heap, item, list);
+
+    return list;
+}
+
+// Free a list built by build_list(), leaving its items
+void free_list(heap_p heap, int list) {
+    int nil = getfield(heap, FIELD_CDR, list);
+    while (getfield(heap, FIELD_TAG, nil) == TAG_CONS)
+        nil = getfield(heap, FIELD_CDR, nil);
+
+    while (list != nil) {
+        int next = getfield(heap, FIELD_CDR, list);
+        rc_free(heap, list);
+        list = next;
+    }
+}
+
+// Build a balanced tree with 2^depth leaves, without sharing any subtrees
+int build_tree(heap_p heap, int depth, int leaf) {
+    if (depth == 0)
+        return leaf;
+
+    int left = build_tree(heap, depth - 1, leaf);
+    int right = build_tree(heap, depth - 1, leaf);
+
+    return rc_cons(heap, left, right);
+}
+
+// Push some number of items onto a vector, freeing each old version
+int push_items(heap_p heap, int vec, int count, int item) {
+    for (int i = 0; i < count; i++) {
+        int next = rc_pvec_push(heap, vec, item);
+        rc_free(heap, vec);
+        vec = next;
+    }
+
+    return vec;
+}
+
+// Put some number of keys into a map, freeing each old version
+int put_keys(heap_p heap, int map, const int *keys, int count, int value) {
+    for (int i = 0; i < count; i++) {
+        int next = rc_pmap_put(heap, map, keys[i], value);
+        if (next != map) {
+            rc_free(heap, map);
+            map = next;
+        }
+    }
+
+    return map;
+}
+
+// Look a key up through the text protocol, the way a client and the server
+// would between them; return the sum of the values found
+long text_lookups(int map, int key, int count, char *response) {
+    char command[64];
+    long total = 0;
+
+    for (int i = 0; i < count; i++) {
+        snprintf(command, sizeof(command), "mapget %d %d\n", map, key);
+        rewind(command_out);
+        run_command(command);
+        fflush(command_out);
+        total += atoi(response);
+    }
+
+    return total;
+}
+
+// Look a key up through the binary protocol, with some number of requests in
+// each frame; return the sum of the values found
+long binary_lookups(heap_p heap, int map, int key, int count, int batch) {
+    wire_buffer request = {0}, frame = {0}, results = {0};
+    long total = 0;
+
+    for (int i = 0; i < count; i += batch) {
+        request.length = 0;
+        frame.length = 0;
+        results.length = 0;
+
+        for (int j = 0; j < batch; j++) {
+            unsigned char op = WIRE_MAPGET;
+            wire_append(&request, &op, 1);
+            wire_put_int(&request, map);
+            wire_put_int(&request, key);
+        }
+        wire_put_frame(&frame, request.data, request.length);
+
+        size_t header, length;
+        if (wire_frame_ready(frame.data, frame.length, &header, &length) != 1)
+            PANIC("Built an incomplete frame");
+        wire_run(heap, frame.data + header, length, &results);
+
+        wire_reader reader = {(unsigned char *)results.data, (unsigned char *)results.data + results.length, 0};
+        for (int j = 0; j < batch; j++) {
+            if (*reader.pos++ != WIRE_OK)
+                PANIC("Lookup failed");
+            total += wire_get_int(&reader);
+        }
+    }
+
+    free(request.data);
+    free(frame.data);
+    free(results.data);
+    return total;
+}
+
+// Find an atom the way try_find_atom() used to, a byte at a time
+long strcmp_find(const char *buf, size_t used, const char *text) {
+    for (const char *cursor = buf; cursor < buf + used; cursor += strlen(cursor) + 1) {
+        if (strcmp(cursor, text) == 0)
+            return cursor - buf;
+    }
+
+    return -1;
+}
+
+#define DEEP_LENGTH 1000000
+#define WIDE_DEPTH 20
+#define SHARED_DEPTH 60
+#define PROTOCOL_COUNT 1000000
+#define TXN_LENGTH 1000000
+#define ATOM_TEXT_ATOMS 10000000
+#define SCAN_CELLS 100000000
+#define GC_CELLS (1 << 25)
+#define GC_TREE_DEPTH 24
+#define INCREMENTAL_CELLS (1 << 22)
+#define INCREMENTAL_TREE_DEPTH 20
+#define INCREMENTAL_PAIRS 4000000
+#define NURSERY_HEAP_CELLS (1 << 22)
+#define NURSERY_TREE_DEPTH 20
+#define NURSERY_CELLS (1 << 16)
+#define NURSERY_PAIRS 1000000
+#define REGION_LISTS 100000
+#define REGION_LIST_LENGTH 100
+#define WEAK_REFERENCES 1000000
+#define WEAK_MAP_KEYS 1000000
+#define HEAPINFO_CELLS 10000000
+#define SHM_CELLS (1 << 22)
+#define SHM_ATTACHES 1000
+#define SHM_LOCKS 1000000
+#define SHM_LIST_LENGTH 1000000
+#define DUMP_CELLS 10000000
+#define DUMP_ATOMS 1000
+#define DUMP_LIST_LENGTH 100
+#define PIPELINE_COMMANDS 1000000
+#ifdef FIXED_CELLS
+#define FIXED_BENCH_CELLS FIXED_CELLS
+#else
+#define FIXED_BENCH_CELLS (1 << 20)
+#endif
+#define FIXED_ROUNDS 10
+
+void bench_equal_deep() {
+    heap_p heap = malloc_heap(2 * DEEP_LENGTH + 10, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+
+    int list1 = build_list(heap, DEEP_LENGTH, item, nil);
+    int list2 = build_list(heap, DEEP_LENGTH, item, nil);
+    uint64_t hash1, hash2;
+    int equal;
+
+    TIME("heap_hash", DEEP_LENGTH, hash1 = heap_hash(heap, list1));
+    TIME("heap_hash", DEEP_LENGTH, hash2 = heap_hash(heap, list2));
+    TIME("heap_equal", DEEP_LENGTH, equal = heap_equal(heap, list1, list2));
+
+    if (hash1 != hash2 || !equal)
+        PANIC("Equal lists didn't compare equal");
+
+    free_heap(heap);
+}
+
+void bench_equal_wide() {
+    heap_p heap = malloc_heap((4 << WIDE_DEPTH) + 10, 100);
+    int leaf = rc_atom(heap, "leaf");
+
+    int tree1 = build_tree(heap, WIDE_DEPTH, leaf);
+    int tree2 = build_tree(heap, WIDE_DEPTH, leaf);
+    long cells = (1 << WIDE_DEPTH) - 1;
+    uint64_t hash1, hash2;
+    int equal;
+
+    TIME("heap_hash", cells, hash1 = heap_hash(heap, tree1));
+    TIME("heap_hash", cells, hash2 = heap_hash(heap, tree2));
+    TIME("heap_equal", cells, equal = heap_equal(heap, tree1, tree2));
+
+    if (hash1 != hash2 || !equal)
+        PANIC("Equal trees didn't compare equal");
+
+    free_heap(heap);
+}
+
+void bench_equal_shared() {
+    heap_p heap = malloc_heap(2 * SHARED_DEPTH + 10, 100);
+    int leaf = rc_atom(heap, "leaf");
+
+    // Each level is a cons of two references to the level below it, so the
+    // tree has 2^60 leaves but only 60 cells.
+    int tree1 = leaf, tree2 = leaf;
+    for (int i = 0; i < SHARED_DEPTH; i++) {
+        tree1 = rc_cons(heap, tree1, tree1);
+        tree2 = rc_cons(heap, tree2, tree2);
+    }
+
+    uint64_t hash1, hash2;
+    int equal;
+
+    TIME("heap_hash", SHARED_DEPTH, hash1 = heap_hash(heap, tree1));
+    TIME("heap_hash", SHARED_DEPTH, hash2 = heap_hash(heap, tree2));
+    TIME("heap_equal", SHARED_DEPTH, equal = heap_equal(heap, tree1, tree2));
+
+    if (hash1 != hash2 || !equal)
+        PANIC("Equal trees didn't compare equal");
+
+    free_heap(heap);
+}
+
+#define PVEC_COUNT 1000000
+#define PMAP_COUNT 100000
+
+void bench_pvec() {
+    heap_p heap = malloc_heap(PVEC_COUNT / 8, 100);
+    int item = rc_atom(heap, "item");
+    int vec;
+
+    TIME("rc_pvec_push", PVEC_COUNT, vec = push_items(heap, rc_pvec(heap), PVEC_COUNT, item));
+    TIME("rc_pvec_set", PVEC_COUNT, for (int i = 0; i < PVEC_COUNT; i++) {
+        int next = rc_pvec_set(heap, vec, i, item);
+        rc_free(heap, vec);
+        vec = next;
+    });
+    rc_free(heap, vec);
+
+    TIME("rc_pvec_push (transient)", PVEC_COUNT, {
+        vec = rc_transient(heap, rc_pvec(heap));
+        for (int i = 0; i < PVEC_COUNT; i++)
+            rc_pvec_push(heap, vec, item);
+        rc_persistent(heap, vec);
+    });
+
+    free_heap(heap);
+}
+
+void bench_pmap() {
+    heap_p heap = malloc_heap(PMAP_COUNT * 2, PMAP_COUNT * 16);
+    int value = rc_atom(heap, "value");
+    int *keys = malloc(PMAP_COUNT * sizeof(int));
+    char text[16];
+
+    for (int i = 0; i < PMAP_COUNT; i++) {
+        sprintf(text, "key%d", i);
+        keys[i] = rc_atom(heap, text);
+    }
+
+    int map;
+    TIME("rc_pmap_put", PMAP_COUNT, map = put_keys(heap, rc_pmap(heap), keys, PMAP_COUNT, value));
+    TIME("rc_pmap_get", PMAP_COUNT, for (int i = 0; i < PMAP_COUNT; i++) {
+        if (rc_pmap_get(heap, map, keys[i]) != value)
+            PANIC("Lost a key");
+    });
+    rc_free(heap, map);
+
+    TIME("rc_pmap_put (transient)", PMAP_COUNT, {
+        map = rc_transient(heap, rc_pmap(heap));
+        put_keys(heap, map, keys, PMAP_COUNT, value);
+        rc_persistent(heap, map);
+    });
+
+    free(keys);
+    free_heap(heap);
+}
+
+void bench_protocols() {
+    char response[64];
+
+    heap = malloc_heap(1024, 1024);
+    command_out = fmemopen(response, sizeof(response), "w");
+    command_err = stderr;
+
+    int key = rc_atom(heap, "key");
+    int value = rc_atom(heap, "value");
+    int map = rc_map(heap);
+    rc_map_put(heap, map, key, value);
+
+    long expected = (long)value * PROTOCOL_COUNT;
+
+    TIME("text", PROTOCOL_COUNT, {
+        if (text_lookups(map, key, PROTOCOL_COUNT, response) != expected)
+            PANIC("Wrong text results");
+    });
+    TIME("binary, 1 per frame", PROTOCOL_COUNT, {
+        if (binary_lookups(heap, map, key, PROTOCOL_COUNT, 1) != expected)
+            PANIC("Wrong binary results");
+    });
+    TIME("binary, 100 per frame", PROTOCOL_COUNT, {
+        if (binary_lookups(heap, map, key, PROTOCOL_COUNT, 100) != expected)
+            PANIC("Wrong binary results");
+    });
+
+    profile_start();
+    TIME("text, profiling", PROTOCOL_COUNT, {
+        if (text_lookups(map, key, PROTOCOL_COUNT, response) != expected)
+            PANIC("Wrong text results");
+    });
+    profile_stop();
+
+    fclose(command_out);
+    free_heap(heap);
+}
+
+void bench_transactions() {
+    heap_p heap = malloc_heap(TXN_LENGTH + 10, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+    int list;
+
+    // Every list is built out of freed cells, as in a heap that's been in use
+    // for a while.
+    free_list(heap, build_list(heap, TXN_LENGTH, item, nil));
+
+    TIME("rc_cons", TXN_LENGTH, list = build_list(heap, TXN_LENGTH, item, nil));
+    free_list(heap, list);
+
+    TIME("rc_cons, then commit", TXN_LENGTH, {
+        heap_begin(heap);
+        list = build_list(heap, TXN_LENGTH, item, nil);
+        heap_commit(heap);
+    });
+    free_list(heap, list);
+
+    TIME("rc_cons, then abort", TXN_LENGTH, {
+        heap_begin(heap);
+        build_list(heap, TXN_LENGTH, item, nil);
+        heap_abort(heap);
+    });
+
+    free_heap(heap);
+}
+
+void bench_atom_text() {
+    // Ten million atoms take up about 120 MB.
+    char *buf = malloc((size_t)ATOM_TEXT_ATOMS * 16);
+    size_t used = 0;
+    if (!buf)
+        PANIC("Failed to allocate the atom text");
+
+    for (int i = 0; i < ATOM_TEXT_ATOMS; i++)
+        used += sprintf(buf + used, "atom%d", i) + 1;
+
+    char last[16];
+    sprintf(last, "atom%d", ATOM_TEXT_ATOMS - 1);
+
+    TIME("strcmp, last atom", ATOM_TEXT_ATOMS, {
+        if (strcmp_find(buf, used, last) == -1)
+            PANIC("Lost an atom");
+    });
+
+    int original = atom_text_kernel();
+    size_t results[16];
+    char what[64];
+
+    for (int kernel = ATOM_KERNEL_SCALAR; kernel <= ATOM_KERNEL_AVX2; kernel++) {
+        if (!atom_text_use_kernel(kernel))
+            continue;
+
+        const char *name = atom_text_kernel_name(kernel);
+
+        snprintf(what, sizeof(what), "%s, last atom", name);
+        TIME(what, ATOM_TEXT_ATOMS, {
+            if (atom_text_find(buf, used, last, strlen(last)) == -1)
+                PANIC("Lost an atom");
+        });
+
+        snprintf(what, sizeof(what), "%s, missing atom", name);
+        TIME(what, ATOM_TEXT_ATOMS, {
+            if (atom_text_find(buf, used, "atom", 4) != -1)
+                PANIC("Found an atom that isn't there");
+        });
+
+        snprintf(what, sizeof(what), "%s, prefix", name);
+        TIME(what, ATOM_TEXT_ATOMS, {
+            if (atom_text_find_prefix(buf, used, "atom999999", 10, results, 16) != 11)
+                PANIC("Wrong number of prefix matches");
+        });
+
+        snprintf(what, sizeof(what), "%s, count", name);
+        TIME(what, ATOM_TEXT_ATOMS, {
+            if (atom_text_count(buf, used) != ATOM_TEXT_ATOMS)
+                PANIC("Wrong number of atoms");
+        });
+    }
+
+    atom_text_use_kernel(original);
+    free(buf);
+}
+
+void bench_scan() {
+    heap_p heap = malloc_heap(SCAN_CELLS, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+    build_list(heap, SCAN_CELLS - 2, item, nil);
+
+    int original = scan_use_avx2(1);
+
+    for (int avx2 = 0; avx2 <= original; avx2++) {
+        scan_use_avx2(avx2);
+        const char *name = avx2 ? "avx2" : "scalar";
+        char what[64];
+
+        snprintf(what, sizeof(what), "%s, scan_count_tag", name);
+        TIME(what, SCAN_CELLS, {
+            if (scan_count_tag(heap, TAG_CONS) != SCAN_CELLS - 2)
+                PANIC("Wrong number of conses");
+        });
+
+        snprintf(what, sizeof(what), "%s, scan_unowned", name);
+        TIME(what, SCAN_CELLS, {
+            if (scan_unowned(heap, 0, 0) != 1)
+                PANIC("Wrong number of unowned cells");
+        });
+
+        snprintf(what, sizeof(what), "%s, scan_bad_conses", name);
+        TIME(what, SCAN_CELLS, {
+            if (scan_bad_conses(heap, 0, 0) != 0)
+                PANIC("Found bad conses");
+        });
+
+        snprintf(what, sizeof(what), "%s, heap_verify", name);
+        TIME(what, SCAN_CELLS, {
+            if (heap_verify(heap, stderr) != 0)
+                PANIC("Found problems in the heap");
+        });
+    }
+
+    size_t counts[SCAN_TAG_COUNT];
+    TIME("scan_tag_counts", SCAN_CELLS, scan_tag_counts(heap, counts));
+
+    scan_use_avx2(original);
+    free_heap(heap);
+}
+
+void bench_gc() {
+    heap_p heap = malloc_heap(GC_CELLS, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+
+    // Half of the heap is live, in a tree that can be marked in parallel.
+    build_tree(heap, GC_TREE_DEPTH, item);
+    int pairs = (GC_CELLS - (1 << GC_TREE_DEPTH) - 2) / 2;
+
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        // The other half is pairs of conses pointing at each other.
+        make_cycles(heap, pairs, item, nil);
+
+        char what[64];
+        snprintf(what, sizeof(what), "heap_collect, %d thread%s", threads, threads == 1 ? "" : "s");
+        gc_set_threads(threads);
+
+        TIME(what, GC_CELLS, {
+            if (heap_collect(heap) != 2 * (size_t)pairs)
+                PANIC("Wrong number of cells collected");
+        });
+    }
+
+    gc_set_threads(0);
+    free_heap(heap);
+}
+
+void bench_incremental_gc() {
+    for (int slice = 100; slice <= 10000; slice *= 10) {
+        heap_p heap = malloc_heap(INCREMENTAL_CELLS, 100);
+        int nil = rc_atom(heap, "nil");
+        int item = rc_atom(heap, "item");
+        build_tree(heap, INCREMENTAL_TREE_DEPTH, item);
+
+        char what[64];
+        snprintf(what, sizeof(what), "slice %d, make cycles", slice);
+        gc_set_incremental(heap, slice);
+        TIME(what, INCREMENTAL_PAIRS, make_cycles(heap, INCREMENTAL_PAIRS, item, nil));
+        histogram_print(stdout, "    pauses", gc_pauses(heap));
+
+        if (slice == 10000)
+            TIME("heap_collect, for comparison", INCREMENTAL_CELLS, heap_collect(heap));
+
+        free_heap(heap);
+    }
+}
+
+void bench_nursery() {
+    for (int use_nursery = 1; use_nursery >= 0; use_nursery--) {
+        heap_p heap = malloc_heap(NURSERY_HEAP_CELLS, 100);
+        int nil = rc_atom(heap, "nil");
+        int item = rc_atom(heap, "item");
+        build_tree(heap, NURSERY_TREE_DEPTH, item);
+
+        if (use_nursery) {
+            heap_set_nursery(heap, NURSERY_CELLS);
+            TIME("make cycles, minor collections", NURSERY_PAIRS,
+                make_cycles(heap, NURSERY_PAIRS, item, nil));
+
+            nursery_stats stats = heap_nursery_stats(heap);
+            printf("    %zu collections, %zu cells promoted, %zu freed\n",
+                stats.collections, stats.promoted, stats.freed);
+        } else {
+            // Collect as often as the nursery would have.
+            TIME("make cycles, heap_collect", NURSERY_PAIRS, {
+                for (int made = 0; made < NURSERY_PAIRS; made += NURSERY_CELLS / 2) {
+                    make_cycles(heap, NURSERY_CELLS / 2, item, nil);
+                    heap_collect(heap);
+                }
+            });
+        }
+
+        free_heap(heap);
+    }
+}
+
+void bench_regions() {
+    heap_p heap = malloc_heap(REGION_LIST_LENGTH * 3, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+    long cells = (long)REGION_LISTS * REGION_LIST_LENGTH;
+
+    TIME("rc_free each cell", cells, {
+        for (int i = 0; i < REGION_LISTS; i++) {
+            int list = build_list(heap, REGION_LIST_LENGTH, item, nil);
+
+            while (list != nil) {
+                int next = getfield(heap, FIELD_CDR, list);
+                rc_free(heap, list);
+                list = next;
+            }
+        }
+    });
+
+    TIME("heap_region_end", cells, {
+        for (int i = 0; i < REGION_LISTS; i++) {
+            int region = heap_region_begin(heap);
+            build_list(heap, REGION_LIST_LENGTH, item, nil);
+            if (heap_region_end(heap, region) != REGION_LIST_LENGTH)
+                PANIC("Wrong number of cells freed");
+        }
+    });
+
+    free_heap(heap);
+}
+
+void bench_weak() {
+    heap_p heap = malloc_heap(10000, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+
+    TIME("rc_free with no weak references", WEAK_REFERENCES, {
+        for (int i = 0; i < WEAK_REFERENCES; i++)
+            rc_free(heap, rc_cons(heap, item, nil));
+    });
+
+    TIME("rc_free with a weak reference", WEAK_REFERENCES, {
+        for (int i = 0; i < WEAK_REFERENCES; i++) {
+            int target = rc_cons(heap, item, nil);
+            int weak = rc_weak(heap, target);
+            if (rc_weak_get(heap, weak) != target)
+                PANIC("Wrong target");
+
+            rc_free(heap, target);
+            if (rc_weak_get(heap, weak) != -1)
+                PANIC("Weak reference wasn't cleared");
+
+            rc_free(heap, weak);
+        }
+    });
+
+    int map = rc_weak_map(heap);
+
+    TIME("weak map put, then key freed", WEAK_MAP_KEYS, {
+        for (int i = 0; i < WEAK_MAP_KEYS; i++) {
+            int key = rc_cons(heap, item, nil);
+            rc_map_put(heap, map, key, item);
+            rc_free(heap, key);
+        }
+    });
+
+    free_heap(heap);
+}
+
+void bench_heapinfo() {
+    heap_p heap = malloc_heap(HEAPINFO_CELLS, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+
+    // Every third cons is freed, leaving the rest in use.
+    for (int i = 2; i < HEAPINFO_CELLS; i++)
+        rc_cons(heap, item, nil);
+    for (int i = 2; i < HEAPINFO_CELLS; i += 3)
+        rc_free(heap, i);
+
+    heap_info info;
+    TIME("heap_get_info", HEAPINFO_CELLS, heap_get_info(heap, &info));
+
+    if (info.live + info.freed + info.uninit != HEAPINFO_CELLS)
+        PANIC("Wrong heap information");
+
+    free_heap(heap);
+}
+
+void bench_shm_heap() {
+    char name[64];
+    snprintf(name, sizeof(name), "/poutine-bench-%d", (int)getpid());
+
+    heap_p heap = shm_heap_create(name, SHM_CELLS, 100);
+    if (!heap)
+        PANIC("Failed to create a shared heap");
+
+    TIME("shm_heap_attach", SHM_ATTACHES, for (int i = 0; i < SHM_ATTACHES; i++) {
+        free_heap(shm_heap_attach(name));
+    });
+
+    TIME("write lock and unlock", SHM_LOCKS, for (int i = 0; i < SHM_LOCKS; i++) {
+        shm_heap_write_lock(heap);
+        shm_heap_unlock(heap);
+    });
+
+    shm_heap_write_lock(heap);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+    TIME("rc_cons (shared)", SHM_LIST_LENGTH, build_list(heap, SHM_LIST_LENGTH, item, nil));
+    shm_heap_unlock(heap);
+
+    heap_p private = malloc_heap(SHM_CELLS, 100);
+    nil = rc_atom(private, "nil");
+    item = rc_atom(private, "item");
+    TIME("rc_cons (private)", SHM_LIST_LENGTH, build_list(private, SHM_LIST_LENGTH, item, nil));
+
+    shm_heap_unlink(name);
+    free_heap(private);
+    free_heap(heap);
+}
+
+void bench_dump() {
+    heap_p heap = malloc_heap(DUMP_CELLS, DUMP_ATOMS * 16);
+    int nil = rc_atom(heap, "nil");
+    int atoms[DUMP_ATOMS];
+
+    for (int i = 0; i < DUMP_ATOMS; i++) {
+        char text[16];
+        snprintf(text, sizeof(text), "atom%d", i);
+        atoms[i] = rc_atom(heap, text);
+    }
+
+    // Lists of one atom each, with every tenth list freed again.
+    for (int i = 0; i < DUMP_CELLS / DUMP_LIST_LENGTH - DUMP_ATOMS; i++) {
+        int list = build_list(heap, DUMP_LIST_LENGTH, atoms[i % DUMP_ATOMS], nil);
+        if (i % 10 == 0)
+            free_list(heap, list);
+    }
+
+    char *data;
+    size_t raw, compressed;
+    heap_p loaded = NULL;
+
+    TIME("heap_dump", DUMP_CELLS, raw = dump_to_memory(heap, 0, &data));
+    free(data);
+    TIME("heap_dump (compressed)", DUMP_CELLS, compressed = dump_to_memory(heap, DUMP_COMPRESS, &data));
+
+    FILE *file = fmemopen(data, compressed, "rb");
+    TIME("heap_load (compressed)", DUMP_CELLS, loaded = heap_load(file));
+    fclose(file);
+
+    if (!loaded || heap_verify(loaded, 0) != 0)
+        PANIC("Failed to load a dump");
+
+    printf("    %.2f bytes per cell, %.2f compressed\n", (double)raw / DUMP_CELLS, (double)compressed / DUMP_CELLS);
+
+    free(data);
+    free_heap(loaded);
+    free_heap(heap);
+}
+
+size_t dump_to_memory(heap_p heap, int flags, char **data) {
+    size_t length;
+    FILE *file = open_memstream(data, &length);
+
+    if (!heap_dump(heap, file, flags))
+        PANIC("Failed to dump a heap");
+
+    fclose(file);
+    return length;
+}
+
+void bench_pipeline() {
+    heap = malloc_heap(1024, 1024);
+    command_out = fopen("/dev/null", "w");
+    command_err = stderr;
+
+    // Make a cons, read it and free it, over and over.
+    FILE *commands = tmpfile();
+    fprintf(commands, "atom nil\natom item\n");
+    for (int i = 2; i < PIPELINE_COMMANDS; i += 3)
+        fprintf(commands, "cons 1 0\ngetcar 2\nfree 2\n");
+    fflush(commands);
+
+    char command[1024];
+    rewind(commands);
+    TIME("one at a time", PIPELINE_COMMANDS, {
+        while (fgets(command, sizeof(command), commands))
+            run_command(command);
+        fflush(command_out);
+    });
+
+    free_heap(heap);
+    heap = malloc_heap(1024, 1024);
+
+    pipeline_stats stats;
+    lseek(fileno(commands), 0, SEEK_SET);
+    TIME("pipeline", PIPELINE_COMMANDS, pipeline_run(fileno(commands), command_out, stderr, &stats));
+    pipeline_print_stats(stdout, &stats);
+
+    fclose(commands);
+    fclose(command_out);
+    free_heap(heap);
+}
+
+void bench_fixed() {
+    heap_p heap = malloc_heap(FIXED_BENCH_CELLS, 100);
+    int nil = rc_atom(heap, "nil");
+    int item = rc_atom(heap, "item");
+    int length = FIXED_BENCH_CELLS - 2;
+    long total = (long)length * FIXED_ROUNDS;
+    int list = nil;
+
+    TIME("rc_cons", total, for (int i = 0; i < FIXED_ROUNDS; i++) {
+        list = build_list(heap, length, item, nil);
+        if (i < FIXED_ROUNDS - 1)
+            free_list(heap, list);
+    });
+
+    long sum = 0;
+    TIME("getfield", total, for (int i = 0; i < FIXED_ROUNDS; i++) {
+        for (int cell = list; cell != nil; cell = getfield(heap, FIELD_CDR, cell))
+            sum += getfield(heap, FIELD_CAR, cell);
+    });
+
+    if (sum != (long)item * total)
+        PANIC("Wrong sum of cars");
+
+    TIME("setfield", total, for (int i = 0; i < FIXED_ROUNDS; i++) {
+        for (int cell = list; cell != nil; cell = getfield(heap, FIELD_CDR, cell))
+            setfield(heap, FIELD_REFCOUNT, cell, getfield(heap, FIELD_REFCOUNT, cell));
+    });
+
+    TIME("rc_free", length, free_list(heap, list));
+
+    free_heap(heap);
+}
+
+void make_cycles(heap_p heap, int pairs, int item, int nil) {
+    for (int i = 0; i < pairs; i++) {
+        int tail = rc_cons(heap, item, nil);
+        int head = rc_cons(heap, item, tail);
+        if (head == -1)
+            PANIC("Ran out of cells");
+
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, tail, head);
+        inc_refcount(heap, head);
+    }
+}
@@ -0,0 +1,1158 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// commands.h: The commands understood by the Poutine shell
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "dump.h"
+#include "gc.h"
+#include "heap.h"
+#include "heapinfo.h"
+#include "histogram.h"
+#include "map.h"
+#include "nursery.h"
+#include "panic.h"
+#include "profile.h"
+// TODO: remove all references to rawheap.h from commands.c
+#include "rawheap.h"
+#include "rcheap.h"
+#include "scan.h"
+#include "trace.h"
+#include "txn.h"
+#include "wire.h"
+
+
+
+// Individual commands:
+
+// Get and print the value of a field in a cell
+void cmd_getfield(int field, const char *command_name);
+// Set the value of a field in a cell
+void cmd_setfield(int field, const char *command_name);
+
+// Get and print the tag of a cell
+void cmd_gettag(void);
+// Set the tag of a cell
+void cmd_settag(void);
+
+// Get and print the text of an atom
+void cmd_getatom(void);
+// Set the text of an atom
+void cmd_setatom(void);
+
+// Allocate a cell
+void cmd_alloc(void);
+// Allocate a cell as an atom
+void cmd_atom(void);
+// Allocate a cell as a cons cell
+void cmd_cons(void);
+// Free a cell
+void cmd_free(void);
+
+// Allocate a cell as an empty map
+void cmd_map(void);
+// Get and print the value for a key in a map
+void cmd_mapget(void);
+// Set the value for a key in a map
+void cmd_mapput(void);
+// Remove a key from a map
+void cmd_mapdel(void);
+// Print the number of entries in a map
+void cmd_mapcount(void);
+
+// Turn hash-consing on or off
+void cmd_hashcons(void);
+
+// Begin a transaction
+void cmd_begin(void);
+// Commit the current transaction
+void cmd_commit(void);
+// Abort the current transaction
+void cmd_abort(void);
+
+// Print the number of cells in the heap
+void cmd_cellcount(void);
+// Check the heap for inconsistencies
+void cmd_verify(void);
+// Print how the heap's memory is used
+void cmd_heapinfo(void);
+// Free every cell that can't be reached from an unowned value
+void cmd_collect(void);
+// Set the amount of incremental collection work done per allocation
+void cmd_incremental(void);
+// Print how long the slices of incremental collection work took
+void cmd_pauses(void);
+// Start or stop timing commands, or print the timings
+void cmd_profile(void);
+// Set the size of the nursery
+void cmd_nursery(void);
+// Collect the nursery
+void cmd_minor(void);
+// Re-initialize the heap
+void cmd_reinit(void);
+// Write the heap to a file
+void cmd_dump(void);
+// Replace the heap with one read from a file
+void cmd_load(void);
+
+// Error messages:
+
+// Print "Unrecognized command: %s"
+void unknown_command(const char *command_name);
+// Print "Too few arguments to %s"
+void too_few_arguments(const char *command_name);
+// Print "Too many arguments to %s"
+void too_many_arguments(const char *command_name);
+// Print "Invalid number: %s"
+void invalid_number(const char *word);
+// Print "Index out of range: %d"
+void index_out_of_range(cell_index index);
+// Print "Unrecognized tag name: %s"
+void unknown_tagname(const char *word);
+// Print "The cell at index %d is not a valid atom"
+void not_an_atom(cell_index index);
+// Print "Invalid index: %d"
+void invalid_index(cell_index index);
+// Print "The cell at index %d has references to it"
+void cell_has_references(cell_index index);
+// Print "The cell at index %d is not a map"
+void not_a_map(cell_index index);
+// Print "Key not found: %d"
+void key_not_found(cell_index key);
+
+// Check whether the name of a command is one of the given names
+int command_is_one_of(const char *command, const char **names, int count);
+// Read the opcode of a request made by trace_encode(), and its numbers, leaving
+// out any words; return the opcode
+int read_request(wire_reader *request, cell_index *arguments);
+// Print the name of a tag
+void print_tag(int tag);
+
+// Argument parsing using strtok_r:
+
+// Try to get an integer argument; return 0 on failure
+int get_int_argument_strtok(const char *command_name, cell_index *result);
+// Try to get a word argument; return 0 on failure
+//
+// The result string remains valid for as long as the command string is valid.
+int get_word_argument_strtok(const char *command_name, const char **result);
+// Try to get a tag name argument; return 0 on failure
+int get_tagname_argument_strtok(const char *command_name, int *result);
+// Assert that there are no more arguments; return 0 if there is one
+int no_more_arguments_strtok(const char *command_name);
+
+
+
+heap_p heap;
+size_t atom_text_size = ATOM_TEXT_SIZE;
+
+__thread FILE *command_out;
+__thread FILE *command_err;
+
+// The position of the argument parser in the current command
+__thread char *strtok_state;
+
+
+
+// Command parsing and processing:
+
+void run_command(char *command) {
+    const char *command_name = strtok_r(command, " \n", &strtok_state);
+
+    if (!command_name)
+        return;
+
+    // The clock is only read while profiling.
+    int timed = profile_running;
+    uint64_t start = timed ? monotonic_ns() : 0;
+
+    if (strcmp(command_name, "getcar") == 0)
+        cmd_getfield(FIELD_CAR, command_name);
+    else if (strcmp(command_name, "getcdr") == 0)
+        cmd_getfield(FIELD_CDR, command_name);
+    else if (strcmp(command_name, "gettag") == 0)
+        cmd_gettag();
+    else if (strcmp(command_name, "getatom") == 0)
+        cmd_getatom();
+    else if (strcmp(command_name, "setcar") == 0)
+        cmd_setfield(FIELD_CAR, command_name);
+    else if (strcmp(command_name, "setcdr") == 0)
+        cmd_setfield(FIELD_CDR, command_name);
+    else if (strcmp(command_name, "settag") == 0)
+        cmd_settag();
+    else if (strcmp(command_name, "setatom") == 0)
+        cmd_setatom();
+    else if (strcmp(command_name, "alloc") == 0)
+        cmd_alloc();
+    else if (strcmp(command_name, "atom") == 0)
+        cmd_atom();
+    else if (strcmp(command_name, "cons") == 0)
+        cmd_cons();
+    else if (strcmp(command_name, "free") == 0)
+        cmd_free();
+    else if (strcmp(command_name, "map") == 0)
+        cmd_map();
+    else if (strcmp(command_name, "mapget") == 0)
+        cmd_mapget();
+    else if (strcmp(command_name, "mapput") == 0)
+        cmd_mapput();
+    else if (strcmp(command_name, "mapdel") == 0)
+        cmd_mapdel();
+    else if (strcmp(command_name, "mapcount") == 0)
+        cmd_mapcount();
+    else if (strcmp(command_name, "hashcons") == 0)
+        cmd_hashcons();
+    else if (strcmp(command_name, "begin") == 0)
+        cmd_begin();
+    else if (strcmp(command_name, "commit") == 0)
+        cmd_commit();
+    else if (strcmp(command_name, "abort") == 0)
+        cmd_abort();
+    else if (strcmp(command_name, "cellcount") == 0)
+        cmd_cellcount();
+    else if (strcmp(command_name, "verify") == 0)
+        cmd_verify();
+    else if (strcmp(command_name, "heapinfo") == 0)
+        cmd_heapinfo();
+    else if (strcmp(command_name, "collect") == 0)
+        cmd_collect();
+    else if (strcmp(command_name, "incremental") == 0)
+        cmd_incremental();
+    else if (strcmp(command_name, "pauses") == 0)
+        cmd_pauses();
+    else if (strcmp(command_name, "profile") == 0)
+        cmd_profile();
+    else if (strcmp(command_name, "nursery") == 0)
+        cmd_nursery();
+    else if (strcmp(command_name, "minor") == 0)
+        cmd_minor();
+    else if (strcmp(command_name, "reinit") == 0)
+        cmd_reinit();
+    else if (strcmp(command_name, "dump") == 0)
+        cmd_dump();
+    else if (strcmp(command_name, "load") == 0)
+        cmd_load();
+    else
+        unknown_command(command_name);
+
+    if (timed && profile_running)
+        profile_record(command_name, monotonic_ns() - start);
+}
+
+int command_is_read_only(const char *command) {
+    static const char *names[] = {
+        "getcar", "getcdr", "gettag", "getatom", "mapget", "mapcount", "cellcount",
+        "verify", "heapinfo", "pauses", "dump",
+    };
+
+    return command_is_one_of(command, names, sizeof(names) / sizeof(names[0]));
+}
+
+int command_controls_transactions(const char *command) {
+    static const char *names[] = {"begin", "commit", "abort"};
+
+    return command_is_one_of(command, names, sizeof(names) / sizeof(names[0]));
+}
+
+int command_uses_files(const char *command) {
+    static const char *names[] = {"dump", "load"};
+
+    return command_is_one_of(command, names, sizeof(names) / sizeof(names[0]));
+}
+
+int command_is_one_of(const char *command, const char **names, int count) {
+    command += strspn(command, " \n");
+    size_t length = strcspn(command, " \n");
+
+    for (int i = 0; i < count; i++) {
+        if (strlen(names[i]) == length && strncmp(command, names[i], length) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+
+// Results of requests:
+
+void command_annotate_result(const char *request, size_t length, wire_buffer *results, size_t offset) {
+    if (results->data[offset] != WIRE_INVALID_INDEX)
+        return;
+
+    wire_reader reader = {(const unsigned char *)request, (const unsigned char *)request + length, 0};
+    cell_index arguments[3];
+    int op = read_request(&reader, arguments);
+
+    // The checks are made in the same order as the shell's.
+    if (op == WIRE_CONS)
+        wire_put_int(results, rc_is_valid(heap, arguments[0]) ? arguments[1] : arguments[0]);
+    else if (op == WIRE_MAPPUT)
+        wire_put_int(results, rc_is_valid(heap, arguments[1]) && arguments[1] != arguments[0]
+            ? arguments[2] : arguments[1]);
+}
+
+void command_print_result(wire_reader *request, wire_reader *result) {
+    cell_index arguments[3];
+    int op = read_request(request, arguments);
+    int status = *result->pos++;
+    size_t length;
+    const char *text;
+
+    switch (op) {
+    case WIRE_GETCAR:
+    case WIRE_GETCDR:
+    case WIRE_GETTAG:
+    case WIRE_GETATOM:
+    case WIRE_SETCAR:
+    case WIRE_SETCDR:
+    case WIRE_SETTAG:
+    case WIRE_SETATOM:
+        if (status == WIRE_OUT_OF_RANGE)
+            index_out_of_range(arguments[0]);
+        else if (status == WIRE_NOT_AN_ATOM)
+            not_an_atom(arguments[0]);
+        else if (status == WIRE_NO_SPACE)
+            fprintf(command_err, "No room for the atom text\n");
+        else if (status == WIRE_OK && op == WIRE_GETTAG)
+            print_tag(wire_get_int(result));
+        else if (status == WIRE_OK && op == WIRE_GETATOM) {
+            text = wire_get_string(result, &length);
+            fprintf(command_out, "%.*s\n", (int)length, text);
+        } else if (status == WIRE_OK && (op == WIRE_GETCAR || op == WIRE_GETCDR))
+            fprintf(command_out, "%" PRI_INDEX "\n", (cell_index)wire_get_int(result));
+        break;
+
+    case WIRE_ALLOC:
+    case WIRE_ATOM:
+    case WIRE_CONS:
+    case WIRE_MAP:
+        if (status == WIRE_INVALID_INDEX) {
+            invalid_index(wire_get_int(result));
+            break;
+        }
+
+        if (status == WIRE_NO_SPACE)
+            fprintf(command_err, "No free cells\n");
+
+        fprintf(command_out, "%" PRI_INDEX "\n", status == WIRE_OK ? (cell_index)wire_get_int(result) : -1);
+        break;
+
+    case WIRE_FREE:
+        if (status == WIRE_INVALID_INDEX)
+            invalid_index(arguments[0]);
+        else if (status == WIRE_HAS_REFERENCES)
+            cell_has_references(arguments[0]);
+        break;
+
+    case WIRE_MAPGET:
+    case WIRE_MAPPUT:
+    case WIRE_MAPDEL:
+    case WIRE_MAPCOUNT:
+        if (status == WIRE_NOT_A_MAP)
+            not_a_map(arguments[0]);
+        else if (status == WIRE_INVALID_INDEX)
+            invalid_index(op == WIRE_MAPPUT ? wire_get_int(result) : arguments[1]);
+        else if (status == WIRE_NOT_FOUND)
+            key_not_found(arguments[1]);
+        else if (status == WIRE_OK && (op == WIRE_MAPGET || op == WIRE_MAPCOUNT))
+            fprintf(command_out, "%" PRI_INDEX "\n", (cell_index)wire_get_int(result));
+        break;
+
+    case WIRE_CELLCOUNT:
+        fprintf(command_out, "%" PRI_INDEX "\n", (cell_index)wire_get_int(result));
+        break;
+
+    case WIRE_BEGIN:
+    case WIRE_COMMIT:
+    case WIRE_ABORT:
+        if (status == WIRE_BAD_TRANSACTION)
+            fprintf(command_err, op == WIRE_BEGIN ? "Already in a transaction\n" : "Not in a transaction\n");
+        break;
+
+    case TRACE_COLLECT:
+    case TRACE_MINOR:
+        if (status == WIRE_BAD_TRANSACTION)
+            fprintf(command_err, "Can't collect garbage during a transaction\n");
+        else
+            fprintf(command_out, "%zu\n", (size_t)wire_get_uint(result));
+        break;
+
+    case TRACE_NURSERY:
+        if (status == WIRE_OUT_OF_RANGE)
+            fprintf(command_err, "Nursery size can't be negative\n");
+        else if (status == WIRE_BAD_TRANSACTION)
+            fprintf(command_err, "Can't change the nursery during a transaction\n");
+        else if (status == WIRE_NO_SPACE)
+            fprintf(command_err, "Not enough uninitialized cells for the nursery\n");
+        break;
+
+    case TRACE_INCREMENTAL:
+        if (status == WIRE_OUT_OF_RANGE)
+            fprintf(command_err, "Slice size can't be negative\n");
+        break;
+
+    case TRACE_REINIT:
+        if (status != WIRE_OUT_OF_RANGE)
+            break;
+#ifdef FIXED_CELLS
+        if (arguments[0] > 0) {
+            fprintf(command_err, "This build only makes heaps of %" PRI_INDEX " cells\n", FIXED_CELLS);
+            break;
+        }
+#endif
+        fprintf(command_err, "New cell count must be positive\n");
+        break;
+    }
+}
+
+int read_request(wire_reader *request, cell_index *arguments) {
+    int op = *request->pos++;
+    const char *kinds = trace_op_arguments(op);
+    size_t length;
+
+    for (int i = 0; kinds && kinds[i]; i++) {
+        if (kinds[i] == 's')
+            wire_get_string(request, &length);
+        else if (kinds[i] == 'b')
+            arguments[i] = wire_get_uint(request);
+        else
+            arguments[i] = wire_get_int(request);
+    }
+
+    return op;
+}
+
+
+
+// Individual commands:
+
+void cmd_getfield(int field, const char *command_name) {
+    cell_index index;
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (index < 0 || index >= cell_count(heap)) {
+        index_out_of_range(index);
+        return;
+    }
+
+    cell_index result = getfield(heap, field, index);
+
+    fprintf(command_out, "%" PRI_INDEX "\n", result);
+}
+
+void cmd_setfield(int field, const char *command_name) {
+    cell_index index, value;
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!get_int_argument_strtok(command_name, &value)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (index < 0 || index >= cell_count(heap)) {
+        index_out_of_range(index);
+        return;
+    }
+
+    setfield(heap, field, index, value);
+}
+
+void cmd_gettag() {
+    cell_index index;
+    const char *command_name = "gettag";
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (index < 0 || index >= cell_count(heap)) {
+        index_out_of_range(index);
+        return;
+    }
+
+    print_tag(getfield(heap, FIELD_TAG, index));
+}
+
+void print_tag(int tag) {
+    switch (tag) {
+        case TAG_UNINIT:
+            fprintf(command_out, "uninit\n");
+            return;
+        case TAG_ATOM:
+            fprintf(command_out, "atom\n");
+            return;
+        case TAG_CONS:
+            fprintf(command_out, "cons\n");
+            return;
+        case TAG_FREED:
+            fprintf(command_out, "freed\n");
+            return;
+        case TAG_MAP:
+            fprintf(command_out, "map\n");
+            return;
+        case TAG_PVEC:
+            fprintf(command_out, "pvec\n");
+            return;
+        case TAG_PMAP:
+            fprintf(command_out, "pmap\n");
+            return;
+        case TAG_NODE:
+            fprintf(command_out, "node\n");
+            return;
+        case TAG_WEAK:
+            fprintf(command_out, "weak\n");
+            return;
+        default:
+            PANIC("Unrecognized tag number: %d", tag);
+    }
+}
+
+void cmd_settag() {
+    cell_index index;
+    int value;
+    const char *command_name = "settag";
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!get_tagname_argument_strtok(command_name, &value)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (index < 0 || index >= cell_count(heap)) {
+        index_out_of_range(index);
+        return;
+    }
+
+    setfield(heap, FIELD_TAG, index, value);
+}
+
+void cmd_getatom() {
+    cell_index index;
+    const char *command_name = "getatom";
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (index < 0 || index >= cell_count(heap)) {
+        index_out_of_range(index);
+        return;
+    }
+
+    if (!isatom(heap, index)) {
+        not_an_atom(index);
+        return;
+    }
+
+    const char *text = getatom(heap, index);
+
+    fprintf(command_out, "%s\n", text);
+}
+
+void cmd_setatom() {
+    cell_index index;
+    const char *text;
+    const char *command_name = "setatom";
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!get_word_argument_strtok(command_name, &text)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (index < 0 || index >= cell_count(heap)) {
+        index_out_of_range(index);
+        return;
+    }
+
+    if (!atom_text_fits(heap, text)) {
+        fprintf(command_err, "No room for the atom text\n");
+        return;
+    }
+
+    setatom(heap, index, text);
+}
+
+
+
+void cmd_alloc() {
+    const char *command_name = "alloc";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    cell_index index = alloc_cell(heap);
+
+    if (index < 0)
+        fprintf(command_err, "No free cells\n");
+
+    fprintf(command_out, "%" PRI_INDEX "\n", index);
+}
+
+void cmd_atom() {
+    const char *text;
+    const char *command_name = "atom";
+
+    if (!get_word_argument_strtok(command_name, &text)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    cell_index index = rc_atom(heap, text);
+
+    if (index < 0)
+        fprintf(command_err, "No free cells\n");
+
+    fprintf(command_out, "%" PRI_INDEX "\n", index);
+}
+
+void cmd_cons() {
+    cell_index car;
+    cell_index cdr;
+    const char *command_name = "cons";
+
+    if (!get_int_argument_strtok(command_name, &car)) return;
+    if (!get_int_argument_strtok(command_name, &cdr)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!rc_is_valid(heap, car)) {
+        invalid_index(car);
+        return;
+    }
+
+    if (!rc_is_valid(heap, cdr)) {
+        invalid_index(cdr);
+        return;
+    }
+
+    cell_index index = rc_cons(heap, car, cdr);
+
+    if (index < 0)
+        fprintf(command_err, "No free cells\n");
+
+    fprintf(command_out, "%" PRI_INDEX "\n", index);
+}
+
+void cmd_free() {
+    cell_index index;
+    const char *command_name = "free";
+
+    if (!get_int_argument_strtok(command_name, &index)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!rc_is_valid(heap, index)) {
+        invalid_index(index);
+        return;
+    }
+
+    if (!rc_is_unowned(heap, index)) {
+        cell_has_references(index);
+        return;
+    }
+
+    rc_free(heap, index);
+}
+
+
+
+void cmd_map() {
+    const char *command_name = "map";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    cell_index index = rc_map(heap);
+
+    if (index < 0)
+        fprintf(command_err, "No free cells\n");
+
+    fprintf(command_out, "%" PRI_INDEX "\n", index);
+}
+
+void cmd_mapget() {
+    cell_index map, key;
+    const char *command_name = "mapget";
+
+    if (!get_int_argument_strtok(command_name, &map)) return;
+    if (!get_int_argument_strtok(command_name, &key)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!rc_is_map(heap, map)) {
+        not_a_map(map);
+        return;
+    }
+
+    if (!rc_is_valid(heap, key)) {
+        invalid_index(key);
+        return;
+    }
+
+    cell_index value = rc_map_get(heap, map, key);
+
+    if (value < 0) {
+        key_not_found(key);
+        return;
+    }
+
+    fprintf(command_out, "%" PRI_INDEX "\n", value);
+}
+
+void cmd_mapput() {
+    cell_index map, key, value;
+    const char *command_name = "mapput";
+
+    if (!get_int_argument_strtok(command_name, &map)) return;
+    if (!get_int_argument_strtok(command_name, &key)) return;
+    if (!get_int_argument_strtok(command_name, &value)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!rc_is_map(heap, map)) {
+        not_a_map(map);
+        return;
+    }
+
+    if (!rc_is_valid(heap, key) || key == map) {
+        invalid_index(key);
+        return;
+    }
+
+    if (!rc_is_valid(heap, value) || value == map) {
+        invalid_index(value);
+        return;
+    }
+
+    rc_map_put(heap, map, key, value);
+}
+
+void cmd_mapdel() {
+    cell_index map, key;
+    const char *command_name = "mapdel";
+
+    if (!get_int_argument_strtok(command_name, &map)) return;
+    if (!get_int_argument_strtok(command_name, &key)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!rc_is_map(heap, map)) {
+        not_a_map(map);
+        return;
+    }
+
+    if (!rc_is_valid(heap, key)) {
+        invalid_index(key);
+        return;
+    }
+
+    if (!rc_map_delete(heap, map, key))
+        key_not_found(key);
+}
+
+void cmd_mapcount() {
+    cell_index map;
+    const char *command_name = "mapcount";
+
+    if (!get_int_argument_strtok(command_name, &map)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!rc_is_map(heap, map)) {
+        not_a_map(map);
+        return;
+    }
+
+    fprintf(command_out, "%" PRI_INDEX "\n", rc_map_count(heap, map));
+}
+
+
+
+void cmd_hashcons() {
+    const char *setting;
+    const char *command_name = "hashcons";
+
+    if (!get_word_argument_strtok(command_name, &setting)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (strcmp(setting, "on") == 0) {
+        rc_set_hashcons(heap, 1);
+    } else if (strcmp(setting, "off") == 0) {
+        rc_set_hashcons(heap, 0);
+    } else {
+        fprintf(command_err, "Expected on or off: %s\n", setting);
+    }
+}
+
+
+
+void cmd_begin() {
+    const char *command_name = "begin";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (heap_in_transaction(heap)) {
+        fprintf(command_err, "Already in a transaction\n");
+        return;
+    }
+
+    heap_begin(heap);
+}
+
+void cmd_commit() {
+    const char *command_name = "commit";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!heap_in_transaction(heap)) {
+        fprintf(command_err, "Not in a transaction\n");
+        return;
+    }
+
+    heap_commit(heap);
+}
+
+void cmd_abort() {
+    const char *command_name = "abort";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (!heap_in_transaction(heap)) {
+        fprintf(command_err, "Not in a transaction\n");
+        return;
+    }
+
+    heap_abort(heap);
+}
+
+
+
+void cmd_cellcount() {
+    const char *command_name = "cellcount";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    cell_index result = cell_count(heap);
+
+    fprintf(command_out, "%" PRI_INDEX "\n", result);
+}
+
+void cmd_verify() {
+    const char *command_name = "verify";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    size_t problems = heap_verify(heap, command_out);
+
+    if (problems == 0)
+        fprintf(command_out, "No problems found\n");
+    else
+        fprintf(command_out, "%zu problems found\n", problems);
+}
+
+void cmd_heapinfo() {
+    const char *command_name = "heapinfo";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    heap_info info;
+    heap_get_info(heap, &info);
+    heap_info_print(command_out, &info);
+}
+
+void cmd_collect() {
+    const char *command_name = "collect";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (heap_in_transaction(heap)) {
+        fprintf(command_err, "Can't collect garbage during a transaction\n");
+        return;
+    }
+
+    size_t freed = heap_collect(heap);
+
+    fprintf(command_out, "%zu\n", freed);
+}
+
+void cmd_incremental() {
+    const char *command_name = "incremental";
+    cell_index slice;
+
+    if (!get_int_argument_strtok(command_name, &slice)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (slice < 0) {
+        fprintf(command_err, "Slice size can't be negative\n");
+        return;
+    }
+
+    gc_set_incremental(heap, slice);
+}
+
+void cmd_pauses() {
+    const char *command_name = "pauses";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    histogram_print(command_out, "pauses", gc_pauses(heap));
+}
+
+void cmd_profile() {
+    const char *command_name = "profile";
+    const char *action;
+
+    if (!get_word_argument_strtok(command_name, &action)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (strcmp(action, "start") == 0)
+        profile_start();
+    else if (strcmp(action, "stop") == 0)
+        profile_stop();
+    else if (strcmp(action, "dump") == 0)
+        profile_dump(command_out);
+    else
+        fprintf(command_err, "Unrecognized profile action: %s\n", action);
+}
+
+void cmd_nursery() {
+    const char *command_name = "nursery";
+    cell_index cells;
+
+    if (!get_int_argument_strtok(command_name, &cells)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (cells < 0) {
+        fprintf(command_err, "Nursery size can't be negative\n");
+        return;
+    }
+
+    if (heap_in_transaction(heap)) {
+        fprintf(command_err, "Can't change the nursery during a transaction\n");
+        return;
+    }
+
+    if (!heap_set_nursery(heap, cells))
+        fprintf(command_err, "Not enough uninitialized cells for the nursery\n");
+}
+
+void cmd_minor() {
+    const char *command_name = "minor";
+
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (heap_in_transaction(heap)) {
+        fprintf(command_err, "Can't collect garbage during a transaction\n");
+        return;
+    }
+
+    size_t freed = minor_collect(heap);
+
+    fprintf(command_out, "%zu\n", freed);
+}
+
+void cmd_reinit() {
+    const char *command_name = "reinit";
+    cell_index new_cell_count;
+
+    if (!get_int_argument_strtok(command_name, &new_cell_count)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+    if (new_cell_count <= 0) {
+        fprintf(command_err, "New cell count must be positive\n");
+        return;
+    }
+
+#ifdef FIXED_CELLS
+    if (new_cell_count != FIXED_CELLS) {
+        fprintf(command_err, "This build only makes heaps of %" PRI_INDEX " cells\n", FIXED_CELLS);
+        return;
+    }
+#endif
+
+    free_heap(heap);
+    heap = malloc_heap(new_cell_count, atom_text_size);
+}
+
+void cmd_dump() {
+    const char *command_name = "dump";
+    const char *path;
+    int flags = 0;
+
+    if (!get_word_argument_strtok(command_name, &path)) return;
+
+    // The optional second argument asks for compression.
+    const char *option = strtok_r(NULL, " \n", &strtok_state);
+    if (option) {
+        if (strcmp(option, "compressed") != 0) {
+            fprintf(command_err, "Unrecognized dump option: %s\n", option);
+            return;
+        }
+
+        flags |= DUMP_COMPRESS;
+        if (!no_more_arguments_strtok(command_name)) return;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(command_err, "Can't open %s for writing\n", path);
+        return;
+    }
+
+    int ok = heap_dump(heap, file, flags);
+
+    if (fclose(file) != 0 || !ok)
+        fprintf(command_err, "Failed to write %s\n", path);
+}
+
+void cmd_load() {
+    const char *command_name = "load";
+    const char *path;
+
+    if (!get_word_argument_strtok(command_name, &path)) return;
+    if (!no_more_arguments_strtok(command_name)) return;
+
+#ifdef FIXED_CELLS
+    // The loaded heap would need cells of its own while the old one is still
+    // there.
+    fprintf(command_err, "Can't load a heap in a fixed-size build\n");
+    return;
+#endif
+
+    if (heap_in_transaction(heap)) {
+        fprintf(command_err, "Can't load a heap during a transaction\n");
+        return;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(command_err, "Can't open %s for reading\n", path);
+        return;
+    }
+
+    heap_p loaded = heap_load(file);
+    fclose(file);
+
+    if (!loaded) {
+        fprintf(command_err, "%s is not a valid heap dump\n", path);
+        return;
+    }
+
+    free_heap(heap);
+    heap = loaded;
+}
+
+
+
+// Error messages:
+
+void unknown_command(const char *command_name) {
+    fprintf(command_err, "Unrecognized command: %s\n", command_name);
+}
+
+void too_few_arguments(const char *command_name) {
+    fprintf(command_err, "Too few arguments to %s\n", command_name);
+}
+
+void too_many_arguments(const char *command_name) {
+    fprintf(command_err, "Too many arguments to %s\n", command_name);
+}
+
+void invalid_number(const char *word) {
+    fprintf(command_err, "Invalid number: %s\n", word);
+}
+
+void index_out_of_range(cell_index index) {
+    fprintf(command_err, "Index out of range: %" PRI_INDEX "\n", index);
+}
+
+void unknown_tagname(const char *word) {
+    fprintf(command_err, "Unrecognized tag name: %s\n", word);
+}
+
+void not_an_atom(cell_index index) {
+    fprintf(command_err, "The cell at index %" PRI_INDEX " is not a valid atom\n", index);
+}
+
+void invalid_index(cell_index index) {
+    fprintf(command_err, "Invalid index: %" PRI_INDEX "\n", index);
+}
+
+void cell_has_references(cell_index index) {
+    fprintf(command_err,  "The cell at index %" PRI_INDEX " has references to it\n", index);
+}
+
+void not_a_map(cell_index index) {
+    fprintf(command_err, "The cell at index %" PRI_INDEX " is not a map\n", index);
+}
+
+void key_not_found(cell_index key) {
+    fprintf(command_err, "Key not found: %" PRI_INDEX "\n", key);
+}
+
+
+
+// Argument parsing using strtok_r:
+
+int get_int_argument_strtok(const char *command_name, cell_index *result) {
+    const char *word = strtok_r(NULL, " \n", &strtok_state);
+
+    if (!word) {
+        too_few_arguments(command_name);
+        return 0;
+    }
+
+    char *remainder;
+    cell_index strtoll_result = strtoll(word, &remainder, 10);
+
+    if (remainder == word) {
+        invalid_number(word);
+        return 0;
+    } else {
+        *result = strtoll_result;
+        return 1;
+    }
+}
+
+int get_word_argument_strtok(const char *command_name, const char **result) {
+    const char *word = strtok_r(NULL, " \n", &strtok_state);
+
+    if (!word) {
+        too_few_arguments(command_name);
+        return 0;
+    }
+
+    *result = word;
+    return 1;
+}
+
+int get_tagname_argument_strtok(const char *command_name, int *result) {
+    const char *word = strtok_r(NULL, " \n", &strtok_state);
+
+    if (!word) {
+        too_few_arguments(command_name);
+        return 0;
+    }
+
+    if (strcmp(word, "uninit") == 0) {
+        *result = TAG_UNINIT;
+        return 1;
+    } else if (strcmp(word, "atom") == 0) {
+        *result = TAG_ATOM;
+        return 1;
+    } else if (strcmp(word, "cons") == 0) {
+        *result = TAG_CONS;
+        return 1;
+    } else {
+        unknown_tagname(word);
+        return 0;
+    }
+}
+
+int no_more_arguments_strtok(const char *command_name) {
+    const char *word = strtok_r(NULL, " \n", &strtok_state);
+
+    if (word) {
+        too_many_arguments(command_name);
+        return 0;
+    } else {
+        return 1;
+    }
+}
@@ -0,0 +1,62 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// commands.h: The commands understood by the Poutine shell
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdio.h>
+
+#include "heap.h"
+#include "wire.h"
+
+#define HEAP_SIZE (1024*1024)
+#define ATOM_TEXT_SIZE (1024*8)
+// The server's heap is shared by all of its clients, so it gets more room
+#define SERVER_ATOM_TEXT_SIZE (1024*1024*16)
+
+// The heap that commands operate on
+extern heap_p heap;
+// The size of the atom text buffer that reinit gives the new heap
+extern size_t atom_text_size;
+
+// Where commands print their results and their error messages
+//
+// Each thread has its own pair of streams, which must be set before running
+// commands on that thread.
+extern __thread FILE *command_out;
+extern __thread FILE *command_err;
+
+// Run a single command
+//
+// The command string is modified in the process.
+void run_command(char *command);
+
+// Check whether a command only reads from the heap, so it's safe to run at
+// the same time as other such commands
+int command_is_read_only(const char *command);
+// Check whether a command begins, commits or aborts a transaction
+int command_controls_transactions(const char *command);
+// Check whether a command reads or writes a file named by its arguments
+int command_uses_files(const char *command);
+
+// Append what command_print_result() needs to know about a request made by
+// trace_encode() beyond its result, which is at the given offset in the
+// results; this must be called right after running the request
+//
+// The shell names the invalid index when cons or mapput fails, but the binary
+// protocol doesn't say which one it was.
+void command_annotate_result(const char *request, size_t length, wire_buffer *results, size_t offset);
+// Print the result of a request made by trace_encode(), and its annotation,
+// exactly as running the command would have, moving past both
+void command_print_result(wire_reader *request, wire_reader *result);
+
+#endif
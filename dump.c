@@ -0,0 +1,761 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// dump.h: Writing a whole heap to a file, and reading it back
+
+// Compressed columns use a small LZ77 scheme. A compressed column is a series
+// of sequences, each a varint count of literal bytes, those bytes, and then,
+// unless the column ends there, a match: a varint giving its length minus
+// LZ_MIN_MATCH and a varint giving how far back it starts. A match may overlap
+// the bytes it produces, so a run of one byte is a literal and a long match
+// one byte back. The compressor finds matches with a hash table of the last
+// position at which each 4 bytes were seen, and takes the first one it finds.
+//
+// No match is longer than LZ_MAX_MATCH. A sequence with a match takes at least
+// three bytes, so a column can't decompress to more than LZ_MAX_MATCH times
+// the bytes stored, and the loader rejects a length that claims otherwise
+// before it allocates anything.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dump.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "pagestore.h"
+#include "panic.h"
+#include "wire.h"
+
+// The shortest match worth encoding, and the farthest back a match can be
+#define LZ_MIN_MATCH 4
+#define LZ_WINDOW 65535
+// The longest match
+#define LZ_MAX_MATCH 65536
+// The size of the compressor's hash table, as a power of two
+#define LZ_HASH_BITS 14
+
+// The most bytes a varint takes
+#define VARINT_MAX 10
+// The most bytes read from the file at once, so a corrupt length can't make the
+// loader allocate much more memory than the file holds
+#define DUMP_CHUNK (1 << 20)
+
+// A hash table entry giving an atom text's dictionary number
+typedef struct dict_entry {
+    // The text's offset, or its hash in the table keyed by content
+    uint64_t key;
+    cell_index offset;
+    cell_index number;
+} dict_entry;
+
+typedef struct dict_table {
+    dict_entry *entries;
+    size_t capacity;
+    size_t count;
+} dict_table;
+
+// The previous atom's dictionary number and the previous cell referred to,
+// from which the next car of each kind is stored as a difference
+typedef struct car_history {
+    cell_index atom;
+    cell_index reference;
+} car_history;
+
+// What's needed while writing a dump
+typedef struct dump_writer {
+    heap_p heap;
+    FILE *out;
+    int flags;
+    int failed;
+
+    // Columns, a buffer for compressing them, and one for varints on their own
+    wire_buffer tags, cars, cdrs, refs, packed, number;
+
+    // Atom text offsets, and distinct atom texts, with their dictionary numbers
+    dict_table by_offset;
+    dict_table by_text;
+    cell_index text_count;
+} dump_writer;
+
+// Writing:
+
+// Number every distinct atom text in the heap, and write the dictionary
+void write_dictionary(dump_writer *writer);
+// Write one block of cells
+void write_cells(dump_writer *writer, cell_index start, cell_index end, car_history *last);
+// Write the blobs
+void write_blobs(dump_writer *writer);
+// Write a column, compressing it if asked to and if that makes it smaller
+void write_column(dump_writer *writer, const unsigned char *data, size_t length);
+// Write bytes to the file, noting any failure
+void write_bytes(dump_writer *writer, const void *data, size_t length);
+// Write a varint to the file
+void write_varint(dump_writer *writer, uint64_t value);
+
+// Reading:
+
+// Read the dictionary, putting its texts in the heap's atom text buffer and
+// their offsets in *offsets; return 0 on failure
+int read_dictionary(heap_p heap, FILE *in, wire_buffer *column, cell_index **offsets, cell_index *count);
+// Read one block of cells; return 0 on failure
+int read_cells(heap_p heap, FILE *in, wire_buffer *columns, cell_index start, cell_index count,
+    const cell_index *offsets, cell_index text_count, car_history *last);
+// Read the blobs; return 0 on failure
+int read_blobs(heap_p heap, FILE *in, wire_buffer *column);
+// Check that every cell that needs a blob has one of its own; return 0 if not
+int check_blobs(heap_p heap);
+// Read a column of at most max_length bytes, decompressing it if necessary;
+// return 0 on failure
+int read_column(FILE *in, wire_buffer *column, wire_buffer *packed, size_t max_length);
+// Read the given number of bytes into a buffer, a chunk at a time; return 0 on
+// failure
+int read_chunked(FILE *in, wire_buffer *buf, size_t length);
+// Read an unsigned or a signed varint from the file; return 0 on failure
+int read_varint(FILE *in, uint64_t *value);
+int read_signed(FILE *in, int64_t *value);
+// Read the bytes of a varint from the file, and point a reader at them; return
+// 0 on failure
+int read_number(FILE *in, unsigned char *bytes, wire_reader *reader);
+
+// Compression:
+
+// Compress bytes into an empty buffer, returning the compressed length, or the
+// original length if compressing doesn't make them smaller
+size_t lz_compress(const unsigned char *in, size_t length, wire_buffer *out);
+// Decompress bytes into exactly out_length bytes in a buffer; return 0 if
+// they're invalid or there isn't enough memory for them
+int lz_decompress(const unsigned char *in, size_t length, wire_buffer *out, size_t out_length);
+
+// The dictionary:
+
+// Find an entry in a table, or the empty slot where it belongs
+dict_entry *dict_slot(dict_table *table, uint64_t key, const char *text, const char *atom_text);
+// Add an entry to a table, growing it if necessary
+void dict_add(dict_table *table, uint64_t key, cell_index offset, cell_index number, const char *atom_text);
+// Hash atom text
+uint64_t hash_dump_text(const char *text);
+// Check whether a cell's car and cdr refer to other cells
+int car_is_reference(int tag);
+int cdr_is_reference(int tag);
+// Check whether a cell's car is a blob number
+int car_is_blob(int tag);
+
+
+
+// Writing:
+
+int heap_dump(heap_p heap, FILE *out, int flags) {
+    dump_writer writer = {.heap = heap, .out = out, .flags = flags};
+    wire_buffer *header = &writer.number;
+
+    if (!wire_reserve(&writer.tags, DUMP_BLOCK_CELLS / 2))
+        PANIC("Failed to allocate enough memory for a dump");
+
+    wire_append(header, DUMP_MAGIC, 8);
+    wire_put_uint(header, DUMP_VERSION);
+    wire_put_uint(header, flags);
+    wire_put_uint(header, heap->cell_count);
+    wire_put_uint(header, heap->atom_buf_size);
+    wire_put_uint(header, heap->next_uninit);
+    wire_put_int(header, heap->next_freed);
+    write_bytes(&writer, header->data, header->length);
+
+    write_dictionary(&writer);
+
+    car_history last = {-1, 0};
+    for (cell_index start = 0; start < heap->next_uninit && !writer.failed; start += DUMP_BLOCK_CELLS) {
+        cell_index end = heap->next_uninit - start > DUMP_BLOCK_CELLS ? start + DUMP_BLOCK_CELLS : heap->next_uninit;
+        write_cells(&writer, start, end, &last);
+    }
+
+    write_blobs(&writer);
+
+    free(writer.tags.data);
+    free(writer.cars.data);
+    free(writer.cdrs.data);
+    free(writer.refs.data);
+    free(writer.packed.data);
+    free(writer.number.data);
+    free(writer.by_offset.entries);
+    free(writer.by_text.entries);
+
+    return !writer.failed;
+}
+
+void write_dictionary(dump_writer *writer) {
+    heap_p heap = writer->heap;
+    wire_buffer column = {0};
+
+    for (cell_index i = 0; i < heap->next_uninit; i++) {
+        cons_cell *cell = &heap->cells[i];
+        if (cell->tag != TAG_ATOM || cell->car < 0)
+            continue;
+
+        if (dict_slot(&writer->by_offset, cell->car, NULL, NULL)->number >= 0)
+            continue;
+
+        // Text that's already in the dictionary at another offset gets the
+        // same number.
+        const char *text = heap->atom_text_buf + cell->car;
+        uint64_t hash = hash_dump_text(text);
+        dict_entry *same = dict_slot(&writer->by_text, hash, text, heap->atom_text_buf);
+        cell_index number = same->number;
+
+        if (number < 0) {
+            number = writer->text_count++;
+            dict_add(&writer->by_text, hash, cell->car, number, heap->atom_text_buf);
+
+            wire_put_string(&column, text, strlen(text));
+        }
+
+        dict_add(&writer->by_offset, cell->car, cell->car, number, NULL);
+    }
+
+    write_varint(writer, writer->text_count);
+    write_column(writer, (unsigned char *)column.data, column.length);
+    free(column.data);
+}
+
+void write_cells(dump_writer *writer, cell_index start, cell_index end, car_history *last) {
+    heap_p heap = writer->heap;
+    unsigned char *tags = (unsigned char *)writer->tags.data;
+
+    memset(tags, 0, (end - start + 1) / 2);
+    writer->cars.length = writer->cdrs.length = writer->refs.length = 0;
+
+    for (cell_index i = start; i < end; i++) {
+        cons_cell *cell = &heap->cells[i];
+        int tag = cell->tag;
+        int64_t car = cell->car;
+
+        tags[(i - start) / 2] |= tag << ((i - start) % 2 * 4);
+
+        if (tag == TAG_ATOM) {
+            cell_index number = car < 0 ? -1 : dict_slot(&writer->by_offset, car, NULL, NULL)->number;
+            car = number - last->atom;
+            last->atom = number;
+        } else if (car_is_reference(tag)) {
+            car -= last->reference;
+            last->reference = cell->car;
+        }
+
+        wire_put_int(&writer->cars, car);
+        wire_put_int(&writer->cdrs, cdr_is_reference(tag) ? (int64_t)cell->cdr - i : cell->cdr);
+        wire_put_int(&writer->refs, cell->ref_count);
+    }
+
+    write_varint(writer, end - start);
+    write_column(writer, tags, (end - start + 1) / 2);
+    write_column(writer, (unsigned char *)writer->cars.data, writer->cars.length);
+    write_column(writer, (unsigned char *)writer->cdrs.data, writer->cdrs.length);
+    write_column(writer, (unsigned char *)writer->refs.data, writer->refs.length);
+}
+
+void write_blobs(dump_writer *writer) {
+    heap_p heap = writer->heap;
+    size_t count = 0;
+
+    for (size_t i = 0; i < heap->blob_count; i++)
+        count += heap->blobs[i] != NULL;
+
+    write_varint(writer, count);
+
+    for (size_t i = 0; i < heap->blob_count; i++) {
+        if (!heap->blobs[i])
+            continue;
+
+        write_varint(writer, i);
+        write_column(writer, (unsigned char *)heap->blobs[i]->data, heap->blobs[i]->size);
+    }
+}
+
+void write_column(dump_writer *writer, const unsigned char *data, size_t length) {
+    size_t stored = length;
+
+    if (writer->flags & DUMP_COMPRESS) {
+        writer->packed.length = 0;
+        size_t packed = lz_compress(data, length, &writer->packed);
+
+        if (packed < length) {
+            data = (unsigned char *)writer->packed.data;
+            stored = packed;
+        }
+    }
+
+    write_varint(writer, length);
+    write_varint(writer, stored);
+    write_bytes(writer, data, stored);
+}
+
+void write_bytes(dump_writer *writer, const void *data, size_t length) {
+    if (length > 0 && fwrite(data, 1, length, writer->out) != length)
+        writer->failed = 1;
+}
+
+void write_varint(dump_writer *writer, uint64_t value) {
+    writer->number.length = 0;
+    wire_put_uint(&writer->number, value);
+    write_bytes(writer, writer->number.data, writer->number.length);
+}
+
+
+
+// Reading:
+
+heap_p heap_load(FILE *in) {
+    char magic[8];
+    uint64_t version, flags, cell_count, atom_buf_size, top;
+    int64_t first_freed;
+
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, DUMP_MAGIC, 8) != 0)
+        return NULL;
+
+    if (!read_varint(in, &version) || !read_varint(in, &flags) || !read_varint(in, &cell_count)
+        || !read_varint(in, &atom_buf_size) || !read_varint(in, &top) || !read_signed(in, &first_freed))
+        return NULL;
+
+    if (version != DUMP_VERSION || cell_count > INDEX_MAX || atom_buf_size > INDEX_MAX || top > cell_count
+        || first_freed < -1 || first_freed >= (int64_t)top)
+        return NULL;
+
+#ifdef POUTINE_FIXED_CELLS
+    if (cell_count != (uint64_t)FIXED_CELLS)
+        return NULL;
+#endif
+
+    heap_p heap = malloc_heap(cell_count, atom_buf_size);
+    wire_buffer columns[5] = {{0}};
+    cell_index *offsets = NULL;
+    cell_index text_count;
+    int ok = read_dictionary(heap, in, &columns[0], &offsets, &text_count);
+
+    heap->next_uninit = top;
+    heap->next_freed = first_freed;
+
+    car_history last = {-1, 0};
+    for (cell_index start = 0; start < (cell_index)top && ok; start += DUMP_BLOCK_CELLS) {
+        uint64_t count;
+        ok = read_varint(in, &count) && count == (top - start > DUMP_BLOCK_CELLS ? DUMP_BLOCK_CELLS : top - start)
+            && read_cells(heap, in, columns, start, count, offsets, text_count, &last);
+    }
+
+    ok = ok && read_blobs(heap, in, &columns[0]) && check_blobs(heap);
+
+    for (int i = 0; i < 5; i++)
+        free(columns[i].data);
+    free(offsets);
+
+    if (!ok) {
+        free_heap(heap);
+        return NULL;
+    }
+
+    // The nursery's blank cells are put to use, and the weak reference table
+    // is made again from the weak references.
+    free_blank_cells(heap, 0, top);
+    weak_rebuild(heap);
+
+    return heap;
+}
+
+int read_dictionary(heap_p heap, FILE *in, wire_buffer *column, cell_index **offsets, cell_index *count) {
+    uint64_t text_count;
+    wire_buffer packed = {0};
+
+    if (!read_varint(in, &text_count) || text_count > heap->atom_buf_size)
+        return 0;
+
+    int ok = read_column(in, column, &packed, heap->atom_buf_size + text_count * VARINT_MAX);
+    free(packed.data);
+    if (!ok)
+        return 0;
+
+    *offsets = malloc((text_count + 1) * sizeof(cell_index));
+    if (!*offsets)
+        PANIC("Failed to allocate enough memory for the atom dictionary");
+    *count = text_count;
+
+    const unsigned char *data = (const unsigned char *)column->data;
+    wire_reader reader = {data, data + column->length, 0};
+    cow_region_touch(&heap->atom_region, 0, heap->atom_buf_size);
+
+    for (uint64_t i = 0; i < text_count; i++) {
+        size_t length;
+        const char *text = wire_get_string(&reader, &length);
+        size_t used = heap->atom_text_next - heap->atom_text_buf;
+
+        // Each text needs room for its NUL.
+        if (reader.failed || length >= heap->atom_buf_size - used || memchr(text, '\0', length))
+            return 0;
+
+        (*offsets)[i] = used;
+        memcpy(heap->atom_text_next, text, length);
+        heap->atom_text_next[length] = '\0';
+        heap->atom_text_next += length + 1;
+    }
+
+    return reader.pos == reader.end;
+}
+
+int read_cells(heap_p heap, FILE *in, wire_buffer *columns, cell_index start, cell_index count,
+    const cell_index *offsets, cell_index text_count, car_history *last) {
+    wire_buffer *packed = &columns[4];
+
+    if (!read_column(in, &columns[0], packed, (count + 1) / 2) || columns[0].length != (size_t)(count + 1) / 2)
+        return 0;
+
+    for (int i = 1; i < 4; i++) {
+        if (!read_column(in, &columns[i], packed, (size_t)count * VARINT_MAX))
+            return 0;
+    }
+
+    const unsigned char *tags = (const unsigned char *)columns[0].data;
+    wire_reader readers[3];
+    for (int i = 0; i < 3; i++) {
+        const unsigned char *data = (const unsigned char *)columns[i + 1].data;
+        readers[i] = (wire_reader){data, data + columns[i + 1].length, 0};
+    }
+    wire_reader *cars = &readers[0], *cdrs = &readers[1], *refs = &readers[2];
+
+    cow_region_touch(&heap->cell_region, (size_t)start * sizeof(cons_cell), (size_t)count * sizeof(cons_cell));
+
+    for (cell_index i = start; i < start + count; i++) {
+        int tag = (tags[(i - start) / 2] >> ((i - start) % 2 * 4)) & 15;
+        int64_t car = wire_get_int(cars);
+        int64_t cdr = wire_get_int(cdrs);
+        int64_t ref_count = wire_get_int(refs);
+
+        if (tag > TAG_WEAK)
+            return 0;
+
+        if (tag == TAG_ATOM) {
+            cell_index number = last->atom + car;
+            if (number < -1 || number >= text_count)
+                return 0;
+
+            last->atom = number;
+            car = number < 0 ? -1 : offsets[number];
+        } else if (car_is_reference(tag)) {
+            car += last->reference;
+            if (car < -1 || car >= (int64_t)heap->cell_count)
+                return 0;
+            last->reference = car;
+        }
+
+        if (cdr_is_reference(tag)) {
+            cdr += i;
+            if (cdr < -1 || cdr >= (int64_t)heap->cell_count)
+                return 0;
+        }
+
+        if (car < -INDEX_MAX - 1 || car > INDEX_MAX || cdr < -INDEX_MAX - 1 || cdr > INDEX_MAX
+            || ref_count < 0 || ref_count > INDEX_MAX)
+            return 0;
+
+        heap->cells[i] = (cons_cell){.car = car, .cdr = cdr, .tag = tag, .ref_count = ref_count};
+    }
+
+    return !cars->failed && !cdrs->failed && !refs->failed
+        && cars->pos == cars->end && cdrs->pos == cdrs->end && refs->pos == refs->end;
+}
+
+int read_blobs(heap_p heap, FILE *in, wire_buffer *column) {
+    uint64_t count;
+    wire_buffer packed = {0};
+    // Blob numbers that weren't in the dump, which are freed at the end
+    wire_buffer missing = {0};
+    int ok = read_varint(in, &count);
+
+    for (uint64_t i = 0; i < count && ok; i++) {
+        // A blob can be any size, as far as its length goes; it's the bytes
+        // actually stored that limit how much memory a corrupt one can take.
+        uint64_t number;
+        ok = read_varint(in, &number) && number >= heap->blob_count && number <= INDEX_MAX
+            && read_column(in, column, &packed, SIZE_MAX);
+        if (!ok)
+            break;
+
+        // Blobs are numbered in order in a new heap, so the gaps are filled
+        // in with empty blobs.
+        while (heap->blob_count < number) {
+            cell_index gap = blob_alloc(heap, 0);
+            wire_append(&missing, &gap, sizeof(cell_index));
+        }
+
+        cell_index allocated = blob_alloc(heap, column->length);
+        memcpy(blob_data(heap, allocated), column->data, column->length);
+    }
+
+    for (size_t i = 0; i < missing.length; i += sizeof(cell_index)) {
+        cell_index gap;
+        memcpy(&gap, missing.data + i, sizeof(cell_index));
+        blob_free(heap, gap);
+    }
+
+    free(packed.data);
+    free(missing.data);
+    return ok;
+}
+
+int check_blobs(heap_p heap) {
+    // Two cells sharing a blob would both free it.
+    unsigned char *owned = calloc(heap->blob_count + 1, 1);
+    if (!owned)
+        PANIC("Failed to allocate enough memory to check a dump's blobs");
+
+    int ok = 1;
+    for (cell_index i = 0; i < heap->next_uninit && ok; i++) {
+        cons_cell *cell = &heap->cells[i];
+        if (!car_is_blob(cell->tag))
+            continue;
+
+        ok = cell->car >= 0 && (size_t)cell->car < heap->blob_count && heap->blobs[cell->car]
+            && !owned[cell->car];
+        if (ok)
+            owned[cell->car] = 1;
+    }
+
+    free(owned);
+    return ok;
+}
+
+int read_column(FILE *in, wire_buffer *column, wire_buffer *packed, size_t max_length) {
+    uint64_t length, stored;
+
+    if (!read_varint(in, &length) || !read_varint(in, &stored) || length > max_length || stored > length
+        || length / LZ_MAX_MATCH > stored)
+        return 0;
+
+    if (stored == length)
+        return read_chunked(in, column, length);
+
+    return read_chunked(in, packed, stored)
+        && lz_decompress((const unsigned char *)packed->data, stored, column, length);
+}
+
+int read_chunked(FILE *in, wire_buffer *buf, size_t length) {
+    buf->length = 0;
+
+    while (buf->length < length) {
+        size_t chunk = length - buf->length < DUMP_CHUNK ? length - buf->length : DUMP_CHUNK;
+
+        if (!wire_reserve(buf, buf->length + chunk) || fread(buf->data + buf->length, 1, chunk, in) != chunk)
+            return 0;
+        buf->length += chunk;
+    }
+
+    return 1;
+}
+
+int read_varint(FILE *in, uint64_t *value) {
+    unsigned char bytes[VARINT_MAX];
+    wire_reader reader;
+
+    if (!read_number(in, bytes, &reader))
+        return 0;
+
+    *value = wire_get_uint(&reader);
+    return 1;
+}
+
+int read_signed(FILE *in, int64_t *value) {
+    unsigned char bytes[VARINT_MAX];
+    wire_reader reader;
+
+    if (!read_number(in, bytes, &reader))
+        return 0;
+
+    *value = wire_get_int(&reader);
+    return 1;
+}
+
+int read_number(FILE *in, unsigned char *bytes, wire_reader *reader) {
+    for (int count = 0; count < VARINT_MAX;) {
+        int byte = getc(in);
+        if (byte == EOF)
+            return 0;
+
+        bytes[count++] = byte;
+        if (!(byte & 0x80)) {
+            *reader = (wire_reader){bytes, bytes + count, 0};
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+// Compression:
+
+size_t lz_compress(const unsigned char *in, size_t length, wire_buffer *out) {
+    // Each entry is one more than a position, so that zero means none.
+    static __thread uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t literal_start = 0;
+    size_t pos = 0;
+
+    while (pos + LZ_MIN_MATCH <= length) {
+        uint32_t word;
+        memcpy(&word, in + pos, 4);
+        uint32_t hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+
+        // Positions are relative to the start of the current 4 GiB, which is
+        // plenty for a column.
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)pos + 1;
+
+        if (candidate == 0 || pos - (candidate - 1) > LZ_WINDOW || memcmp(in + candidate - 1, in + pos, 4) != 0) {
+            pos++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t match_length = LZ_MIN_MATCH;
+        while (pos + match_length < length && match_length < LZ_MAX_MATCH
+            && in[match + match_length] == in[pos + match_length])
+            match_length++;
+
+        size_t literals = pos - literal_start;
+        size_t needed = 3 * VARINT_MAX + literals;
+
+        // Give up if the output would be no smaller than the input.
+        if (out->length + needed >= length)
+            return length;
+
+        wire_put_uint(out, literals);
+        wire_append(out, in + literal_start, literals);
+        wire_put_uint(out, match_length - LZ_MIN_MATCH);
+        wire_put_uint(out, pos - match);
+
+        pos += match_length;
+        literal_start = pos;
+    }
+
+    size_t literals = length - literal_start;
+    if (out->length + literals >= length)
+        return length;
+
+    wire_put_uint(out, literals);
+    wire_append(out, in + literal_start, literals);
+    return out->length;
+}
+
+int lz_decompress(const unsigned char *in, size_t length, wire_buffer *out, size_t out_length) {
+    wire_reader reader = {in, in + length, 0};
+    size_t pos = 0;
+
+    // Every sequence starts with literals, even if there are none, so the
+    // last one ends the data.
+    for (;;) {
+        uint64_t literals = wire_get_uint(&reader);
+        if (reader.failed || literals > out_length - pos || literals > (size_t)(reader.end - reader.pos)
+            || !wire_reserve(out, pos + literals))
+            return 0;
+
+        memcpy(out->data + pos, reader.pos, literals);
+        reader.pos += literals;
+        pos += literals;
+
+        if (pos == out_length)
+            break;
+
+        uint64_t match_length = wire_get_uint(&reader) + LZ_MIN_MATCH;
+        uint64_t distance = wire_get_uint(&reader);
+        if (reader.failed || distance == 0 || distance > pos || match_length > LZ_MAX_MATCH
+            || match_length > out_length - pos || !wire_reserve(out, pos + match_length))
+            return 0;
+
+        // The match may overlap what it's producing, so it's copied a byte at
+        // a time.
+        for (uint64_t i = 0; i < match_length; i++, pos++)
+            out->data[pos] = out->data[pos - distance];
+    }
+
+    out->length = pos;
+    return reader.pos == reader.end;
+}
+
+
+
+// The dictionary:
+
+dict_entry *dict_slot(dict_table *table, uint64_t key, const char *text, const char *atom_text) {
+    static dict_entry none = {.number = -1};
+
+    if (table->capacity == 0)
+        return &none;
+
+    size_t mask = table->capacity - 1;
+    size_t slot = (key * 0x9e3779b97f4a7c15) >> 7 & mask;
+
+    for (;; slot = (slot + 1) & mask) {
+        dict_entry *entry = &table->entries[slot];
+
+        if (entry->number < 0)
+            return entry;
+
+        // In the table keyed by content, equal hashes still need the text
+        // compared.
+        if (entry->key == key && (!text || strcmp(atom_text + entry->offset, text) == 0))
+            return entry;
+    }
+}
+
+void dict_add(dict_table *table, uint64_t key, cell_index offset, cell_index number, const char *atom_text) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        dict_table grown = {.capacity = table->capacity ? table->capacity * 2 : 1024};
+        grown.entries = malloc(grown.capacity * sizeof(dict_entry));
+        if (!grown.entries)
+            PANIC("Failed to allocate enough memory for the atom dictionary");
+
+        for (size_t i = 0; i < grown.capacity; i++)
+            grown.entries[i].number = -1;
+
+        // Entries already in the table are all different, so they don't
+        // need comparing.
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->entries[i].number >= 0)
+                *dict_slot(&grown, table->entries[i].key, NULL, NULL) = table->entries[i];
+        }
+
+        grown.count = table->count;
+        free(table->entries);
+        *table = grown;
+    }
+
+    const char *text = atom_text ? atom_text + offset : NULL;
+    *dict_slot(table, key, text, atom_text) = (dict_entry){.key = key, .offset = offset, .number = number};
+    table->count++;
+}
+
+uint64_t hash_dump_text(const char *text) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (; *text; text++)
+        hash = (hash ^ (unsigned char)*text) * 0x100000001b3;
+
+    return hash;
+}
+
+int car_is_reference(int tag) {
+    return tag == TAG_CONS || tag == TAG_WEAK || tag == TAG_FREED;
+}
+
+int cdr_is_reference(int tag) {
+    return tag == TAG_CONS;
+}
+
+int car_is_blob(int tag) {
+    return tag == TAG_MAP || tag == TAG_PVEC || tag == TAG_PMAP || tag == TAG_NODE;
+}
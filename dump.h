@@ -0,0 +1,86 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// dump.h: Writing a whole heap to a file, and reading it back
+
+// A dump stores a heap's cells by column rather than by cell, since each
+// column on its own is much more regular than the cells are. It's written as
+// a stream, a block of cells at a time, so dumping a heap takes a fixed amount
+// of memory beyond the atom dictionary, however big the heap is.
+//
+// The file starts with a header:
+//
+//     the 8 bytes DUMP_MAGIC
+//     varints: DUMP_VERSION, the flags, the number of cells in the heap, the
+//         size of its atom text buffer, and the number of cells dumped, which
+//         is every cell that's ever been allocated
+//     a zigzag varint: the first cell on the free list, or -1
+//
+// Next is the atom dictionary: a varint count of distinct atom texts, then a
+// column holding each text as a varint length followed by its bytes. Then come
+// the cells, in blocks of up to DUMP_BLOCK_CELLS. A block is a varint count of
+// cells, followed by four columns:
+//
+//     tags, 4 bits each, two to a byte, low bits first
+//     cars: for an atom, the difference between its dictionary number (or -1)
+//         and that of the atom before it; for a cons, a weak reference or a
+//         freed cell, the difference between the cell it refers to (or -1) and
+//         the one the cell before it of those kinds referred to, starting from
+//         0; for anything else, the car itself
+//     cdrs: for a cons, the difference between its cdr and its own index; for
+//         anything else, the cdr itself
+//     reference counts
+//
+// Every number in the columns is a zigzag varint, as in wire.h. Last come the
+// blobs: a varint count, then for each a varint blob number and a column
+// holding its bytes.
+//
+// A column is a varint giving its length, a varint giving the number of bytes
+// stored, and those bytes. If the number stored is less than the length, the
+// bytes are compressed with the LZ77 scheme described in dump.c.
+//
+// Loading a dump makes a new heap with the same cells, atom text, free list,
+// blobs and weak references. Duplicate atom text is stored once, so the atom
+// text buffer may be smaller afterwards. Hash-consing, the nursery and the
+// incremental collector start out off, as in a new heap; blank cells left
+// behind by the nursery go on the free list.
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdio.h>
+
+#include "heap.h"
+
+#define DUMP_MAGIC "POUTDUMP"
+#define DUMP_VERSION 1
+
+// The most cells in one block
+#define DUMP_BLOCK_CELLS 65536
+
+// Flags for heap_dump()
+#define DUMP_COMPRESS 1
+
+// Write a heap to a file; return 0 if writing failed
+//
+// This function panics if it fails to allocate enough memory.
+int heap_dump(heap_p heap, FILE *out, int flags);
+
+// Read a heap written by heap_dump(); return NULL if reading failed or the
+// file isn't a valid dump, or, in a fixed-size build, if the heap it holds
+// isn't FIXED_CELLS cells
+//
+// Every cell in the dump that needs a blob must have one of its own. This
+// function panics if it fails to allocate enough memory for the heap, but a
+// corrupt column length only makes it fail, since a column is never given more
+// memory than the bytes actually stored for it could decompress to.
+heap_p heap_load(FILE *in);
+
+#endif
@@ -0,0 +1,354 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// equal.h: Structural equality and hashing of values
+
+#include <stdint.h>
+#include <string.h>
+
+#include "equal.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "panic.h"
+
+#define STATE_EMPTY 0
+#define STATE_STARTED 1
+#define STATE_DONE 2
+
+// Two cell indexes packed into one number, with room for a flag above the
+// first one
+#if POUTINE_INDEX_BITS == 64
+typedef unsigned __int128 cell_pair;
+typedef uint64_t index_bits;
+#else
+typedef uint64_t cell_pair;
+typedef uint32_t index_bits;
+#endif
+
+#define PAIR_SHIFT (8 * sizeof(index_bits))
+
+// A side table from cells (or pairs of cells) to 64-bit values, used to
+// remember which ones have been visited already
+typedef struct side_table {
+    struct side_slot {
+        cell_pair key;
+        uint64_t value;
+        int state;
+    } *slots;
+    // Always a power of two
+    size_t capacity;
+    size_t count;
+} side_table;
+
+// A stack of cells, pairs of cells or hashes
+typedef struct work_stack {
+    cell_pair *items;
+    size_t count;
+    size_t capacity;
+} work_stack;
+
+// Marks an item on the work stack as a cell whose children have been visited
+#define COMBINE ((cell_pair)1 << PAIR_SHIFT)
+
+// Check whether a cell has exactly one reference to it
+static inline int is_single_reference(heap_p heap, cell_index index) {
+    return getfield(heap, FIELD_REFCOUNT, index) == 1;
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    h ^= b + 0x94D049BB133111EBull + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0x94D049BB133111EBull;
+    h ^= h >> 29;
+    return h;
+}
+
+static inline cell_pair pair_key(cell_index a, cell_index b) {
+    return (cell_pair)(index_bits)a << PAIR_SHIFT | (index_bits)b;
+}
+
+// Hash a key of a side table
+static inline uint64_t hash_pair(cell_pair key) {
+    // The high half is zero unless indexes are 64 bits wide.
+    return mix((uint64_t)key, (uint64_t)(key >> 32 >> 32));
+}
+
+// Hash the text of an atom
+uint64_t hash_text(const char *text);
+
+void side_table_init(side_table *table);
+void side_table_free(side_table *table);
+// Find the slot for a key; return 0 if there isn't one
+struct side_slot *side_table_find(side_table *table, cell_pair key);
+// Find the slot for a key, adding one if there isn't one already
+//
+// A new slot has a state of STATE_EMPTY, and the caller must change that. The
+// result pointer is only valid until the next call to this function.
+struct side_slot *side_table_slot(side_table *table, cell_pair key);
+
+void work_stack_init(work_stack *stack);
+void work_stack_free(work_stack *stack);
+void work_stack_push(work_stack *stack, cell_pair item);
+
+int heap_equal(heap_p heap, cell_index a, cell_index b) {
+    if (a == b)
+        return 1;
+
+    cons_cell *cells = heap->cells;
+    side_table visited;
+    work_stack stack;
+    int result = 1;
+
+    side_table_init(&visited);
+    work_stack_init(&stack);
+    work_stack_push(&stack, pair_key(a, b));
+
+    while (stack.count > 0) {
+        cell_pair key = stack.items[--stack.count];
+        cell_index x = (index_bits)(key >> PAIR_SHIFT);
+        cell_index y = (index_bits)key;
+
+        if (x == y)
+            continue;
+
+        // If this pair turns out to differ, we'll stop right away, so a pair
+        // we've seen before is either equal or already being compared. A pair
+        // of cells which each have one reference can only be reached once, so
+        // there's no need to remember it, unless it's the first pair: a cycle
+        // can come back around to that one.
+        if (key == pair_key(a, b) || !is_single_reference(heap, x) || !is_single_reference(heap, y)) {
+            struct side_slot *slot = side_table_slot(&visited, key);
+            if (slot->state != STATE_EMPTY)
+                continue;
+            slot->state = STATE_DONE;
+        }
+
+        int tag = getfield(heap, FIELD_TAG, x);
+        if (tag != getfield(heap, FIELD_TAG, y)) {
+            result = 0;
+            break;
+        }
+
+        if (tag == TAG_ATOM) {
+            // Atom text is never stored twice, so equal atoms have equal cars.
+            if (cells[x].car != cells[y].car) {
+                result = 0;
+                break;
+            }
+        } else if (tag == TAG_CONS) {
+            work_stack_push(&stack, pair_key(cells[x].cdr, cells[y].cdr));
+            work_stack_push(&stack, pair_key(cells[x].car, cells[y].car));
+        } else if (tag == TAG_MAP || tag == TAG_PVEC || tag == TAG_PMAP || tag == TAG_WEAK) {
+            // Collections and weak references are only equal to themselves.
+            result = 0;
+            break;
+        } else {
+            PANIC("The cell at index %" PRI_INDEX " doesn't contain a value", x);
+        }
+    }
+
+    work_stack_free(&stack);
+    side_table_free(&visited);
+
+    return result;
+}
+
+uint64_t heap_hash(heap_p heap, cell_index index) {
+    cons_cell *cells = heap->cells;
+    side_table memo;
+    // Cells still to visit, and cons cells waiting for their children's
+    // hashes (marked with COMBINE)
+    work_stack stack;
+    // The hashes of the children visited so far
+    work_stack hashes;
+
+    side_table_init(&memo);
+    work_stack_init(&stack);
+    work_stack_init(&hashes);
+    work_stack_push(&stack, index);
+
+    while (stack.count > 0) {
+        cell_pair item = stack.items[--stack.count];
+        cell_index current = (index_bits)item;
+        // Only cells with several references can be reached more than once,
+        // so those are the only ones worth remembering. (The root counts,
+        // since the traversal might come back around to it.)
+        int memoize = current == index || !is_single_reference(heap, current);
+
+        if (item & COMBINE) {
+            uint64_t cdr_hash = hashes.items[--hashes.count];
+            uint64_t car_hash = hashes.items[--hashes.count];
+            uint64_t hash = mix(mix(TAG_CONS, car_hash), cdr_hash);
+
+            if (memoize) {
+                struct side_slot *slot = side_table_find(&memo, current);
+                slot->value = hash;
+                slot->state = STATE_DONE;
+            }
+
+            work_stack_push(&hashes, hash);
+            continue;
+        }
+
+        if (memoize) {
+            struct side_slot *slot = side_table_slot(&memo, current);
+
+            if (slot->state == STATE_DONE) {
+                work_stack_push(&hashes, slot->value);
+                continue;
+            }
+
+            if (slot->state == STATE_STARTED)
+                PANIC("The value at index %" PRI_INDEX " contains a cycle", index);
+
+            slot->state = STATE_STARTED;
+        }
+
+        int tag = getfield(heap, FIELD_TAG, current);
+
+        if (tag == TAG_ATOM || tag == TAG_MAP || tag == TAG_PVEC || tag == TAG_PMAP || tag == TAG_WEAK) {
+            uint64_t hash;
+            // A blank cell is an atom without any text, and those all
+            // compare equal, by car.
+            if (tag == TAG_ATOM && cells[current].car < 0)
+                hash = mix(TAG_ATOM, (uint64_t)cells[current].car);
+            else if (tag == TAG_ATOM)
+                hash = hash_text(getatom(heap, current));
+            else
+                hash = mix(tag, current);
+
+            if (memoize) {
+                struct side_slot *slot = side_table_find(&memo, current);
+                slot->value = hash;
+                slot->state = STATE_DONE;
+            }
+
+            work_stack_push(&hashes, hash);
+        } else if (tag == TAG_CONS) {
+            // Hash the children first, then come back to this cell.
+            work_stack_push(&stack, COMBINE | (index_bits)current);
+            work_stack_push(&stack, (index_bits)cells[current].cdr);
+            work_stack_push(&stack, (index_bits)cells[current].car);
+        } else {
+            PANIC("The cell at index %" PRI_INDEX " doesn't contain a value", current);
+        }
+    }
+
+    uint64_t result = hashes.items[0];
+
+    work_stack_free(&hashes);
+    work_stack_free(&stack);
+    side_table_free(&memo);
+
+    return result;
+}
+
+uint64_t hash_text(const char *text) {
+    // FNV-1a, finished off with a mix so that short strings spread out
+    uint64_t h = 0xCBF29CE484222325ull;
+
+    for (const char *c = text; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 0x100000001B3ull;
+    }
+
+    return mix(TAG_ATOM, h);
+}
+
+void side_table_init(side_table *table) {
+    table->capacity = 64;
+    table->count = 0;
+    table->slots = calloc(table->capacity, sizeof(struct side_slot));
+    if (!table->slots)
+        PANIC("Failed to allocate enough memory for a side table");
+}
+
+void side_table_free(side_table *table) {
+    free(table->slots);
+}
+
+struct side_slot *side_table_find(side_table *table, cell_pair key) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash_pair(key) & mask;
+
+    while (table->slots[i].state != STATE_EMPTY) {
+        if (table->slots[i].key == key)
+            return &table->slots[i];
+
+        i = (i + 1) & mask;
+    }
+
+    return 0;
+}
+
+struct side_slot *side_table_slot(side_table *table, cell_pair key) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        struct side_slot *old_slots = table->slots;
+        size_t old_capacity = table->capacity;
+
+        table->capacity *= 2;
+        table->slots = calloc(table->capacity, sizeof(struct side_slot));
+        if (!table->slots)
+            PANIC("Failed to allocate enough memory for a side table");
+
+        size_t mask = table->capacity - 1;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_slots[i].state == STATE_EMPTY)
+                continue;
+
+            size_t j = hash_pair(old_slots[i].key) & mask;
+            while (table->slots[j].state != STATE_EMPTY)
+                j = (j + 1) & mask;
+
+            table->slots[j] = old_slots[i];
+        }
+
+        free(old_slots);
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t i = hash_pair(key) & mask;
+
+    while (table->slots[i].state != STATE_EMPTY) {
+        if (table->slots[i].key == key)
+            return &table->slots[i];
+
+        i = (i + 1) & mask;
+    }
+
+    table->slots[i].key = key;
+    table->count++;
+
+    return &table->slots[i];
+}
+
+void work_stack_init(work_stack *stack) {
+    stack->capacity = 64;
+    stack->count = 0;
+    stack->items = malloc(stack->capacity * sizeof(cell_pair));
+    if (!stack->items)
+        PANIC("Failed to allocate enough memory for a work stack");
+}
+
+void work_stack_free(work_stack *stack) {
+    free(stack->items);
+}
+
+void work_stack_push(work_stack *stack, cell_pair item) {
+    if (stack->count == stack->capacity) {
+        stack->capacity *= 2;
+        stack->items = realloc(stack->items, stack->capacity * sizeof(cell_pair));
+        if (!stack->items)
+            PANIC("Failed to allocate enough memory for a work stack");
+    }
+
+    stack->items[stack->count++] = item;
+}
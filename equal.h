@@ -0,0 +1,42 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// equal.h: Structural equality and hashing of values
+
+// Two values are structurally equal if they're atoms with the same text, or
+// cons cells whose cars are structurally equal and whose cdrs are structurally
+// equal. A map or a persistent collection is only equal to itself. Both
+// functions here walk the value with an explicit stack, so deep lists don't
+// overflow the C stack, and remember the cells they've visited that have more
+// than one reference, so heavily shared structures don't take exponential
+// time. They rely on reference counts being accurate to find the shared cells.
+
+#ifndef EQUAL_H
+#define EQUAL_H
+
+#include <stdint.h>
+
+#include "heap.h"
+
+// Return 1 if the two values are structurally equal, 0 otherwise
+//
+// Values may contain cycles. They're compared as if the cycles were unrolled
+// forever, so two cycles are equal if following them never finds a
+// difference.
+int heap_equal(heap_p heap, cell_index a, cell_index b);
+
+// Compute a hash of a value
+//
+// Structurally equal values have equal hashes, even if they're in different
+// heaps (unless they contain collections). This function panics if the value
+// contains a cycle.
+uint64_t heap_hash(heap_p heap, cell_index index);
+
+#endif
@@ -0,0 +1,917 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// gc.h: A tracing garbage collector for what reference counting misses
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gc.h"
+#include "hashcons.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "map.h"
+#include "panic.h"
+#include "persist.h"
+#include "rawheap.h"
+
+// A heap is only split between threads if each one gets at least this many
+// cells.
+#define CELLS_PER_THREAD (1 << 20)
+
+// The tags of values, which are roots if nothing refers to them
+#define VALUE_TAGS ((1 << TAG_ATOM) | (1 << TAG_CONS) | (1 << TAG_MAP) | (1 << TAG_PVEC) | (1 << TAG_PMAP) \
+    | (1 << TAG_WEAK))
+// The tags of cells whose car is a blob number
+#define BLOB_TAGS ((1 << TAG_MAP) | (1 << TAG_PVEC) | (1 << TAG_PMAP) | (1 << TAG_NODE))
+
+// The tags of cells which the incremental collector treats as roots if nothing
+// refers to them. A node with no references only exists while a collection is
+// in the middle of being updated, and is about to be either linked in or freed.
+#define ROOT_TAGS (VALUE_TAGS | (1 << TAG_NODE))
+
+// An incremental cycle starts after at least this many allocations.
+#define GC_MIN_TRIGGER 1024
+
+// The number of cells a work deque has room for at first
+#define INITIAL_DEQUE_SIZE 1024
+
+// Returned by the deque functions when there's nothing to take
+#define NO_WORK -1
+
+// The storage behind a work deque
+typedef struct work_array {
+    // Always a power of 2
+    long size;
+    cell_index items[];
+} work_array;
+
+// A Chase-Lev work-stealing deque of cells whose references still need to be
+// followed
+//
+// The thread which owns the deque pushes and pops cells at the bottom. Other
+// threads steal cells from the top. Only stealing the last cell needs a
+// compare-and-swap; everything else is plain loads and stores.
+typedef struct work_deque {
+    long top;
+    long bottom;
+    work_array *array;
+    // Arrays that have been outgrown, which a thief might still be reading
+    work_array **retired;
+    size_t retired_count;
+} work_deque;
+
+typedef struct collection collection;
+
+// One thread's share of a collection
+typedef struct gc_worker {
+    collection *gc;
+    int number;
+    // The cells this thread looks for roots and garbage in
+    cell_index start;
+    cell_index end;
+
+    work_deque deque;
+
+    // The garbage this thread found
+    cell_index *garbage;
+    size_t garbage_count;
+    size_t garbage_capacity;
+    // How much of the garbage, from the front, went on this thread's free
+    // list; the rest belonged to regions
+    size_t linked;
+} gc_worker;
+
+// A collection in progress
+struct collection {
+    heap_p heap;
+    // One bit for each cell, set once the cell is known to be live
+    uint64_t *marks;
+
+    gc_worker *workers;
+    int worker_count;
+    // The number of workers which have run out of marking work
+    int idle;
+};
+
+// Set up the workers for a collection
+void start_collection(collection *gc, heap_p heap);
+// Free everything start_collection() allocated
+void finish_collection(collection *gc);
+// Run a function for each worker, in separate threads if there's more than
+// one
+void run_workers(collection *gc, void *(*work)(void *));
+// Check whether any chunk of a region is shared with another region
+int region_has_shared_chunks(cow_region *region);
+
+// Mark everything reachable from the roots in a worker's share of the heap,
+// then help the other workers until there's nothing left to mark
+void *mark_worker(void *worker);
+// Mark a cell; return 1 if it wasn't marked already
+int mark(collection *gc, cell_index index);
+// Check whether a cell is marked
+int is_marked(collection *gc, cell_index index);
+// Mark a cell and queue it up to have its references followed, if it wasn't
+// marked already
+void mark_reference(void *worker, cell_index reference);
+// Follow the references of every cell in a worker's deque
+void drain(gc_worker *worker);
+// Follow the references of a marked cell
+void follow(gc_worker *worker, cell_index index);
+// Steal a cell from another worker and follow its references; return 0 if
+// there was nothing to steal
+int steal_work(gc_worker *worker);
+// Wait until another worker has work to steal or every worker is idle; return
+// 0 once they're all idle
+int wait_for_work(gc_worker *worker);
+
+// Find the unmarked cells in a worker's share of the heap
+void *find_garbage_worker(void *worker);
+// Drop the references that a worker's garbage holds to live cells
+void *release_worker(void *worker);
+// Drop one reference found by release_worker(), if it's to a live cell
+void release_reference(void *worker, cell_index reference);
+// Free the blobs of all the garbage, take it out of the hash-consing table and
+// clear the weak references to it
+void release_storage(collection *gc);
+// Turn a worker's garbage into a free list
+void *link_worker(void *worker);
+
+// Set up a work deque
+void deque_init(work_deque *deque);
+// Free a work deque
+void deque_free(work_deque *deque);
+// Push a cell onto the bottom of a worker's own deque
+void deque_push(work_deque *deque, cell_index index);
+// Pop a cell off the bottom of a worker's own deque, or return NO_WORK
+cell_index deque_pop(work_deque *deque);
+// Steal a cell from the top of another worker's deque, or return NO_WORK
+cell_index deque_steal(work_deque *deque);
+// Check whether a deque looks like it has cells in it
+int deque_has_work(work_deque *deque);
+
+// Do up to the given amount of work on the running incremental cycle; return
+// 0 once the cycle is over
+int incremental_work(heap_p heap, long budget);
+// Follow the references of the next grey cell, or look at the next possible
+// root; return the amount of work done
+long mark_step(heap_p heap);
+// Drop the references that the next cell holds to live cells, if it's
+// garbage; return the amount of work done
+long release_step(heap_p heap);
+// Free the next cell, if it's garbage; return the amount of work done
+long sweep_step(heap_p heap);
+// End the running incremental cycle
+void end_cycle(heap_p heap);
+// Shade a cell that a grey cell refers to, counting the work
+void shade_reference(void *counter, cell_index reference);
+// Drop a reference held by a piece of garbage, if it's to a live cell
+void release_incremental_reference(void *counter, cell_index reference);
+// Check whether a cell was found to be garbage by the running cycle
+int is_garbage(heap_p heap, cell_index index);
+
+// The context for shade_reference()
+typedef struct shade_counter {
+    heap_p heap;
+    long work;
+} shade_counter;
+
+static int thread_setting = 0;
+
+
+
+// Collecting:
+
+size_t heap_collect(heap_p heap) {
+    if (heap->undo.active)
+        PANIC("Can't collect garbage during a transaction");
+
+    gc_cancel(heap);
+
+    collection gc;
+    start_collection(&gc, heap);
+
+    run_workers(&gc, mark_worker);
+    run_workers(&gc, find_garbage_worker);
+
+    // Writing to the cells from several threads at once is only safe if none
+    // of them needs to unshare a chunk first.
+    int parallel = gc.worker_count > 1 && !region_has_shared_chunks(&heap->cell_region);
+
+    if (parallel) {
+        run_workers(&gc, release_worker);
+    } else {
+        for (int i = 0; i < gc.worker_count; i++)
+            release_worker(&gc.workers[i]);
+    }
+
+    release_storage(&gc);
+
+    if (parallel) {
+        run_workers(&gc, link_worker);
+    } else {
+        for (int i = 0; i < gc.worker_count; i++)
+            link_worker(&gc.workers[i]);
+    }
+
+    // Join the workers' free lists onto the front of the heap's.
+    size_t freed = 0;
+    cell_index next = heap->next_freed;
+
+    for (int i = gc.worker_count - 1; i >= 0; i--) {
+        gc_worker *worker = &gc.workers[i];
+        freed += worker->garbage_count;
+
+        if (worker->linked > 0) {
+            writable_cell(heap, worker->garbage[worker->linked - 1])->car = next;
+            next = worker->garbage[0];
+        }
+    }
+
+    heap->next_freed = next;
+    heap->gc.allocations = 0;
+    heap->nursery.full = 0;
+
+    finish_collection(&gc);
+    return freed;
+}
+
+void gc_set_threads(int threads) {
+    thread_setting = threads;
+}
+
+void cell_references(heap_p heap, cell_index index,
+    void (*visit)(void *context, cell_index reference), void *context) {
+
+    cons_cell *cell = &heap->cells[index];
+
+    if (cell->tag == TAG_CONS) {
+        visit(context, cell->car);
+        visit(context, cell->cdr);
+    } else if (cell->tag == TAG_MAP) {
+        cell_index key, value;
+        cell_index position = 0;
+
+        while ((position = map_next_stored(heap, index, position, &key, &value)) != 0) {
+            visit(context, key);
+            visit(context, value);
+        }
+    } else if (cell->tag == TAG_PVEC || cell->tag == TAG_PMAP || cell->tag == TAG_NODE) {
+        persist_references(heap, index, visit, context);
+    }
+}
+
+void start_collection(collection *gc, heap_p heap) {
+    int threads = thread_setting;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int worker_count = heap->cell_count / CELLS_PER_THREAD;
+    if (worker_count > threads)
+        worker_count = threads;
+    if (worker_count < 1)
+        worker_count = 1;
+
+    gc->heap = heap;
+    gc->marks = calloc((heap->cell_count + 63) / 64, sizeof(uint64_t));
+    gc->workers = calloc(worker_count, sizeof(gc_worker));
+    gc->worker_count = worker_count;
+    gc->idle = 0;
+
+    if (!gc->marks || !gc->workers)
+        PANIC("Failed to allocate enough memory to collect garbage");
+
+    // Each worker's share of the heap starts on a word of the mark bitmap.
+    size_t words = (heap->cell_count + 63) / 64;
+
+    for (int i = 0; i < worker_count; i++) {
+        gc_worker *worker = &gc->workers[i];
+        worker->gc = gc;
+        worker->number = i;
+        worker->start = words * i / worker_count * 64;
+        worker->end = i == worker_count - 1 ? heap->cell_count : words * (i + 1) / worker_count * 64;
+        deque_init(&worker->deque);
+    }
+}
+
+void finish_collection(collection *gc) {
+    for (int i = 0; i < gc->worker_count; i++) {
+        deque_free(&gc->workers[i].deque);
+        free(gc->workers[i].garbage);
+    }
+
+    free(gc->workers);
+    free(gc->marks);
+}
+
+void run_workers(collection *gc, void *(*work)(void *)) {
+    pthread_t *threads = malloc(gc->worker_count * sizeof(pthread_t));
+    if (!threads)
+        PANIC("Failed to allocate enough memory to collect garbage");
+
+    // This thread does the first worker's share itself.
+    for (int i = 1; i < gc->worker_count; i++) {
+        if (pthread_create(&threads[i], 0, work, &gc->workers[i]) != 0)
+            PANIC("Failed to start a collector thread");
+    }
+
+    work(&gc->workers[0]);
+
+    for (int i = 1; i < gc->worker_count; i++)
+        pthread_join(threads[i], 0);
+
+    free(threads);
+}
+
+int region_has_shared_chunks(cow_region *region) {
+    size_t chunk_count = region->size >> COW_CHUNK_SHIFT;
+
+    for (size_t i = 0; i < chunk_count; i++) {
+        if (region->shared[i])
+            return 1;
+    }
+
+    return 0;
+}
+
+
+
+// Marking:
+
+void *mark_worker(void *arg) {
+    gc_worker *worker = arg;
+    collection *gc = worker->gc;
+    cons_cell *cells = gc->heap->cells;
+
+    for (cell_index i = worker->start; i < worker->end; i++) {
+        unsigned tag = cells[i].tag;
+
+        if (tag < 32 && (VALUE_TAGS & (1 << tag)) && cells[i].ref_count == 0) {
+            mark_reference(worker, i);
+            drain(worker);
+        }
+    }
+
+    do {
+        drain(worker);
+    } while (steal_work(worker) || wait_for_work(worker));
+
+    return 0;
+}
+
+int mark(collection *gc, cell_index index) {
+    uint64_t bit = (uint64_t)1 << (index & 63);
+    uint64_t *word = &gc->marks[index >> 6];
+
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        return 0;
+
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+int is_marked(collection *gc, cell_index index) {
+    return (gc->marks[index >> 6] >> (index & 63)) & 1;
+}
+
+void mark_reference(void *arg, cell_index reference) {
+    gc_worker *worker = arg;
+
+    if (reference >= 0 && reference < worker->gc->heap->cell_count && mark(worker->gc, reference))
+        deque_push(&worker->deque, reference);
+}
+
+void drain(gc_worker *worker) {
+    cell_index index;
+
+    while ((index = deque_pop(&worker->deque)) != NO_WORK)
+        follow(worker, index);
+}
+
+void follow(gc_worker *worker, cell_index index) {
+    heap_p heap = worker->gc->heap;
+    cons_cell *cell = &heap->cells[index];
+
+    if (cell->tag == TAG_CONS) {
+        mark_reference(worker, cell->car);
+        mark_reference(worker, cell->cdr);
+    } else if (cell->tag != TAG_ATOM) {
+        cell_references(heap, index, mark_reference, worker);
+    }
+}
+
+int steal_work(gc_worker *worker) {
+    collection *gc = worker->gc;
+
+    for (int i = 1; i < gc->worker_count; i++) {
+        gc_worker *victim = &gc->workers[(worker->number + i) % gc->worker_count];
+        cell_index index = deque_steal(&victim->deque);
+
+        if (index != NO_WORK) {
+            follow(worker, index);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int wait_for_work(gc_worker *worker) {
+    collection *gc = worker->gc;
+
+    // A worker only goes idle with an empty deque, so once every worker is
+    // idle, there's nothing left anywhere.
+    __atomic_add_fetch(&gc->idle, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&gc->idle, __ATOMIC_SEQ_CST) < gc->worker_count) {
+        for (int i = 0; i < gc->worker_count; i++) {
+            if (deque_has_work(&gc->workers[i].deque)) {
+                __atomic_sub_fetch(&gc->idle, 1, __ATOMIC_SEQ_CST);
+                return 1;
+            }
+        }
+
+        sched_yield();
+    }
+
+    return 0;
+}
+
+
+
+// Sweeping:
+
+void *find_garbage_worker(void *arg) {
+    gc_worker *worker = arg;
+    collection *gc = worker->gc;
+    cons_cell *cells = gc->heap->cells;
+
+    for (cell_index i = worker->start; i < worker->end; i++) {
+        if (cells[i].tag == TAG_UNINIT || cells[i].tag == TAG_FREED || is_marked(gc, i))
+            continue;
+
+        if (worker->garbage_count == worker->garbage_capacity) {
+            worker->garbage_capacity = worker->garbage_capacity ? worker->garbage_capacity * 2 : 1024;
+            worker->garbage = realloc(worker->garbage, worker->garbage_capacity * sizeof(cell_index));
+            if (!worker->garbage)
+                PANIC("Failed to allocate enough memory to collect garbage");
+        }
+
+        worker->garbage[worker->garbage_count++] = i;
+    }
+
+    return 0;
+}
+
+void *release_worker(void *arg) {
+    gc_worker *worker = arg;
+
+    for (size_t i = 0; i < worker->garbage_count; i++)
+        cell_references(worker->gc->heap, worker->garbage[i], release_reference, worker);
+
+    return 0;
+}
+
+void release_reference(void *arg, cell_index reference) {
+    gc_worker *worker = arg;
+    collection *gc = worker->gc;
+
+    // References between pieces of garbage don't matter, since all of it is
+    // about to be freed.
+    if (reference < 0 || reference >= gc->heap->cell_count || !is_marked(gc, reference))
+        return;
+
+    cons_cell *cell = writable_cell(gc->heap, reference);
+
+    if (gc->worker_count > 1)
+        __atomic_sub_fetch(&cell->ref_count, 1, __ATOMIC_RELAXED);
+    else
+        cell->ref_count--;
+}
+
+void release_storage(collection *gc) {
+    heap_p heap = gc->heap;
+
+    for (int i = 0; i < gc->worker_count; i++) {
+        gc_worker *worker = &gc->workers[i];
+
+        for (size_t j = 0; j < worker->garbage_count; j++) {
+            cell_index index = worker->garbage[j];
+            unsigned tag = heap->cells[index].tag;
+
+            if (heap->hashcons && (tag == TAG_ATOM || tag == TAG_CONS))
+                hashcons_remove(heap, index);
+
+            if (tag < 32 && (BLOB_TAGS & (1 << tag)))
+                blob_free(heap, heap->cells[index].car);
+
+            weak_forget(heap, index);
+        }
+    }
+}
+
+void *link_worker(void *arg) {
+    gc_worker *worker = arg;
+    heap_p heap = worker->gc->heap;
+
+    // Garbage in the nursery or a region goes back to being blank, like
+    // anything else freed there, and the rest moves up to the front. The
+    // nursery's young bits are left for the next minor collection to tidy up,
+    // since other threads may be using the same words.
+    worker->linked = 0;
+    for (size_t i = 0; i < worker->garbage_count; i++) {
+        cell_index index = worker->garbage[i];
+
+        if (in_nursery(heap, index) || in_region(heap, index))
+            *writable_cell(heap, index) = (cons_cell){0};
+        else
+            worker->garbage[worker->linked++] = index;
+    }
+
+    for (size_t i = 0; i < worker->linked; i++) {
+        cons_cell *cell = writable_cell(heap, worker->garbage[i]);
+        cell->tag = TAG_FREED;
+        cell->car = i + 1 < worker->linked ? worker->garbage[i + 1] : -1;
+        cell->ref_count = 0;
+    }
+
+    return 0;
+}
+
+
+
+// Incremental collection:
+
+void gc_set_incremental(heap_p heap, int slice) {
+    if (slice <= 0) {
+        gc_cancel(heap);
+        heap->gc.slice = 0;
+        return;
+    }
+
+    check_private(heap, "Incremental collection");
+    heap->gc.slice = slice;
+    if (heap->gc.trigger < GC_MIN_TRIGGER)
+        heap->gc.trigger = GC_MIN_TRIGGER;
+}
+
+void gc_start(heap_p heap) {
+    gc_state *gc = &heap->gc;
+
+    if (heap->undo.active)
+        PANIC("Can't start a collection cycle during a transaction");
+
+    if (gc->phase != GC_IDLE)
+        return;
+
+    gc->marks = calloc((heap->cell_count + 63) / 64, sizeof(uint64_t));
+    if (!gc->marks)
+        PANIC("Failed to allocate enough memory to collect garbage");
+
+    gc->phase = GC_MARKING;
+    gc->grey_count = 0;
+    gc->cursor = 0;
+    gc->freed = 0;
+    gc->kept = 0;
+}
+
+int gc_step(heap_p heap, long budget) {
+    if (heap->undo.active)
+        PANIC("Can't collect garbage during a transaction");
+
+    return incremental_work(heap, budget);
+}
+
+size_t gc_finish(heap_p heap) {
+    if (heap->gc.phase == GC_IDLE)
+        return 0;
+
+    gc_step(heap, LONG_MAX);
+    return heap->gc.freed;
+}
+
+void gc_cancel(heap_p heap) {
+    gc_state *gc = &heap->gc;
+
+    // Once some of the garbage has let go of its references, the rest of it
+    // has to as well, or the reference counts would be left wrong.
+    if (gc_freeing(heap)) {
+        gc_finish(heap);
+        return;
+    }
+
+    free(gc->marks);
+    gc->marks = 0;
+    gc->grey_count = 0;
+    gc->phase = GC_IDLE;
+}
+
+int gc_running(heap_p heap) {
+    return heap->gc.phase != GC_IDLE;
+}
+
+const histogram *gc_pauses(heap_p heap) {
+    return &heap->gc.pauses;
+}
+
+void gc_clear_pauses(heap_p heap) {
+    histogram_clear(&heap->gc.pauses);
+}
+
+void gc_allocated(heap_p heap, cell_index index) {
+    gc_state *gc = &heap->gc;
+
+    // New cells are black: they hold no references yet, and any they're given
+    // later go through the write barrier.
+    if (gc->phase != GC_IDLE)
+        gc->marks[index >> 6] |= (uint64_t)1 << (index & 63);
+
+    if (gc->slice == 0 || heap->undo.active)
+        return;
+
+    if (gc->phase == GC_IDLE) {
+        if (++gc->allocations < gc->trigger)
+            return;
+
+        gc_start(heap);
+    }
+
+    uint64_t start = monotonic_ns();
+    incremental_work(heap, gc->slice);
+    histogram_record(&gc->pauses, monotonic_ns() - start);
+}
+
+void gc_shade_cell(heap_p heap, cell_index index) {
+    gc_state *gc = &heap->gc;
+
+    if (index < 0 || index >= heap->cell_count)
+        return;
+
+    uint64_t bit = (uint64_t)1 << (index & 63);
+    if (gc->marks[index >> 6] & bit)
+        return;
+
+    gc->marks[index >> 6] |= bit;
+
+    if (gc->grey_count == gc->grey_capacity) {
+        gc->grey_capacity = gc->grey_capacity ? gc->grey_capacity * 2 : 1024;
+        gc->grey = realloc(gc->grey, gc->grey_capacity * sizeof(cell_index));
+        if (!gc->grey)
+            PANIC("Failed to allocate enough memory to collect garbage");
+    }
+
+    gc->grey[gc->grey_count++] = index;
+}
+
+int incremental_work(heap_p heap, long budget) {
+    gc_state *gc = &heap->gc;
+
+    while (budget > 0 && gc->phase != GC_IDLE) {
+        if (gc->phase == GC_MARKING)
+            budget -= mark_step(heap);
+        else if (gc->phase == GC_RELEASING)
+            budget -= release_step(heap);
+        else
+            budget -= sweep_step(heap);
+    }
+
+    return gc->phase != GC_IDLE;
+}
+
+long mark_step(heap_p heap) {
+    gc_state *gc = &heap->gc;
+
+    if (gc->grey_count > 0) {
+        shade_counter counter = {heap, 1};
+        cell_index index = gc->grey[--gc->grey_count];
+        cons_cell *cell = &heap->cells[index];
+
+        if (cell->tag == TAG_CONS) {
+            shade_reference(&counter, cell->car);
+            shade_reference(&counter, cell->cdr);
+        } else if (cell->tag != TAG_ATOM) {
+            cell_references(heap, index, shade_reference, &counter);
+        }
+
+        return counter.work;
+    }
+
+    // Roots are looked for one cell at a time. A cell which becomes a root
+    // after the cursor has passed it lost its last reference on the way, and
+    // was shaded then.
+    if (gc->cursor < heap->next_uninit) {
+        cons_cell *cell = &heap->cells[gc->cursor];
+        unsigned tag = cell->tag;
+
+        if (tag < 32 && (ROOT_TAGS & (1 << tag)) && cell->ref_count == 0)
+            gc_shade_cell(heap, gc->cursor);
+
+        gc->cursor++;
+        return 1;
+    }
+
+    gc->phase = GC_RELEASING;
+    gc->cursor = 0;
+    return 1;
+}
+
+long release_step(heap_p heap) {
+    gc_state *gc = &heap->gc;
+
+    if (gc->cursor >= heap->next_uninit) {
+        gc->phase = GC_SWEEPING;
+        gc->cursor = 0;
+        return 1;
+    }
+
+    // Garbage isn't freed until every piece of it has been released, since a
+    // freed cell could be reused and marked before the garbage referring to it
+    // was released.
+    cell_index index = gc->cursor++;
+    if (!is_garbage(heap, index))
+        return 1;
+
+    shade_counter counter = {heap, 1};
+    cell_references(heap, index, release_incremental_reference, &counter);
+    return counter.work;
+}
+
+long sweep_step(heap_p heap) {
+    gc_state *gc = &heap->gc;
+
+    if (gc->cursor >= heap->next_uninit) {
+        end_cycle(heap);
+        return 1;
+    }
+
+    cell_index index = gc->cursor++;
+    unsigned tag = heap->cells[index].tag;
+
+    if (tag == TAG_UNINIT || tag == TAG_FREED)
+        return 1;
+
+    if (!is_garbage(heap, index)) {
+        gc->kept++;
+        return 1;
+    }
+
+    if (heap->hashcons && (tag == TAG_ATOM || tag == TAG_CONS))
+        hashcons_remove(heap, index);
+
+    if (tag < 32 && (BLOB_TAGS & (1 << tag)))
+        blob_free(heap, heap->cells[index].car);
+
+    free_cell(heap, index);
+    writable_cell(heap, index)->ref_count = 0;
+    gc->freed++;
+    return 1;
+}
+
+void end_cycle(heap_p heap) {
+    gc_state *gc = &heap->gc;
+
+    free(gc->marks);
+    gc->marks = 0;
+    gc->phase = GC_IDLE;
+    gc->allocations = 0;
+
+    // The next cycle starts once the heap has allocated about as many cells
+    // as survived this one.
+    gc->trigger = gc->kept > GC_MIN_TRIGGER ? gc->kept : GC_MIN_TRIGGER;
+}
+
+void shade_reference(void *arg, cell_index reference) {
+    shade_counter *counter = arg;
+    gc_shade_cell(counter->heap, reference);
+    counter->work++;
+}
+
+void release_incremental_reference(void *arg, cell_index reference) {
+    shade_counter *counter = arg;
+    heap_p heap = counter->heap;
+    counter->work++;
+
+    if (reference < 0 || reference >= heap->cell_count)
+        return;
+
+    if (heap->gc.marks[reference >> 6] & ((uint64_t)1 << (reference & 63)))
+        writable_cell(heap, reference)->ref_count--;
+}
+
+int is_garbage(heap_p heap, cell_index index) {
+    unsigned tag = heap->cells[index].tag;
+
+    if (tag == TAG_UNINIT || tag == TAG_FREED)
+        return 0;
+
+    return !(heap->gc.marks[index >> 6] & ((uint64_t)1 << (index & 63)));
+}
+
+
+
+// Work deques:
+
+void deque_init(work_deque *deque) {
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->array = malloc(sizeof(work_array) + INITIAL_DEQUE_SIZE * sizeof(cell_index));
+    deque->retired = 0;
+    deque->retired_count = 0;
+
+    if (!deque->array)
+        PANIC("Failed to allocate enough memory to collect garbage");
+
+    deque->array->size = INITIAL_DEQUE_SIZE;
+}
+
+void deque_free(work_deque *deque) {
+    for (size_t i = 0; i < deque->retired_count; i++)
+        free(deque->retired[i]);
+
+    free(deque->retired);
+    free(deque->array);
+}
+
+void deque_push(work_deque *deque, cell_index index) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    work_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if (bottom - top >= array->size) {
+        work_array *bigger = malloc(sizeof(work_array) + 2 * array->size * sizeof(cell_index));
+        work_array **retired = realloc(deque->retired, (deque->retired_count + 1) * sizeof(work_array *));
+        if (!bigger || !retired)
+            PANIC("Failed to allocate enough memory to collect garbage");
+
+        bigger->size = 2 * array->size;
+        for (long i = top; i < bottom; i++)
+            bigger->items[i & (bigger->size - 1)] = array->items[i & (array->size - 1)];
+
+        deque->retired = retired;
+        deque->retired[deque->retired_count++] = array;
+        __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+        array = bigger;
+    }
+
+    __atomic_store_n(&array->items[bottom & (array->size - 1)], index, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+cell_index deque_pop(work_deque *deque) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    work_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NO_WORK;
+    }
+
+    cell_index index = __atomic_load_n(&array->items[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+
+    // Taking the last cell races with thieves.
+    if (top == bottom) {
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            index = NO_WORK;
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return index;
+}
+
+cell_index deque_steal(work_deque *deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+        return NO_WORK;
+
+    work_array *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    cell_index index = __atomic_load_n(&array->items[top & (array->size - 1)], __ATOMIC_RELAXED);
+
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NO_WORK;
+
+    return index;
+}
+
+int deque_has_work(work_deque *deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    return bottom > top;
+}
@@ -0,0 +1,93 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// gc.h: A tracing garbage collector for what reference counting misses
+
+// Reference counting frees a cell as soon as nothing refers to it, but it never
+// frees a cycle: two maps holding each other, say, always have references to
+// them. The collector finds these. Every value with no references to it is a
+// root, since whoever made it is presumably still using it. Everything
+// reachable from a root is live; every other cell still in use is garbage, and
+// gets freed, and the references it held to live cells are dropped.
+//
+// Marking keeps its mark bits in a bitmap of its own, not in the cells. On
+// large heaps, marking and sweeping are both split between threads. Each
+// marking thread works through a deque of cells whose references still need
+// to be followed, and steals from the others' deques when its own runs dry.
+// Each sweeping thread builds a free list out of its share of the garbage, and
+// the lists are joined at the end.
+//
+// A heap can also be collected incrementally, a little at a time, so that no
+// single pause takes time proportional to the size of the heap. Once
+// gc_set_incremental() turns this on, every allocation does a bounded slice of
+// work on the current cycle, and a new cycle starts after about as many
+// allocations as there were cells left over from the last one. The collector
+// is tri-color: cells are white until they're marked, grey while their
+// references still need following, and black once that's done. Cells allocated
+// during a cycle start out black. The write barrier shades (marks grey) any
+// cell whose reference count goes up or down, and the old and new values of a
+// cons's car or cdr whenever setfield() changes them, which covers
+// rc_setcons() too. So while a cycle is marking, a cell can't lose its last
+// path from a root without being shaded. Marking is followed by releasing the
+// garbage's references to live cells, then sweeping the garbage onto the free
+// list, both also a slice at a time.
+//
+// Incremental work doesn't happen during a transaction. The time each slice
+// takes is recorded in a histogram, for tuning the slice size.
+
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+#include "heap.h"
+#include "histogram.h"
+
+// Free every cell that can't be reached from a root; return the number of
+// cells freed
+//
+// This function panics if a transaction is running. It abandons any
+// incremental cycle that's running.
+size_t heap_collect(heap_p heap);
+
+// Set the number of threads to use for collecting large heaps; 0 means one for
+// each CPU
+void gc_set_threads(int threads);
+
+// Turn on incremental collection, doing the given amount of work with each
+// allocation, or turn it off with a slice size of 0
+//
+// A unit of work is about one cell looked at or one reference followed.
+// Turning incremental collection off abandons any cycle that's running.
+void gc_set_incremental(heap_p heap, int slice);
+// Start an incremental cycle, if one isn't running already
+void gc_start(heap_p heap);
+// Do up to the given amount of work on the running cycle; return 1 if it's
+// still running afterwards
+int gc_step(heap_p heap, long budget);
+// Finish the running cycle; return the number of cells it freed
+size_t gc_finish(heap_p heap);
+// Abandon the running cycle, if there is one, without freeing anything
+//
+// A cycle that's already releasing or sweeping garbage is finished instead.
+void gc_cancel(heap_p heap);
+// Check whether an incremental cycle is running
+int gc_running(heap_p heap);
+// Get the histogram of how long each slice of incremental work took, in
+// nanoseconds
+const histogram *gc_pauses(heap_p heap);
+// Empty the histogram of pauses
+void gc_clear_pauses(heap_p heap);
+
+// Call the given function on every cell that a cell holds a reference to
+void cell_references(heap_p heap, cell_index index,
+    void (*visit)(void *context, cell_index reference), void *context);
+
+#endif
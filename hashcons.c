@@ -0,0 +1,202 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// hashcons.h: The table of cells used for hash-consing
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hashcons.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "panic.h"
+
+#define SLOT_EMPTY -1
+#define SLOT_DELETED -2
+
+#define INITIAL_CAPACITY 64
+
+// An open-addressing hash table of cell indices
+typedef struct hashcons_table {
+    cell_index *slots;
+    // Always a power of two
+    size_t capacity;
+    // The number of slots that aren't empty, including deleted ones
+    size_t used;
+} hashcons_table;
+
+// Hash the contents of a cell
+static inline size_t hash_key(int tag, cell_index car, cell_index cdr) {
+    uint64_t h = (uint64_t)car * 0x9E3779B97F4A7C15ull;
+    h ^= ((uint64_t)cdr << 32 ^ (uint64_t)cdr >> 32 ^ (uint32_t)tag) * 0xC2B2AE3D27D4EB4Full;
+    h ^= h >> 29;
+    return h;
+}
+
+// Hash the current contents of a cell
+static inline size_t hash_cell(heap_p heap, cell_index index) {
+    cons_cell *cell = &heap->cells[index];
+
+    if (cell->tag == TAG_CONS)
+        return hash_key(TAG_CONS, cell->car, cell->cdr);
+    else
+        return hash_key(TAG_ATOM, cell->car, 0);
+}
+
+// Check whether a listed cell still has the given contents
+static inline int cell_matches(heap_p heap, cell_index index, int tag, cell_index car,
+    cell_index cdr) {
+    cons_cell *cell = &heap->cells[index];
+
+    if (cell->tag != tag || cell->car != car)
+        return 0;
+
+    return tag != TAG_CONS || cell->cdr == cdr;
+}
+
+// Check whether a listed cell is still an atom or a cons cell
+static inline int holds_value(heap_p heap, cell_index index) {
+    int tag = heap->cells[index].tag;
+    return tag == TAG_ATOM || tag == TAG_CONS;
+}
+
+// Find the listed cell with the given contents; return -1 if there isn't one
+cell_index find_key(heap_p heap, int tag, cell_index car, cell_index cdr);
+// Rebuild the table with the given capacity, dropping deleted slots
+void rehash(heap_p heap, size_t capacity);
+
+hashcons_table *hashcons_create() {
+    hashcons_table *table = calloc(1, sizeof(hashcons_table));
+    if (!table)
+        PANIC("Failed to allocate enough memory for the hash-consing table");
+
+    table->capacity = INITIAL_CAPACITY;
+    table->slots = malloc(table->capacity * sizeof(cell_index));
+    if (!table->slots)
+        PANIC("Failed to allocate enough memory for the hash-consing table");
+
+    memset(table->slots, 0xff, table->capacity * sizeof(cell_index));
+
+    return table;
+}
+
+hashcons_table *hashcons_copy(const hashcons_table *table) {
+    hashcons_table *copy = malloc(sizeof(hashcons_table));
+    if (!copy)
+        PANIC("Failed to allocate enough memory for the hash-consing table");
+
+    *copy = *table;
+    copy->slots = malloc(table->capacity * sizeof(cell_index));
+    if (!copy->slots)
+        PANIC("Failed to allocate enough memory for the hash-consing table");
+
+    memcpy(copy->slots, table->slots, table->capacity * sizeof(cell_index));
+
+    return copy;
+}
+
+void hashcons_free(hashcons_table *table) {
+    free(table->slots);
+    free(table);
+}
+
+cell_index hashcons_find_cons(heap_p heap, cell_index car, cell_index cdr) {
+    return find_key(heap, TAG_CONS, car, cdr);
+}
+
+cell_index hashcons_find_atom(heap_p heap, cell_index text_offset) {
+    return find_key(heap, TAG_ATOM, text_offset, 0);
+}
+
+void hashcons_insert(heap_p heap, cell_index index) {
+    hashcons_table *table = heap->hashcons;
+
+    // Keep the load factor under one half.
+    if ((table->used + 1) * 2 > table->capacity)
+        rehash(heap, table->capacity * 2);
+
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_cell(heap, index) & mask;
+
+    while (table->slots[slot] >= 0)
+        slot = (slot + 1) & mask;
+
+    if (table->slots[slot] == SLOT_EMPTY)
+        table->used++;
+
+    table->slots[slot] = index;
+}
+
+void hashcons_remove(heap_p heap, cell_index index) {
+    hashcons_table *table = heap->hashcons;
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_cell(heap, index) & mask;
+
+    while (table->slots[slot] != SLOT_EMPTY) {
+        if (table->slots[slot] == index) {
+            table->slots[slot] = SLOT_DELETED;
+            return;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+cell_index find_key(heap_p heap, int tag, cell_index car, cell_index cdr) {
+    hashcons_table *table = heap->hashcons;
+    size_t mask = table->capacity - 1;
+    size_t slot = hash_key(tag, car, cdr) & mask;
+
+    while (table->slots[slot] != SLOT_EMPTY) {
+        cell_index index = table->slots[slot];
+
+        if (index >= 0 && cell_matches(heap, index, tag, car, cdr))
+            return index;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
+
+void rehash(heap_p heap, size_t capacity) {
+    hashcons_table *table = heap->hashcons;
+    cell_index *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    // Drop entries for cells that have since been freed.
+    size_t live = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i] >= 0 && !holds_value(heap, old_slots[i]))
+            old_slots[i] = SLOT_DELETED;
+
+        if (old_slots[i] >= 0)
+            live++;
+    }
+
+    // If most of the used slots were deleted, there's no need to grow.
+    while (capacity > INITIAL_CAPACITY && (live + 1) * 4 < capacity)
+        capacity /= 2;
+
+    table->slots = malloc(capacity * sizeof(cell_index));
+    if (!table->slots)
+        PANIC("Failed to allocate enough memory for the hash-consing table");
+
+    memset(table->slots, 0xff, capacity * sizeof(cell_index));
+    table->capacity = capacity;
+    table->used = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i] >= 0)
+            hashcons_insert(heap, old_slots[i]);
+    }
+
+    free(old_slots);
+}
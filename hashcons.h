@@ -0,0 +1,45 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// hashcons.h: The table of cells used for hash-consing
+
+// The hash-consing table maps the contents of a cell to the index of a cell
+// with those contents. Cons cells are keyed on their car and cdr; atoms are
+// keyed on their text. The table doesn't own the cells it lists: an entry is
+// only trusted if the cell it points at still has the contents it was listed
+// under.
+
+#ifndef HASHCONS_H
+#define HASHCONS_H
+
+#include "heap.h"
+#include "heapimpl.h"
+
+// Create an empty hash-consing table
+//
+// This function panics if it fails to allocate enough memory.
+hashcons_table *hashcons_create(void);
+// Make a copy of a hash-consing table
+hashcons_table *hashcons_copy(const hashcons_table *table);
+// Free a hash-consing table
+void hashcons_free(hashcons_table *table);
+
+// Find a cons cell with the given car and cdr; return -1 if there isn't one
+cell_index hashcons_find_cons(heap_p heap, cell_index car, cell_index cdr);
+// Find an atom whose text is at the given atom buffer offset; return -1 if
+// there isn't one
+cell_index hashcons_find_atom(heap_p heap, cell_index text_offset);
+
+// List a cell under its current contents
+void hashcons_insert(heap_p heap, cell_index index);
+// Take a cell out of the table, if it's listed
+void hashcons_remove(heap_p heap, cell_index index);
+
+#endif
@@ -13,78 +13,255 @@
 
 #include <string.h>
 
+#include "atomtext.h"
+#include "hashcons.h"
 #include "heap.h"
+#include "heapimpl.h"
+#include "pagestore.h"
 #include "panic.h"
+#include "probe.h"
 #include "rawheap.h"
+#include "txn.h"
 
-// Try to find an atom in the buffer; return 0 if it isn't there
-int try_find_atom(heap_p heap, const char *text, char **result);
+#ifdef POUTINE_FIXED_CELLS
+// The cells, rounded up to whole chunks as cow_region_wrap() requires
+#define FIXED_CELL_BYTES \
+    ((POUTINE_FIXED_CELLS * sizeof(cons_cell) + COW_CHUNK_SIZE - 1) / COW_CHUNK_SIZE * COW_CHUNK_SIZE)
 
-typedef struct cons_cell {
-    int car;
-    int cdr;
-    int tag;
-    int ref_count;
-} cons_cell;
-
-typedef struct heap {
-    cons_cell *cells;
-    size_t cell_count;
-    int next_freed;
-    int next_uninit;
-
-    char *atom_text_buf;
-    char *atom_text_next;
-    char *atom_text_end;
-    size_t atom_buf_size;
-} heap;
+cons_cell fixed_cells[FIXED_CELL_BYTES / sizeof(cons_cell)];
+// Nonzero while the heap whose cells those are exists
+int fixed_cells_in_use;
+#endif
 
 heap_p malloc_heap(size_t cell_count, size_t atom_buf_size) {
+    // Atom text is found by its offset, which is kept in a car.
+    if (cell_count > INDEX_MAX || atom_buf_size > INDEX_MAX)
+        PANIC("A heap can't have more than %" PRI_INDEX " cells or atom text characters",
+            (cell_index)INDEX_MAX);
+
     heap_p new_heap = calloc(1, sizeof(heap));
     if (!new_heap)
         PANIC("Failed to allocate enough memory for the heap");
 
-    new_heap->cells = calloc(cell_count, sizeof(cons_cell));
-    if (!new_heap->cells)
-        PANIC("Failed to allocate enough memory for the heap");
+#ifdef POUTINE_FIXED_CELLS
+    if ((cell_index)cell_count != FIXED_CELLS)
+        PANIC("This build only makes heaps of %" PRI_INDEX " cells", FIXED_CELLS);
+    if (fixed_cells_in_use)
+        PANIC("This build can only have one heap at a time");
+
+    fixed_cells_in_use = 1;
+    memset(fixed_cells, 0, FIXED_CELL_BYTES);
+    cow_region_wrap(&new_heap->cell_region, (char *)fixed_cells, FIXED_CELL_BYTES);
+#else
+    cow_region_create(&new_heap->cell_region, cell_count * sizeof(cons_cell));
+#endif
+    new_heap->cells = (cons_cell *)new_heap->cell_region.base;
     new_heap->cell_count = cell_count;
 
     new_heap->next_freed = -1;
 
     new_heap->next_uninit = 0;
 
-    new_heap->atom_text_buf = calloc(atom_buf_size, sizeof(char));
-    if (!new_heap->atom_text_buf)
-        PANIC("Failed to allocate enough memory for the heap");
+    cow_region_create(&new_heap->atom_region, atom_buf_size);
+    new_heap->atom_text_buf = new_heap->atom_region.base;
     new_heap->atom_text_next = new_heap->atom_text_buf;
     new_heap->atom_buf_size = atom_buf_size;
 
     return new_heap;
 }
 
+heap_p heap_fork(heap_p heap) {
+    check_private(heap, "Forking");
+#ifdef POUTINE_FIXED_CELLS
+    PANIC("Forking can't be used in a fixed-size build");
+#endif
+
+    heap_p new_heap = malloc(sizeof(struct heap));
+    if (!new_heap)
+        PANIC("Failed to allocate enough memory for the heap");
+
+    *new_heap = *heap;
+
+    // The fork starts with the uncommitted state of a running transaction,
+    // but outside of any transaction.
+    new_heap->undo = (undo_log){0};
+
+    // It keeps the incremental collector's settings, but starts outside of
+    // any cycle, unless the cycle is partway through freeing its garbage.
+    // Then the fork has to finish the job too.
+    if (gc_freeing(heap)) {
+        size_t words = (heap->cell_count + 63) / 64;
+        new_heap->gc.marks = malloc(words * sizeof(uint64_t));
+        if (!new_heap->gc.marks)
+            PANIC("Failed to allocate enough memory for the heap");
+        memcpy(new_heap->gc.marks, heap->gc.marks, words * sizeof(uint64_t));
+    } else {
+        new_heap->gc.phase = GC_IDLE;
+        new_heap->gc.marks = 0;
+    }
+    new_heap->gc.grey = 0;
+    new_heap->gc.grey_count = 0;
+    new_heap->gc.grey_capacity = 0;
+    histogram_clear(&new_heap->gc.pauses);
+    nursery_fork(new_heap);
+    regions_fork(new_heap);
+    weak_fork(new_heap, heap);
+
+    cow_region_fork(&new_heap->cell_region, &heap->cell_region);
+    new_heap->cells = (cons_cell *)new_heap->cell_region.base;
+
+    cow_region_fork(&new_heap->atom_region, &heap->atom_region);
+    new_heap->atom_text_buf = new_heap->atom_region.base;
+    new_heap->atom_text_next = new_heap->atom_text_buf + (heap->atom_text_next - heap->atom_text_buf);
+
+    if (heap->hashcons)
+        new_heap->hashcons = hashcons_copy(heap->hashcons);
+
+    // Blobs aren't copy-on-write, so they're copied right away.
+    if (heap->blob_capacity > 0) {
+        new_heap->blobs = calloc(heap->blob_capacity, sizeof(blob *));
+        new_heap->free_blobs = malloc(heap->blob_capacity * sizeof(cell_index));
+        if (!new_heap->blobs || !new_heap->free_blobs)
+            PANIC("Failed to allocate enough memory for the heap");
+
+        memcpy(new_heap->free_blobs, heap->free_blobs, heap->free_blob_count * sizeof(cell_index));
+
+        for (size_t i = 0; i < heap->blob_count; i++) {
+            blob *original = heap->blobs[i];
+            if (!original)
+                continue;
+
+            blob *copy = malloc(sizeof(blob) + original->size);
+            if (!copy)
+                PANIC("Failed to allocate enough memory for the heap");
+
+            memcpy(copy, original, sizeof(blob) + original->size);
+            copy->saved = 0;
+            new_heap->blobs[i] = copy;
+        }
+    }
+
+    return new_heap;
+}
+
 void free_heap(heap_p heap) {
-    free(heap->atom_text_buf);
-    free(heap->cells);
+    if (heap->undo.active)
+        heap_commit(heap);
+    free(heap->undo.entries);
+    free(heap->undo.logged);
+
+    free(heap->gc.marks);
+    free(heap->gc.grey);
+    nursery_free(heap);
+    regions_free(heap);
+    weak_free(heap);
+
+    if (heap->hashcons)
+        hashcons_free(heap->hashcons);
+
+    for (size_t i = 0; i < heap->blob_count; i++)
+        free(heap->blobs[i]);
+    free(heap->blobs);
+    free(heap->free_blobs);
+
+    cow_region_free(&heap->atom_region);
+    cow_region_free(&heap->cell_region);
+    if (heap->shm)
+        shm_heap_unmap(heap);
+#ifdef POUTINE_FIXED_CELLS
+    fixed_cells_in_use = 0;
+#endif
     free(heap);
 }
 
 
 
-int cell_count(heap_p heap) {
-    return heap->cell_count;
+cell_index blob_alloc(heap_p heap, size_t size) {
+    cell_index number;
+
+    check_private(heap, "Out-of-line storage");
+
+    if (heap->free_blob_count > 0) {
+        number = heap->free_blobs[--heap->free_blob_count];
+    } else {
+        if (heap->blob_count == heap->blob_capacity) {
+            size_t capacity = heap->blob_capacity ? heap->blob_capacity * 2 : 16;
+
+            blob **blobs = realloc(heap->blobs, capacity * sizeof(blob *));
+            cell_index *free_blobs = realloc(heap->free_blobs, capacity * sizeof(cell_index));
+            if (!blobs || !free_blobs)
+                PANIC("Failed to allocate enough memory for a blob");
+
+            heap->blobs = blobs;
+            heap->free_blobs = free_blobs;
+            heap->blob_capacity = capacity;
+        }
+
+        number = heap->blob_count++;
+    }
+
+    blob *new_blob = calloc(1, sizeof(blob) + size);
+    if (!new_blob)
+        PANIC("Failed to allocate enough memory for a blob");
+
+    new_blob->size = size;
+    heap->blobs[number] = new_blob;
+
+    // A blob that's new in this transaction never needs a copy made.
+    if (heap->undo.active) {
+        new_blob->saved = 1;
+        undo_blob_lifetime(heap, UNDO_BLOB_ALLOC, number, NULL);
+    }
+
+    return number;
+}
+
+void blob_resize(heap_p heap, cell_index number, size_t size) {
+    writable_blob(heap, number);
+    blob *old_blob = heap->blobs[number];
+
+    blob *new_blob = realloc(old_blob, sizeof(blob) + size);
+    if (!new_blob)
+        PANIC("Failed to allocate enough memory for a blob");
+
+    if (size > new_blob->size)
+        memset(new_blob->data + new_blob->size, 0, size - new_blob->size);
+
+    new_blob->size = size;
+    heap->blobs[number] = new_blob;
+}
+
+void blob_free(heap_p heap, cell_index number) {
+    // Keep the blob around until the transaction is over, in case it's
+    // aborted.
+    if (heap->undo.active)
+        undo_blob_lifetime(heap, UNDO_BLOB_FREE, number, heap->blobs[number]);
+    else
+        free(heap->blobs[number]);
+
+    heap->blobs[number] = 0;
+    heap->free_blobs[heap->free_blob_count++] = number;
+}
+
+
+
+cell_index cell_count(heap_p heap) {
+    return cell_limit(heap);
 }
 
-int alloc_cell(heap_p heap) {
-    int index;
+cell_index alloc_cell(heap_p heap) {
+    cell_index index;
 
-    if (heap->next_freed != -1) {
+    // Inside a region, cells are taken from the end of the heap, so that the
+    // region's cells are all together.
+    if (heap->next_freed != -1 && heap->regions.count == 0) {
         index = heap->next_freed;
         // pop this off the freed stack
         heap->next_freed = getfield(heap, FIELD_CAR, heap->next_freed);
     } else {
         index = heap->next_uninit;
 
-        if (index >= heap->cell_count)
+        if (index >= cell_limit(heap))
             return -1;
 
         heap->next_uninit++;
@@ -94,16 +271,38 @@ int alloc_cell(heap_p heap) {
     setfield(heap, FIELD_CAR, index, -1);
     setfield(heap, FIELD_REFCOUNT, index, 0);
 
+    if (heap->gc.slice > 0 || heap->gc.phase != GC_IDLE)
+        gc_allocated(heap, index);
+
+    PROBE1(alloc_cell, index);
     return index;
 }
 
-void free_cell(heap_p heap, int index) {
-    int tag = getfield(heap, FIELD_TAG, index);
+void free_cell(heap_p heap, cell_index index) {
+    cell_index tag = getfield(heap, FIELD_TAG, index);
     if (tag == TAG_UNINIT)
         PANIC("tried to free an uninitialized cell");
     if (tag == TAG_FREED)
         PANIC("tried to free a freed cell");
 
+    PROBE1(free_cell, index);
+
+    // If a transaction frees this cell and is then aborted, the cell comes
+    // back, so it has to survive the cycle.
+    gc_shade(heap, index);
+    weak_forget(heap, index);
+
+    if (in_nursery(heap, index)) {
+        nursery_release(heap, index);
+        return;
+    }
+
+    // A region's cells are all freed together when it ends.
+    if (in_region(heap, index)) {
+        *writable_cell(heap, index) = (cons_cell){0};
+        return;
+    }
+
     // push this onto the freed stack
     setfield(heap, FIELD_TAG, index, TAG_FREED);
     setfield(heap, FIELD_CAR, index, heap->next_freed);
@@ -111,141 +310,229 @@ void free_cell(heap_p heap, int index) {
     heap->next_freed = index;
 }
 
-int getfield(heap_p heap, int field, int index) {
-    if (index < 0 || index >= heap->cell_count) {
-        PANIC("Index out of range: %d", index);
+void free_blank_cells(heap_p heap, cell_index start, cell_index end) {
+    // Going backwards leaves the list in order, so the lowest cells are used
+    // first.
+    for (cell_index i = end - 1; i >= start; i--) {
+        if (heap->cells[i].tag != TAG_UNINIT)
+            continue;
+
+        cons_cell *cell = writable_cell(heap, i);
+        cell->tag = TAG_FREED;
+        cell->car = heap->next_freed;
+        heap->next_freed = i;
     }
+}
+
+cell_index getfield(heap_p heap, int field, cell_index index) {
+    CHECK(index >= 0 && index < cell_limit(heap), "Index out of range: %" PRI_INDEX, index);
+
+    cons_cell *cell = &heap_cells(heap)[index];
 
     switch (field) {
         case FIELD_CAR:
-            return heap->cells[index].car;
+            return cell->car;
         case FIELD_CDR:
-            return heap->cells[index].cdr;
+            return cell->cdr;
         case FIELD_TAG:
-            return heap->cells[index].tag;
+            return cell->tag;
         case FIELD_REFCOUNT:
-            return heap->cells[index].ref_count;
+            return cell->ref_count;
         default:
             PANIC("Unrecognized field number: %d", field);
     }
 }
 
-void setfield(heap_p heap, int field, int index, int value) {
-    if (index < 0 || index >= heap->cell_count) {
-        PANIC("Index out of range: %d", index);
-    }
+void setfield(heap_p heap, int field, cell_index index, cell_index value) {
+    CHECK(index >= 0 && index < cell_limit(heap), "Index out of range: %" PRI_INDEX, index);
+
+    cons_cell *cell = writable_cell(heap, index);
 
     switch (field) {
         case FIELD_CAR:
-            heap->cells[index].car = value;
+            if (cell->tag == TAG_CONS) {
+                gc_shade(heap, cell->car);
+                gc_shade(heap, value);
+            }
+            cell->car = value;
             return;
         case FIELD_CDR:
-            heap->cells[index].cdr = value;
+            if (cell->tag == TAG_CONS) {
+                gc_shade(heap, cell->cdr);
+                gc_shade(heap, value);
+            }
+            cell->cdr = value;
             return;
         case FIELD_TAG:
-            heap->cells[index].tag = value;
+            cell->tag = (int)value;
             return;
         case FIELD_REFCOUNT:
-            heap->cells[index].ref_count = value;
+            cell->ref_count = value;
             return;
         default:
             PANIC("Unrecognized field number: %d", field);
     }
 }
 
-void inc_refcount(heap_p heap, int index) {
-    int refcount = getfield(heap, FIELD_REFCOUNT, index);
+void inc_refcount(heap_p heap, cell_index index) {
+    gc_shade(heap, index);
+    cell_index refcount = getfield(heap, FIELD_REFCOUNT, index);
     setfield(heap, FIELD_REFCOUNT, index, refcount + 1);
 }
 
-void dec_refcount(heap_p heap, int index) {
-    int refcount = getfield(heap, FIELD_REFCOUNT, index);
+void dec_refcount(heap_p heap, cell_index index) {
+    gc_shade(heap, index);
+    cell_index refcount = getfield(heap, FIELD_REFCOUNT, index);
     setfield(heap, FIELD_REFCOUNT, index, refcount - 1);
 }
 
-int isatom(heap_p heap, int index) {
-    if (index < 0 || index >= heap->cell_count)
-        PANIC("Index out of range: %d", index);
+int isatom(heap_p heap, cell_index index) {
+    CHECK(index >= 0 && index < cell_limit(heap), "Index out of range: %" PRI_INDEX, index);
+
+    cons_cell *cell = &heap_cells(heap)[index];
 
-    if (heap->cells[index].tag != TAG_ATOM)
+    if (cell->tag != TAG_ATOM)
         return 0;
 
-    if (index < 0 || index >= heap->atom_buf_size)
+    cell_index buf_index = cell->car;
+
+    if (buf_index < 0 || buf_index >= heap->atom_buf_size)
         return 0;
 
-    if (heap->atom_text_buf[heap->cells[index].car] == 0)
+    if (heap->atom_text_buf[buf_index] == 0)
         return 0;
 
     return 1;
 }
 
-const char *getatom(heap_p heap, int index) {
-    if (index < 0 || index >= heap->cell_count)
-        PANIC("Index out of range: %d", index);
+const char *getatom(heap_p heap, cell_index index) {
+    CHECK(index >= 0 && index < cell_limit(heap), "Index out of range: %" PRI_INDEX, index);
 
-    if (heap->cells[index].tag != TAG_ATOM)
-        PANIC("Cell %d is not an atom", index);
+    cons_cell *cell = &heap_cells(heap)[index];
 
-    if (index < 0 || index >= heap->atom_buf_size)
-        PANIC("Atom text index out of range: %d", index);
+    CHECK(cell->tag == TAG_ATOM, "Cell %" PRI_INDEX " is not an atom", index);
 
-    int buf_index = heap->cells[index].car;
+    cell_index buf_index = cell->car;
 
-    if (heap->atom_text_buf[buf_index] == 0)
-        PANIC("Atom text index points at a null byte: %d", index);
+    CHECK(buf_index >= 0 && buf_index < heap->atom_buf_size, "Atom text index out of range: %" PRI_INDEX,
+        buf_index);
+    CHECK(heap->atom_text_buf[buf_index] != 0, "Atom text index points at a null byte: %" PRI_INDEX,
+        buf_index);
 
     return &(heap->atom_text_buf[buf_index]);
 }
 
-void setatom(heap_p heap, int index, const char *text) {
-    if (index < 0 || index >= heap->cell_count)
-        PANIC("Index out of range: %d", index);
+void setatom(heap_p heap, cell_index index, const char *text) {
+    CHECK(index >= 0 && index < cell_limit(heap), "Index out of range: %" PRI_INDEX, index);
 
     if (*text == 0)
         PANIC("The given atom text was empty");
 
-    heap->cells[index].tag = TAG_ATOM;
+    cons_cell *cell = writable_cell(heap, index);
+    cell->tag = TAG_ATOM;
 
     char *text_location;
     int found_it = try_find_atom(heap, text, &text_location);
 
     if (!found_it) {
-        int space_needed = strlen(text) + 1;
+        size_t space_needed = strlen(text) + 1;
         char *atom_text_end = heap->atom_text_buf + heap->atom_buf_size;
 
-        if (atom_text_end - heap->atom_text_next < space_needed)
+        if ((size_t)(atom_text_end - heap->atom_text_next) < space_needed)
             PANIC("Ran out of space in the atom text buffer");
 
         text_location = heap->atom_text_next;
+        cow_region_touch(&heap->atom_region, text_location - heap->atom_text_buf, space_needed);
         strcpy(text_location, text);
 
         heap->atom_text_next += space_needed;
     }
 
-    heap->cells[index].car = text_location - heap->atom_text_buf;
+    cell->car = text_location - heap->atom_text_buf;
+    PROBE2(setatom, index, text);
+}
+
+int atom_text_fits(heap_p heap, const char *text) {
+    char *atom_text_end = heap->atom_text_buf + heap->atom_buf_size;
+
+    if ((size_t)(atom_text_end - heap->atom_text_next) >= strlen(text) + 1)
+        return 1;
+
+    // Text that's already in the buffer gets shared, so it needs no room.
+    char *text_location;
+    return try_find_atom(heap, text, &text_location);
 }
 
 int try_find_atom(heap_p heap, const char *text, char **result) {
-    char *cursor = heap->atom_text_buf;
-
-    while (*cursor != 0) {
-        if (strcmp(cursor, text) == 0) {
-            *result = cursor;
-            return 1;
-        } else {
-            cursor += strlen(cursor) + 1;
+    long offset = atom_text_find(heap->atom_text_buf, heap->atom_text_next - heap->atom_text_buf,
+        text, strlen(text));
+
+    if (offset == -1)
+        return 0;
+
+    *result = heap->atom_text_buf + offset;
+    return 1;
+}
+
+size_t find_atoms_with_prefix(heap_p heap, const char *prefix, cell_index *results,
+    size_t max_results) {
+    size_t used = heap->atom_text_next - heap->atom_text_buf;
+    size_t length = strlen(prefix);
+
+    size_t capacity = 64;
+    size_t *offsets = malloc(capacity * sizeof(size_t));
+    if (!offsets)
+        PANIC("Failed to allocate enough memory for an atom search");
+
+    size_t offset_count = atom_text_find_prefix(heap->atom_text_buf, used, prefix, length,
+        offsets, capacity);
+
+    if (offset_count > capacity) {
+        capacity = offset_count;
+        offsets = realloc(offsets, capacity * sizeof(size_t));
+        if (!offsets)
+            PANIC("Failed to allocate enough memory for an atom search");
+
+        atom_text_find_prefix(heap->atom_text_buf, used, prefix, length, offsets, capacity);
+    }
+
+    // Several atom cells can share the same text, so go through the cells
+    // looking for the ones using the texts we found. The offsets are in order.
+    size_t found = 0;
+
+    for (cell_index i = 0; i < heap->cell_count && offset_count > 0; i++) {
+        if (!isatom(heap, i))
+            continue;
+
+        size_t car = heap->cells[i].car;
+        size_t low = 0, high = offset_count;
+
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+
+            if (offsets[middle] < car)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        if (low < offset_count && offsets[low] == car) {
+            if (found < max_results)
+                results[found] = i;
+            found++;
         }
     }
 
-    return 0;
+    free(offsets);
+    return found;
 }
 
 
 
-int print_to_buffer(heap_p heap, int index, char *buffer, int length) {
+int print_to_buffer(heap_p heap, cell_index index, char *buffer, int length) {
     const char *atom = getatom(heap, index);
     if (!atom)
-        PANIC("The value at index %d isn't an atom", index);
+        PANIC("The value at index %" PRI_INDEX " isn't an atom", index);
 
     if (strcmp(atom, "nil") == 0)
         atom = "()";
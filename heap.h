@@ -19,39 +19,94 @@
 #ifndef HEAP_H
 #define HEAP_H
 
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The index of a cell, and the type of everything stored in a cell's fields
+//
+// Indexes are 32 bits wide unless the heap is built with INDEX_BITS=64 (see the
+// Makefile). That allows more than 2^31 - 1 cells and atom text buffers bigger
+// than 2 GiB, but makes each cell twice as big.
+#if POUTINE_INDEX_BITS == 64
+typedef int64_t cell_index;
+#define INDEX_MAX INT64_MAX
+#define PRI_INDEX PRId64
+#else
+typedef int32_t cell_index;
+#define INDEX_MAX INT32_MAX
+#define PRI_INDEX PRId32
+#endif
+
+// Fixed-size builds, made with POUTINE_FIXED_CELLS defined (see make fixed in
+// the Makefile), are for programs that only ever need one heap of a known
+// size. The heap's cells are a static array of FIXED_CELLS cells, so their
+// address and number are constants that the compiler can fold into bounds
+// checks and field accesses. Such a heap can't be forked, so changing a cell
+// needs no copy-on-write bookkeeping. Only one heap can exist at a time, it
+// must have exactly FIXED_CELLS cells, and it can't be shared.
+#ifdef POUTINE_FIXED_CELLS
+#define FIXED_CELLS ((cell_index)POUTINE_FIXED_CELLS)
+#endif
+
 typedef struct heap *heap_p;
 
 // Allocate a heap with the given number of cons cells and atom buffer
 // characters
 //
 // Use free_heap() to free the heap. This function panics if it fails to
-// allocate enough memory.
+// allocate enough memory, or if either size is more than INDEX_MAX. In a
+// fixed-size build, it also panics if there's already a heap, or if the
+// number of cells isn't FIXED_CELLS.
 heap_p malloc_heap(size_t cell_count, size_t atom_buf_size);
 
-// Free a heap allocated with malloc_heap().
+// Free a heap allocated with malloc_heap() or heap_fork(), or detach from a
+// shared heap (see shmheap.h).
 void free_heap(heap_p heap);
 
+// Make a copy-on-write fork of a heap
+//
+// The fork starts out with the same contents as the given heap, but the two are
+// independent afterwards: writes to either heap are not visible in the other.
+// The heaps share memory until it's written to, so forking costs time
+// proportional to the number of 64 KiB chunks in the heap rather than the
+// number of bytes. The contents of maps aren't copy-on-write, so they're copied
+// right away, along with the nodes of persistent collections. This function
+// panics if it fails to allocate enough memory.
+heap_p heap_fork(heap_p heap);
+
 // Get the number of cells in the heap
-int cell_count(heap_p heap);
+cell_index cell_count(heap_p heap);
 
 // Get the value of a field in a cell
-int getfield(heap_p heap, int field, int index);
+//
+// The index has to be in range. Checked builds panic if it isn't; release
+// builds don't look.
+cell_index getfield(heap_p heap, int field, cell_index index);
 
 // Return 1 if this cell is a valid atom, 0 otherwise
 //
 // A cell is a valid atom if its tag is TAG_ATOM and its car is a valid index
 // into the atom text buffer.
-int isatom(heap_p heap, int index);
+int isatom(heap_p heap, cell_index index);
 // Get the text of an atom cell; return 0 if it isn't an atom
 //
 // The result pointer remains valid until the heap is freed.
-const char *getatom(heap_p heap, int index);
+const char *getatom(heap_p heap, cell_index index);
+
+// Find the atom cells whose text starts with the given prefix
+//
+// The indexes of the first max_results of them are stored in results, in
+// order. Return the number of atom cells found, which may be more than
+// max_results.
+size_t find_atoms_with_prefix(heap_p heap, const char *prefix, cell_index *results,
+    size_t max_results);
 
 // Print the contents of the given cell to the given buffer with the given
 // length.
 //
 // Return 1 on success, 0 if the buffer is too short.
-int print_to_buffer(heap_p heap, int index, char *buffer, int length);
+int print_to_buffer(heap_p heap, cell_index index, char *buffer, int length);
 
 #define FIELD_CAR 0
 #define FIELD_CDR 1
@@ -62,5 +117,10 @@ int print_to_buffer(heap_p heap, int index, char *buffer, int length);
 #define TAG_ATOM 1
 #define TAG_CONS 2
 #define TAG_FREED 3
+#define TAG_MAP 4
+#define TAG_PVEC 5
+#define TAG_PMAP 6
+#define TAG_NODE 7
+#define TAG_WEAK 8
 
 #endif
@@ -0,0 +1,408 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// heapimpl.h: The layout of a heap in memory
+
+// Only the modules that implement the heap should include this file. Everyone
+// else should use the functions in heap.h, rawheap.h and rcheap.h.
+
+#ifndef HEAPIMPL_H
+#define HEAPIMPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "heap.h"
+#include "histogram.h"
+#include "pagestore.h"
+#include "panic.h"
+#include "probe.h"
+#include "rawheap.h"
+
+typedef struct cons_cell {
+    cell_index car;
+    cell_index cdr;
+    int tag;
+    cell_index ref_count;
+} cons_cell;
+
+typedef struct hashcons_table hashcons_table;
+typedef struct shm_header shm_header;
+
+// A block of out-of-line storage belonging to a cell, for values such as maps
+// which don't fit in a car and a cdr
+typedef struct blob {
+    size_t size;
+    // Nonzero if the current transaction won't need another copy of this blob
+    // to undo changes to it
+    int saved;
+    _Alignas(8) char data[];
+} blob;
+
+// One change recorded in the undo log
+typedef struct undo_entry {
+    // UNDO_CELL, UNDO_BLOB_ALLOC, UNDO_BLOB_SAVE, UNDO_BLOB_FREE or
+    // UNDO_WEAK_HEAD
+    int kind;
+    // The cell or blob number that was changed
+    cell_index index;
+    union {
+        // For UNDO_CELL, the cell's old contents
+        cons_cell cell;
+        // For UNDO_BLOB_SAVE, a copy of the blob's old contents; for
+        // UNDO_BLOB_FREE, the freed blob itself
+        blob *saved;
+        // For UNDO_WEAK_HEAD, the cell's old entry in the weak reference table
+        cell_index weak_head;
+    };
+} undo_entry;
+
+#define UNDO_CELL 0
+#define UNDO_BLOB_ALLOC 1
+#define UNDO_BLOB_SAVE 2
+#define UNDO_BLOB_FREE 3
+#define UNDO_WEAK_HEAD 4
+
+// What's needed to put a heap back the way it was when a transaction began
+typedef struct undo_log {
+    // Nonzero while a transaction is running
+    int active;
+
+    undo_entry *entries;
+    size_t count;
+    size_t capacity;
+
+    // One bit for each cell, set if the log already has the cell's contents
+    uint64_t *logged;
+
+    // The allocation state of the heap when the transaction began
+    cell_index next_freed;
+    cell_index next_uninit;
+    cell_index nursery_next;
+    cell_index nursery_limit;
+    size_t region_count;
+    size_t atom_text_used;
+    size_t blob_count;
+} undo_log;
+
+// The phases of an incremental collection cycle
+#define GC_IDLE 0
+#define GC_MARKING 1
+#define GC_RELEASING 2
+#define GC_SWEEPING 3
+
+// The state of the incremental collector; see gc.h
+typedef struct gc_state {
+    // The amount of work to do for each allocation, or 0 if incremental
+    // collection is off
+    int slice;
+    // One of the GC_ phases above
+    int phase;
+
+    // One bit for each cell, set once the cell is known to be live
+    uint64_t *marks;
+    // Marked cells whose references haven't been followed yet
+    cell_index *grey;
+    size_t grey_count;
+    size_t grey_capacity;
+
+    // The next cell to look at for roots, to release or to sweep
+    cell_index cursor;
+    // The number of cells freed and kept so far in this cycle
+    size_t freed;
+    size_t kept;
+
+    // The number of allocations since the last cycle, and the number at which
+    // to start the next one
+    size_t allocations;
+    size_t trigger;
+
+    // How long each slice of work took, in nanoseconds
+    histogram pauses;
+} gc_state;
+
+// The bump-allocated nursery; see nursery.h
+typedef struct nursery_state {
+    // The cells set aside for the nursery, or 0 and 0 if there isn't one
+    cell_index start;
+    cell_index end;
+    // The next cell to hand out, and the end of the run of free cells it's in
+    cell_index next;
+    cell_index limit;
+    // Nonzero if the last minor collection left no free cells, so that another
+    // one would be pointless until some are freed
+    int full;
+
+    // One bit for each nursery cell, set if it was allocated since the last
+    // minor collection
+    uint64_t *young;
+
+    // Scratch space for minor collections, with an entry for each nursery
+    // cell: a mark bit, the number of references from young cells, and a
+    // stack of marked cells whose references haven't been followed yet
+    uint64_t *marks;
+    cell_index *young_refs;
+    cell_index *grey;
+
+    // What minor collections have done so far
+    size_t collections;
+    size_t promoted;
+    size_t freed;
+} nursery_state;
+
+// The regions that have begun but not ended; see region.h
+typedef struct region_stack {
+    // The first cell of each region, outermost first
+    cell_index *starts;
+    size_t count;
+    size_t capacity;
+} region_stack;
+
+typedef struct heap {
+    cons_cell *cells;
+    size_t cell_count;
+    cell_index next_freed;
+    cell_index next_uninit;
+
+    char *atom_text_buf;
+    char *atom_text_next;
+    char *atom_text_end;
+    size_t atom_buf_size;
+
+    // The copy-on-write memory behind cells and atom_text_buf
+    cow_region cell_region;
+    cow_region atom_region;
+
+    // The hash-consing table, or NULL if hash-consing is off
+    hashcons_table *hashcons;
+
+    // Out-of-line storage, indexed by blob number; unused numbers are NULL
+    blob **blobs;
+    size_t blob_count;
+    size_t blob_capacity;
+    // Blob numbers that are free to be reused
+    cell_index *free_blobs;
+    size_t free_blob_count;
+
+    // The most recent edit number given to a transient collection
+    int next_edit;
+
+    // The undo log of the current transaction
+    undo_log undo;
+
+    // The incremental collector
+    gc_state gc;
+
+    // The nursery
+    nursery_state nursery;
+
+    // The regions currently open
+    region_stack regions;
+
+    // For each cell, one more than the index of the first weak reference to
+    // it, or 0 if there aren't any; NULL until the first weak reference is
+    // made. See weak.h.
+    cell_index *weak_heads;
+    cow_region weak_region;
+
+    // The shared-memory object the heap is in, or NULL if it's private; see
+    // shmheap.h
+    shm_header *shm;
+    size_t shm_size;
+    // Nonzero while this process holds the shared heap's write lock
+    int shm_writing;
+} heap;
+
+#ifdef POUTINE_FIXED_CELLS
+// The cells of the only heap, in a fixed-size build
+extern cons_cell fixed_cells[];
+#endif
+
+// Get a heap's cells; in a fixed-size build, that's always the static array
+static inline cons_cell *heap_cells(heap_p heap) {
+#ifdef POUTINE_FIXED_CELLS
+    return fixed_cells;
+#else
+    return heap->cells;
+#endif
+}
+
+// Get the number of cells in a heap, which is a constant in a fixed-size build
+static inline cell_index cell_limit(heap_p heap) {
+#ifdef POUTINE_FIXED_CELLS
+    return FIXED_CELLS;
+#else
+    return heap->cell_count;
+#endif
+}
+
+// Try to find an atom in the buffer; return 0 if it isn't there
+int try_find_atom(heap_p heap, const char *text, char **result);
+
+// Allocate a zero-filled blob with the given number of bytes and return its
+// number
+//
+// This function panics if it fails to allocate enough memory.
+cell_index blob_alloc(heap_p heap, size_t size);
+// Change the size of a blob, keeping its contents; any new bytes are zero
+//
+// The blob's data may move, so pointers into it become invalid.
+void blob_resize(heap_p heap, cell_index number, size_t size);
+// Free a blob
+void blob_free(heap_p heap, cell_index number);
+
+// Record a cell's contents in the undo log before it's changed
+void undo_cell(heap_p heap, cell_index index);
+// Record a copy of a blob in the undo log before it's changed
+void undo_blob(heap_p heap, cell_index number);
+// Record in the undo log that a blob was allocated or freed
+void undo_blob_lifetime(heap_p heap, int kind, cell_index number, blob *freed);
+// Record a cell's entry in the weak reference table before it's changed
+void undo_weak_head(heap_p heap, cell_index index);
+
+// Get the data of a blob
+static inline void *blob_data(heap_p heap, cell_index number) {
+    return heap->blobs[number]->data;
+}
+
+// Get the data of a blob that's about to be changed
+static inline void *writable_blob(heap_p heap, cell_index number) {
+    if (heap->undo.active && !heap->blobs[number]->saved)
+        undo_blob(heap, number);
+
+    return heap->blobs[number]->data;
+}
+
+// Tell the incremental collector that a cell was just allocated
+void gc_allocated(heap_p heap, cell_index index);
+// Mark a cell for the running collection cycle, so it won't be collected
+void gc_shade_cell(heap_p heap, cell_index index);
+
+// Keep a cell from being collected while the incremental collector is marking
+//
+// This is the write barrier. Anything that adds or drops a reference to a cell
+// calls it, so that a cell can't escape marking by being moved from a cell
+// that hasn't been looked at yet to one that has.
+static inline void gc_shade(heap_p heap, cell_index index) {
+    if (heap->gc.phase == GC_MARKING)
+        gc_shade_cell(heap, index);
+}
+
+// Check whether the incremental collector is releasing or sweeping garbage
+static inline int gc_freeing(heap_p heap) {
+    return heap->gc.phase == GC_RELEASING || heap->gc.phase == GC_SWEEPING;
+}
+
+// Check whether the running incremental cycle has found a cell to be garbage,
+// but hasn't freed it yet
+static inline int gc_found_garbage(heap_p heap, cell_index index) {
+    unsigned tag = heap->cells[index].tag;
+
+    if (!gc_freeing(heap) || tag == TAG_UNINIT || tag == TAG_FREED)
+        return 0;
+
+    return !((heap->gc.marks[index >> 6] >> (index & 63)) & 1);
+}
+
+// Get a cell that's about to be written to
+static inline cons_cell *writable_cell(heap_p heap, cell_index index) {
+    if (heap->undo.active)
+        undo_cell(heap, index);
+
+    // Fixed-size heaps can't be forked, so their cells are never shared.
+#ifndef POUTINE_FIXED_CELLS
+    cow_region_touch(&heap->cell_region, (size_t)index * sizeof(cons_cell), sizeof(cons_cell));
+#endif
+    return &heap_cells(heap)[index];
+}
+
+// Check whether a cell is in the nursery
+static inline int in_nursery(heap_p heap, cell_index index) {
+    return index >= heap->nursery.start && index < heap->nursery.end;
+}
+
+// Check whether a cell belongs to a region that hasn't ended yet
+static inline int in_region(heap_p heap, cell_index index) {
+    return heap->regions.count > 0 && index >= heap->regions.starts[0];
+}
+
+// Clear the weak references to a cell that's going away, and unlink it from
+// the weak references to its target if it's a weak reference itself
+void weak_forget_cell(heap_p heap, cell_index index);
+// Give a fork of a heap its own copy of the weak reference table
+void weak_fork(heap_p fork, heap_p heap);
+// Free the weak reference table
+void weak_free(heap_p heap);
+// Make the weak reference table again from the weak references in the cells,
+// for a heap whose cells were written directly
+void weak_rebuild(heap_p heap);
+
+// Do what weak_forget_cell() does, if there are any weak references at all
+static inline void weak_forget(heap_p heap, cell_index index) {
+    if (heap->weak_heads)
+        weak_forget_cell(heap, index);
+}
+
+// Unmap a shared heap's memory
+void shm_heap_unmap(heap_p heap);
+
+// Panic if a heap is shared, for features which keep their state in process
+// memory
+static inline void check_private(heap_p heap, const char *feature) {
+    if (heap->shm)
+        PANIC("%s can't be used on a shared heap", feature);
+}
+
+// Put the blank cells in the given range on the free list
+void free_blank_cells(heap_p heap, cell_index start, cell_index end);
+
+// Give a fork of a heap its own copy of the open regions
+void regions_fork(heap_p fork);
+// Free the memory used to keep track of open regions
+void regions_free(heap_p heap);
+
+// Move on to the next run of free cells in the nursery, doing a minor
+// collection first if the nursery is used up; return 0 if there aren't any
+int nursery_refill(heap_p heap);
+// Turn a nursery cell back into a blank one, ready to be allocated again
+void nursery_release(heap_p heap, cell_index index);
+// Give a fork of a heap its own copy of the nursery's state
+void nursery_fork(heap_p fork);
+// Free the memory used for the nursery's state
+void nursery_free(heap_p heap);
+
+// Allocate a cell in the nursery, or with alloc_cell() if the nursery is full
+// or a region is open
+//
+// Like alloc_cell(), this leaves the cell as an atom without any text.
+static inline cell_index alloc_young_cell(heap_p heap) {
+    nursery_state *nursery = &heap->nursery;
+
+    // Cells in a region have to be kept together, at the end of the heap.
+    if (heap->regions.count > 0 || (nursery->next == nursery->limit && !nursery_refill(heap)))
+        return alloc_cell(heap);
+
+    cell_index index = nursery->next++;
+    cell_index offset = index - nursery->start;
+    nursery->young[offset >> 6] |= (uint64_t)1 << (offset & 63);
+
+    // Free nursery cells are blank, so only the tag and car need setting.
+    cons_cell *cell = writable_cell(heap, index);
+    cell->tag = TAG_ATOM;
+    cell->car = -1;
+
+    if (heap->gc.slice > 0 || heap->gc.phase != GC_IDLE)
+        gc_allocated(heap, index);
+
+    PROBE1(alloc_cell, index);
+    return index;
+}
+
+#endif
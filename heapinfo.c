@@ -0,0 +1,140 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+
+// heapinfo.h: How a heap's memory is used, and how fragmented it is
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "heapimpl.h"
+#include "heapinfo.h"
+#include "panic.h"
+
+// Count a run of cells that aren't live
+void count_free_run(heap_info *info, size_t length);
+// Get the distance between two cells
+uint64_t cell_distance(cell_index from, cell_index to);
+
+
+
+void heap_get_info(heap_p heap, heap_info *info) {
+    memset(info, 0, sizeof(heap_info));
+    info->cells = heap->cell_count;
+    info->cell_size = sizeof(cons_cell);
+    info->atom_text_size = heap->atom_buf_size;
+    info->atom_text_used = heap->atom_text_next - heap->atom_text_buf;
+
+    // Atoms with the same text share it, so each piece of text is only counted
+    // the first time it's seen.
+    uint64_t *text_seen = calloc(info->atom_text_used / 64 + 1, sizeof(uint64_t));
+    if (!text_seen)
+        PANIC("Failed to allocate enough memory for heap information");
+
+    uint64_t car_total = 0, cdr_total = 0;
+    size_t run = 0;
+
+    // Every cell from next_uninit on is blank.
+    for (cell_index i = 0; i < heap->next_uninit; i++) {
+        cons_cell *cell = &heap->cells[i];
+
+        if (cell->tag == TAG_UNINIT || cell->tag == TAG_FREED) {
+            if (cell->tag == TAG_UNINIT)
+                info->uninit++;
+            else
+                info->freed++;
+            run++;
+            continue;
+        }
+
+        if (run > 0) {
+            count_free_run(info, run);
+            run = 0;
+        }
+
+        info->live++;
+        info->top = i + 1;
+
+        if (cell->tag == TAG_CONS) {
+            info->conses++;
+            car_total += cell_distance(i, cell->car);
+            cdr_total += cell_distance(i, cell->cdr);
+        } else if (cell->tag == TAG_ATOM && cell->car >= 0 && cell->car < info->atom_text_used) {
+            cell_index offset = cell->car;
+            uint64_t bit = (uint64_t)1 << (offset & 63);
+
+            if (!(text_seen[offset >> 6] & bit)) {
+                text_seen[offset >> 6] |= bit;
+                info->atom_text_live += strlen(&heap->atom_text_buf[offset]) + 1;
+            }
+        }
+    }
+
+    info->uninit += heap->cell_count - heap->next_uninit;
+    run += heap->cell_count - heap->next_uninit;
+    if (run > 0)
+        count_free_run(info, run);
+
+    free(text_seen);
+
+    if (info->conses > 0) {
+        info->car_distance = (double)car_total / info->conses;
+        info->cdr_distance = (double)cdr_total / info->conses;
+    }
+
+    for (size_t i = 0; i < heap->blob_count; i++) {
+        if (heap->blobs[i])
+            info->blob_bytes += sizeof(blob) + heap->blobs[i]->size;
+    }
+}
+
+void heap_info_print(FILE *out, const heap_info *info) {
+    fprintf(out, "cells: %zu in all, %zu live, %zu freed, %zu uninitialized, %zu bytes each\n",
+        info->cells, info->live, info->freed, info->uninit, info->cell_size);
+
+    fprintf(out, "free runs: longest %zu", info->longest_free_run);
+    for (int i = 0; i < HEAP_INFO_RUN_BUCKETS; i++) {
+        size_t low = (size_t)1 << i;
+
+        if (info->free_runs[i] == 0)
+            continue;
+        else if (low == 1)
+            fprintf(out, ", %zu of 1", info->free_runs[i]);
+        else
+            fprintf(out, ", %zu of %zu-%zu", info->free_runs[i], low, 2 * low - 1);
+    }
+    fprintf(out, "\n");
+
+    fprintf(out, "atom text: %zu of %zu bytes used, %zu live, %zu dead\n",
+        info->atom_text_used, info->atom_text_size, info->atom_text_live,
+        info->atom_text_used - info->atom_text_live);
+
+    fprintf(out, "blobs: %zu bytes\n", info->blob_bytes);
+
+    fprintf(out, "conses: %zu, mean distance %.1f cells to the car, %.1f to the cdr\n",
+        info->conses, info->car_distance, info->cdr_distance);
+
+    size_t scattered = info->top - info->live;
+    fprintf(out, "compaction: would gather %zu scattered free cells (%zu bytes) and %zu bytes of dead atom "
+        "text\n", scattered, scattered * info->cell_size, info->atom_text_used - info->atom_text_live);
+}
+
+void count_free_run(heap_info *info, size_t length) {
+    info->free_runs[63 - __builtin_clzll(length)]++;
+
+    if (length > info->longest_free_run)
+        info->longest_free_run = length;
+}
+
+uint64_t cell_distance(cell_index from, cell_index to) {
+    return from < to ? (uint64_t)(to - from) : (uint64_t)(from - to);
+}
@@ -0,0 +1,70 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+
+// heapinfo.h: How a heap's memory is used, and how fragmented it is
+
+#ifndef HEAPINFO_H
+#define HEAPINFO_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "heap.h"
+
+// The number of buckets for the lengths of runs of free cells; bucket n counts
+// the runs of 2^n to 2^(n + 1) - 1 cells
+#define HEAP_INFO_RUN_BUCKETS 64
+
+typedef struct heap_info {
+    // The numbers of cells in the heap, holding values, freed and never used
+    // or blank
+    size_t cells;
+    size_t live;
+    size_t freed;
+    size_t uninit;
+    // The number of bytes in each cell
+    size_t cell_size;
+
+    // Runs of consecutive cells that aren't live, by length
+    size_t free_runs[HEAP_INFO_RUN_BUCKETS];
+    size_t longest_free_run;
+
+    // Bytes of atom text: the size of the buffer, how much of it has been
+    // handed out, and how much of that belongs to live atoms
+    size_t atom_text_size;
+    size_t atom_text_used;
+    size_t atom_text_live;
+
+    // Bytes of out-of-line storage, for maps and persistent collections
+    size_t blob_bytes;
+
+    // The number of conses, and the mean distance from a cons to its car and
+    // to its cdr, in cells; lists built in order have a cdr distance near 1
+    size_t conses;
+    double car_distance;
+    double cdr_distance;
+
+    // One more than the index of the last live cell. Compacting the heap would
+    // move every live cell below live, so the top - live free cells scattered
+    // below top would become one run.
+    size_t top;
+} heap_info;
+
+// Find out how a heap's memory is used
+//
+// This makes a single pass over the cells that have ever been allocated, and
+// only reads them, so it's safe to run on a heap that's in use, as long as
+// nothing changes the heap at the same time.
+void heap_get_info(heap_p heap, heap_info *info);
+// Print a few lines summing up a heap_info
+void heap_info_print(FILE *out, const heap_info *info);
+
+#endif
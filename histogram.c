@@ -0,0 +1,111 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// histogram.h: Histograms of durations, for latency percentiles
+
+#include <string.h>
+#include <time.h>
+
+#include "histogram.h"
+
+// Get the bucket that counts the given value
+static inline int bucket_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_COUNT)
+        return value;
+
+    // Keep the top HISTOGRAM_SUB_BITS + 1 bits of the value; the highest of
+    // them is always set, so it doesn't need a bucket of its own.
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)(value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+// Get the smallest value counted by the given bucket
+static inline uint64_t bucket_low(int bucket) {
+    int group = bucket / HISTOGRAM_SUB_COUNT;
+    uint64_t position = bucket % HISTOGRAM_SUB_COUNT;
+
+    if (group == 0)
+        return position;
+
+    return (HISTOGRAM_SUB_COUNT + position) << (group - 1);
+}
+
+void histogram_clear(histogram *hist) {
+    memset(hist, 0, sizeof(histogram));
+}
+
+void histogram_record(histogram *hist, uint64_t value) {
+    if (hist->count == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+
+    hist->count++;
+    hist->sum += value;
+    hist->buckets[bucket_of(value)]++;
+}
+
+void histogram_merge(histogram *dest, const histogram *src) {
+    if (src->count == 0)
+        return;
+
+    if (dest->count == 0 || src->min < dest->min)
+        dest->min = src->min;
+    if (src->max > dest->max)
+        dest->max = src->max;
+
+    dest->count += src->count;
+    dest->sum += src->sum;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dest->buckets[i] += src->buckets[i];
+}
+
+uint64_t histogram_percentile(const histogram *hist, double percent) {
+    if (hist->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percent / 100.0 * hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank >= hist->count)
+        return hist->max;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            // Report the middle of the bucket, but never beyond what was seen.
+            uint64_t low = bucket_low(i);
+            uint64_t middle = low + (bucket_low(i + 1) - low) / 2;
+            if (middle < hist->min)
+                return hist->min;
+            return middle < hist->max ? middle : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+void histogram_print(FILE *out, const char *label, const histogram *hist) {
+    double mean = hist->count ? (double)hist->sum / hist->count : 0;
+
+    fprintf(out, "%s: %llu samples, mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+        label, (unsigned long long)hist->count, mean / 1000,
+        histogram_percentile(hist, 50) / 1000.0,
+        histogram_percentile(hist, 99) / 1000.0,
+        histogram_percentile(hist, 99.9) / 1000.0,
+        hist->max / 1000.0);
+}
+
+uint64_t monotonic_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
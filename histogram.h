@@ -0,0 +1,51 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// histogram.h: Histograms of durations, for latency percentiles
+
+// A histogram counts values in buckets whose width grows with the value, so it
+// covers everything from nanoseconds to years in a fixed amount of space while
+// keeping every percentile within about 3% of the true value. Recording a value
+// is a few instructions and never allocates.
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Each power of two is split into 2^HISTOGRAM_SUB_BITS buckets.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+// Empty a histogram
+void histogram_clear(histogram *hist);
+// Count one value
+void histogram_record(histogram *hist, uint64_t value);
+// Add all the values counted in src to dest
+void histogram_merge(histogram *dest, const histogram *src);
+// Get the value below which the given percentage of values fall
+uint64_t histogram_percentile(const histogram *hist, double percent);
+// Print a one-line summary of a histogram of nanosecond durations
+void histogram_print(FILE *out, const char *label, const histogram *hist);
+
+// Get the current time in nanoseconds, for timing things to record
+uint64_t monotonic_ns(void);
+
+#endif
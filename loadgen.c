@@ -0,0 +1,417 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// loadgen.c: A load generator for the Poutine server
+
+// The load generator creates a map and some atoms to use as keys, then opens
+// several connections, each of which sends a mix of mapget and mapput commands
+// with a fixed number of requests outstanding at a time. It reports the
+// throughput and the distribution of latencies, measured from sending each
+// request to receiving the end of its response.
+//
+// With --binary, the connections speak the binary protocol in wire.h instead,
+// sending --batch requests in each frame; the latencies are then those of
+// whole frames. The setup is always done in text, so the server mustn't be
+// running with --binary.
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "panic.h"
+#include "wire.h"
+
+// The number of atoms used as map keys
+#define KEY_COUNT 64
+
+typedef struct options {
+    const char *socket_path;
+    int tcp_port;
+    int connections;
+    int requests;
+    int depth;
+    int write_percent;
+    int binary;
+    int batch;
+} options;
+
+typedef struct client {
+    pthread_t thread;
+    int fd;
+    unsigned int seed;
+
+    // The send time of each outstanding message, oldest first, where a
+    // message is a command or a frame
+    uint64_t *sent_at;
+    int oldest;
+    int outstanding;
+
+    // The opcodes of the requests in each outstanding frame
+    unsigned char *ops;
+
+    // Buffering and response parsing
+    char in[65536];
+    int line_start;
+    int error_line;
+    wire_buffer frames;
+    wire_buffer out;
+
+    histogram latency;
+    long errors;
+} client;
+
+options opts = {.connections = 4, .requests = 100000, .depth = 16, .write_percent = 10, .batch = 1};
+int map;
+int keys[KEY_COUNT];
+
+// Get the time in nanoseconds
+uint64_t now_ns(void);
+// Connect to the server, exiting on failure
+int connect_server(void);
+// Send a whole string, exiting on failure
+void send_all(int fd, const char *data, size_t length);
+// Send a command and read its one-line response as a number
+int request_number(int fd, const char *command);
+// Send requests on one connection and time the responses
+void *run_client(void *arg);
+// Add one message to the outgoing data
+void add_message(client *self);
+// Consume received bytes, recording the latency of each complete response
+void receive(client *self, const char *data, size_t length);
+// Consume received binary frames, recording the latency of each one
+void receive_frames(client *self, const char *data, size_t length);
+// Print a summary of the command-line options
+void usage(const char *program);
+
+
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"tcp", required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"requests", required_argument, NULL, 'n'},
+        {"depth", required_argument, NULL, 'd'},
+        {"writes", required_argument, NULL, 'w'},
+        {"binary", no_argument, NULL, 'b'},
+        {"batch", required_argument, NULL, 'B'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "s:p:c:n:d:w:bB:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 's': opts.socket_path = optarg; break;
+        case 'p': opts.tcp_port = atoi(optarg); break;
+        case 'c': opts.connections = atoi(optarg); break;
+        case 'n': opts.requests = atoi(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        case 'w': opts.write_percent = atoi(optarg); break;
+        case 'b': opts.binary = 1; break;
+        case 'B': opts.batch = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if ((!opts.socket_path && !opts.tcp_port) || opts.connections <= 0 ||
+        opts.requests <= 0 || opts.depth <= 0 || opts.batch <= 0 ||
+        opts.write_percent < 0 || opts.write_percent > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Set up the map that the clients will use, with every key present.
+    int setup = connect_server();
+    char command[64];
+
+    map = request_number(setup, "map\n");
+    for (int i = 0; i < KEY_COUNT; i++) {
+        snprintf(command, sizeof(command), "atom loadgen%d\n", i);
+        keys[i] = request_number(setup, command);
+    }
+    for (int i = 0; i < KEY_COUNT; i++) {
+        snprintf(command, sizeof(command), "mapput %d %d %d\n", map, keys[i], keys[i]);
+        request_number(setup, command);
+    }
+
+    client *clients = calloc(opts.connections, sizeof(client));
+    if (!clients)
+        PANIC("Failed to allocate enough memory for the clients");
+
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < opts.connections; i++) {
+        clients[i].fd = connect_server();
+        clients[i].seed = i + 1;
+        if (pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0)
+            PANIC("Failed to start a client thread");
+    }
+
+    histogram total;
+    long errors = 0;
+    histogram_clear(&total);
+
+    for (int i = 0; i < opts.connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        histogram_merge(&total, &clients[i].latency);
+        errors += clients[i].errors;
+        close(clients[i].fd);
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+
+    uint64_t requests = total.count * (opts.binary ? opts.batch : 1);
+
+    printf("%d connections, %d requests each, depth %d, %d%% writes, %s protocol",
+        opts.connections, opts.requests, opts.depth, opts.write_percent, opts.binary ? "binary" : "text");
+    if (opts.binary)
+        printf(", %d requests per frame", opts.batch);
+    printf("\n");
+    printf("%llu requests in %.3f s: %.0f requests/s, %ld errors\n",
+        (unsigned long long)requests, seconds, requests / seconds, errors);
+    histogram_print(stdout, "latency", &total);
+
+    close(setup);
+    return errors ? 1 : 0;
+}
+
+uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+int connect_server(void) {
+    int fd;
+
+    if (opts.socket_path) {
+        struct sockaddr_un address = {.sun_family = AF_UNIX};
+        strncpy(address.sun_path, opts.socket_path, sizeof(address.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+            PANIC("Failed to connect to the server");
+    } else {
+        struct sockaddr_in address = {
+            .sin_family = AF_INET,
+            .sin_port = htons(opts.tcp_port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+            PANIC("Failed to connect to the server");
+
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+
+    return fd;
+}
+
+void send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, data, length);
+        if (sent <= 0)
+            PANIC("Failed to send to the server");
+        data += sent;
+        length -= sent;
+    }
+}
+
+int request_number(int fd, const char *command) {
+    char response[256];
+    size_t length = 0;
+
+    send_all(fd, command, strlen(command));
+
+    // Read up to the empty line that ends the response.
+    while (!(length == 1 && response[0] == '\n') &&
+           !(length >= 2 && response[length - 2] == '\n' && response[length - 1] == '\n')) {
+        if (length == sizeof(response) - 1 || read(fd, response + length, 1) != 1)
+            PANIC("Failed to read a response from the server");
+        length++;
+    }
+    response[length] = '\0';
+
+    if (response[0] == '!') {
+        fprintf(stderr, "Setup command failed: %s%s", command, response);
+        exit(1);
+    }
+
+    return atoi(response);
+}
+
+void *run_client(void *arg) {
+    client *self = arg;
+    int messages = opts.binary ? (opts.requests + opts.batch - 1) / opts.batch : opts.requests;
+
+    self->sent_at = calloc(opts.depth, sizeof(uint64_t));
+    self->ops = calloc((size_t)opts.depth * opts.batch, 1);
+    if (!self->sent_at || !self->ops)
+        PANIC("Failed to allocate enough memory for a client");
+
+    self->line_start = 1;
+    histogram_clear(&self->latency);
+
+    if (opts.binary) {
+        unsigned char hello = WIRE_HELLO;
+        send_all(self->fd, (const char *)&hello, 1);
+    }
+
+    int sent = 0;
+
+    while (sent < messages || self->outstanding > 0) {
+        // Top the pipeline up to the full depth in a single write.
+        self->out.length = 0;
+
+        while (self->outstanding < opts.depth && sent < messages) {
+            add_message(self);
+            sent++;
+        }
+
+        if (self->out.length > 0)
+            send_all(self->fd, self->out.data, self->out.length);
+
+        ssize_t received = read(self->fd, self->in, sizeof(self->in));
+        if (received <= 0)
+            PANIC("Failed to read a response from the server");
+
+        if (opts.binary)
+            receive_frames(self, self->in, received);
+        else
+            receive(self, self->in, received);
+    }
+
+    free(self->sent_at);
+    free(self->ops);
+    free(self->frames.data);
+    free(self->out.data);
+    return NULL;
+}
+
+void add_message(client *self) {
+    int slot = (self->oldest + self->outstanding) % opts.depth;
+    char command[64];
+    wire_buffer payload = {0};
+
+    for (int i = 0; i < (opts.binary ? opts.batch : 1); i++) {
+        int key = keys[rand_r(&self->seed) % KEY_COUNT];
+        int write = rand_r(&self->seed) % 100 < opts.write_percent;
+        int value = keys[rand_r(&self->seed) % KEY_COUNT];
+
+        if (!opts.binary) {
+            int length = write
+                ? sprintf(command, "mapput %d %d %d\n", map, key, value)
+                : sprintf(command, "mapget %d %d\n", map, key);
+            wire_append(&self->out, command, length);
+            break;
+        }
+
+        unsigned char op = write ? WIRE_MAPPUT : WIRE_MAPGET;
+        self->ops[slot * opts.batch + i] = op;
+
+        wire_append(&payload, &op, 1);
+        wire_put_int(&payload, map);
+        wire_put_int(&payload, key);
+        if (write)
+            wire_put_int(&payload, value);
+    }
+
+    if (opts.binary) {
+        wire_put_frame(&self->out, payload.data, payload.length);
+        free(payload.data);
+    }
+
+    self->sent_at[slot] = now_ns();
+    self->outstanding++;
+}
+
+void receive(client *self, const char *data, size_t length) {
+    uint64_t time = now_ns();
+
+    for (size_t i = 0; i < length; i++) {
+        if (self->line_start && data[i] == '\n') {
+            // An empty line ends the oldest outstanding response.
+            histogram_record(&self->latency, time - self->sent_at[self->oldest]);
+            self->oldest = (self->oldest + 1) % opts.depth;
+            self->outstanding--;
+            self->error_line = 0;
+        } else if (self->line_start && data[i] == '!' && !self->error_line) {
+            self->errors++;
+            self->error_line = 1;
+        }
+
+        self->line_start = data[i] == '\n';
+    }
+}
+
+void receive_frames(client *self, const char *data, size_t length) {
+    uint64_t time = now_ns();
+    size_t start = 0;
+
+    wire_append(&self->frames, data, length);
+
+    while (1) {
+        size_t header, size;
+        int ready = wire_frame_ready(self->frames.data + start, self->frames.length - start, &header, &size);
+
+        if (ready < 0)
+            PANIC("Received a malformed frame");
+        if (!ready)
+            break;
+
+        wire_reader reader = {
+            (const unsigned char *)self->frames.data + start + header,
+            (const unsigned char *)self->frames.data + start + header + size,
+            0,
+        };
+
+        for (int i = 0; i < opts.batch && reader.pos < reader.end; i++) {
+            int status = *reader.pos++;
+
+            if (status != WIRE_OK)
+                self->errors++;
+            else if (self->ops[self->oldest * opts.batch + i] == WIRE_MAPGET)
+                wire_get_int(&reader);
+        }
+
+        if (reader.failed)
+            PANIC("Received a malformed frame");
+
+        histogram_record(&self->latency, time - self->sent_at[self->oldest]);
+        self->oldest = (self->oldest + 1) % opts.depth;
+        self->outstanding--;
+        start += header + size;
+    }
+
+    memmove(self->frames.data, self->frames.data + start, self->frames.length - start);
+    self->frames.length -= start;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s (--socket PATH | --tcp PORT) [--connections N] [--requests N]\n", program);
+    fprintf(stderr, "       [--depth N] [--writes PERCENT] [--binary [--batch N]]\n");
+}
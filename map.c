@@ -0,0 +1,407 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// map.h: Hash maps stored in the heap
+
+#include <stdint.h>
+#include <string.h>
+
+#include "equal.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "map.h"
+#include "panic.h"
+#include "rawheap.h"
+#include "rcheap.h"
+#include "weak.h"
+
+#define SLOT_EMPTY -1
+#define SLOT_DELETED -2
+
+#define INITIAL_CAPACITY 8
+
+typedef struct map_entry {
+    // The key's cell, or SLOT_EMPTY or SLOT_DELETED
+    cell_index key;
+    cell_index value;
+    uint64_t hash;
+} map_entry;
+
+// The layout of a map's blob
+typedef struct map_table {
+    // Nonzero if the keys are held through weak references
+    int weak_keys;
+    cell_index count;
+    // The number of entries which aren't empty, including deleted ones
+    cell_index used;
+    // Always a power of two
+    cell_index capacity;
+    map_entry entries[];
+} map_table;
+
+static inline map_table *get_table(heap_p heap, cell_index map) {
+    return blob_data(heap, heap->cells[map].car);
+}
+
+static inline map_table *writable_table(heap_p heap, cell_index map) {
+    return writable_blob(heap, heap->cells[map].car);
+}
+
+// Hash a key the way a particular map does
+uint64_t key_hash(heap_p heap, map_table *table, cell_index key);
+// Find the entry for a key; return -1 if it isn't there
+cell_index find_entry(heap_p heap, map_table *table, cell_index key, uint64_t hash);
+// Get the key of an entry, which for a weak-keyed map is the target of the
+// weak reference held by the entry, or -1 if it's gone
+cell_index entry_key(heap_p heap, map_table *table, cell_index slot);
+// Drop a map's reference to a weak reference it made for a key
+void release_weak_key(heap_p heap, cell_index weak);
+// Give a map's table a new capacity, dropping deleted entries
+void resize_table(heap_p heap, cell_index map, cell_index capacity);
+// Panic unless the given cell is a map
+void check_map(heap_p heap, cell_index map);
+
+cell_index rc_map(heap_p heap) {
+    cell_index index = alloc_cell(heap);
+
+    if (index == -1)
+        return -1;
+
+    size_t size = sizeof(map_table) + INITIAL_CAPACITY * sizeof(map_entry);
+    cell_index number = blob_alloc(heap, size);
+
+    map_table *table = blob_data(heap, number);
+    table->capacity = INITIAL_CAPACITY;
+    for (int i = 0; i < INITIAL_CAPACITY; i++)
+        table->entries[i].key = SLOT_EMPTY;
+
+    setfield(heap, FIELD_TAG, index, TAG_MAP);
+    setfield(heap, FIELD_CAR, index, number);
+    setfield(heap, FIELD_CDR, index, 0);
+
+    return index;
+}
+
+cell_index rc_weak_map(heap_p heap) {
+    cell_index index = rc_map(heap);
+
+    if (index != -1)
+        get_table(heap, index)->weak_keys = 1;
+
+    return index;
+}
+
+int rc_is_map(heap_p heap, cell_index index) {
+    return rc_is_valid(heap, index) && getfield(heap, FIELD_TAG, index) == TAG_MAP;
+}
+
+cell_index rc_map_count(heap_p heap, cell_index map) {
+    check_map(heap, map);
+
+    return get_table(heap, map)->count;
+}
+
+cell_index rc_map_get(heap_p heap, cell_index map, cell_index key) {
+    check_map(heap, map);
+
+    if (!rc_is_valid(heap, key))
+        PANIC("Tried to look up cell %" PRI_INDEX ", which doesn't contain a value", key);
+
+    map_table *table = get_table(heap, map);
+    cell_index slot = find_entry(heap, table, key, key_hash(heap, table, key));
+
+    return slot == -1 ? -1 : table->entries[slot].value;
+}
+
+void rc_map_put(heap_p heap, cell_index map, cell_index key, cell_index value) {
+    check_map(heap, map);
+
+    if (map == key)
+        PANIC("Tried to use the map at index %" PRI_INDEX " as a key in itself", map);
+
+    if (map == value)
+        PANIC("Tried to use the map at index %" PRI_INDEX " as a value in itself", map);
+
+    if (!rc_is_valid(heap, key))
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value",
+            key);
+
+    if (!rc_is_valid(heap, value))
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value",
+            value);
+
+    uint64_t hash = key_hash(heap, get_table(heap, map), key);
+    map_table *table = writable_table(heap, map);
+    cell_index slot = find_entry(heap, table, key, hash);
+
+    if (slot != -1) {
+        cell_index old_value = table->entries[slot].value;
+
+        inc_refcount(heap, value);
+        dec_refcount(heap, old_value);
+        table->entries[slot].value = value;
+        return;
+    }
+
+    // A weak-keyed map holds the weak reference instead of the key. Entries
+    // whose keys are gone are pruned before the map grows.
+    cell_index stored_key = key;
+    if (table->weak_keys) {
+        stored_key = rc_weak(heap, key);
+        if (stored_key == -1)
+            PANIC("Not enough room for a weak reference to cell %" PRI_INDEX, key);
+
+        table = get_table(heap, map);
+        if ((table->used + 1) * 2 > table->capacity)
+            rc_map_prune(heap, map);
+
+        table = get_table(heap, map);
+    }
+
+    // Keep the load factor at most one half, counting deleted entries.
+    if ((table->used + 1) * 2 > table->capacity) {
+        cell_index capacity = table->capacity;
+        while ((table->count + 1) * 2 > capacity / 2)
+            capacity *= 2;
+
+        resize_table(heap, map, capacity);
+        table = get_table(heap, map);
+    }
+
+    cell_index mask = table->capacity - 1;
+    cell_index i = hash & mask;
+    while (table->entries[i].key >= 0)
+        i = (i + 1) & mask;
+
+    if (table->entries[i].key == SLOT_EMPTY)
+        table->used++;
+
+    table->entries[i].key = stored_key;
+    table->entries[i].value = value;
+    table->entries[i].hash = hash;
+    table->count++;
+
+    inc_refcount(heap, stored_key);
+    inc_refcount(heap, value);
+}
+
+int rc_map_delete(heap_p heap, cell_index map, cell_index key) {
+    check_map(heap, map);
+
+    if (!rc_is_valid(heap, key))
+        PANIC("Tried to look up cell %" PRI_INDEX ", which doesn't contain a value", key);
+
+    map_table *table = get_table(heap, map);
+    cell_index slot = find_entry(heap, table, key, key_hash(heap, table, key));
+
+    if (slot == -1)
+        return 0;
+
+    table = writable_table(heap, map);
+    cell_index stored_key = table->entries[slot].key;
+    cell_index value = table->entries[slot].value;
+
+    table->entries[slot].key = SLOT_DELETED;
+    table->count--;
+
+    if (table->weak_keys)
+        release_weak_key(heap, stored_key);
+    else
+        dec_refcount(heap, stored_key);
+    dec_refcount(heap, value);
+
+    return 1;
+}
+
+cell_index rc_map_prune(heap_p heap, cell_index map) {
+    check_map(heap, map);
+
+    map_table *table = get_table(heap, map);
+    cell_index pruned = 0;
+
+    if (!table->weak_keys)
+        return 0;
+
+    for (cell_index i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key < 0 || entry_key(heap, table, i) != -1)
+            continue;
+
+        table = writable_table(heap, map);
+        cell_index weak = table->entries[i].key;
+        cell_index value = table->entries[i].value;
+
+        table->entries[i].key = SLOT_DELETED;
+        table->count--;
+        pruned++;
+
+        release_weak_key(heap, weak);
+        dec_refcount(heap, value);
+        table = get_table(heap, map);
+    }
+
+    return pruned;
+}
+
+cell_index rc_map_next(heap_p heap, cell_index map, cell_index position, cell_index *key,
+    cell_index *value) {
+    check_map(heap, map);
+
+    map_table *table = get_table(heap, map);
+
+    for (cell_index i = position; i < table->capacity; i++) {
+        if (table->entries[i].key >= 0 && entry_key(heap, table, i) != -1) {
+            *key = entry_key(heap, table, i);
+            *value = table->entries[i].value;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+cell_index map_next_stored(heap_p heap, cell_index map, cell_index position,
+    cell_index *key, cell_index *value) {
+    map_table *table = get_table(heap, map);
+
+    for (cell_index i = position; i < table->capacity; i++) {
+        if (table->entries[i].key >= 0) {
+            *key = table->entries[i].key;
+            *value = table->entries[i].value;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+void map_erase(heap_p heap, cell_index map) {
+    map_table *table = get_table(heap, map);
+
+    cell_index number = heap->cells[map].car;
+
+    for (cell_index i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key < 0)
+            continue;
+
+        if (table->weak_keys)
+            release_weak_key(heap, table->entries[i].key);
+        else
+            dec_refcount(heap, table->entries[i].key);
+
+        dec_refcount(heap, table->entries[i].value);
+        table = blob_data(heap, number);
+    }
+
+    blob_free(heap, number);
+}
+
+uint64_t map_key_hash(heap_p heap, cell_index key) {
+    cons_cell *cell = &heap->cells[key];
+
+    // Atom text is interned, so an atom's car identifies its text.
+    if (cell->tag == TAG_ATOM)
+        return (uint64_t)cell->car * 0x9E3779B97F4A7C15ull;
+    else
+        return heap_hash(heap, key);
+}
+
+int map_key_equal(heap_p heap, cell_index a, cell_index b) {
+    if (a == b)
+        return 1;
+
+    cons_cell *cell_a = &heap->cells[a];
+    cons_cell *cell_b = &heap->cells[b];
+
+    if (cell_a->tag != cell_b->tag)
+        return 0;
+
+    if (cell_a->tag == TAG_ATOM)
+        return cell_a->car == cell_b->car;
+    else
+        return heap_equal(heap, a, b);
+}
+
+uint64_t key_hash(heap_p heap, map_table *table, cell_index key) {
+    if (table->weak_keys)
+        return (uint64_t)key * 0x9E3779B97F4A7C15ull;
+    else
+        return map_key_hash(heap, key);
+}
+
+cell_index find_entry(heap_p heap, map_table *table, cell_index key, uint64_t hash) {
+    cell_index mask = table->capacity - 1;
+    cell_index i = hash & mask;
+
+    while (table->entries[i].key != SLOT_EMPTY) {
+        map_entry *entry = &table->entries[i];
+
+        if (entry->key >= 0 && entry->hash == hash) {
+            if (table->weak_keys ? entry_key(heap, table, i) == key : map_key_equal(heap, entry->key, key))
+                return i;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+cell_index entry_key(heap_p heap, map_table *table, cell_index slot) {
+    cell_index key = table->entries[slot].key;
+
+    return table->weak_keys ? rc_weak_get(heap, key) : key;
+}
+
+void release_weak_key(heap_p heap, cell_index weak) {
+    dec_refcount(heap, weak);
+
+    // Nobody else has this weak reference, unless someone got it by iterating
+    // over the cells.
+    if (getfield(heap, FIELD_REFCOUNT, weak) == 0)
+        rc_free(heap, weak);
+}
+
+void resize_table(heap_p heap, cell_index map, cell_index capacity) {
+    map_table *old_table = get_table(heap, map);
+    size_t old_size = sizeof(map_table) + old_table->capacity * sizeof(map_entry);
+
+    map_table *saved = malloc(old_size);
+    if (!saved)
+        PANIC("Failed to allocate enough memory for a map");
+    memcpy(saved, old_table, old_size);
+
+    cell_index number = heap->cells[map].car;
+    blob_resize(heap, number, sizeof(map_table) + capacity * sizeof(map_entry));
+
+    map_table *table = blob_data(heap, number);
+    table->capacity = capacity;
+    table->used = saved->count;
+    for (cell_index i = 0; i < capacity; i++)
+        table->entries[i].key = SLOT_EMPTY;
+
+    cell_index mask = capacity - 1;
+    for (cell_index i = 0; i < saved->capacity; i++) {
+        if (saved->entries[i].key < 0)
+            continue;
+
+        cell_index j = saved->entries[i].hash & mask;
+        while (table->entries[j].key != SLOT_EMPTY)
+            j = (j + 1) & mask;
+
+        table->entries[j] = saved->entries[i];
+    }
+
+    free(saved);
+}
+
+void check_map(heap_p heap, cell_index map) {
+    if (!rc_is_map(heap, map))
+        PANIC("The cell at index %" PRI_INDEX " is not a map", map);
+}
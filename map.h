@@ -0,0 +1,90 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// map.h: Hash maps stored in the heap
+
+// A map is a cell with the tag TAG_MAP. Its entries live in a blob belonging
+// to the cell, in an open-addressing hash table of cell indices. Atom keys are
+// compared by their interned text, so looking one up never walks the heap;
+// other keys are compared structurally (see equal.h), and maps used as keys
+// are only equal to themselves.
+//
+// A map holds a reference to each of its keys and values, just like a cons
+// cell holds references to its car and cdr, so a key can't be modified while
+// it's in a map.
+//
+// A weak-keyed map, made by rc_weak_map(), holds its keys through weak
+// references (see weak.h) instead, so being a key doesn't keep a cell alive,
+// which suits a cache. Its keys are compared by identity, since a weak
+// reference is to a particular cell. Once a key goes away, its entry can't be
+// found any more, but it still holds its value until the entry is pruned, by
+// rc_map_prune() or by the map growing. The value mustn't refer back to the
+// key, or the key will never go away.
+
+#ifndef MAP_H
+#define MAP_H
+
+#include <stdint.h>
+
+#include "heap.h"
+
+// Allocate a cell as an empty map, returning -1 on insufficient space
+cell_index rc_map(heap_p heap);
+// Allocate a cell as an empty weak-keyed map, returning -1 on insufficient
+// space
+cell_index rc_weak_map(heap_p heap);
+// Check whether a cell is a map
+int rc_is_map(heap_p heap, cell_index index);
+// Get the number of entries in a map
+//
+// For a weak-keyed map, this includes entries whose keys have gone away but
+// which haven't been pruned yet.
+cell_index rc_map_count(heap_p heap, cell_index map);
+
+// Look up a key in a map; return its value, or -1 if the key isn't there
+cell_index rc_map_get(heap_p heap, cell_index map, cell_index key);
+// Set the value for a key in a map, adding the key if it isn't there already
+//
+// Adding a key to a weak-keyed map allocates a weak reference, and this
+// function panics if there's no room for one.
+void rc_map_put(heap_p heap, cell_index map, cell_index key, cell_index value);
+// Remove a key from a map; return 1 if it was there, 0 if not
+int rc_map_delete(heap_p heap, cell_index map, cell_index key);
+// Remove the entries of a weak-keyed map whose keys have gone away; return the
+// number removed
+cell_index rc_map_prune(heap_p heap, cell_index map);
+
+// Get the next entry of a map, for iterating over the entries
+//
+// Start with a position of 0, and pass in the previous result each time after
+// that. The entry's key and value are put in *key and *value. The result is 0
+// once there are no more entries. Don't change the map while iterating over it.
+// Entries of a weak-keyed map whose keys have gone away are skipped.
+cell_index rc_map_next(heap_p heap, cell_index map, cell_index position, cell_index *key,
+    cell_index *value);
+
+// Get the next entry of a map as it's stored, like rc_map_next(), but with the
+// weak references held by a weak-keyed map in place of their targets
+//
+// This is for following the references a map holds.
+cell_index map_next_stored(heap_p heap, cell_index map, cell_index position,
+    cell_index *key, cell_index *value);
+
+// Hash a key the way maps do
+uint64_t map_key_hash(heap_p heap, cell_index key);
+// Check whether two keys are the same key, the way maps do
+int map_key_equal(heap_p heap, cell_index a, cell_index b);
+
+// Drop a map's references to its entries and free its storage
+//
+// This is used by rc_erase(); afterwards, the cell is no longer a map.
+void map_erase(heap_p heap, cell_index map);
+
+#endif
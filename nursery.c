@@ -0,0 +1,331 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// nursery.h: A bump-allocated nursery for short-lived conses
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "hashcons.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "nursery.h"
+#include "panic.h"
+
+// Find the next run of blank cells at or after the end of the current one;
+// return 0 if there aren't any
+int find_free_run(heap_p heap);
+// Get the first young cell after the given one, or -1 if there aren't any
+cell_index next_young(heap_p heap, cell_index index);
+// Check whether a cell is young
+int is_young(heap_p heap, cell_index index);
+// Check whether a cell is young and marked by the running minor collection
+int is_marked_young(heap_p heap, cell_index index);
+// Mark a young cell and push it onto the grey stack, if it isn't marked
+// already
+void mark_young(heap_p heap, cell_index index, size_t *grey_count);
+
+// Go through the young cells, setting index to each one in turn
+#define FOR_EACH_YOUNG(heap, index) \
+    for (index = next_young(heap, (heap)->nursery.start - 1); index != -1; index = next_young(heap, index))
+
+
+
+// Setting up:
+
+int heap_set_nursery(heap_p heap, cell_index cells) {
+    nursery_state *nursery = &heap->nursery;
+
+    if (heap->undo.active)
+        PANIC("Can't change the nursery during a transaction");
+
+    if (heap->regions.count > 0)
+        PANIC("Can't change the nursery inside a region");
+
+    if (cells > 0)
+        check_private(heap, "The nursery");
+
+    if (cells > 0 && (size_t)heap->next_uninit + cells > heap->cell_count)
+        return 0;
+
+    // The old nursery's blank cells go on the free list, since they're no
+    // longer past the initialized ones.
+    free_blank_cells(heap, nursery->start, nursery->end);
+
+    nursery_free(heap);
+    *nursery = (nursery_state){0};
+
+    if (cells <= 0)
+        return 1;
+
+    size_t words = ((size_t)cells + 63) / 64;
+    nursery->start = heap->next_uninit;
+    nursery->end = heap->next_uninit + cells;
+    nursery->next = nursery->start;
+    nursery->limit = nursery->start;
+    nursery->young = calloc(words, sizeof(uint64_t));
+    nursery->marks = calloc(words, sizeof(uint64_t));
+    nursery->young_refs = malloc(cells * sizeof(cell_index));
+    nursery->grey = malloc(cells * sizeof(cell_index));
+
+    if (!nursery->young || !nursery->marks || !nursery->young_refs || !nursery->grey)
+        PANIC("Failed to allocate enough memory for the nursery");
+
+    heap->next_uninit = nursery->end;
+    return 1;
+}
+
+nursery_stats heap_nursery_stats(heap_p heap) {
+    nursery_stats stats = {
+        heap->nursery.collections,
+        heap->nursery.promoted,
+        heap->nursery.freed,
+    };
+
+    return stats;
+}
+
+void nursery_fork(heap_p fork) {
+    nursery_state *nursery = &fork->nursery;
+
+    if (nursery->end == 0)
+        return;
+
+    size_t cells = nursery->end - nursery->start;
+    size_t words = (cells + 63) / 64;
+    uint64_t *young = malloc(words * sizeof(uint64_t));
+
+    nursery->marks = calloc(words, sizeof(uint64_t));
+    nursery->young_refs = malloc(cells * sizeof(cell_index));
+    nursery->grey = malloc(cells * sizeof(cell_index));
+
+    if (!young || !nursery->marks || !nursery->young_refs || !nursery->grey)
+        PANIC("Failed to allocate enough memory for the nursery");
+
+    memcpy(young, nursery->young, words * sizeof(uint64_t));
+    nursery->young = young;
+}
+
+void nursery_free(heap_p heap) {
+    free(heap->nursery.young);
+    free(heap->nursery.marks);
+    free(heap->nursery.young_refs);
+    free(heap->nursery.grey);
+}
+
+
+
+// Allocating:
+
+int nursery_refill(heap_p heap) {
+    nursery_state *nursery = &heap->nursery;
+
+    if (nursery->end == 0)
+        return 0;
+
+    if (find_free_run(heap))
+        return 1;
+
+    // The nursery is used up. Collect it, if that's safe right now, and start
+    // again from the beginning.
+    if (nursery->full || heap->undo.active || heap->gc.phase != GC_IDLE)
+        return 0;
+
+    minor_collect(heap);
+    nursery->full = !find_free_run(heap);
+    return !nursery->full;
+}
+
+void nursery_release(heap_p heap, cell_index index) {
+    nursery_state *nursery = &heap->nursery;
+    cell_index offset = index - nursery->start;
+
+    *writable_cell(heap, index) = (cons_cell){0};
+    nursery->young[offset >> 6] &= ~((uint64_t)1 << (offset & 63));
+    nursery->full = 0;
+}
+
+int find_free_run(heap_p heap) {
+    nursery_state *nursery = &heap->nursery;
+    cons_cell *cells = heap->cells;
+    cell_index first = nursery->limit;
+
+    while (first < nursery->end && cells[first].tag != TAG_UNINIT)
+        first++;
+
+    cell_index last = first;
+    while (last < nursery->end && cells[last].tag == TAG_UNINIT)
+        last++;
+
+    nursery->next = first;
+    nursery->limit = last;
+    return first < last;
+}
+
+
+
+// Minor collections:
+
+size_t minor_collect(heap_p heap) {
+    nursery_state *nursery = &heap->nursery;
+
+    if (heap->undo.active)
+        PANIC("Can't collect garbage during a transaction");
+
+    if (nursery->end == 0)
+        return 0;
+
+    if (heap->gc.phase != GC_IDLE)
+        gc_finish(heap);
+
+    cons_cell *cells = heap->cells;
+    size_t words = ((size_t)(nursery->end - nursery->start) + 63) / 64;
+    size_t grey_count = 0;
+    size_t freed = 0;
+    cell_index index;
+
+    // A full collection may have freed some young cells.
+    FOR_EACH_YOUNG(heap, index) {
+        nursery->young_refs[index - nursery->start] = 0;
+
+        if (cells[index].tag == TAG_FREED || cells[index].tag == TAG_UNINIT) {
+            cell_index offset = index - nursery->start;
+            nursery->young[offset >> 6] &= ~((uint64_t)1 << (offset & 63));
+        }
+    }
+
+    // Count the references each young cell has from young conses.
+    FOR_EACH_YOUNG(heap, index) {
+        if (cells[index].tag != TAG_CONS)
+            continue;
+
+        if (is_young(heap, cells[index].car))
+            nursery->young_refs[cells[index].car - nursery->start]++;
+        if (is_young(heap, cells[index].cdr))
+            nursery->young_refs[cells[index].cdr - nursery->start]++;
+    }
+
+    // Any other reference is from outside the young conses. Only conses are
+    // traced, so any other young cell is kept.
+    FOR_EACH_YOUNG(heap, index) {
+        cons_cell *cell = &cells[index];
+
+        if (cell->tag != TAG_CONS || cell->ref_count == 0
+            || cell->ref_count > nursery->young_refs[index - nursery->start])
+            mark_young(heap, index, &grey_count);
+    }
+
+    while (grey_count > 0) {
+        cons_cell *cell = &cells[nursery->grey[--grey_count]];
+
+        if (cell->tag == TAG_CONS) {
+            mark_young(heap, cell->car, &grey_count);
+            mark_young(heap, cell->cdr, &grey_count);
+        }
+    }
+
+    // Garbage lets go of its references to live cells before any of it is
+    // freed, so that it's still clear which cells are garbage.
+    FOR_EACH_YOUNG(heap, index) {
+        if (is_marked_young(heap, index))
+            continue;
+
+        cell_index references[2] = {cells[index].car, cells[index].cdr};
+
+        for (int i = 0; i < 2; i++) {
+            cell_index reference = references[i];
+            if (reference < 0 || reference >= heap->cell_count)
+                continue;
+            if (is_young(heap, reference) && !is_marked_young(heap, reference))
+                continue;
+
+            writable_cell(heap, reference)->ref_count--;
+        }
+    }
+
+    FOR_EACH_YOUNG(heap, index) {
+        if (!is_marked_young(heap, index)) {
+            if (heap->hashcons)
+                hashcons_remove(heap, index);
+
+            weak_forget(heap, index);
+            *writable_cell(heap, index) = (cons_cell){0};
+            freed++;
+        }
+    }
+
+    for (size_t i = 0; i < words; i++) {
+        nursery->promoted += __builtin_popcountll(nursery->marks[i]);
+        nursery->young[i] = 0;
+        nursery->marks[i] = 0;
+    }
+
+    nursery->collections++;
+    nursery->freed += freed;
+    nursery->next = nursery->start;
+    nursery->limit = nursery->start;
+    nursery->full = 0;
+    return freed;
+}
+
+cell_index next_young(heap_p heap, cell_index index) {
+    nursery_state *nursery = &heap->nursery;
+    size_t cells = nursery->end - nursery->start;
+    size_t offset = index + 1 - nursery->start;
+
+    if (offset >= cells)
+        return -1;
+
+    size_t word = offset >> 6;
+    uint64_t bits = nursery->young[word] & (~(uint64_t)0 << (offset & 63));
+
+    while (bits == 0) {
+        if (++word >= (cells + 63) / 64)
+            return -1;
+        bits = nursery->young[word];
+    }
+
+    return nursery->start + (cell_index)(word * 64 + __builtin_ctzll(bits));
+}
+
+int is_young(heap_p heap, cell_index index) {
+    nursery_state *nursery = &heap->nursery;
+
+    if (!in_nursery(heap, index))
+        return 0;
+
+    cell_index offset = index - nursery->start;
+    return (nursery->young[offset >> 6] >> (offset & 63)) & 1;
+}
+
+int is_marked_young(heap_p heap, cell_index index) {
+    nursery_state *nursery = &heap->nursery;
+    cell_index offset = index - nursery->start;
+
+    return is_young(heap, index) && ((nursery->marks[offset >> 6] >> (offset & 63)) & 1);
+}
+
+void mark_young(heap_p heap, cell_index index, size_t *grey_count) {
+    nursery_state *nursery = &heap->nursery;
+
+    if (!is_young(heap, index))
+        return;
+
+    cell_index offset = index - nursery->start;
+    uint64_t bit = (uint64_t)1 << (offset & 63);
+
+    if (nursery->marks[offset >> 6] & bit)
+        return;
+
+    nursery->marks[offset >> 6] |= bit;
+    nursery->grey[(*grey_count)++] = index;
+}
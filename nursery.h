@@ -0,0 +1,67 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// nursery.h: A bump-allocated nursery for short-lived conses
+
+// Most conses die young. With a nursery, rc_cons() takes its cells from a
+// range of the heap set aside for new conses, by bumping a pointer through the
+// runs of free cells there instead of popping the free list. When the nursery
+// is used up, a minor collection frees the young conses (those allocated since
+// the last minor collection) that are garbage, and the rest are promoted: they
+// become old, and stay where they are, since a cell's index is its identity.
+// Then allocation starts again from the beginning of the nursery, skipping over
+// the cells still in use.
+//
+// The remembered set, which says which young cells are referred to from
+// outside the young generation, comes from the reference counts. Every
+// reference to a cell is counted, whether it's from a cons, a map or a
+// persistent collection, so a young cell has a reference from outside if its
+// count is more than the number of young conses referring to it. A minor
+// collection treats those cells, and young cells with no references at all, as
+// roots. So its cost is proportional to the number of young cells, and never
+// looks at the rest of the heap.
+//
+// A cell freed in the nursery goes back to being blank, to be reused once
+// allocation comes around to it again. Minor collections don't happen during
+// a transaction or while an incremental cycle is running; rc_cons() allocates
+// outside the nursery until they can.
+
+#ifndef NURSERY_H
+#define NURSERY_H
+
+#include <stddef.h>
+
+#include "heap.h"
+
+// What minor collections have done
+typedef struct nursery_stats {
+    size_t collections;
+    // The number of young cells found to be live and made old
+    size_t promoted;
+    size_t freed;
+} nursery_stats;
+
+// Set aside the given number of cells for the nursery, or turn the nursery off
+// with 0; return 0 if there aren't enough uninitialized cells left
+//
+// The nursery is taken from the uninitialized cells, and stays part of the
+// heap if it's turned off. This function panics if a transaction is running or
+// a region is open.
+int heap_set_nursery(heap_p heap, cell_index cells);
+// Free the young conses which are garbage and promote the rest; return the
+// number of cells freed
+//
+// This function panics if a transaction is running. It finishes any running
+// incremental cycle first.
+size_t minor_collect(heap_p heap);
+// Get the totals for what minor collections have done
+nursery_stats heap_nursery_stats(heap_p heap);
+
+#endif
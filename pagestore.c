@@ -0,0 +1,237 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// pagestore.h: Copy-on-write memory regions backed by a shared page store
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pagestore.h"
+#include "panic.h"
+
+typedef struct page_store {
+    // The anonymous file holding the chunks
+    int fd;
+    // The number of chunks in the file
+    size_t chunk_count;
+    // The number of regions mapping each chunk
+    size_t *chunk_refs;
+
+    // Chunks that no region is using, ready to be handed out again
+    size_t *free_chunks;
+    size_t free_count;
+
+    // The number of regions using this store
+    int region_count;
+} page_store;
+
+// Map the given run of store chunks at the given address
+void map_chunks(cow_region *region, size_t first, size_t count);
+// Get an unused chunk of the store, growing the file if necessary
+size_t take_chunk(page_store_p store);
+// Return a chunk to the store once nothing is using it
+void release_chunk(page_store_p store, size_t chunk);
+
+void cow_region_create(cow_region *region, size_t size) {
+    size_t chunk_count = (size + COW_CHUNK_SIZE - 1) >> COW_CHUNK_SHIFT;
+    if (chunk_count == 0)
+        chunk_count = 1;
+
+    page_store_p store = calloc(1, sizeof(page_store));
+    if (!store)
+        PANIC("Failed to allocate enough memory for the page store");
+
+    store->fd = memfd_create("poutine-heap", MFD_CLOEXEC);
+    if (store->fd < 0)
+        PANIC("Failed to create the page store file");
+
+    if (ftruncate(store->fd, chunk_count << COW_CHUNK_SHIFT) != 0)
+        PANIC("Failed to allocate enough memory for the page store");
+
+    store->chunk_count = chunk_count;
+    store->chunk_refs = calloc(chunk_count, sizeof(size_t));
+    store->free_chunks = calloc(chunk_count, sizeof(size_t));
+    if (!store->chunk_refs || !store->free_chunks)
+        PANIC("Failed to allocate enough memory for the page store");
+
+    region->store = store;
+    region->size = chunk_count << COW_CHUNK_SHIFT;
+    region->chunks = calloc(chunk_count, sizeof(size_t));
+    region->shared = calloc(chunk_count, sizeof(unsigned char));
+    if (!region->chunks || !region->shared)
+        PANIC("Failed to allocate enough memory for the page store");
+
+    for (size_t i = 0; i < chunk_count; i++) {
+        region->chunks[i] = i;
+        store->chunk_refs[i] = 1;
+    }
+
+    region->base = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (region->base == MAP_FAILED)
+        PANIC("Failed to map the page store");
+
+    store->region_count = 1;
+}
+
+void cow_region_wrap(cow_region *region, char *base, size_t size) {
+    region->base = base;
+    region->size = size;
+    region->store = NULL;
+    region->chunks = NULL;
+
+    // Nothing is ever shared, so touching the region does nothing.
+    region->shared = calloc(size >> COW_CHUNK_SHIFT, sizeof(unsigned char));
+    if (!region->shared)
+        PANIC("Failed to allocate enough memory for the page store");
+}
+
+void cow_region_fork(cow_region *dest, cow_region *src) {
+    page_store_p store = src->store;
+    size_t chunk_count = src->size >> COW_CHUNK_SHIFT;
+
+    if (!store)
+        PANIC("Tried to fork a region that isn't in a page store");
+
+    dest->store = store;
+    dest->size = src->size;
+    dest->chunks = malloc(chunk_count * sizeof(size_t));
+    dest->shared = malloc(chunk_count * sizeof(unsigned char));
+    if (!dest->chunks || !dest->shared)
+        PANIC("Failed to allocate enough memory for the page store");
+
+    memcpy(dest->chunks, src->chunks, chunk_count * sizeof(size_t));
+    memset(dest->shared, 1, chunk_count);
+    memset(src->shared, 1, chunk_count);
+
+    // Reserve an address range, then map runs of consecutive store chunks into
+    // it. A region that has never been written since it was created is a
+    // single run.
+    dest->base = mmap(NULL, dest->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dest->base == MAP_FAILED)
+        PANIC("Failed to reserve address space for a forked region");
+
+    size_t run_start = 0;
+    for (size_t i = 1; i <= chunk_count; i++) {
+        if (i == chunk_count || dest->chunks[i] != dest->chunks[i - 1] + 1) {
+            map_chunks(dest, run_start, i - run_start);
+            run_start = i;
+        }
+    }
+
+    for (size_t i = 0; i < chunk_count; i++)
+        store->chunk_refs[dest->chunks[i]]++;
+
+    store->region_count++;
+}
+
+void cow_region_free(cow_region *region) {
+    page_store_p store = region->store;
+    size_t chunk_count = region->size >> COW_CHUNK_SHIFT;
+
+    if (!store) {
+        free(region->shared);
+        return;
+    }
+
+    munmap(region->base, region->size);
+
+    for (size_t i = 0; i < chunk_count; i++)
+        release_chunk(store, region->chunks[i]);
+
+    free(region->chunks);
+    free(region->shared);
+
+    store->region_count--;
+    if (store->region_count == 0) {
+        close(store->fd);
+        free(store->chunk_refs);
+        free(store->free_chunks);
+        free(store);
+    }
+}
+
+void cow_region_unshare(cow_region *region, size_t chunk) {
+    page_store_p store = region->store;
+    size_t old_chunk = region->chunks[chunk];
+
+    region->shared[chunk] = 0;
+
+    // The other regions may have let go of this chunk already.
+    if (store->chunk_refs[old_chunk] == 1)
+        return;
+
+    size_t new_chunk = take_chunk(store);
+    char *address = region->base + (chunk << COW_CHUNK_SHIFT);
+
+    if (pwrite(store->fd, address, COW_CHUNK_SIZE, new_chunk << COW_CHUNK_SHIFT) != COW_CHUNK_SIZE)
+        PANIC("Failed to copy a chunk of the page store");
+
+    region->chunks[chunk] = new_chunk;
+    map_chunks(region, chunk, 1);
+
+    release_chunk(store, old_chunk);
+}
+
+void map_chunks(cow_region *region, size_t first, size_t count) {
+    char *address = region->base + (first << COW_CHUNK_SHIFT);
+    off_t offset = region->chunks[first] << COW_CHUNK_SHIFT;
+
+    void *result = mmap(address, count << COW_CHUNK_SHIFT, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, region->store->fd, offset);
+    if (result == MAP_FAILED)
+        PANIC("Failed to map the page store");
+}
+
+size_t take_chunk(page_store_p store) {
+    size_t chunk;
+
+    if (store->free_count > 0) {
+        chunk = store->free_chunks[--store->free_count];
+    } else {
+        chunk = store->chunk_count;
+        size_t new_count = store->chunk_count * 2;
+
+        if (ftruncate(store->fd, new_count << COW_CHUNK_SHIFT) != 0)
+            PANIC("Failed to grow the page store");
+
+        size_t *refs = realloc(store->chunk_refs, new_count * sizeof(size_t));
+        size_t *free_chunks = realloc(store->free_chunks, new_count * sizeof(size_t));
+        if (!refs || !free_chunks)
+            PANIC("Failed to allocate enough memory for the page store");
+
+        memset(refs + store->chunk_count, 0, (new_count - store->chunk_count) * sizeof(size_t));
+        store->chunk_refs = refs;
+        store->free_chunks = free_chunks;
+
+        // Everything past the chunk we're taking is free.
+        for (size_t i = new_count - 1; i > chunk; i--)
+            store->free_chunks[store->free_count++] = i;
+
+        store->chunk_count = new_count;
+    }
+
+    store->chunk_refs[chunk] = 1;
+    return chunk;
+}
+
+void release_chunk(page_store_p store, size_t chunk) {
+    store->chunk_refs[chunk]--;
+
+    if (store->chunk_refs[chunk] == 0) {
+        // Give the memory back to the system; the chunk reads as zeros after.
+        fallocate(store->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            chunk << COW_CHUNK_SHIFT, COW_CHUNK_SIZE);
+        store->free_chunks[store->free_count++] = chunk;
+    }
+}
@@ -0,0 +1,82 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// pagestore.h: Copy-on-write memory regions backed by a shared page store
+
+// A region is a contiguous, zero-initialized block of memory which can be
+// forked cheaply. The memory of a region lives in a page store (an anonymous
+// in-memory file), divided into chunks of COW_CHUNK_SIZE bytes. Forking a
+// region maps the same chunks into a second address range; after that, the
+// first write to a chunk through either region gives that region a private
+// copy of the chunk.
+//
+// Reading from a region is an ordinary memory access. Before writing to a
+// region, call cow_region_touch() on the bytes about to be written.
+
+#ifndef PAGESTORE_H
+#define PAGESTORE_H
+
+#include <stddef.h>
+
+#define COW_CHUNK_SHIFT 16
+#define COW_CHUNK_SIZE ((size_t)1 << COW_CHUNK_SHIFT)
+
+typedef struct page_store *page_store_p;
+
+typedef struct cow_region {
+    // The start of the region's memory
+    char *base;
+    // The size of the region in bytes; always a multiple of COW_CHUNK_SIZE
+    size_t size;
+
+    page_store_p store;
+    // For each chunk of the region, the chunk of the store backing it
+    size_t *chunks;
+    // For each chunk of the region, nonzero if another region might be using
+    // the same chunk of the store
+    unsigned char *shared;
+} cow_region;
+
+// Create a region of at least the given number of bytes in a new page store
+//
+// This function panics if it fails to allocate enough memory.
+void cow_region_create(cow_region *region, size_t size);
+
+// Make a region of memory that's already mapped, such as shared memory, and
+// isn't in a page store
+//
+// The size must be a multiple of COW_CHUNK_SIZE. Such a region can't be
+// forked, and freeing it leaves the memory mapped.
+void cow_region_wrap(cow_region *region, char *base, size_t size);
+
+// Make dest a copy-on-write fork of src
+//
+// This costs time proportional to the number of chunks in src, not the number
+// of bytes. This function panics if it fails to allocate enough memory.
+void cow_region_fork(cow_region *dest, cow_region *src);
+
+// Unmap a region and release its chunks
+void cow_region_free(cow_region *region);
+
+// Give the region a private copy of the given chunk
+void cow_region_unshare(cow_region *region, size_t chunk);
+
+// Prepare the given bytes of the region to be written to
+static inline void cow_region_touch(cow_region *region, size_t offset, size_t length) {
+    size_t first = offset >> COW_CHUNK_SHIFT;
+    size_t last = (offset + length - 1) >> COW_CHUNK_SHIFT;
+
+    for (size_t chunk = first; chunk <= last; chunk++) {
+        if (region->shared[chunk])
+            cow_region_unshare(region, chunk);
+    }
+}
+
+#endif
@@ -21,4 +21,17 @@
     exit(-1); \
 } while (0)
 
+// Panic if a condition that only a bug could make false is false
+//
+// Checked builds, with POUTINE_CHECKED defined, test the condition; release
+// builds leave it out.
+#ifdef POUTINE_CHECKED
+#define CHECK(condition, message, ...) do { \
+    if (!(condition)) \
+        PANIC(message, ##__VA_ARGS__); \
+} while (0)
+#else
+#define CHECK(condition, message, ...) do { } while (0)
+#endif
+
 #endif
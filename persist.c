@@ -0,0 +1,831 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// persist.h: Persistent vectors and maps
+
+#include <stdint.h>
+#include <string.h>
+
+#include "heap.h"
+#include "heapimpl.h"
+#include "map.h"
+#include "panic.h"
+#include "persist.h"
+#include "rawheap.h"
+#include "rcheap.h"
+
+// The kinds of trie node
+#define NODE_VECTOR 0
+#define NODE_BITMAP 1
+#define NODE_COLLISION 2
+
+#define BITS 5
+#define WIDTH (1 << BITS)
+#define MASK (WIDTH - 1)
+
+// Map tries stop branching once they've used up every bit of the hash.
+#define HASH_BITS 64
+
+// Returned by the delete functions when a node ends up with nothing in it
+#define EMPTY -2
+
+// The layout of a node's blob
+typedef struct node {
+    int kind;
+    // The transient collection which may change this node in place, or 0
+    int edit;
+    // For bitmap nodes, which of the 32 branches are present
+    uint32_t bitmap;
+    // The number of slots in use
+    //
+    // A vector node always has 32 slots, holding an item or a child node, or
+    // -1 if that part of the vector doesn't exist yet. A bitmap node has two
+    // slots for each branch that's present: either a key and its value, or -1
+    // and a child node. A collision node holds keys and values in pairs.
+    int slot_count;
+    cell_index slots[];
+} node;
+
+// The layout of a collection's blob
+typedef struct root {
+    cell_index count;
+    // The number of hash or position bits used above the bottom level of a
+    // vector's trie
+    int shift;
+    // The root node of the trie, or -1 if the collection is empty
+    cell_index trie;
+    // The edit number of a transient collection, or 0
+    int edit;
+} root;
+
+static inline node *get_node(heap_p heap, cell_index index) {
+    return blob_data(heap, heap->cells[index].car);
+}
+
+static inline root *get_root(heap_p heap, cell_index collection) {
+    return blob_data(heap, heap->cells[collection].car);
+}
+
+static inline node *writable_node(heap_p heap, cell_index index) {
+    return writable_blob(heap, heap->cells[index].car);
+}
+
+static inline int branch(uint64_t hash, int shift) {
+    return (hash >> shift) & MASK;
+}
+
+static inline int bit_position(uint32_t bitmap, uint32_t bit) {
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+// Allocate a collection cell, returning -1 on insufficient space
+cell_index new_root(heap_p heap, int tag, cell_index count, int shift, cell_index trie, int edit);
+// Make an updated copy of a collection, or update a transient one in place
+cell_index update_root(heap_p heap, cell_index collection, cell_index count, int shift,
+    cell_index trie);
+// Panic unless a cell is a collection with the given tag
+root *check_collection(heap_p heap, cell_index collection, int tag);
+// Get the tag of a collection, panicking if the cell isn't a collection
+int collection_tag(heap_p heap, cell_index collection);
+
+// Allocate an empty node with room for the given number of slots, returning
+// -1 on insufficient space
+cell_index new_node(heap_p heap, int kind, int edit, int capacity);
+// Get a copy of a node which the given edit may change, with room for some
+// more slots; return -1 on insufficient space
+//
+// If the node already belongs to the edit, this is the node itself.
+cell_index editable(heap_p heap, cell_index index, int edit, int extra);
+// Set a slot of a node, keeping reference counts right
+void set_slot(heap_p heap, cell_index index, int slot, cell_index value);
+// Add a reference to a cell
+void hold(heap_p heap, cell_index index);
+// Remove a reference to a cell, freeing it if it's a node nothing uses
+void release(heap_p heap, cell_index index);
+// Free a newly built node if nothing has taken a reference to it
+void discard(heap_p heap, cell_index index);
+// Free a node and let go of everything in it
+void free_node(heap_p heap, cell_index index);
+
+// Build a chain of vector nodes leading down to a single item
+cell_index vector_path(heap_p heap, int shift, cell_index value, int edit);
+// Set an item in a vector trie
+cell_index vector_set(heap_p heap, cell_index index, int shift, cell_index position,
+    cell_index value, int edit);
+// Add an item to the end of a vector trie which has room for it
+cell_index vector_push(heap_p heap, cell_index index, int shift, cell_index position,
+    cell_index value, int edit);
+
+// Set a key in a map trie
+cell_index map_trie_put(heap_p heap, cell_index index, int shift, uint64_t hash, cell_index key,
+    cell_index value, int edit, int *added);
+// Build a map trie holding two keys whose hashes agree below the given shift
+cell_index map_trie_pair(heap_p heap, int shift, cell_index key1, cell_index value1, uint64_t hash1,
+    cell_index key2, cell_index value2, uint64_t hash2, int edit);
+// Remove a key from a map trie, returning EMPTY if nothing is left
+cell_index map_trie_delete(heap_p heap, cell_index index, int shift, uint64_t hash,
+    cell_index key, int edit, int *removed);
+// Remove a pair of slots from a node, returning EMPTY if nothing is left
+cell_index remove_pair(heap_p heap, cell_index index, int pair, uint32_t bit, int edit);
+
+
+
+// Vectors:
+
+cell_index rc_pvec(heap_p heap) {
+    return new_root(heap, TAG_PVEC, 0, 0, -1, 0);
+}
+
+cell_index rc_pvec_count(heap_p heap, cell_index vec) {
+    return check_collection(heap, vec, TAG_PVEC)->count;
+}
+
+cell_index rc_pvec_get(heap_p heap, cell_index vec, cell_index position) {
+    root *r = check_collection(heap, vec, TAG_PVEC);
+
+    if (position < 0 || position >= r->count)
+        PANIC("Position %" PRI_INDEX " is out of range for a vector of %" PRI_INDEX " items", position, r->count);
+
+    cell_index index = r->trie;
+    for (int shift = r->shift; shift > 0; shift -= BITS)
+        index = get_node(heap, index)->slots[(position >> shift) & MASK];
+
+    return get_node(heap, index)->slots[position & MASK];
+}
+
+cell_index rc_pvec_set(heap_p heap, cell_index vec, cell_index position, cell_index value) {
+    root *r = check_collection(heap, vec, TAG_PVEC);
+
+    if (position < 0 || position >= r->count)
+        PANIC("Position %" PRI_INDEX " is out of range for a vector of %" PRI_INDEX " items", position, r->count);
+
+    if (!rc_is_valid(heap, value))
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value", value);
+
+    cell_index trie = vector_set(heap, r->trie, r->shift, position, value, r->edit);
+    if (trie == -1)
+        return -1;
+
+    return update_root(heap, vec, r->count, r->shift, trie);
+}
+
+cell_index rc_pvec_push(heap_p heap, cell_index vec, cell_index value) {
+    root *r = check_collection(heap, vec, TAG_PVEC);
+
+    if (!rc_is_valid(heap, value))
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value", value);
+
+    cell_index count = r->count;
+    int shift = r->shift;
+    cell_index trie;
+
+    if (r->trie == -1) {
+        trie = vector_path(heap, 0, value, r->edit);
+    } else if (count == WIDTH << shift) {
+        // The trie is full, so it needs another level on top.
+        cell_index path = vector_path(heap, shift, value, r->edit);
+        if (path == -1)
+            return -1;
+
+        trie = new_node(heap, NODE_VECTOR, r->edit, WIDTH);
+        if (trie == -1) {
+            discard(heap, path);
+            return -1;
+        }
+
+        set_slot(heap, trie, 0, r->trie);
+        set_slot(heap, trie, 1, path);
+        shift += BITS;
+    } else {
+        trie = vector_push(heap, r->trie, shift, count, value, r->edit);
+    }
+
+    if (trie == -1)
+        return -1;
+
+    return update_root(heap, vec, count + 1, shift, trie);
+}
+
+cell_index vector_path(heap_p heap, int shift, cell_index value, int edit) {
+    cell_index child = value;
+
+    if (shift > 0) {
+        child = vector_path(heap, shift - BITS, value, edit);
+        if (child == -1)
+            return -1;
+    }
+
+    cell_index index = new_node(heap, NODE_VECTOR, edit, WIDTH);
+    if (index == -1) {
+        discard(heap, child);
+        return -1;
+    }
+
+    set_slot(heap, index, 0, child);
+    return index;
+}
+
+cell_index vector_set(heap_p heap, cell_index index, int shift, cell_index position,
+    cell_index value, int edit) {
+    cell_index copy = editable(heap, index, edit, 0);
+    if (copy == -1)
+        return -1;
+
+    int slot = (position >> shift) & MASK;
+
+    if (shift == 0) {
+        set_slot(heap, copy, slot, value);
+        return copy;
+    }
+
+    cell_index child = get_node(heap, copy)->slots[slot];
+    cell_index new_child = vector_set(heap, child, shift - BITS, position, value, edit);
+
+    if (new_child == -1) {
+        discard(heap, copy);
+        return -1;
+    }
+
+    set_slot(heap, copy, slot, new_child);
+    return copy;
+}
+
+cell_index vector_push(heap_p heap, cell_index index, int shift, cell_index position,
+    cell_index value, int edit) {
+    cell_index copy = editable(heap, index, edit, 0);
+    if (copy == -1)
+        return -1;
+
+    int slot = (position >> shift) & MASK;
+
+    if (shift == 0) {
+        set_slot(heap, copy, slot, value);
+        return copy;
+    }
+
+    cell_index child = get_node(heap, copy)->slots[slot];
+    cell_index new_child;
+
+    if (child == -1)
+        new_child = vector_path(heap, shift - BITS, value, edit);
+    else
+        new_child = vector_push(heap, child, shift - BITS, position, value, edit);
+
+    if (new_child == -1) {
+        discard(heap, copy);
+        return -1;
+    }
+
+    set_slot(heap, copy, slot, new_child);
+    return copy;
+}
+
+
+
+// Maps:
+
+cell_index rc_pmap(heap_p heap) {
+    return new_root(heap, TAG_PMAP, 0, 0, -1, 0);
+}
+
+cell_index rc_pmap_count(heap_p heap, cell_index map) {
+    return check_collection(heap, map, TAG_PMAP)->count;
+}
+
+cell_index rc_pmap_get(heap_p heap, cell_index map, cell_index key) {
+    root *r = check_collection(heap, map, TAG_PMAP);
+
+    if (!rc_is_valid(heap, key))
+        PANIC("Tried to look up cell %" PRI_INDEX ", which doesn't contain a value", key);
+
+    uint64_t hash = map_key_hash(heap, key);
+    cell_index index = r->trie;
+
+    for (int shift = 0; index != -1; shift += BITS) {
+        node *n = get_node(heap, index);
+
+        if (n->kind == NODE_COLLISION) {
+            for (int i = 0; i < n->slot_count; i += 2) {
+                if (map_key_equal(heap, n->slots[i], key))
+                    return n->slots[i + 1];
+            }
+
+            return -1;
+        }
+
+        uint32_t bit = 1u << branch(hash, shift);
+        if (!(n->bitmap & bit))
+            return -1;
+
+        int pair = 2 * bit_position(n->bitmap, bit);
+        cell_index entry_key = n->slots[pair];
+
+        if (entry_key == -1)
+            index = n->slots[pair + 1];
+        else if (map_key_equal(heap, entry_key, key))
+            return n->slots[pair + 1];
+        else
+            return -1;
+    }
+
+    return -1;
+}
+
+cell_index rc_pmap_put(heap_p heap, cell_index map, cell_index key, cell_index value) {
+    root *r = check_collection(heap, map, TAG_PMAP);
+
+    if (!rc_is_valid(heap, key))
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value", key);
+
+    if (!rc_is_valid(heap, value))
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value", value);
+
+    int added = 0;
+    cell_index trie = map_trie_put(heap, r->trie, 0, map_key_hash(heap, key), key, value, r->edit,
+        &added);
+    if (trie == -1)
+        return -1;
+
+    return update_root(heap, map, r->count + added, 0, trie);
+}
+
+cell_index rc_pmap_delete(heap_p heap, cell_index map, cell_index key) {
+    root *r = check_collection(heap, map, TAG_PMAP);
+
+    if (!rc_is_valid(heap, key))
+        PANIC("Tried to look up cell %" PRI_INDEX ", which doesn't contain a value", key);
+
+    int removed = 0;
+    cell_index trie = r->trie;
+
+    if (trie != -1) {
+        trie = map_trie_delete(heap, trie, 0, map_key_hash(heap, key), key, r->edit, &removed);
+        if (trie == -1)
+            return -1;
+        if (trie == EMPTY)
+            trie = -1;
+    }
+
+    return update_root(heap, map, r->count - removed, 0, trie);
+}
+
+cell_index map_trie_put(heap_p heap, cell_index index, int shift, uint64_t hash, cell_index key,
+    cell_index value, int edit, int *added) {
+    if (index == -1) {
+        index = new_node(heap, NODE_BITMAP, edit, 2);
+        if (index == -1)
+            return -1;
+
+        node *n = get_node(heap, index);
+        n->bitmap = 1u << branch(hash, shift);
+        n->slot_count = 2;
+        set_slot(heap, index, 0, key);
+        set_slot(heap, index, 1, value);
+
+        *added = 1;
+        return index;
+    }
+
+    node *n = get_node(heap, index);
+
+    if (n->kind == NODE_COLLISION) {
+        for (int i = 0; i < n->slot_count; i += 2) {
+            if (map_key_equal(heap, n->slots[i], key)) {
+                if (n->slots[i + 1] == value)
+                    return index;
+
+                cell_index copy = editable(heap, index, edit, 0);
+                if (copy == -1)
+                    return -1;
+
+                set_slot(heap, copy, i + 1, value);
+                return copy;
+            }
+        }
+
+        cell_index copy = editable(heap, index, edit, 2);
+        if (copy == -1)
+            return -1;
+
+        n = get_node(heap, copy);
+        n->slot_count += 2;
+        set_slot(heap, copy, n->slot_count - 2, key);
+        set_slot(heap, copy, n->slot_count - 1, value);
+
+        *added = 1;
+        return copy;
+    }
+
+    uint32_t bit = 1u << branch(hash, shift);
+    int pair = 2 * bit_position(n->bitmap, bit);
+
+    if (!(n->bitmap & bit)) {
+        cell_index copy = editable(heap, index, edit, 2);
+        if (copy == -1)
+            return -1;
+
+        n = get_node(heap, copy);
+        memmove(&n->slots[pair + 2], &n->slots[pair], (n->slot_count - pair) * sizeof(cell_index));
+        n->slots[pair] = -1;
+        n->slots[pair + 1] = -1;
+        n->slot_count += 2;
+        n->bitmap |= bit;
+        set_slot(heap, copy, pair, key);
+        set_slot(heap, copy, pair + 1, value);
+
+        *added = 1;
+        return copy;
+    }
+
+    cell_index entry_key = n->slots[pair];
+    cell_index entry_value = n->slots[pair + 1];
+    cell_index new_child;
+
+    if (entry_key == -1) {
+        new_child = map_trie_put(heap, entry_value, shift + BITS, hash, key, value, edit, added);
+        if (new_child == -1)
+            return -1;
+        if (new_child == entry_value)
+            return index;
+    } else if (map_key_equal(heap, entry_key, key)) {
+        if (entry_value == value)
+            return index;
+
+        cell_index copy = editable(heap, index, edit, 0);
+        if (copy == -1)
+            return -1;
+
+        set_slot(heap, copy, pair + 1, value);
+        return copy;
+    } else {
+        // Two different keys on the same branch: push them both down a level.
+        new_child = map_trie_pair(heap, shift + BITS, entry_key, entry_value,
+            map_key_hash(heap, entry_key), key, value, hash, edit);
+        if (new_child == -1)
+            return -1;
+
+        *added = 1;
+    }
+
+    cell_index copy = editable(heap, index, edit, 0);
+    if (copy == -1) {
+        discard(heap, new_child);
+        return -1;
+    }
+
+    set_slot(heap, copy, pair, -1);
+    set_slot(heap, copy, pair + 1, new_child);
+    return copy;
+}
+
+cell_index map_trie_pair(heap_p heap, int shift, cell_index key1, cell_index value1, uint64_t hash1,
+        cell_index key2, cell_index value2, uint64_t hash2, int edit) {
+    if (shift >= HASH_BITS) {
+        cell_index index = new_node(heap, NODE_COLLISION, edit, 4);
+        if (index == -1)
+            return -1;
+
+        get_node(heap, index)->slot_count = 4;
+        set_slot(heap, index, 0, key1);
+        set_slot(heap, index, 1, value1);
+        set_slot(heap, index, 2, key2);
+        set_slot(heap, index, 3, value2);
+        return index;
+    }
+
+    uint32_t bit1 = 1u << branch(hash1, shift);
+    uint32_t bit2 = 1u << branch(hash2, shift);
+
+    if (bit1 == bit2) {
+        cell_index child = map_trie_pair(heap, shift + BITS, key1, value1, hash1, key2, value2, hash2, edit);
+        if (child == -1)
+            return -1;
+
+        cell_index index = new_node(heap, NODE_BITMAP, edit, 2);
+        if (index == -1) {
+            discard(heap, child);
+            return -1;
+        }
+
+        node *n = get_node(heap, index);
+        n->bitmap = bit1;
+        n->slot_count = 2;
+        set_slot(heap, index, 1, child);
+        return index;
+    }
+
+    cell_index index = new_node(heap, NODE_BITMAP, edit, 4);
+    if (index == -1)
+        return -1;
+
+    node *n = get_node(heap, index);
+    n->bitmap = bit1 | bit2;
+    n->slot_count = 4;
+
+    int first = bit1 < bit2 ? 0 : 2;
+    set_slot(heap, index, first, key1);
+    set_slot(heap, index, first + 1, value1);
+    set_slot(heap, index, 2 - first, key2);
+    set_slot(heap, index, 3 - first, value2);
+    return index;
+}
+
+cell_index map_trie_delete(heap_p heap, cell_index index, int shift, uint64_t hash,
+    cell_index key, int edit, int *removed) {
+    node *n = get_node(heap, index);
+
+    if (n->kind == NODE_COLLISION) {
+        for (int i = 0; i < n->slot_count; i += 2) {
+            if (map_key_equal(heap, n->slots[i], key)) {
+                *removed = 1;
+                return remove_pair(heap, index, i, 0, edit);
+            }
+        }
+
+        return index;
+    }
+
+    uint32_t bit = 1u << branch(hash, shift);
+    if (!(n->bitmap & bit))
+        return index;
+
+    int pair = 2 * bit_position(n->bitmap, bit);
+    cell_index entry_key = n->slots[pair];
+    cell_index entry_value = n->slots[pair + 1];
+
+    if (entry_key != -1) {
+        if (!map_key_equal(heap, entry_key, key))
+            return index;
+
+        *removed = 1;
+        return remove_pair(heap, index, pair, bit, edit);
+    }
+
+    cell_index new_child = map_trie_delete(heap, entry_value, shift + BITS, hash, key, edit, removed);
+    if (new_child == -1)
+        return -1;
+    if (new_child == entry_value)
+        return index;
+    if (new_child == EMPTY)
+        return remove_pair(heap, index, pair, bit, edit);
+
+    cell_index copy = editable(heap, index, edit, 0);
+    if (copy == -1) {
+        discard(heap, new_child);
+        return -1;
+    }
+
+    set_slot(heap, copy, pair + 1, new_child);
+    return copy;
+}
+
+cell_index remove_pair(heap_p heap, cell_index index, int pair, uint32_t bit, int edit) {
+    if (get_node(heap, index)->slot_count == 2)
+        return EMPTY;
+
+    cell_index copy = editable(heap, index, edit, 0);
+    if (copy == -1)
+        return -1;
+
+    set_slot(heap, copy, pair, -1);
+    set_slot(heap, copy, pair + 1, -1);
+
+    node *n = get_node(heap, copy);
+    memmove(&n->slots[pair], &n->slots[pair + 2], (n->slot_count - pair - 2) * sizeof(cell_index));
+    n->slot_count -= 2;
+    n->bitmap &= ~bit;
+    n->slots[n->slot_count] = -1;
+    n->slots[n->slot_count + 1] = -1;
+
+    return copy;
+}
+
+
+
+// Transients:
+
+cell_index rc_transient(heap_p heap, cell_index collection) {
+    int tag = collection_tag(heap, collection);
+    root *r = check_collection(heap, collection, tag);
+
+    if (r->edit != 0)
+        PANIC("The collection at index %" PRI_INDEX " is already transient", collection);
+
+    heap->next_edit++;
+    return new_root(heap, tag, r->count, r->shift, r->trie, heap->next_edit);
+}
+
+void rc_persistent(heap_p heap, cell_index collection) {
+    int tag = collection_tag(heap, collection);
+
+    // The nodes stay marked with the old edit number, but since no collection
+    // has that number any more, nothing will change them in place.
+    check_collection(heap, collection, tag);
+    root *r = writable_blob(heap, heap->cells[collection].car);
+    r->edit = 0;
+}
+
+void persist_erase(heap_p heap, cell_index collection) {
+    root *r = get_root(heap, collection);
+
+    if (r->trie != -1)
+        release(heap, r->trie);
+
+    blob_free(heap, heap->cells[collection].car);
+}
+
+void persist_references(heap_p heap, cell_index index,
+    void (*visit)(void *context, cell_index reference), void *context) {
+
+    if (heap->cells[index].tag == TAG_NODE) {
+        node *n = get_node(heap, index);
+
+        for (int i = 0; i < n->slot_count; i++) {
+            if (n->slots[i] >= 0)
+                visit(context, n->slots[i]);
+        }
+    } else {
+        root *r = get_root(heap, index);
+
+        if (r->trie != -1)
+            visit(context, r->trie);
+    }
+}
+
+
+
+// Collections and nodes:
+
+cell_index new_root(heap_p heap, int tag, cell_index count, int shift, cell_index trie, int edit) {
+    cell_index index = alloc_cell(heap);
+    if (index == -1)
+        return -1;
+
+    cell_index number = blob_alloc(heap, sizeof(root));
+    root *r = blob_data(heap, number);
+    r->count = count;
+    r->shift = shift;
+    r->trie = trie;
+    r->edit = edit;
+
+    setfield(heap, FIELD_TAG, index, tag);
+    setfield(heap, FIELD_CAR, index, number);
+    setfield(heap, FIELD_CDR, index, 0);
+
+    if (trie != -1)
+        hold(heap, trie);
+
+    return index;
+}
+
+cell_index update_root(heap_p heap, cell_index collection, cell_index count, int shift,
+    cell_index trie) {
+    root *r = get_root(heap, collection);
+
+    if (r->edit == 0) {
+        int tag = getfield(heap, FIELD_TAG, collection);
+        cell_index result = new_root(heap, tag, count, shift, trie, 0);
+
+        if (result == -1)
+            discard(heap, trie);
+
+        return result;
+    }
+
+    writable_blob(heap, heap->cells[collection].car);
+
+    if (trie != r->trie) {
+        cell_index old_trie = r->trie;
+
+        if (trie != -1)
+            hold(heap, trie);
+        r->trie = trie;
+        if (old_trie != -1)
+            release(heap, old_trie);
+    }
+
+    r->count = count;
+    r->shift = shift;
+    return collection;
+}
+
+root *check_collection(heap_p heap, cell_index collection, int tag) {
+    if (!rc_is_valid(heap, collection) || getfield(heap, FIELD_TAG, collection) != tag)
+        PANIC("The cell at index %" PRI_INDEX " is not a persistent %s", collection,
+            tag == TAG_PMAP ? "map" : "vector");
+
+    return get_root(heap, collection);
+}
+
+int collection_tag(heap_p heap, cell_index collection) {
+    int tag = rc_is_valid(heap, collection) ? getfield(heap, FIELD_TAG, collection) : TAG_UNINIT;
+
+    if (tag != TAG_PVEC && tag != TAG_PMAP)
+        PANIC("The cell at index %" PRI_INDEX " is not a persistent collection", collection);
+
+    return tag;
+}
+
+cell_index new_node(heap_p heap, int kind, int edit, int capacity) {
+    cell_index index = alloc_cell(heap);
+    if (index == -1)
+        return -1;
+
+    cell_index number = blob_alloc(heap, sizeof(node) + capacity * sizeof(cell_index));
+    node *n = blob_data(heap, number);
+    n->kind = kind;
+    n->edit = edit;
+    n->slot_count = kind == NODE_VECTOR ? WIDTH : 0;
+    memset(n->slots, 0xff, capacity * sizeof(cell_index));
+
+    setfield(heap, FIELD_TAG, index, TAG_NODE);
+    setfield(heap, FIELD_CAR, index, number);
+    setfield(heap, FIELD_CDR, index, 0);
+
+    return index;
+}
+
+cell_index editable(heap_p heap, cell_index index, int edit, int extra) {
+    node *n = get_node(heap, index);
+    int needed = n->slot_count + extra;
+
+    if (edit != 0 && n->edit == edit) {
+        cell_index number = heap->cells[index].car;
+        size_t capacity = (heap->blobs[number]->size - sizeof(node)) / sizeof(cell_index);
+
+        if (capacity < needed) {
+            size_t old_size = heap->blobs[number]->size;
+            blob_resize(heap, number, sizeof(node) + 2 * needed * sizeof(cell_index));
+            memset(heap->blobs[number]->data + old_size, 0xff, heap->blobs[number]->size - old_size);
+        }
+
+        // The caller is about to change the node in place.
+        writable_node(heap, index);
+        return index;
+    }
+
+    cell_index copy = new_node(heap, n->kind, edit, needed);
+    if (copy == -1)
+        return -1;
+
+    n = get_node(heap, index);
+    node *c = get_node(heap, copy);
+    c->bitmap = n->bitmap;
+    c->slot_count = n->slot_count;
+    memcpy(c->slots, n->slots, n->slot_count * sizeof(cell_index));
+
+    for (int i = 0; i < c->slot_count; i++) {
+        if (c->slots[i] >= 0)
+            hold(heap, c->slots[i]);
+    }
+
+    return copy;
+}
+
+void set_slot(heap_p heap, cell_index index, int slot, cell_index value) {
+    node *n = writable_node(heap, index);
+    cell_index old_value = n->slots[slot];
+
+    if (value >= 0)
+        hold(heap, value);
+
+    n->slots[slot] = value;
+
+    if (old_value >= 0)
+        release(heap, old_value);
+}
+
+void hold(heap_p heap, cell_index index) {
+    inc_refcount(heap, index);
+}
+
+void release(heap_p heap, cell_index index) {
+    dec_refcount(heap, index);
+
+    if (heap->cells[index].tag == TAG_NODE && heap->cells[index].ref_count == 0)
+        free_node(heap, index);
+}
+
+void discard(heap_p heap, cell_index index) {
+    if (index >= 0 && heap->cells[index].tag == TAG_NODE && heap->cells[index].ref_count == 0)
+        free_node(heap, index);
+}
+
+void free_node(heap_p heap, cell_index index) {
+    node *n = get_node(heap, index);
+
+    for (int i = 0; i < n->slot_count; i++) {
+        if (n->slots[i] >= 0)
+            release(heap, n->slots[i]);
+    }
+
+    blob_free(heap, heap->cells[index].car);
+    free_cell(heap, index);
+}
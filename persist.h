@@ -0,0 +1,86 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// persist.h: Persistent vectors and maps
+
+// A persistent collection is never changed. Updating one returns a new
+// collection which shares most of its structure with the old one, so both can
+// be used afterwards. Vectors are 32-way tries indexed by position; maps are
+// hash array mapped tries, with keys compared the same way as in map.h.
+//
+// A collection is a cell with the tag TAG_PVEC or TAG_PMAP. The nodes of its
+// trie are cells with the tag TAG_NODE, each holding a reference to every node,
+// key and value under it, so nodes can be shared between any number of
+// collections. Nodes are internal: they aren't valid values, and a node is
+// freed automatically once no collection uses it. So freeing an old version of
+// a collection frees exactly the nodes that no other version shares.
+//
+// The update functions return -1 if they run out of cells, leaving the heap as
+// it was.
+//
+// For loading a lot of data at once, rc_transient() makes a transient copy of
+// a collection. Updating a transient collection changes it in place and
+// returns the same index, and reuses any nodes that the transient collection
+// created itself, so a batch of updates allocates far fewer cells. Once you're
+// done, rc_persistent() makes it an ordinary persistent collection again.
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include "heap.h"
+
+// Allocate a cell as an empty persistent vector, returning -1 on insufficient
+// space
+cell_index rc_pvec(heap_p heap);
+// Get the number of items in a persistent vector
+cell_index rc_pvec_count(heap_p heap, cell_index vec);
+// Get the item at the given position in a persistent vector
+cell_index rc_pvec_get(heap_p heap, cell_index vec, cell_index position);
+// Make a copy of a persistent vector with the item at the given position
+// replaced; return the new vector, or -1 on insufficient space
+cell_index rc_pvec_set(heap_p heap, cell_index vec, cell_index position, cell_index value);
+// Make a copy of a persistent vector with an item added to the end; return the
+// new vector, or -1 on insufficient space
+cell_index rc_pvec_push(heap_p heap, cell_index vec, cell_index value);
+
+// Allocate a cell as an empty persistent map, returning -1 on insufficient
+// space
+cell_index rc_pmap(heap_p heap);
+// Get the number of entries in a persistent map
+cell_index rc_pmap_count(heap_p heap, cell_index map);
+// Look up a key in a persistent map; return its value, or -1 if the key isn't
+// there
+cell_index rc_pmap_get(heap_p heap, cell_index map, cell_index key);
+// Make a copy of a persistent map with the value for a key set; return the new
+// map, or -1 on insufficient space
+cell_index rc_pmap_put(heap_p heap, cell_index map, cell_index key, cell_index value);
+// Make a copy of a persistent map without the given key; return the new map,
+// or -1 on insufficient space
+cell_index rc_pmap_delete(heap_p heap, cell_index map, cell_index key);
+
+// Make a transient copy of a persistent collection, returning -1 on
+// insufficient space
+cell_index rc_transient(heap_p heap, cell_index collection);
+// Make a transient collection persistent again
+void rc_persistent(heap_p heap, cell_index collection);
+
+// Drop a collection's reference to its trie and free its storage
+//
+// This is used by rc_erase(); afterwards, the cell is no longer a collection.
+void persist_erase(heap_p heap, cell_index collection);
+
+// Call the given function on every cell that a collection or a node holds a
+// reference to
+//
+// This is used by cell_references().
+void persist_references(heap_p heap, cell_index index,
+    void (*visit)(void *context, cell_index reference), void *context);
+
+#endif
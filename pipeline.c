@@ -0,0 +1,474 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// pipeline.h: Running a stream of shell commands on three threads
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "histogram.h"
+#include "panic.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "trace.h"
+#include "wire.h"
+
+// The number of bytes of requests in a batch, beyond which it's sent on
+#define PIPELINE_BATCH_BYTES 65536
+// The longest command, including its newline and NUL, as in the shell
+#define PIPELINE_MAX_COMMAND 1024
+// The number of batches, and of slots in each ring, as a power of two
+#define PIPELINE_RING_SIZE 8
+// The number of times a stage yields before it starts sleeping while it waits
+#define PIPELINE_YIELDS 100
+// An opcode used by neither wire.h nor trace.h, for a command that
+// trace_encode() can't make into a request; it's followed by the command as a
+// string
+#define PIPELINE_TEXT 0
+
+typedef struct pipeline_batch {
+    // Requests made by trace_encode(), and PIPELINE_TEXT commands
+    wire_buffer requests;
+    size_t count;
+    // Nonzero if this is the last batch
+    int last;
+
+    // The result of each request, followed by anything added by
+    // command_annotate_result(), or for a text command, what it printed to its
+    // output stream and to its error stream, as two strings
+    wire_buffer results;
+} pipeline_batch;
+
+// A ring of batches passed from one thread to another
+//
+// Only the producer changes tail, and only the consumer changes head, so
+// neither needs a lock. They're kept on separate cache lines so the two
+// threads don't contend for them.
+typedef struct pipeline_ring {
+    pipeline_batch *slots[PIPELINE_RING_SIZE];
+    _Alignas(64) size_t head;
+    _Alignas(64) size_t tail;
+} pipeline_ring;
+
+typedef struct pipeline {
+    int in_fd;
+    FILE *out_file;
+    FILE *err_file;
+    int read_failed;
+
+    // Empty batches for the reader, full ones for the executor, and finished
+    // ones for the writer
+    pipeline_ring empty;
+    pipeline_ring full;
+    pipeline_ring done;
+
+    // What the executor's current text command has printed
+    wire_buffer text_out;
+    wire_buffer text_err;
+    // What the writer's current batch prints
+    wire_buffer out;
+    wire_buffer err;
+
+    // When each stage last stopped waiting
+    uint64_t busy_since[PIPELINE_STAGES];
+    pipeline_stats stats;
+} pipeline;
+
+// Put a batch in a ring
+//
+// There are only as many batches as there are slots in a ring, so this never
+// has to wait.
+void pipeline_ring_push(pipeline_ring *ring, pipeline_batch *batch);
+// Take a batch from a ring for the given stage, waiting for one if it's empty
+pipeline_batch *pipeline_ring_pop(pipeline *pipe, pipeline_ring *ring, int stage);
+
+// The reader and writer threads
+void *pipeline_reader_main(void *arg);
+void *pipeline_writer_main(void *arg);
+// Run the commands in each batch, until the last one
+void pipeline_execute(pipeline *pipe);
+
+// Move complete commands from the start of the input into batches, sending
+// them on as they fill up; return the number of bytes used
+size_t pipeline_split(pipeline *pipe, pipeline_batch **batch, char *input, size_t length, int at_end);
+// Add a command to a batch, as a request if possible
+void pipeline_encode(pipeline_batch *batch, const char *command, size_t length);
+
+// Run the request or text command at the reader's position, appending its
+// result to the batch
+void pipeline_run_request(pipeline_batch *batch, wire_reader *reader);
+void pipeline_run_text(pipeline *pipe, pipeline_batch *batch, wire_reader *reader);
+// Print the results of the commands in a batch
+void pipeline_print_batch(pipeline *pipe, pipeline_batch *batch);
+
+// Open a stream on the calling thread that appends what's printed to a buffer
+FILE *pipeline_open_stream(wire_buffer *buf);
+ssize_t pipeline_write_stream(void *cookie, const char *data, size_t length);
+
+
+
+// Running the pipeline:
+
+int pipeline_run(int in_fd, FILE *out, FILE *err, pipeline_stats *stats) {
+    // The rings keep their indexes on their own cache lines, which calloc()
+    // doesn't promise to line up.
+    pipeline *pipe = aligned_alloc(_Alignof(pipeline), sizeof(pipeline));
+    if (!pipe)
+        PANIC("Failed to allocate enough memory for the pipeline");
+    memset(pipe, 0, sizeof(pipeline));
+
+    pipe->in_fd = in_fd;
+    pipe->out_file = out;
+    pipe->err_file = err;
+
+    for (int i = 0; i < PIPELINE_RING_SIZE; i++) {
+        pipeline_batch *batch = calloc(1, sizeof(pipeline_batch));
+        if (!batch)
+            PANIC("Failed to allocate enough memory for the pipeline");
+
+        pipeline_ring_push(&pipe->empty, batch);
+    }
+
+    uint64_t start = monotonic_ns();
+    pthread_t reader, writer;
+
+    if (pthread_create(&reader, NULL, pipeline_reader_main, pipe) != 0
+        || pthread_create(&writer, NULL, pipeline_writer_main, pipe) != 0)
+        PANIC("Failed to start the pipeline's threads");
+
+    pipeline_execute(pipe);
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    pipe->stats.elapsed_ns = monotonic_ns() - start;
+    if (stats)
+        *stats = pipe->stats;
+
+    // Every batch is back in the empty ring.
+    for (int i = 0; i < PIPELINE_RING_SIZE; i++) {
+        pipeline_batch *batch = pipe->empty.slots[i];
+        free(batch->requests.data);
+        free(batch->results.data);
+        free(batch);
+    }
+
+    free(pipe->text_out.data);
+    free(pipe->text_err.data);
+    free(pipe->out.data);
+    free(pipe->err.data);
+
+    int ok = !pipe->read_failed;
+    free(pipe);
+    return ok;
+}
+
+void pipeline_print_stats(FILE *out, const pipeline_stats *stats) {
+    static const char *names[PIPELINE_STAGES] = {"reader", "executor", "writer"};
+    double elapsed = stats->elapsed_ns / 1e9;
+
+    fprintf(out, "%llu commands in %.3f s: %.0f commands/s\n",
+        (unsigned long long)stats->commands[PIPELINE_EXECUTOR], elapsed,
+        elapsed > 0 ? stats->commands[PIPELINE_EXECUTOR] / elapsed : 0);
+
+    for (int i = 0; i < PIPELINE_STAGES; i++) {
+        double busy = stats->busy_ns[i] / 1e9;
+
+        fprintf(out, "    %-8s %10llu commands, busy %8.3f s: %.0f commands/s\n", names[i],
+            (unsigned long long)stats->commands[i], busy, busy > 0 ? stats->commands[i] / busy : 0);
+    }
+}
+
+
+
+// The stages:
+
+void *pipeline_reader_main(void *arg) {
+    pipeline *pipe = arg;
+    pipe->busy_since[PIPELINE_READER] = monotonic_ns();
+
+    // Input that hasn't been split into commands yet, which is always less
+    // than a whole command once it's been split
+    char *input = malloc(PIPELINE_BATCH_BYTES);
+    size_t length = 0;
+    if (!input)
+        PANIC("Failed to allocate enough memory for the pipeline");
+
+    pipeline_batch *batch = pipeline_ring_pop(pipe, &pipe->empty, PIPELINE_READER);
+
+    while (1) {
+        size_t wanted = PIPELINE_BATCH_BYTES - length;
+        ssize_t got = read(pipe->in_fd, input + length, wanted);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            pipe->read_failed = 1;
+
+        int at_end = got <= 0;
+        if (!at_end)
+            length += got;
+
+        size_t used = pipeline_split(pipe, &batch, input, length, at_end);
+        memmove(input, input + used, length - used);
+        length -= used;
+
+        if (at_end) {
+            batch->last = 1;
+            pipeline_ring_push(&pipe->full, batch);
+            break;
+        }
+
+        // A short read means there's nothing more to read for now, so what
+        // has been read is sent on rather than waiting for a full batch.
+        if ((size_t)got < wanted && batch->count > 0) {
+            pipeline_ring_push(&pipe->full, batch);
+            batch = pipeline_ring_pop(pipe, &pipe->empty, PIPELINE_READER);
+        }
+    }
+
+    pipe->stats.busy_ns[PIPELINE_READER] += monotonic_ns() - pipe->busy_since[PIPELINE_READER];
+    free(input);
+    return NULL;
+}
+
+size_t pipeline_split(pipeline *pipe, pipeline_batch **batch, char *input, size_t length, int at_end) {
+    size_t used = 0;
+
+    while (used < length) {
+        // Like fgets(), take a line, or as much of one as fits.
+        size_t limit = length - used < PIPELINE_MAX_COMMAND - 1 ? length - used : PIPELINE_MAX_COMMAND - 1;
+        char *newline = memchr(input + used, '\n', limit);
+        size_t command_length = newline ? (size_t)(newline - (input + used)) + 1 : limit;
+
+        if (!newline && limit < PIPELINE_MAX_COMMAND - 1 && !at_end)
+            break;
+
+        if ((*batch)->requests.length >= PIPELINE_BATCH_BYTES) {
+            pipeline_ring_push(&pipe->full, *batch);
+            *batch = pipeline_ring_pop(pipe, &pipe->empty, PIPELINE_READER);
+        }
+
+        pipeline_encode(*batch, input + used, command_length);
+        pipe->stats.commands[PIPELINE_READER]++;
+
+        used += command_length;
+    }
+
+    return used;
+}
+
+void pipeline_encode(pipeline_batch *batch, const char *command, size_t length) {
+    char text[PIPELINE_MAX_COMMAND];
+
+    memcpy(text, command, length);
+    text[length] = '\0';
+    batch->count++;
+
+    if (trace_encode(text, &batch->requests))
+        return;
+
+    unsigned char op = PIPELINE_TEXT;
+    wire_append(&batch->requests, &op, 1);
+    wire_put_string(&batch->requests, text, length);
+}
+
+void pipeline_execute(pipeline *pipe) {
+    FILE *saved_out = command_out;
+    FILE *saved_err = command_err;
+    pipe->busy_since[PIPELINE_EXECUTOR] = monotonic_ns();
+
+    command_out = pipeline_open_stream(&pipe->text_out);
+    command_err = pipeline_open_stream(&pipe->text_err);
+
+    int last = 0;
+
+    while (!last) {
+        pipeline_batch *batch = pipeline_ring_pop(pipe, &pipe->full, PIPELINE_EXECUTOR);
+        wire_reader reader = {(const unsigned char *)batch->requests.data,
+            (const unsigned char *)batch->requests.data + batch->requests.length, 0};
+        last = batch->last;
+
+        while (reader.pos < reader.end) {
+            if (*reader.pos == PIPELINE_TEXT)
+                pipeline_run_text(pipe, batch, &reader);
+            else
+                pipeline_run_request(batch, &reader);
+        }
+
+        pipe->stats.commands[PIPELINE_EXECUTOR] += batch->count;
+        pipeline_ring_push(&pipe->done, batch);
+    }
+
+    pipe->stats.busy_ns[PIPELINE_EXECUTOR] += monotonic_ns() - pipe->busy_since[PIPELINE_EXECUTOR];
+
+    fclose(command_out);
+    fclose(command_err);
+    command_out = saved_out;
+    command_err = saved_err;
+}
+
+void pipeline_run_request(pipeline_batch *batch, wire_reader *reader) {
+    const unsigned char *request = reader->pos;
+    size_t result = batch->results.length;
+
+    // The clock is only read while profiling, as in run_command().
+    int timed = profile_running;
+    uint64_t start = timed ? monotonic_ns() : 0;
+
+    if (!trace_run_request(&heap, atom_text_size, reader, &batch->results))
+        PANIC("The pipeline made a malformed request");
+
+    size_t length = reader->pos - request;
+    command_annotate_result((const char *)request, length, &batch->results, result);
+
+    if (timed && profile_running)
+        profile_record(trace_op_name(*request), monotonic_ns() - start);
+
+    if (trace_recording)
+        trace_record_request((const char *)request, length);
+}
+
+void pipeline_run_text(pipeline *pipe, pipeline_batch *batch, wire_reader *reader) {
+    char command[PIPELINE_MAX_COMMAND];
+    size_t length;
+
+    reader->pos++;
+    const char *text = wire_get_string(reader, &length);
+    memcpy(command, text, length);
+    command[length] = '\0';
+
+    // It's not recorded in a trace, since trace_encode() couldn't encode it.
+    pipe->text_out.length = 0;
+    pipe->text_err.length = 0;
+    run_command(command);
+
+    wire_put_string(&batch->results, pipe->text_out.data, pipe->text_out.length);
+    wire_put_string(&batch->results, pipe->text_err.data, pipe->text_err.length);
+}
+
+void *pipeline_writer_main(void *arg) {
+    pipeline *pipe = arg;
+    pipe->busy_since[PIPELINE_WRITER] = monotonic_ns();
+
+    // The results are printed by the same code as the shell's, on this
+    // thread's own streams.
+    command_out = pipeline_open_stream(&pipe->out);
+    command_err = pipeline_open_stream(&pipe->err);
+
+    int last = 0;
+
+    while (!last) {
+        pipeline_batch *batch = pipeline_ring_pop(pipe, &pipe->done, PIPELINE_WRITER);
+        last = batch->last;
+
+        pipeline_print_batch(pipe, batch);
+        fwrite(pipe->out.data, 1, pipe->out.length, pipe->out_file);
+        fwrite(pipe->err.data, 1, pipe->err.length, pipe->err_file);
+        fflush(pipe->out_file);
+        fflush(pipe->err_file);
+
+        pipe->stats.commands[PIPELINE_WRITER] += batch->count;
+
+        pipe->out.length = 0;
+        pipe->err.length = 0;
+        batch->requests.length = 0;
+        batch->results.length = 0;
+        batch->count = 0;
+        batch->last = 0;
+        pipeline_ring_push(&pipe->empty, batch);
+    }
+
+    fclose(command_out);
+    fclose(command_err);
+
+    pipe->stats.busy_ns[PIPELINE_WRITER] += monotonic_ns() - pipe->busy_since[PIPELINE_WRITER];
+    return NULL;
+}
+
+void pipeline_print_batch(pipeline *pipe, pipeline_batch *batch) {
+    wire_reader requests = {(const unsigned char *)batch->requests.data,
+        (const unsigned char *)batch->requests.data + batch->requests.length, 0};
+    wire_reader results = {(const unsigned char *)batch->results.data,
+        (const unsigned char *)batch->results.data + batch->results.length, 0};
+
+    while (requests.pos < requests.end) {
+        if (*requests.pos != PIPELINE_TEXT) {
+            command_print_result(&requests, &results);
+            continue;
+        }
+
+        size_t length;
+        requests.pos++;
+        wire_get_string(&requests, &length);
+
+        const char *text = wire_get_string(&results, &length);
+        wire_append(&pipe->out, text, length);
+        text = wire_get_string(&results, &length);
+        wire_append(&pipe->err, text, length);
+    }
+}
+
+FILE *pipeline_open_stream(wire_buffer *buf) {
+    FILE *stream = fopencookie(buf, "w", (cookie_io_functions_t){.write = pipeline_write_stream});
+    if (!stream)
+        PANIC("Failed to open the pipeline's output streams");
+
+    setvbuf(stream, NULL, _IONBF, 0);
+    return stream;
+}
+
+ssize_t pipeline_write_stream(void *cookie, const char *data, size_t length) {
+    wire_append(cookie, data, length);
+    return length;
+}
+
+
+
+// Rings:
+
+void pipeline_ring_push(pipeline_ring *ring, pipeline_batch *batch) {
+    size_t tail = ring->tail;
+
+    ring->slots[tail % PIPELINE_RING_SIZE] = batch;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+pipeline_batch *pipeline_ring_pop(pipeline *pipe, pipeline_ring *ring, int stage) {
+    size_t head = ring->head;
+
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+        // The time spent waiting doesn't count as busy. Yielding first lets
+        // the other stages run if they share a CPU with this one; sleeping
+        // afterwards keeps an idle pipeline from spinning.
+        pipe->stats.busy_ns[stage] += monotonic_ns() - pipe->busy_since[stage];
+
+        for (int waits = 0; __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head; waits++) {
+            if (waits < PIPELINE_YIELDS)
+                sched_yield();
+            else
+                nanosleep(&(struct timespec){.tv_nsec = 50000}, NULL);
+        }
+
+        pipe->busy_since[stage] = monotonic_ns();
+    }
+
+    pipeline_batch *batch = ring->slots[head % PIPELINE_RING_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return batch;
+}
@@ -0,0 +1,73 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// pipeline.h: Running a stream of shell commands on three threads
+
+// The ordinary shell reads a command, runs it and prints its results before
+// reading the next, so it's never doing more than one of those at a time. The
+// pipeline splits that work between three threads, so that reading and writing
+// overlap with running commands:
+//
+//     The reader reads the input in large chunks and splits it into commands,
+//     exactly as the shell's fgets() would. It parses each command into a
+//     request in the binary protocol of wire.h with trace_encode(), packing
+//     the requests into batches. A command that can't be made into a request,
+//     such as verify or one with a bad argument, is kept as text.
+//     The executor, on the calling thread, runs each batch's requests on the
+//     heap with trace_run_request(), collecting their results in the batch.
+//     Text commands are run by run_command(), and what they print is
+//     collected instead.
+//     The writer prints each result exactly as the shell would have, with
+//     command_print_result(), and writes each batch's output with one call per
+//     stream.
+//
+// Batches are handed from thread to thread through lock-free rings with a
+// single producer and a single consumer. A batch is sent on as soon as it's
+// full or the input has nothing more to read for now, so commands typed at a
+// terminal still run straight away, while a large piped stream gets large
+// batches.
+//
+// Everything a command prints to its output stream comes out in order, and so
+// does everything it prints as errors, but within a batch the errors are
+// written after the output. There's no prompt.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The stages of the pipeline
+#define PIPELINE_READER 0
+#define PIPELINE_EXECUTOR 1
+#define PIPELINE_WRITER 2
+#define PIPELINE_STAGES 3
+
+typedef struct pipeline_stats {
+    // The number of commands each stage handled, and how long it spent busy
+    // rather than waiting for another stage
+    uint64_t commands[PIPELINE_STAGES];
+    uint64_t busy_ns[PIPELINE_STAGES];
+    // How long the whole pipeline took
+    uint64_t elapsed_ns;
+} pipeline_stats;
+
+// Run commands read from a file descriptor on the global heap until the end of
+// the input, writing what they print to the given streams; return 0 if reading
+// failed
+//
+// If stats isn't NULL, it's filled in. This function panics if it can't start
+// its threads.
+int pipeline_run(int in_fd, FILE *out, FILE *err, pipeline_stats *stats);
+
+// Print how many commands per second each stage handled
+void pipeline_print_stats(FILE *out, const pipeline_stats *stats);
+
+#endif
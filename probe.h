@@ -0,0 +1,46 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// probe.h: Static tracepoints for perf, bpftrace and the like
+
+// Where <sys/sdt.h> is available (it comes with SystemTap), each probe is a
+// single no-op instruction, along with a note saying where to find it and its
+// arguments, which tracing tools use to attach to it while the program runs:
+//
+//     perf probe -x bin/poutine sdt_poutine:alloc_cell
+//     bpftrace -e 'usdt:bin/poutine:poutine:free_cell { @[ustack] = count(); }'
+//
+// Elsewhere, probes compile to nothing. The probes, all in the "poutine"
+// provider, are:
+//
+// alloc_cell(index): A cell was allocated, by alloc_cell() or in the nursery
+// free_cell(index): A cell was freed
+// setatom(index, text): A cell was made into an atom
+// rc_erase(index, tag): A value with no references to it was erased
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define POUTINE_PROBES
+#endif
+#endif
+
+#ifdef POUTINE_PROBES
+#define PROBE1(name, a) STAP_PROBE1(poutine, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(poutine, name, a, b)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+
+// profile.h: How long each of the shell's commands takes
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "panic.h"
+#include "profile.h"
+
+// The most different command names each thread keeps timings for
+#define PROFILE_MAX_COMMANDS 64
+// Names are cut short to this many characters
+#define PROFILE_NAME_LENGTH 15
+
+// The timings for one command on one thread
+typedef struct profile_entry {
+    char name[PROFILE_NAME_LENGTH + 1];
+    histogram hist;
+} profile_entry;
+
+// The timings kept by one thread
+typedef struct profile_table {
+    struct profile_table *next;
+    int count;
+    profile_entry *entries[PROFILE_MAX_COMMANDS];
+} profile_table;
+
+// Get the calling thread's table, making it if it doesn't exist yet
+profile_table *profile_table_for_thread(void);
+// Find the entry for a command in a table, adding it if it isn't there; return
+// NULL if the table is full
+profile_entry *profile_entry_for(profile_table *table, const char *command_name);
+// Order entries by total time, most first
+int compare_profile_entries(const void *a, const void *b);
+
+
+
+int profile_running = 0;
+
+// Every thread's table, so that they can be cleared and merged
+static profile_table *all_tables = 0;
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread profile_table *this_thread_table = 0;
+
+
+
+// Profiling:
+
+void profile_start() {
+    pthread_mutex_lock(&tables_lock);
+
+    for (profile_table *table = all_tables; table; table = table->next) {
+        for (int i = 0; i < table->count; i++)
+            histogram_clear(&table->entries[i]->hist);
+    }
+
+    pthread_mutex_unlock(&tables_lock);
+    profile_running = 1;
+}
+
+void profile_stop() {
+    profile_running = 0;
+}
+
+void profile_record(const char *command_name, uint64_t nanoseconds) {
+    profile_entry *entry = profile_entry_for(profile_table_for_thread(), command_name);
+
+    if (entry)
+        histogram_record(&entry->hist, nanoseconds);
+}
+
+void profile_dump(FILE *out) {
+    // Every thread's timings for the same command are merged into the first
+    // thread's entry for it.
+    profile_table merged = {0};
+
+    pthread_mutex_lock(&tables_lock);
+
+    for (profile_table *table = all_tables; table; table = table->next) {
+        for (int i = 0; i < table->count; i++) {
+            profile_entry *total = profile_entry_for(&merged, table->entries[i]->name);
+            if (total)
+                histogram_merge(&total->hist, &table->entries[i]->hist);
+        }
+    }
+
+    pthread_mutex_unlock(&tables_lock);
+
+    qsort(merged.entries, merged.count, sizeof(profile_entry *), compare_profile_entries);
+
+    int printed = 0;
+    for (int i = 0; i < merged.count; i++) {
+        if (merged.entries[i]->hist.count > 0) {
+            histogram_print(out, merged.entries[i]->name, &merged.entries[i]->hist);
+            printed++;
+        }
+
+        free(merged.entries[i]);
+    }
+
+    if (printed == 0)
+        fprintf(out, "No commands have been timed\n");
+}
+
+
+
+// Tables:
+
+profile_table *profile_table_for_thread() {
+    if (this_thread_table)
+        return this_thread_table;
+
+    profile_table *table = calloc(1, sizeof(profile_table));
+    if (!table)
+        PANIC("Failed to allocate enough memory for profiling");
+
+    // Tables last as long as the program, so that the timings of threads that
+    // have finished still count.
+    pthread_mutex_lock(&tables_lock);
+    table->next = all_tables;
+    all_tables = table;
+    pthread_mutex_unlock(&tables_lock);
+
+    this_thread_table = table;
+    return table;
+}
+
+profile_entry *profile_entry_for(profile_table *table, const char *command_name) {
+    for (int i = 0; i < table->count; i++) {
+        if (strncmp(table->entries[i]->name, command_name, PROFILE_NAME_LENGTH) == 0)
+            return table->entries[i];
+    }
+
+    if (table->count == PROFILE_MAX_COMMANDS)
+        return 0;
+
+    profile_entry *entry = calloc(1, sizeof(profile_entry));
+    if (!entry)
+        PANIC("Failed to allocate enough memory for profiling");
+
+    strncpy(entry->name, command_name, PROFILE_NAME_LENGTH);
+    table->entries[table->count++] = entry;
+    return entry;
+}
+
+int compare_profile_entries(const void *a, const void *b) {
+    uint64_t a_sum = (*(profile_entry *const *)a)->hist.sum;
+    uint64_t b_sum = (*(profile_entry *const *)b)->hist.sum;
+
+    return (a_sum < b_sum) - (a_sum > b_sum);
+}
@@ -0,0 +1,41 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+
+// profile.h: How long each of the shell's commands takes
+
+// While profiling is running, run_command() times every command and counts
+// the time in a histogram for that command's name. When it isn't, the only
+// cost is checking profile_running.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Nonzero while commands are being timed
+extern int profile_running;
+
+// Start timing commands, forgetting the timings from before
+void profile_start(void);
+// Stop timing commands, keeping the timings so far
+void profile_stop(void);
+// Count one run of a command which took the given number of nanoseconds
+//
+// Each thread counts into its own histograms, so threads can do this at the
+// same time as each other, but not at the same time as the other functions
+// here.
+void profile_record(const char *command_name, uint64_t nanoseconds);
+// Print a line for each command that's been timed, in order of the total time
+// spent on it, most first
+void profile_dump(FILE *out);
+
+#endif
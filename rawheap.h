@@ -20,19 +20,21 @@
 // If a cell is successfully allocated, then the newly allocated cell has a tag
 // of ATOM, a car of -1, and a reference count of 0. If no cells are available,
 // nothing happens and the function returns -1.
-int alloc_cell(heap_p heap);
+cell_index alloc_cell(heap_p heap);
 
 // Free the given cell
-void free_cell(heap_p heap, int index);
+void free_cell(heap_p heap, cell_index index);
 
 // Set the value of a field in a cell
-void setfield(heap_p heap, int field, int index, int value);
+void setfield(heap_p heap, int field, cell_index index, cell_index value);
 // Add 1 to the reference count of a cell
-void inc_refcount(heap_p heap, int index);
+void inc_refcount(heap_p heap, cell_index index);
 // Subtract 1 from the reference count of a cell
-void dec_refcount(heap_p heap, int index);
+void dec_refcount(heap_p heap, cell_index index);
 
 // Make a cell into an atom and set its text
-void setatom(heap_p heap, int index, const char *text);
+void setatom(heap_p heap, cell_index index, const char *text);
+// Check whether setatom() has room for the given text
+int atom_text_fits(heap_p heap, const char *text);
 
 #endif
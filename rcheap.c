@@ -12,72 +12,96 @@
 
 #include <string.h>
 
+#include "hashcons.h"
 #include "heap.h"
+#include "heapimpl.h"
+#include "map.h"
 #include "panic.h"
+#include "persist.h"
+#include "probe.h"
 #include "rawheap.h"
 #include "rcheap.h"
 
-int rc_getfield(heap_p heap, int field, int index) {
+cell_index rc_getfield(heap_p heap, int field, cell_index index) {
     return getfield(heap, field, index);
 }
 
-int rc_is_valid(heap_p heap, int index) {
-    if (index < 0 || index >= cell_count(heap))
+int rc_is_valid(heap_p heap, cell_index index) {
+    if (index < 0 || index >= cell_limit(heap))
         return 0;
 
     int tag = getfield(heap, FIELD_TAG, index);
-    return tag == TAG_ATOM || tag == TAG_CONS;
+    return tag == TAG_ATOM || tag == TAG_CONS || tag == TAG_MAP || tag == TAG_PVEC || tag == TAG_PMAP
+        || tag == TAG_WEAK;
 }
 
-int rc_is_unowned(heap_p heap, int index) {
-    int refcount = getfield(heap, FIELD_REFCOUNT, index);
+int rc_is_unowned(heap_p heap, cell_index index) {
+    cell_index refcount = getfield(heap, FIELD_REFCOUNT, index);
 
     if (refcount < 0)
-        PANIC("The cell at index %d has reference count %d, which is negative", index, refcount);
+        PANIC("The cell at index %" PRI_INDEX " has reference count %" PRI_INDEX ", which is negative",
+            index, refcount);
 
     return refcount == 0;
 }
 
-void rc_erase(heap_p heap, int index) {
+void rc_erase(heap_p heap, cell_index index) {
     if (!rc_is_unowned(heap, index))
-        PANIC("Tried to erase the cell at index %d which has references to it", index);
+        PANIC("Tried to erase the cell at index %" PRI_INDEX " which has references to it", index);
 
-    if (getfield(heap, FIELD_TAG, index) == TAG_CONS) {
-        int car = getfield(heap, FIELD_CAR, index);
+    if (heap->hashcons)
+        hashcons_remove(heap, index);
+
+    // Whatever the cell becomes next, it won't be the same value.
+    weak_forget(heap, index);
+
+    int tag = getfield(heap, FIELD_TAG, index);
+    PROBE2(rc_erase, index, tag);
+
+    if (tag == TAG_CONS) {
+        cell_index car = getfield(heap, FIELD_CAR, index);
         dec_refcount(heap, car);
-        int cdr = getfield(heap, FIELD_CDR, index);
+        cell_index cdr = getfield(heap, FIELD_CDR, index);
         dec_refcount(heap, cdr);
+    } else if (tag == TAG_MAP) {
+        map_erase(heap, index);
+    } else if (tag == TAG_PVEC || tag == TAG_PMAP) {
+        persist_erase(heap, index);
     }
 
     setfield(heap, FIELD_TAG, index, TAG_ATOM);
     setfield(heap, FIELD_CAR, index, 0);
 }
 
-void rc_free(heap_p heap, int index) {
+void rc_free(heap_p heap, cell_index index) {
     rc_erase(heap, index);
     free_cell(heap, index);
 }
 
-void rc_setatom(heap_p heap, int index, const char *text) {
+void rc_setatom(heap_p heap, cell_index index, const char *text) {
     rc_erase(heap, index);
 
     setatom(heap, index, text);
 }
 
-void rc_setcons(heap_p heap, int index, int car, int cdr) {
+void rc_setcons(heap_p heap, cell_index index, cell_index car, cell_index cdr) {
     rc_erase(heap, index);
 
     if (index == car)
-        PANIC("Tried to create a cons cell at index %d whose car is a self-reference", index);
+        PANIC("Tried to create a cons cell at index %" PRI_INDEX " whose car is a self-reference",
+            index);
 
     if (index == cdr)
-        PANIC("Tried to create a cons cell at index %d whose cdr is a self-reference", index);
+        PANIC("Tried to create a cons cell at index %" PRI_INDEX " whose cdr is a self-reference",
+            index);
 
     if (!rc_is_valid(heap, car))
-        PANIC("Tried to create a reference to cell %d, which doesn't contain a value", car);
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value",
+            car);
 
     if (!rc_is_valid(heap, cdr))
-        PANIC("Tried to create a reference to cell %d, which doesn't contain a value", cdr);
+        PANIC("Tried to create a reference to cell %" PRI_INDEX ", which doesn't contain a value",
+            cdr);
 
     setfield(heap, FIELD_TAG, index, TAG_CONS);
     setfield(heap, FIELD_CAR, index, car);
@@ -87,20 +111,85 @@ void rc_setcons(heap_p heap, int index, int car, int cdr) {
     inc_refcount(heap, cdr);
 }
 
-int rc_atom(heap_p heap, const char *text) {
-    int index = alloc_cell(heap);
+cell_index rc_atom(heap_p heap, const char *text) {
+    if (heap->hashcons) {
+        char *text_location;
+
+        if (try_find_atom(heap, text, &text_location)) {
+            cell_index existing = hashcons_find_atom(heap, text_location - heap->atom_text_buf);
+            if (existing != -1) {
+                // Handing out a cell is like adding a reference to it.
+                gc_shade(heap, existing);
+                return existing;
+            }
+        }
+    }
+
+    if (!atom_text_fits(heap, text))
+        return -1;
+
+    cell_index index = alloc_cell(heap);
     
-    if (index != -1)
+    if (index != -1) {
         rc_setatom(heap, index, text);
 
+        if (heap->hashcons)
+            hashcons_insert(heap, index);
+    }
+
     return index;
 }
 
-int rc_cons(heap_p heap, int car, int cdr) {
-    int index = alloc_cell(heap);
+cell_index rc_cons(heap_p heap, cell_index car, cell_index cdr) {
+    if (heap->hashcons) {
+        cell_index existing = hashcons_find_cons(heap, car, cdr);
+        if (existing != -1) {
+            gc_shade(heap, existing);
+            return existing;
+        }
+    }
+
+    cell_index index = alloc_young_cell(heap);
 
-    if (index != -1)
+    if (index != -1) {
         rc_setcons(heap, index, car, cdr);
 
+        if (heap->hashcons)
+            hashcons_insert(heap, index);
+    }
+
     return index;
 }
+
+void rc_set_hashcons(heap_p heap, int enabled) {
+    if (!enabled) {
+        if (heap->hashcons) {
+            hashcons_free(heap->hashcons);
+            heap->hashcons = 0;
+        }
+
+        return;
+    }
+
+    if (heap->hashcons)
+        return;
+
+    check_private(heap, "Hash-consing");
+    heap->hashcons = hashcons_create();
+
+    for (cell_index index = 0; index < heap->next_uninit; index++) {
+        int tag = heap->cells[index].tag;
+        if (tag != TAG_ATOM && tag != TAG_CONS)
+            continue;
+
+        // Only list the first of several cells with the same contents.
+        cell_index existing;
+        if (tag == TAG_ATOM)
+            existing = hashcons_find_atom(heap, heap->cells[index].car);
+        else
+            existing = hashcons_find_cons(heap, heap->cells[index].car, heap->cells[index].cdr);
+
+        if (existing == -1)
+            hashcons_insert(heap, index);
+    }
+}
@@ -22,26 +22,40 @@
 #ifndef RCHEAP_H
 #define RCHEAP_H
 
-typedef struct heap *heap_p;
+#include "heap.h"
 
 // Get the value of a field in a cell
-int rc_getfield(heap_p heap, int field, int index);
+cell_index rc_getfield(heap_p heap, int field, cell_index index);
 // Check if a cell contains a value
-int rc_is_valid(heap_p heap, int index);
+int rc_is_valid(heap_p heap, cell_index index);
 // Check if a cell has zero incoming references
-int rc_is_unowned(heap_p heap, int index);
+int rc_is_unowned(heap_p heap, cell_index index);
 
 // Erase a cell, but leave it allocated
-void rc_erase(heap_p heap, int index);
+void rc_erase(heap_p heap, cell_index index);
 // Erase and free a cell
-void rc_free(heap_p heap, int index);
+void rc_free(heap_p heap, cell_index index);
 // Make a cell into an atom and set its text
-void rc_setatom(heap_p heap, int index, const char *text);
+void rc_setatom(heap_p heap, cell_index index, const char *text);
 // Make a cell into a cons cell with the given car and cdr
-void rc_setcons(heap_p heap, int index, int car, int cdr);
-// Allocate a cell as an atom, returning -1 on insufficient space
-int rc_atom(heap_p heap, const char *text);
+void rc_setcons(heap_p heap, cell_index index, cell_index car, cell_index cdr);
+// Allocate a cell as an atom, returning -1 if there are no free cells or no
+// room for its text
+cell_index rc_atom(heap_p heap, const char *text);
 // Allocate a cell as a cons cell, returning -1 on insufficient space
-int rc_cons(heap_p heap, int car, int cdr);
+cell_index rc_cons(heap_p heap, cell_index car, cell_index cdr);
+
+// Turn hash-consing on or off
+//
+// While hash-consing is on, rc_atom() and rc_cons() return an existing cell
+// with the same contents instead of allocating a new one, if there is such a
+// cell. So two lists built with rc_cons() are structurally equal exactly when
+// they have the same index. Turning hash-consing on lists the cells that are
+// already in the heap.
+//
+// Since hash-consed cells are shared, a cell returned by rc_atom() or rc_cons()
+// may still be in use by someone else; don't free or modify it unless you know
+// it isn't. A cell stops being shared as soon as it's erased.
+void rc_set_hashcons(heap_p heap, int enabled);
 
 #endif
@@ -0,0 +1,190 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// region.h: Scopes for temporary values which are freed all at once
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "hashcons.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "panic.h"
+#include "region.h"
+
+// The tags of cells whose car is a blob number
+#define BLOB_TAGS ((1 << TAG_MAP) | (1 << TAG_PVEC) | (1 << TAG_PMAP) | (1 << TAG_NODE))
+
+// The cells of the region being ended, and what's known about them
+typedef struct region_cells {
+    heap_p heap;
+    cell_index start;
+    cell_index end;
+    // For each cell, the number of references to it from the region
+    cell_index *inside_refs;
+} region_cells;
+
+// Check whether anything outside a region refers to a cell in it
+int region_escaped(region_cells *region);
+// Count a reference from a cell in a region, if it's to another one
+void count_inside_reference(void *region, cell_index reference);
+// Drop a reference from a cell in a region, if it's to a cell outside
+void release_outside_reference(void *region, cell_index reference);
+// Check whether the incremental collector has already dropped the references
+// a cell holds, since it's garbage
+int gc_released(heap_p heap, cell_index index);
+
+
+
+// Beginning and ending:
+
+int heap_region_begin(heap_p heap) {
+    region_stack *regions = &heap->regions;
+
+    if (regions->count == regions->capacity) {
+        regions->capacity = regions->capacity ? regions->capacity * 2 : 8;
+        regions->starts = realloc(regions->starts, regions->capacity * sizeof(cell_index));
+        if (!regions->starts)
+            PANIC("Failed to allocate enough memory for a region");
+    }
+
+    regions->starts[regions->count++] = heap->next_uninit;
+    return regions->count;
+}
+
+long heap_region_end(heap_p heap, int region) {
+    region_stack *regions = &heap->regions;
+
+    if (region <= 0 || (size_t)region != regions->count)
+        PANIC("Tried to end region %d, which isn't the innermost one", region);
+
+    cell_index start = regions->starts[region - 1];
+
+    // Cells that were in use when the transaction began would have to be
+    // logged one at a time.
+    if (heap->undo.active && start < heap->undo.next_uninit)
+        PANIC("Can't end a region inside a transaction that began after it");
+
+    region_cells cells = {heap, start, heap->next_uninit, NULL};
+
+    if (cells.end > cells.start) {
+        cells.inside_refs = calloc(cells.end - cells.start, sizeof(cell_index));
+        if (!cells.inside_refs)
+            PANIC("Failed to allocate enough memory to end a region");
+    }
+
+    regions->count--;
+
+    if (region_escaped(&cells)) {
+        // The cells stay. If there's no other region around them, the blank
+        // ones can be used again.
+        if (regions->count == 0)
+            free_blank_cells(heap, cells.start, cells.end);
+
+        free(cells.inside_refs);
+        return -1;
+    }
+
+    long freed = 0;
+
+    for (cell_index i = cells.start; i < cells.end; i++) {
+        unsigned tag = heap->cells[i].tag;
+        if (tag == TAG_UNINIT)
+            continue;
+
+        if (!gc_released(heap, i))
+            cell_references(heap, i, release_outside_reference, &cells);
+
+        if (heap->hashcons && (tag == TAG_ATOM || tag == TAG_CONS))
+            hashcons_remove(heap, i);
+
+        if (tag < 32 && (BLOB_TAGS & (1 << tag)))
+            blob_free(heap, heap->cells[i].car);
+
+        weak_forget(heap, i);
+        freed++;
+    }
+
+    // None of the cells were in use when a running transaction began, so
+    // aborting it clears them anyway.
+    size_t offset = (size_t)cells.start * sizeof(cons_cell);
+    size_t length = (size_t)(cells.end - cells.start) * sizeof(cons_cell);
+    cow_region_touch(&heap->cell_region, offset, length);
+    memset(&heap->cells[cells.start], 0, length);
+    heap->next_uninit = cells.start;
+
+    free(cells.inside_refs);
+    return freed;
+}
+
+int heap_region_depth(heap_p heap) {
+    return heap->regions.count;
+}
+
+void regions_fork(heap_p fork) {
+    region_stack *regions = &fork->regions;
+
+    if (regions->capacity == 0)
+        return;
+
+    cell_index *starts = malloc(regions->capacity * sizeof(cell_index));
+    if (!starts)
+        PANIC("Failed to allocate enough memory for the heap");
+
+    memcpy(starts, regions->starts, regions->count * sizeof(cell_index));
+    regions->starts = starts;
+}
+
+void regions_free(heap_p heap) {
+    free(heap->regions.starts);
+}
+
+
+
+// Escape detection:
+
+int region_escaped(region_cells *region) {
+    heap_p heap = region->heap;
+
+    for (cell_index i = region->start; i < region->end; i++)
+        cell_references(heap, i, count_inside_reference, region);
+
+    for (cell_index i = region->start; i < region->end; i++) {
+        if (heap->cells[i].ref_count > region->inside_refs[i - region->start])
+            return 1;
+    }
+
+    return 0;
+}
+
+void count_inside_reference(void *arg, cell_index reference) {
+    region_cells *region = arg;
+
+    if (reference >= region->start && reference < region->end)
+        region->inside_refs[reference - region->start]++;
+}
+
+void release_outside_reference(void *arg, cell_index reference) {
+    region_cells *region = arg;
+
+    if (reference < 0 || reference >= region->heap->cell_count)
+        return;
+
+    if (reference < region->start || reference >= region->end)
+        dec_refcount(region->heap, reference);
+}
+
+int gc_released(heap_p heap, cell_index index) {
+    if (!gc_found_garbage(heap, index))
+        return 0;
+
+    return heap->gc.phase == GC_SWEEPING || index < heap->gc.cursor;
+}
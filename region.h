@@ -0,0 +1,52 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// region.h: Scopes for temporary values which are freed all at once
+
+// A region is for scratch values, such as the ones made while handling a
+// single request. Between heap_region_begin() and heap_region_end(), every cell
+// allocated comes from the uninitialized cells at the end of the heap, instead
+// of from the free list or the nursery, so the region's cells are all together.
+// Ending the region frees all of them at once, without putting any of them on
+// the free list: they go back to being uninitialized.
+//
+// That's only safe if none of the region's values escaped, that is, if nothing
+// outside the region refers to anything inside it. Since every reference is
+// counted, a cell in the region has a reference from outside exactly when its
+// count is more than the number of references to it from the region's own
+// cells. If anything escaped, the region ends without freeing anything, and its
+// cells become ordinary cells.
+//
+// Ending a region takes time proportional to the number of cells in it, since
+// the references it holds to cells outside have to be dropped. A cell freed
+// inside a region isn't reused until the region ends.
+//
+// Regions nest; they have to end in the opposite order to the one they began
+// in. A region which begins inside a transaction can end inside it or after
+// it, and disappears if the transaction is aborted. A region which begins
+// outside a transaction can't end inside one.
+
+#ifndef REGION_H
+#define REGION_H
+
+#include "heap.h"
+
+// Begin a region; return a number to give heap_region_end()
+int heap_region_begin(heap_p heap);
+// End the innermost region; return the number of cells freed, or -1 if
+// something in the region escaped and nothing was freed
+//
+// This function panics if the region isn't the innermost one, or if it began
+// outside the current transaction.
+long heap_region_end(heap_p heap, int region);
+// Get the number of regions which have begun and not ended
+int heap_region_depth(heap_p heap);
+
+#endif
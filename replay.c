@@ -0,0 +1,193 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// replay.c: A benchmark which replays a trace recorded by the shell
+
+// The whole trace is read into memory, then its requests are run one after
+// another on a new heap the size of the one it was recorded on, as fast as
+// possible and without the shell's text parsing. The replayer reports the
+// throughput and the distribution of latencies for each kind of request. With
+// --repeat, the trace is replayed several times, each on a new heap, and the
+// results are added together.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "histogram.h"
+#include "panic.h"
+#include "trace.h"
+#include "txn.h"
+#include "wire.h"
+
+// Replay a trace once, adding to the histograms; return 0 if it's malformed
+int replay(const char *data, size_t length);
+// Read a whole file into memory, returning NULL on failure
+char *read_file(const char *path, size_t *length);
+// Print a summary of the command-line options
+void usage(const char *program);
+
+
+
+// The latencies of each kind of request, indexed by opcode
+histogram latencies[256];
+histogram all_latencies;
+
+// How long the trace took when it was recorded, in nanoseconds
+uint64_t recorded_ns;
+// How many requests failed
+long failures;
+
+
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"repeat", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int repeat = 1;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "r:h", options, NULL)) != -1) {
+        switch (option) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || repeat <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    size_t length;
+    char *data = read_file(path, &length);
+
+    if (!data) {
+        perror(path);
+        return 1;
+    }
+
+    uint64_t start = monotonic_ns();
+
+    for (int i = 0; i < repeat; i++) {
+        if (!replay(data, length)) {
+            fprintf(stderr, "%s is not a valid trace\n", path);
+            return 1;
+        }
+    }
+
+    double seconds = (monotonic_ns() - start) / 1e9;
+
+    printf("%llu requests in %.3f s: %.0f requests/s, %ld failed; recorded over %.3f s\n",
+        (unsigned long long)all_latencies.count, seconds, all_latencies.count / seconds, failures,
+        recorded_ns / 1e9);
+    histogram_print(stdout, "all", &all_latencies);
+
+    for (int op = 0; op < 256; op++) {
+        if (latencies[op].count > 0)
+            histogram_print(stdout, trace_op_name(op), &latencies[op]);
+    }
+
+    free(data);
+}
+
+int replay(const char *data, size_t length) {
+    wire_reader reader = {(const unsigned char *)data, (const unsigned char *)data + length, 0};
+    wire_buffer response = {0};
+    cell_index cells;
+    size_t atom_text_size;
+
+    if (!trace_read_header(&reader, &cells, &atom_text_size))
+        return 0;
+
+    heap_p heap = malloc_heap(cells, atom_text_size);
+    recorded_ns = 0;
+
+    while (reader.pos < reader.end) {
+        recorded_ns += wire_get_uint(&reader);
+
+        // Every opcode in a valid trace has a name.
+        int op = reader.pos < reader.end ? *reader.pos : -1;
+        if (reader.failed || op < 0 || !trace_op_name(op)) {
+            free_heap(heap);
+            free(response.data);
+            return 0;
+        }
+
+        response.length = 0;
+
+        uint64_t before = monotonic_ns();
+        int ok = trace_run_request(&heap, atom_text_size, &reader, &response);
+        uint64_t elapsed = monotonic_ns() - before;
+
+        if (!ok) {
+            free_heap(heap);
+            free(response.data);
+            return 0;
+        }
+
+        histogram_record(&latencies[op], elapsed);
+        histogram_record(&all_latencies, elapsed);
+
+        if (response.data[0] != WIRE_OK)
+            failures++;
+    }
+
+    if (heap_in_transaction(heap))
+        heap_abort(heap);
+
+    free_heap(heap);
+    free(response.data);
+    return 1;
+}
+
+char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    wire_buffer buf = {0};
+    char chunk[65536];
+    size_t count;
+
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        wire_append(&buf, chunk, count);
+
+    if (ferror(file)) {
+        fclose(file);
+        free(buf.data);
+        return NULL;
+    }
+
+    fclose(file);
+
+    // An empty file still gets a buffer, so it's reported as an invalid trace.
+    if (!buf.data)
+        wire_append(&buf, "", 1);
+
+    *length = buf.length;
+    return buf.data;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--repeat N] TRACE\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Replay a trace recorded with poutine --trace, N times (once by default), and\n");
+    fprintf(stderr, "report the throughput and the latencies of each kind of request.\n");
+}
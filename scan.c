@@ -0,0 +1,786 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// scan.h: Bulk scans over every cell of a heap
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gc.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "panic.h"
+#include "scan.h"
+
+// The AVX2 scans gather 32-bit fields, so they need 32-bit cell indexes.
+#if (defined(__x86_64__) || defined(__i386__)) && POUTINE_INDEX_BITS != 64
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// Cells are looked at in blocks of this many, one bit per cell.
+#define BLOCK 32
+
+// A heap is only split between threads if each one gets at least this many
+// cells.
+#define CELLS_PER_THREAD (1 << 20)
+
+// The AVX2 scans gather fields by their offset in ints from the start of the
+// cells array, so they only work on heaps smaller than this.
+#define MAX_GATHER_CELLS (1 << 29)
+
+// Sets of tags, as bitmaps: the tags of values, and the tags of cells which
+// can have references to them
+#define VALUE_TAGS ((1 << TAG_ATOM) | (1 << TAG_CONS) | (1 << TAG_MAP) | (1 << TAG_PVEC) | (1 << TAG_PMAP) \
+    | (1 << TAG_WEAK))
+#define COUNTED_TAGS (VALUE_TAGS | (1 << TAG_NODE))
+// The tags of cells whose car is a blob number
+#define BLOB_TAGS ((1 << TAG_MAP) | (1 << TAG_PVEC) | (1 << TAG_PMAP) | (1 << TAG_NODE))
+
+// How many problems of each kind heap_verify() describes
+#define REPORT_LIMIT 100
+
+// The kinds of cell a scan can look for
+#define MATCH_TAG 0
+#define MATCH_UNOWNED 1
+#define MATCH_BAD_CONS 2
+#define MATCH_BAD_CELL 3
+#define MATCH_BAD_ATOM 4
+#define MATCH_BAD_BLOB 5
+#define MATCH_BAD_REFCOUNT 6
+// Any of MATCH_BAD_CELL, MATCH_BAD_CONS, MATCH_BAD_ATOM and MATCH_BAD_BLOB
+#define MATCH_SUSPECT 7
+
+typedef struct scan_query {
+    int kind;
+    // For MATCH_TAG, the tag to look for
+    int tag;
+    // For MATCH_BAD_REFCOUNT, the number of references found to each cell
+    const cell_index *expected;
+} scan_query;
+
+// One thread's share of a scan
+typedef struct scan_part {
+    heap_p heap;
+    // The cells to look at
+    cell_index start;
+    cell_index end;
+
+    const scan_query *query;
+    // Where to put the indexes of matching cells, or NULL to just count them;
+    // the part's first match goes in results[first_result]
+    cell_index *results;
+    size_t first_result;
+    size_t max_results;
+    // The number of matching cells
+    size_t found;
+
+    // The number of cells with each tag
+    size_t tag_counts[SCAN_TAG_COUNT];
+
+    // For counting references, the count for each cell, and whether other
+    // threads are adding to the same counts
+    cell_index *expected;
+    int shared;
+    // The number of freed cells
+    size_t freed;
+} scan_part;
+
+// Split a heap into parts for scanning, and return the number of parts
+int split_heap(heap_p heap, scan_part **parts);
+// Run a function on each part of a scan, in separate threads if there's more
+// than one part
+void run_parts(scan_part *parts, int count, void *(*work)(void *));
+
+// Find the cells matching a query
+size_t scan_matching(heap_p heap, const scan_query *query, cell_index *results, size_t max_results);
+// Find the cells matching a query in one part of the heap
+void *match_part(void *part);
+// Count the cells with each tag in one part of the heap
+void *count_tags_part(void *part);
+// Look for suspicious cells in one part of the heap, counting references and
+// freed cells along the way
+void *verify_part(void *part);
+// Count one reference found by verify_part()
+void count_reference(void *part, cell_index reference);
+
+// Check a block of cells against a query, setting a bit for each match
+uint32_t match_block(heap_p heap, const scan_query *query, cell_index first, int count);
+// Check one cell against a query
+int query_matches(heap_p heap, const scan_query *query, cell_index index);
+// Check whether a cell is a value; unlike rc_is_valid(), this never panics
+int is_value(heap_p heap, cell_index index);
+// Check whether a cell's car is the number of a blob that exists
+int has_blob(heap_p heap, cell_index index);
+
+#ifdef SCAN_X86
+uint32_t match_block_avx2(heap_p heap, const scan_query *query, cell_index first);
+#endif
+
+
+// Run a check and describe the problems it finds; return the number found
+size_t report_problems(heap_p heap, FILE *out, const scan_query *query, const char *problem);
+// Check that the free list holds the given number of freed cells; return the
+// number of problems found
+size_t verify_free_list(heap_p heap, FILE *out, size_t freed);
+// Check that each weak reference is listed under its target in the weak
+// reference table, and nothing else is; return the number of problems found
+size_t verify_weak_refs(heap_p heap, FILE *out);
+
+static int thread_setting = 0;
+static int avx2_enabled = -1;
+
+
+
+// Scans:
+
+void scan_tag_counts(heap_p heap, size_t counts[SCAN_TAG_COUNT]) {
+    scan_part *parts;
+    int part_count = split_heap(heap, &parts);
+
+    run_parts(parts, part_count, count_tags_part);
+
+    for (int tag = 0; tag < SCAN_TAG_COUNT; tag++) {
+        counts[tag] = 0;
+        for (int i = 0; i < part_count; i++)
+            counts[tag] += parts[i].tag_counts[tag];
+    }
+
+    free(parts);
+}
+
+size_t scan_count_tag(heap_p heap, int tag) {
+    scan_query query = { MATCH_TAG, tag, 0 };
+    return scan_matching(heap, &query, 0, 0);
+}
+
+size_t scan_filter_tag(heap_p heap, int tag, cell_index *results, size_t max_results) {
+    scan_query query = { MATCH_TAG, tag, 0 };
+    return scan_matching(heap, &query, results, max_results);
+}
+
+size_t scan_unowned(heap_p heap, cell_index *results, size_t max_results) {
+    scan_query query = { MATCH_UNOWNED, 0, 0 };
+    return scan_matching(heap, &query, results, max_results);
+}
+
+size_t scan_bad_conses(heap_p heap, cell_index *results, size_t max_results) {
+    scan_query query = { MATCH_BAD_CONS, 0, 0 };
+    return scan_matching(heap, &query, results, max_results);
+}
+
+size_t heap_verify(heap_p heap, FILE *out) {
+    size_t problems = 0;
+
+    cell_index *expected = calloc(heap->cell_count, sizeof(cell_index));
+    if (!expected)
+        PANIC("Failed to allocate enough memory to verify the heap");
+
+    // One pass looks for anything wrong with individual cells while counting
+    // references. It's only worth working out exactly what's wrong if it finds
+    // something.
+    scan_query suspect = { MATCH_SUSPECT, 0, 0 };
+    scan_part *parts;
+    int part_count = split_heap(heap, &parts);
+    size_t suspects = 0, freed = 0;
+
+    for (int i = 0; i < part_count; i++) {
+        parts[i].query = &suspect;
+        parts[i].expected = expected;
+        parts[i].shared = part_count > 1;
+    }
+
+    run_parts(parts, part_count, verify_part);
+
+    for (int i = 0; i < part_count; i++) {
+        suspects += parts[i].found;
+        freed += parts[i].freed;
+    }
+
+    free(parts);
+
+    if (suspects > 0) {
+        scan_query bad_cells = { MATCH_BAD_CELL, 0, 0 };
+        problems += report_problems(heap, out, &bad_cells, "is malformed");
+
+        scan_query bad_conses = { MATCH_BAD_CONS, 0, 0 };
+        problems += report_problems(heap, out, &bad_conses, "is a cons whose car or cdr isn't a value");
+
+        scan_query bad_atoms = { MATCH_BAD_ATOM, 0, 0 };
+        problems += report_problems(heap, out, &bad_atoms, "is an atom whose text isn't in the atom buffer");
+
+        scan_query bad_blobs = { MATCH_BAD_BLOB, 0, 0 };
+        problems += report_problems(heap, out, &bad_blobs, "doesn't have any storage");
+    }
+
+    problems += verify_free_list(heap, out, freed);
+    problems += verify_weak_refs(heap, out);
+
+    scan_query bad_refcounts = { MATCH_BAD_REFCOUNT, 0, expected };
+    problems += report_problems(heap, out, &bad_refcounts, "has the wrong reference count");
+
+    free(expected);
+    return problems;
+}
+
+void scan_set_threads(int threads) {
+    thread_setting = threads;
+}
+
+int scan_use_avx2(int enabled) {
+#ifdef SCAN_X86
+    if (enabled && !__builtin_cpu_supports("avx2"))
+        return 0;
+
+    avx2_enabled = enabled;
+    return 1;
+#else
+    avx2_enabled = 0;
+    return !enabled;
+#endif
+}
+
+
+
+// Running scans:
+
+int split_heap(heap_p heap, scan_part **parts) {
+    int threads = thread_setting;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int part_count = heap->cell_count / CELLS_PER_THREAD;
+    if (part_count > threads)
+        part_count = threads;
+    if (part_count < 1)
+        part_count = 1;
+
+    *parts = calloc(part_count, sizeof(scan_part));
+    if (!*parts)
+        PANIC("Failed to allocate enough memory for a scan");
+
+    // Every part but the last is a whole number of blocks.
+    size_t blocks = (heap->cell_count + BLOCK - 1) / BLOCK;
+
+    for (int i = 0; i < part_count; i++) {
+        (*parts)[i].heap = heap;
+        (*parts)[i].start = blocks * i / part_count * BLOCK;
+        (*parts)[i].end = i == part_count - 1 ? heap->cell_count : blocks * (i + 1) / part_count * BLOCK;
+    }
+
+    return part_count;
+}
+
+void run_parts(scan_part *parts, int count, void *(*work)(void *)) {
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    if (!threads)
+        PANIC("Failed to allocate enough memory for a scan");
+
+    // This thread does the first part itself.
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], 0, work, &parts[i]) != 0)
+            PANIC("Failed to start a scanning thread");
+    }
+
+    work(&parts[0]);
+
+    for (int i = 1; i < count; i++)
+        pthread_join(threads[i], 0);
+
+    free(threads);
+}
+
+size_t scan_matching(heap_p heap, const scan_query *query, cell_index *results, size_t max_results) {
+    scan_part *parts;
+    int part_count = split_heap(heap, &parts);
+
+    for (int i = 0; i < part_count; i++)
+        parts[i].query = query;
+
+    // With one part, the results can be stored as they're found. Otherwise,
+    // each part needs to know how many the parts before it found first.
+    if (part_count == 1 && max_results > 0) {
+        parts[0].results = results;
+        parts[0].max_results = max_results;
+    }
+
+    run_parts(parts, part_count, match_part);
+
+    size_t found = 0;
+    for (int i = 0; i < part_count; i++) {
+        parts[i].first_result = found;
+        found += parts[i].found;
+    }
+
+    if (part_count > 1 && max_results > 0) {
+        int fill_count = 0;
+        while (fill_count < part_count && parts[fill_count].first_result < max_results) {
+            parts[fill_count].results = results;
+            parts[fill_count].max_results = max_results;
+            fill_count++;
+        }
+
+        run_parts(parts, fill_count, match_part);
+    }
+
+    free(parts);
+    return found;
+}
+
+void *match_part(void *arg) {
+    scan_part *part = arg;
+    size_t found = 0;
+
+    for (cell_index first = part->start; first < part->end; first += BLOCK) {
+        int count = part->end - first < BLOCK ? part->end - first : BLOCK;
+        uint32_t mask = match_block(part->heap, part->query, first, count);
+
+        if (!part->results) {
+            found += __builtin_popcount(mask);
+            continue;
+        }
+
+        while (mask) {
+            size_t slot = part->first_result + found;
+            if (slot < part->max_results)
+                part->results[slot] = first + __builtin_ctz(mask);
+
+            found++;
+            mask &= mask - 1;
+        }
+    }
+
+    part->found = found;
+    return 0;
+}
+
+void *count_tags_part(void *arg) {
+    scan_part *part = arg;
+    cons_cell *cells = part->heap->cells;
+
+    for (cell_index i = part->start; i < part->end; i++) {
+        unsigned tag = cells[i].tag;
+        if (tag < SCAN_TAG_COUNT)
+            part->tag_counts[tag]++;
+    }
+
+    return 0;
+}
+
+void *verify_part(void *arg) {
+    scan_part *part = arg;
+    heap_p heap = part->heap;
+
+    for (cell_index first = part->start; first < part->end; first += BLOCK) {
+        int count = part->end - first < BLOCK ? part->end - first : BLOCK;
+        part->found += __builtin_popcount(match_block(heap, part->query, first, count));
+
+        for (cell_index i = first; i < first + count; i++) {
+            cons_cell *cell = &heap->cells[i];
+
+            // Garbage that an incremental cycle has already let go of doesn't
+            // hold any references any more.
+            if (gc_found_garbage(heap, i) && !(heap->gc.phase == GC_RELEASING && i >= heap->gc.cursor))
+                continue;
+
+            if (cell->tag == TAG_CONS) {
+                count_reference(part, cell->car);
+                count_reference(part, cell->cdr);
+            } else if (cell->tag == TAG_FREED) {
+                part->freed++;
+            } else if ((unsigned)cell->tag < 32 && (BLOB_TAGS & (1 << cell->tag)) && has_blob(heap, i)) {
+                cell_references(heap, i, count_reference, part);
+            }
+        }
+    }
+
+    return 0;
+}
+
+void count_reference(void *arg, cell_index reference) {
+    scan_part *part = arg;
+
+    // References out of range are reported as bad conses or bad blobs.
+    if (reference < 0 || reference >= part->heap->cell_count)
+        return;
+
+    if (part->shared)
+        __atomic_fetch_add(&part->expected[reference], 1, __ATOMIC_RELAXED);
+    else
+        part->expected[reference]++;
+}
+
+
+
+// Checking cells:
+
+uint32_t match_block(heap_p heap, const scan_query *query, cell_index first, int count) {
+    uint32_t mask = 0;
+
+#ifdef SCAN_X86
+    if (avx2_enabled == -1)
+        scan_use_avx2(1);
+
+    if (avx2_enabled && count == BLOCK && heap->cell_count < MAX_GATHER_CELLS)
+        mask = match_block_avx2(heap, query, first);
+    else
+#endif
+    for (int i = 0; i < count; i++) {
+        if (query_matches(heap, query, first + i))
+            mask |= (uint32_t)1 << i;
+    }
+
+    // While an incremental cycle is freeing garbage, the garbage is as good as
+    // gone, and may already refer to freed cells.
+    if (mask && query->kind != MATCH_TAG && gc_freeing(heap)) {
+        for (uint32_t bits = mask; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            if (gc_found_garbage(heap, first + i))
+                mask &= ~((uint32_t)1 << i);
+        }
+    }
+
+    return mask;
+}
+
+int query_matches(heap_p heap, const scan_query *query, cell_index index) {
+    cons_cell *cell = &heap->cells[index];
+    unsigned tag = cell->tag;
+    int tag_bit = tag < 32 ? 1 << tag : 0;
+
+    switch (query->kind) {
+    case MATCH_TAG:
+        return cell->tag == query->tag;
+
+    case MATCH_UNOWNED:
+        return (tag_bit & VALUE_TAGS) && cell->ref_count == 0;
+
+    case MATCH_BAD_CONS:
+        return tag == TAG_CONS && (!is_value(heap, cell->car) || !is_value(heap, cell->cdr));
+
+    case MATCH_BAD_CELL:
+        // Free cells in the nursery and in regions are blank, like the ones
+        // past the initialized cells.
+        if (index >= heap->next_uninit
+            || (tag == TAG_UNINIT && (in_nursery(heap, index) || in_region(heap, index))))
+            return cell->car != 0 || cell->cdr != 0 || cell->tag != 0 || cell->ref_count != 0;
+
+        return tag == TAG_UNINIT || tag > TAG_WEAK || cell->ref_count < 0;
+
+    case MATCH_BAD_ATOM: {
+        // alloc_cell() leaves an atom without any text.
+        if (tag != TAG_ATOM || cell->car == -1)
+            return 0;
+
+        const char *text = heap->atom_text_buf;
+        long used = heap->atom_text_next - heap->atom_text_buf;
+
+        return cell->car < 0 || cell->car >= used || text[cell->car] == 0
+            || (cell->car > 0 && text[cell->car - 1] != 0);
+    }
+
+    case MATCH_BAD_BLOB:
+        return (tag_bit & BLOB_TAGS) && !has_blob(heap, index);
+
+    case MATCH_BAD_REFCOUNT:
+        return (tag_bit & COUNTED_TAGS) && cell->ref_count != query->expected[index];
+
+    case MATCH_SUSPECT:
+        for (int kind = MATCH_BAD_CONS; kind <= MATCH_BAD_BLOB; kind++) {
+            scan_query part = { kind, 0, 0 };
+            if (query_matches(heap, &part, index))
+                return 1;
+        }
+        return 0;
+
+    default:
+        PANIC("Unknown scan: %d", query->kind);
+    }
+}
+
+int is_value(heap_p heap, cell_index index) {
+    if (index < 0 || index >= heap->cell_count)
+        return 0;
+
+    unsigned tag = heap->cells[index].tag;
+    return tag < 32 && (VALUE_TAGS & (1 << tag));
+}
+
+int has_blob(heap_p heap, cell_index index) {
+    cell_index number = heap->cells[index].car;
+    return number >= 0 && number < heap->blob_count && heap->blobs[number];
+}
+
+#ifdef SCAN_X86
+
+// Each step gathers the fields of eight cells, one field at a time. Checking
+// which tags are in a set shifts the set's bitmap right by each tag; tags of 32
+// or more shift everything out, and so do negative ones, which look huge to
+// the shift.
+
+// Get all ones in the lanes whose tag is in the given set
+__attribute__((target("avx2")))
+static inline __m256i tags_in(__m256i tags, int set) {
+    __m256i ones = _mm256_set1_epi32(1);
+    __m256i bits = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(set), tags), ones);
+    return _mm256_cmpeq_epi32(bits, ones);
+}
+
+// Get all ones in the lanes whose car or cdr isn't a value
+__attribute__((target("avx2")))
+static inline __m256i bad_conses(heap_p heap, __m256i cars, __m256i cdrs, __m256i tags) {
+    const int *fields = (const int *)heap->cells;
+    __m256i zeros = _mm256_setzero_si256();
+    __m256i cell_count = _mm256_set1_epi32(heap->cell_count);
+    __m256i is_cons = _mm256_cmpeq_epi32(tags, _mm256_set1_epi32(TAG_CONS));
+    __m256i bad = zeros;
+
+    for (int field = 0; field < 2; field++) {
+        __m256i targets = field == 0 ? cars : cdrs;
+        __m256i in_range = _mm256_andnot_si256(_mm256_cmpgt_epi32(zeros, targets),
+            _mm256_cmpgt_epi32(cell_count, targets));
+
+        // Only look up the tags of targets that are in the heap.
+        __m256i target_tags = _mm256_mask_i32gather_epi32(_mm256_set1_epi32(-1),
+            fields + 2, _mm256_slli_epi32(targets, 2), _mm256_and_si256(is_cons, in_range), 4);
+        __m256i valid = _mm256_and_si256(in_range, tags_in(target_tags, VALUE_TAGS));
+
+        bad = _mm256_or_si256(bad, _mm256_andnot_si256(valid, is_cons));
+    }
+
+    return bad;
+}
+
+// Get all ones in the lanes of malformed cells
+__attribute__((target("avx2")))
+static inline __m256i bad_cells(heap_p heap, __m256i indexes,
+    __m256i cars, __m256i cdrs, __m256i tags, __m256i refs) {
+
+    __m256i zeros = _mm256_setzero_si256();
+    __m256i initialized = _mm256_cmpgt_epi32(_mm256_set1_epi32(heap->next_uninit), indexes);
+    __m256i nursery = _mm256_andnot_si256(
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(heap->nursery.start), indexes),
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(heap->nursery.end), indexes));
+    cell_index region_start = heap->regions.count > 0 ? heap->regions.starts[0] : heap->next_uninit;
+    __m256i region = _mm256_andnot_si256(
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(region_start), indexes), _mm256_set1_epi32(-1));
+    __m256i may_be_blank = _mm256_or_si256(nursery, region);
+    initialized = _mm256_andnot_si256(_mm256_and_si256(may_be_blank, _mm256_cmpeq_epi32(tags, zeros)), initialized);
+    __m256i blank = _mm256_cmpeq_epi32(
+        _mm256_or_si256(_mm256_or_si256(cars, cdrs), _mm256_or_si256(tags, refs)), zeros);
+    __m256i known = tags_in(tags, ~(1 << TAG_UNINIT) & ((1 << (TAG_WEAK + 1)) - 1));
+    __m256i bad_ref = _mm256_cmpgt_epi32(zeros, refs);
+
+    __m256i bad_initialized = _mm256_andnot_si256(_mm256_andnot_si256(bad_ref, known), initialized);
+    __m256i bad_uninit = _mm256_andnot_si256(_mm256_or_si256(initialized, blank), _mm256_set1_epi32(-1));
+
+    return _mm256_or_si256(bad_initialized, bad_uninit);
+}
+
+__attribute__((target("avx2")))
+uint32_t match_block_avx2(heap_p heap, const scan_query *query, cell_index first) {
+    const int *fields = (const int *)heap->cells;
+    __m256i zeros = _mm256_setzero_si256();
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    uint32_t mask = 0;
+
+    // Atoms and blobs are checked one cell at a time, but only the cells which
+    // have them need to be.
+    int scalar_tags = 0;
+    uint32_t scalar = 0;
+
+    if (query->kind == MATCH_BAD_ATOM)
+        scalar_tags = 1 << TAG_ATOM;
+    else if (query->kind == MATCH_BAD_BLOB)
+        scalar_tags = BLOB_TAGS;
+    else if (query->kind == MATCH_SUSPECT)
+        scalar_tags = (1 << TAG_ATOM) | BLOB_TAGS;
+
+    for (int step = 0; step < BLOCK; step += 8) {
+        int base = first + step;
+        __m256i indexes = _mm256_add_epi32(_mm256_set1_epi32(base), lanes);
+        __m256i offsets = _mm256_slli_epi32(indexes, 2);
+        __m256i tags = _mm256_i32gather_epi32(fields + 2, offsets, 4);
+        __m256i matches = zeros;
+
+        switch (query->kind) {
+        case MATCH_TAG:
+            matches = _mm256_cmpeq_epi32(tags, _mm256_set1_epi32(query->tag));
+            break;
+
+        case MATCH_UNOWNED: {
+            __m256i refs = _mm256_i32gather_epi32(fields + 3, offsets, 4);
+            matches = _mm256_and_si256(tags_in(tags, VALUE_TAGS), _mm256_cmpeq_epi32(refs, zeros));
+            break;
+        }
+
+        case MATCH_BAD_CONS: {
+            __m256i cars = _mm256_i32gather_epi32(fields, offsets, 4);
+            __m256i cdrs = _mm256_i32gather_epi32(fields + 1, offsets, 4);
+            matches = bad_conses(heap, cars, cdrs, tags);
+            break;
+        }
+
+        case MATCH_BAD_CELL:
+        case MATCH_SUSPECT: {
+            __m256i cars = _mm256_i32gather_epi32(fields, offsets, 4);
+            __m256i cdrs = _mm256_i32gather_epi32(fields + 1, offsets, 4);
+            __m256i refs = _mm256_i32gather_epi32(fields + 3, offsets, 4);
+            matches = bad_cells(heap, indexes, cars, cdrs, tags, refs);
+
+            if (query->kind == MATCH_SUSPECT)
+                matches = _mm256_or_si256(matches, bad_conses(heap, cars, cdrs, tags));
+            break;
+        }
+
+        case MATCH_BAD_REFCOUNT: {
+            __m256i refs = _mm256_i32gather_epi32(fields + 3, offsets, 4);
+            __m256i expected = _mm256_loadu_si256((const __m256i *)(query->expected + base));
+            matches = _mm256_andnot_si256(_mm256_cmpeq_epi32(refs, expected), tags_in(tags, COUNTED_TAGS));
+            break;
+        }
+        }
+
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(matches)) << step;
+
+        if (scalar_tags)
+            scalar |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(tags_in(tags, scalar_tags))) << step;
+    }
+
+    scalar &= ~mask;
+
+    while (scalar) {
+        int lane = __builtin_ctz(scalar);
+        if (query_matches(heap, query, first + lane))
+            mask |= (uint32_t)1 << lane;
+        scalar &= scalar - 1;
+    }
+
+    return mask;
+}
+
+#endif
+
+
+
+// Reporting problems:
+
+size_t report_problems(heap_p heap, FILE *out, const scan_query *query, const char *problem) {
+    cell_index cells[REPORT_LIMIT];
+    size_t found = scan_matching(heap, query, cells, REPORT_LIMIT);
+
+    if (!out)
+        return found;
+
+    for (size_t i = 0; i < found && i < REPORT_LIMIT; i++) {
+        cons_cell *cell = &heap->cells[cells[i]];
+        fprintf(out, "Cell %" PRI_INDEX " %s (car %" PRI_INDEX ", cdr %" PRI_INDEX
+            ", tag %d, reference count %" PRI_INDEX, cells[i], problem, cell->car, cell->cdr, cell->tag, cell->ref_count);
+
+        if (query->kind == MATCH_BAD_REFCOUNT)
+            fprintf(out, ", %" PRI_INDEX " references found", query->expected[cells[i]]);
+
+        fprintf(out, ")\n");
+    }
+
+    if (found > REPORT_LIMIT)
+        fprintf(out, "...and %zu more cells which %s\n", found - REPORT_LIMIT, problem);
+
+    return found;
+}
+
+size_t verify_free_list(heap_p heap, FILE *out, size_t freed) {
+    size_t listed = 0;
+    cell_index index = heap->next_freed;
+
+    while (index != -1) {
+        if (index < 0 || index >= heap->cell_count) {
+            if (out)
+                fprintf(out, "The free list leads to cell %" PRI_INDEX ", which is out of range\n", index);
+            return 1;
+        }
+
+        if (heap->cells[index].tag != TAG_FREED) {
+            if (out)
+                fprintf(out, "The free list leads to cell %" PRI_INDEX ", which isn't freed\n", index);
+            return 1;
+        }
+
+        listed++;
+        if (listed > freed) {
+            if (out)
+                fprintf(out, "The free list has a cycle\n");
+            return 1;
+        }
+
+        index = heap->cells[index].car;
+    }
+
+    if (listed != freed) {
+        if (out)
+            fprintf(out, "%zu cells are freed, but only %zu are on the free list\n", freed, listed);
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t verify_weak_refs(heap_p heap, FILE *out) {
+    if (!heap->weak_heads)
+        return 0;
+
+    size_t problems = 0;
+    size_t uncleared = 0, listed = 0;
+
+    for (cell_index i = 0; i < heap->cell_count; i++) {
+        if (heap->cells[i].tag == TAG_WEAK && heap->cells[i].car != -1)
+            uncleared++;
+    }
+
+    for (cell_index target = 0; target < heap->cell_count; target++) {
+        cell_index weak = heap->weak_heads[target] - 1;
+
+        while (weak != -1) {
+            if (weak < 0 || weak >= heap->cell_count || heap->cells[weak].tag != TAG_WEAK
+                || heap->cells[weak].car != target) {
+                if (out)
+                    fprintf(out, "The weak references to cell %" PRI_INDEX " include cell %" PRI_INDEX
+                        ", which isn't one\n", target, weak);
+                problems++;
+                break;
+            }
+
+            if (!is_value(heap, target)) {
+                if (out)
+                    fprintf(out, "Cell %" PRI_INDEX " is a weak reference to cell %" PRI_INDEX
+                        ", which doesn't contain a value\n", weak, target);
+                problems++;
+            }
+
+            if (++listed > uncleared) {
+                if (out)
+                    fprintf(out, "The weak references to cell %" PRI_INDEX " are in a cycle\n", target);
+                return problems + 1;
+            }
+
+            weak = heap->cells[weak].cdr;
+        }
+    }
+
+    if (listed != uncleared) {
+        if (out)
+            fprintf(out, "%zu weak references haven't been cleared, but only %zu are listed\n", uncleared, listed);
+        problems++;
+    }
+
+    return problems;
+}
@@ -0,0 +1,70 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// scan.h: Bulk scans over every cell of a heap
+
+// These functions look at the cells array directly instead of calling
+// getfield() on each cell. Where the CPU supports AVX2, they check eight cells
+// at a time, gathering the fields they need. Large heaps are split into parts
+// which are scanned by separate threads.
+//
+// The functions which find cells store the indexes of the first max_results of
+// them in results, in order, and return the number found, which may be more
+// than max_results.
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "heap.h"
+
+// One more than the largest tag
+#define SCAN_TAG_COUNT 9
+
+// Count the cells with each tag
+//
+// counts[tag] is set to the number of cells with that tag. Cells whose tag
+// isn't a known one aren't counted.
+void scan_tag_counts(heap_p heap, size_t counts[SCAN_TAG_COUNT]);
+
+// Count the cells with the given tag
+size_t scan_count_tag(heap_p heap, int tag);
+// Find the cells with the given tag
+size_t scan_filter_tag(heap_p heap, int tag, cell_index *results, size_t max_results);
+
+// Find the values with no references to them
+size_t scan_unowned(heap_p heap, cell_index *results, size_t max_results);
+
+// Find the cons cells whose car or cdr isn't a valid value
+size_t scan_bad_conses(heap_p heap, cell_index *results, size_t max_results);
+
+// Check the whole heap for inconsistencies, the way fsck checks a file system
+//
+// This checks that every cell has a known tag and a sensible reference count,
+// that cells past the uninitialized ones are blank, that every cons, atom and
+// map points at something valid, that the free list holds exactly the freed
+// cells, and that every reference count matches the number of references
+// actually found. Each problem is described on its own line in out, unless out
+// is NULL. Return the number of problems found.
+size_t heap_verify(heap_p heap, FILE *out);
+
+// Set the number of threads to use for scanning large heaps; 0 means one for
+// each CPU
+void scan_set_threads(int threads);
+// Turn the AVX2 scans on or off; return 0 if this CPU doesn't support them, or
+// if cell indexes are 64 bits wide
+//
+// They're on by default when the CPU supports them. This isn't thread-safe;
+// it's meant for tests and benchmarks.
+int scan_use_avx2(int enabled);
+
+#endif
@@ -0,0 +1,552 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// server.h: Serving shell commands to many clients at once
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "panic.h"
+#include "server.h"
+#include "wire.h"
+
+// The most commands a worker runs under one acquisition of the heap lock, so
+// that a long pipeline can't keep the other workers waiting
+#define MAX_BATCH 64
+
+// The most events a worker handles per call to epoll_wait()
+#define MAX_EVENTS 64
+
+// The longest text command, including its newline and NUL, as in the shell
+#define MAX_COMMAND 1024
+
+typedef enum protocol { PROTOCOL_UNKNOWN, PROTOCOL_TEXT, PROTOCOL_BINARY } protocol;
+
+typedef struct connection {
+    int fd;
+    // Nonzero if this is a listening socket rather than a client
+    int listening;
+    // The protocol the client speaks, which is unknown until it sends
+    // something, unless the server only speaks the binary protocol
+    protocol protocol;
+
+    // Bytes received which don't make up a complete command yet
+    wire_buffer in;
+    // Responses which haven't been sent yet, starting at out_sent
+    wire_buffer out;
+    size_t out_sent;
+
+    // Nonzero if we're waiting for the socket to become writable
+    int blocked;
+} connection;
+
+typedef struct worker {
+    pthread_t thread;
+    int epoll_fd;
+
+    // The client whose command is running, which command_out and command_err
+    // write to
+    connection *current;
+    // Nonzero if the next byte written to command_err starts a line
+    int err_line_start;
+
+    // The results of the binary requests being run
+    wire_buffer results;
+} worker;
+
+typedef enum lock_mode { UNLOCKED, READ_LOCKED, WRITE_LOCKED } lock_mode;
+
+// Readers share the heap; writers take it for themselves.
+pthread_rwlock_t heap_lock;
+
+// The protocol new clients are assumed to speak
+protocol initial_protocol;
+
+// Create a listening Unix domain socket at the given path
+int listen_unix(const char *path);
+// Create a listening TCP socket on the given localhost port
+int listen_tcp(int port);
+
+// Run the event loop of a worker
+void *worker_main(void *arg);
+// Accept every pending connection on a listening socket
+void accept_clients(worker *self, connection *listener);
+// Read from a client and run the complete commands it has sent
+void read_client(worker *self, connection *client);
+// Run the complete commands in a client's input buffer
+void run_client_commands(worker *self, connection *client);
+// Run the complete text commands in a client's input buffer; return the number
+// of bytes consumed, or -1 if the client sent a command that's too long
+ssize_t run_text_commands(worker *self, connection *client);
+// Run the complete binary frames in a client's input buffer; return the
+// number of bytes consumed, or -1 if the client sent a malformed frame
+ssize_t run_binary_frames(worker *self, connection *client);
+// Send as much of a client's pending output as the socket will take; return
+// -1 if the connection has failed
+int flush_client(worker *self, connection *client);
+// Close a client's connection and free it
+void close_client(connection *client);
+
+// Take or release the heap lock as needed to run a command in the given mode
+void switch_lock(lock_mode *held, lock_mode wanted);
+
+
+// The write functions of a worker's command_out and command_err streams
+ssize_t write_out(void *cookie, const char *data, size_t length);
+ssize_t write_err(void *cookie, const char *data, size_t length);
+
+
+
+int server_run(const server_options *options) {
+    int listeners[2];
+    int listener_count = 0;
+
+    if (options->socket_path) {
+        listeners[listener_count] = listen_unix(options->socket_path);
+        if (listeners[listener_count] < 0)
+            return 1;
+        fprintf(stderr, "Listening on %s\n", options->socket_path);
+        listener_count++;
+    }
+
+    if (options->tcp_port) {
+        listeners[listener_count] = listen_tcp(options->tcp_port);
+        if (listeners[listener_count] < 0)
+            return 1;
+        fprintf(stderr, "Listening on 127.0.0.1:%d\n", options->tcp_port);
+        listener_count++;
+    }
+
+    initial_protocol = options->binary ? PROTOCOL_BINARY : PROTOCOL_UNKNOWN;
+
+    // Prefer writers, so that a steady stream of reads can't starve them.
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&heap_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    // Clients that hang up shouldn't kill the server, and only this thread
+    // handles the shutdown signals.
+    signal(SIGPIPE, SIG_IGN);
+
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+
+    worker *workers = calloc(options->threads, sizeof(worker));
+    if (!workers)
+        PANIC("Failed to allocate enough memory for the server");
+
+    for (int i = 0; i < options->threads; i++) {
+        workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epoll_fd < 0)
+            PANIC("Failed to create an epoll instance");
+
+        // Every worker waits on the listening sockets, but EPOLLEXCLUSIVE
+        // wakes only one of them for each new connection.
+        for (int j = 0; j < listener_count; j++) {
+            connection *listener = calloc(1, sizeof(connection));
+            if (!listener)
+                PANIC("Failed to allocate enough memory for the server");
+
+            listener->fd = listeners[j];
+            listener->listening = 1;
+
+            struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = listener};
+            if (epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, listeners[j], &event) != 0)
+                PANIC("Failed to watch a listening socket");
+        }
+
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            PANIC("Failed to start a worker thread");
+    }
+
+    int signal_number;
+    sigwait(&shutdown_signals, &signal_number);
+
+    if (options->socket_path)
+        unlink(options->socket_path);
+
+    fprintf(stderr, "\nShutting down\n");
+    return 0;
+}
+
+int listen_unix(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // Clear away a socket left behind by an earlier server, but nothing else.
+    struct stat status;
+    if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+int listen_tcp(int port) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int enable = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+
+
+// The event loop:
+
+void *worker_main(void *arg) {
+    worker *self = arg;
+
+    command_out = fopencookie(self, "w", (cookie_io_functions_t){.write = write_out});
+    command_err = fopencookie(self, "w", (cookie_io_functions_t){.write = write_err});
+    if (!command_out || !command_err)
+        PANIC("Failed to open a worker's output streams");
+
+    // Leave the streams unbuffered so that output and error lines arrive in
+    // the order the command printed them.
+    setvbuf(command_out, NULL, _IONBF, 0);
+    setvbuf(command_err, NULL, _IONBF, 0);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int count = epoll_wait(self->epoll_fd, events, MAX_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            PANIC("Failed to wait for events");
+        }
+
+        for (int i = 0; i < count; i++) {
+            connection *conn = events[i].data.ptr;
+
+            if (conn->listening) {
+                accept_clients(self, conn);
+            } else if (events[i].events & EPOLLOUT) {
+                if (flush_client(self, conn) < 0)
+                    close_client(conn);
+                else if (!conn->blocked)
+                    // Output has drained, so commands that arrived in the
+                    // meantime can run now.
+                    run_client_commands(self, conn);
+            } else {
+                read_client(self, conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void accept_clients(worker *self, connection *listener) {
+    while (1) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+            return;
+        }
+
+        // Responses are small and latency matters, so don't let Nagle's
+        // algorithm hold them back. This fails harmlessly on Unix sockets.
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        connection *client = calloc(1, sizeof(connection));
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->protocol = initial_protocol;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+            close_client(client);
+    }
+}
+
+void read_client(worker *self, connection *client) {
+    char data[65536];
+    ssize_t length = read(client->fd, data, sizeof(data));
+
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    if (length <= 0) {
+        close_client(client);
+        return;
+    }
+
+    wire_append(&client->in, data, length);
+    run_client_commands(self, client);
+}
+
+void run_client_commands(worker *self, connection *client) {
+    if (client->protocol == PROTOCOL_UNKNOWN && client->in.length > 0) {
+        if ((unsigned char)client->in.data[0] == WIRE_HELLO) {
+            client->protocol = PROTOCOL_BINARY;
+            memmove(client->in.data, client->in.data + 1, --client->in.length);
+        } else {
+            client->protocol = PROTOCOL_TEXT;
+        }
+    }
+
+    ssize_t consumed = 0;
+    if (client->protocol == PROTOCOL_TEXT)
+        consumed = run_text_commands(self, client);
+    else if (client->protocol == PROTOCOL_BINARY)
+        consumed = run_binary_frames(self, client);
+
+    // Send whatever the client has been told so far, including why it's
+    // being disconnected, before hanging up.
+    if (consumed < 0) {
+        flush_client(self, client);
+        close_client(client);
+        return;
+    }
+
+    memmove(client->in.data, client->in.data + consumed, client->in.length - consumed);
+    client->in.length -= consumed;
+
+    if (flush_client(self, client) < 0)
+        close_client(client);
+}
+
+ssize_t run_text_commands(worker *self, connection *client) {
+    lock_mode held = UNLOCKED;
+    int batch = 0;
+    size_t start = 0;
+
+    self->current = client;
+
+    while (!client->blocked) {
+        char *line = client->in.data + start;
+        char *end = memchr(line, '\n', client->in.length - start);
+
+        // A command has to fit in the shell's buffer, newline and all, so a
+        // client can't make the server hold on to an endless line.
+        if ((end ? end - line : client->in.length - start) >= MAX_COMMAND - 1) {
+            switch_lock(&held, UNLOCKED);
+            self->err_line_start = 1;
+            fprintf(command_err, "Command is too long\n");
+            wire_append(&client->out, "\n", 1);
+            self->current = NULL;
+            return -1;
+        }
+
+        if (!end)
+            break;
+
+        *end = '\0';
+        start = end + 1 - client->in.data;
+
+        lock_mode wanted = command_is_read_only(line) ? READ_LOCKED : WRITE_LOCKED;
+        if (batch == MAX_BATCH) {
+            switch_lock(&held, UNLOCKED);
+            batch = 0;
+        }
+        if (wanted != held) {
+            switch_lock(&held, wanted);
+            batch = 0;
+        }
+
+        self->err_line_start = 1;
+
+        // A transaction belongs to the whole heap, so it can't be left open
+        // between one client's commands while other clients run theirs.
+        if (command_controls_transactions(line))
+            fprintf(command_err, "Transactions are only available to binary clients of the server\n");
+        // Clients may not be running as the user the server runs as, so
+        // they can't have it read or write files for them.
+        else if (command_uses_files(line))
+            fprintf(command_err, "Files can't be read or written by clients of the server\n");
+        else
+            run_command(line);
+        wire_append(&client->out, "\n", 1);
+        batch++;
+
+        // Don't let a client that never reads its responses use up memory.
+        if (client->out.length - client->out_sent >= 65536) {
+            switch_lock(&held, UNLOCKED);
+            if (flush_client(self, client) < 0)
+                break;
+        }
+    }
+
+    switch_lock(&held, UNLOCKED);
+    self->current = NULL;
+    return start;
+}
+
+ssize_t run_binary_frames(worker *self, connection *client) {
+    size_t start = 0;
+
+    while (!client->blocked) {
+        size_t header, length;
+        int ready = wire_frame_ready(client->in.data + start, client->in.length - start, &header, &length);
+
+        if (ready < 0)
+            return -1;
+        if (!ready)
+            break;
+
+        const char *payload = client->in.data + start + header;
+        start += header + length;
+
+        // A frame runs under a single acquisition of the lock, so its
+        // requests see a consistent heap.
+        lock_mode held = UNLOCKED;
+        switch_lock(&held, wire_is_read_only(payload, length) ? READ_LOCKED : WRITE_LOCKED);
+        self->results.length = 0;
+        wire_run(heap, payload, length, &self->results);
+        switch_lock(&held, UNLOCKED);
+
+        wire_put_frame(&client->out, self->results.data, self->results.length);
+
+        if (client->out.length - client->out_sent >= 65536 && flush_client(self, client) < 0)
+            break;
+    }
+
+    return start;
+}
+
+int flush_client(worker *self, connection *client) {
+    while (client->out_sent < client->out.length) {
+        ssize_t sent = write(client->fd, client->out.data + client->out_sent,
+            client->out.length - client->out_sent);
+
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+
+            // Wait until the client catches up, and stop reading its commands
+            // in the meantime.
+            if (!client->blocked) {
+                struct epoll_event event = {.events = EPOLLOUT, .data.ptr = client};
+                if (epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) != 0)
+                    return -1;
+                client->blocked = 1;
+            }
+            return 0;
+        }
+
+        client->out_sent += sent;
+    }
+
+    client->out.length = 0;
+    client->out_sent = 0;
+
+    if (client->blocked) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) != 0)
+            return -1;
+        client->blocked = 0;
+    }
+
+    return 0;
+}
+
+void close_client(connection *client) {
+    // Closing the socket also removes it from the epoll instance.
+    close(client->fd);
+    free(client->in.data);
+    free(client->out.data);
+    free(client);
+}
+
+void switch_lock(lock_mode *held, lock_mode wanted) {
+    if (*held == wanted)
+        return;
+
+    if (*held != UNLOCKED)
+        pthread_rwlock_unlock(&heap_lock);
+
+    if (wanted == READ_LOCKED)
+        pthread_rwlock_rdlock(&heap_lock);
+    else if (wanted == WRITE_LOCKED)
+        pthread_rwlock_wrlock(&heap_lock);
+
+    *held = wanted;
+}
+
+
+
+// Output streams:
+
+ssize_t write_out(void *cookie, const char *data, size_t length) {
+    worker *self = cookie;
+
+    wire_append(&self->current->out, data, length);
+    return length;
+}
+
+ssize_t write_err(void *cookie, const char *data, size_t length) {
+    worker *self = cookie;
+    wire_buffer *out = &self->current->out;
+
+    for (size_t i = 0; i < length; i++) {
+        if (self->err_line_start)
+            wire_append(out, "! ", 2);
+
+        wire_append(out, data + i, 1);
+        self->err_line_start = data[i] == '\n';
+    }
+
+    return length;
+}
@@ -0,0 +1,50 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// server.h: Serving shell commands to many clients at once
+
+// The server accepts connections on a Unix domain socket, a localhost TCP
+// port, or both. A client sends commands one per line, exactly as it would
+// type them into the shell, and may send any number of commands without
+// waiting for the responses. The server answers each command in order with
+// the lines the command printed, followed by an empty line. Lines that the
+// command printed as errors start with "! ". A command must fit in the shell's
+// 1024-byte buffer, newline included; a client that sends a longer one is told
+// so and disconnected. Commands that read or write files, such as dump and
+// load, are refused.
+//
+// A client can instead speak the binary protocol in wire.h by sending
+// WIRE_HELLO as its first byte, or by connecting to a server started with the
+// binary option, which speaks nothing else. Each request frame runs under a
+// single acquisition of the heap lock.
+//
+// Each worker thread runs its own epoll loop over the clients it accepted.
+// Commands which only read the heap run in parallel; all other commands run
+// one at a time.
+
+#ifndef SERVER_H
+#define SERVER_H
+
+typedef struct server_options {
+    // The path of the Unix domain socket to listen on, or NULL for none
+    const char *socket_path;
+    // The localhost TCP port to listen on, or 0 for none
+    int tcp_port;
+    // The number of worker threads
+    int threads;
+    // Nonzero if every client speaks the binary protocol from the start
+    int binary;
+} server_options;
+
+// Serve commands on the global heap until interrupted; return the process exit
+// status
+int server_run(const server_options *options);
+
+#endif
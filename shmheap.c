@@ -0,0 +1,245 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// shmheap.h: Heaps in named shared memory, for use by several processes
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "heapimpl.h"
+#include "pagestore.h"
+#include "panic.h"
+#include "shmheap.h"
+
+// "Pout" in ASCII, stored once the rest of the header is ready
+#define SHM_MAGIC 0x74756f50
+#define SHM_VERSION 1
+
+// The start of a shared-memory object holding a heap
+//
+// The header takes up the object's first chunk. The cells start at the second
+// chunk, and the atom text at the next chunk boundary after the cells.
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t index_bits;
+    uint64_t cell_count;
+    uint64_t atom_buf_size;
+
+    pthread_rwlock_t lock;
+
+    // The allocator's state, changed only under the write lock
+    int64_t next_freed;
+    int64_t next_uninit;
+    uint64_t atom_text_used;
+};
+
+// Round a size up to a whole number of chunks, of which there's at least one
+size_t round_to_chunks(size_t size);
+// Get the size of the object for a heap of the given size
+size_t shm_object_size(size_t cell_count, size_t atom_buf_size);
+// Map an open shared-memory object and close it; return NULL on failure
+shm_header *map_shm_object(int fd, size_t size);
+// Make a process's heap_p for a mapped shared heap
+heap_p wrap_shm_heap(shm_header *header, size_t size);
+
+
+
+// Creating and attaching:
+
+heap_p shm_heap_create(const char *name, size_t cell_count, size_t atom_buf_size) {
+#ifdef POUTINE_FIXED_CELLS
+    PANIC("Shared heaps can't be used in a fixed-size build");
+#endif
+
+    if (cell_count > INDEX_MAX || atom_buf_size > INDEX_MAX)
+        PANIC("A heap can't have more than %" PRI_INDEX " cells or atom text characters",
+            (cell_index)INDEX_MAX);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+
+    // The new object is all zeros, which is what blank cells and unused atom
+    // text are.
+    size_t size = shm_object_size(cell_count, atom_buf_size);
+    shm_header *header = NULL;
+
+    if (ftruncate(fd, size) == 0)
+        header = map_shm_object(fd, size);
+    else
+        close(fd);
+
+    if (!header) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    header->version = SHM_VERSION;
+    header->index_bits = sizeof(cell_index) * 8;
+    header->cell_count = cell_count;
+    header->atom_buf_size = atom_buf_size;
+    header->next_freed = -1;
+
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&header->lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return wrap_shm_heap(header, size);
+}
+
+heap_p shm_heap_attach(const char *name) {
+#ifdef POUTINE_FIXED_CELLS
+    PANIC("Shared heaps can't be used in a fixed-size build");
+#endif
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < COW_CHUNK_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = info.st_size;
+    shm_header *header = map_shm_object(fd, size);
+    if (!header)
+        return NULL;
+
+    // A heap that's still being created counts as not being there yet.
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+        || header->version != SHM_VERSION || header->index_bits != sizeof(cell_index) * 8
+        || header->cell_count > INDEX_MAX || header->atom_buf_size > INDEX_MAX
+        || shm_object_size(header->cell_count, header->atom_buf_size) != size) {
+        munmap(header, size);
+        return NULL;
+    }
+
+    heap_p heap = wrap_shm_heap(header, size);
+
+    // The heap_p starts out with the allocator's current state, as though the
+    // write lock had been taken and released.
+    shm_heap_write_lock(heap);
+    shm_heap_unlock(heap);
+
+    return heap;
+}
+
+int shm_heap_unlink(const char *name) {
+    return shm_unlink(name) == 0;
+}
+
+int heap_is_shared(heap_p heap) {
+    return heap->shm != NULL;
+}
+
+void shm_heap_unmap(heap_p heap) {
+    munmap(heap->shm, heap->shm_size);
+}
+
+size_t round_to_chunks(size_t size) {
+    size_t chunks = (size + COW_CHUNK_SIZE - 1) >> COW_CHUNK_SHIFT;
+    return (chunks > 0 ? chunks : 1) << COW_CHUNK_SHIFT;
+}
+
+size_t shm_object_size(size_t cell_count, size_t atom_buf_size) {
+    return COW_CHUNK_SIZE + round_to_chunks(cell_count * sizeof(cons_cell)) + round_to_chunks(atom_buf_size);
+}
+
+shm_header *map_shm_object(int fd, size_t size) {
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return base == MAP_FAILED ? NULL : base;
+}
+
+heap_p wrap_shm_heap(shm_header *header, size_t size) {
+    heap_p heap = calloc(1, sizeof(struct heap));
+    if (!heap)
+        PANIC("Failed to allocate enough memory for the heap");
+
+    char *base = (char *)header;
+    size_t cells_size = round_to_chunks(header->cell_count * sizeof(cons_cell));
+
+    cow_region_wrap(&heap->cell_region, base + COW_CHUNK_SIZE, cells_size);
+    heap->cells = (cons_cell *)heap->cell_region.base;
+    heap->cell_count = header->cell_count;
+
+    cow_region_wrap(&heap->atom_region, base + COW_CHUNK_SIZE + cells_size,
+        round_to_chunks(header->atom_buf_size));
+    heap->atom_text_buf = heap->atom_region.base;
+    heap->atom_text_next = heap->atom_text_buf;
+    heap->atom_buf_size = header->atom_buf_size;
+
+    heap->next_freed = -1;
+    heap->shm = header;
+    heap->shm_size = size;
+
+    return heap;
+}
+
+
+
+// Locking:
+
+void shm_heap_read_lock(heap_p heap) {
+    if (!heap->shm)
+        PANIC("Tried to lock a heap that isn't shared");
+
+    pthread_rwlock_rdlock(&heap->shm->lock);
+
+    // Readers need to see other processes' cells and atom text too, though
+    // they don't publish anything, so they don't need the free list.
+    heap->next_uninit = heap->shm->next_uninit;
+    heap->atom_text_next = heap->atom_text_buf + heap->shm->atom_text_used;
+}
+
+void shm_heap_write_lock(heap_p heap) {
+    shm_header *header = heap->shm;
+
+    if (!header)
+        PANIC("Tried to lock a heap that isn't shared");
+
+    pthread_rwlock_wrlock(&header->lock);
+
+    // Other processes may have allocated since this one last had the lock.
+    heap->next_freed = header->next_freed;
+    heap->next_uninit = header->next_uninit;
+    heap->atom_text_next = heap->atom_text_buf + header->atom_text_used;
+    heap->shm_writing = 1;
+}
+
+void shm_heap_unlock(heap_p heap) {
+    shm_header *header = heap->shm;
+
+    if (!header)
+        PANIC("Tried to unlock a heap that isn't shared");
+
+    if (heap->shm_writing) {
+        header->next_freed = heap->next_freed;
+        header->next_uninit = heap->next_uninit;
+        header->atom_text_used = heap->atom_text_next - heap->atom_text_buf;
+        heap->shm_writing = 0;
+    }
+
+    pthread_rwlock_unlock(&header->lock);
+}
@@ -0,0 +1,82 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// shmheap.h: Heaps in named shared memory, for use by several processes
+
+// A shared heap lives in a POSIX shared-memory object, which holds a header,
+// the cells and the atom text. Since cells refer to each other and to their
+// text by index and offset, never by address, each process can map the object
+// anywhere. Attaching to a heap maps the object and reads its header, so it
+// costs a couple of system calls however big the heap is, and nothing is
+// copied: the cells a process reads are the shared ones.
+//
+// Each process has its own heap_p for a shared heap, and uses the ordinary
+// heap functions on it, between calls to the locking functions below. Any
+// number of processes can hold the read lock at once, or one can hold the
+// write lock. The allocator's state is kept in the header, and loaded into the
+// process's heap_p when it takes the write lock, so cells and atom text
+// allocated by one process are seen by the others.
+//
+// Only what's in the cells and the atom text is shared, so the features that
+// keep their own state in process memory can't be used on a shared heap, and
+// panic if they're tried: maps and other values with out-of-line storage, weak
+// references, hash-consing, the nursery, incremental collection and forking.
+// Transactions, regions and full collections can be, provided they're begun
+// and finished under one write lock.
+//
+// The lock is an ordinary process-shared lock, so a process which dies while
+// holding it leaves the heap locked.
+//
+// A fixed-size build keeps its heap's cells in a static array, so it can't
+// have shared heaps, and the functions below panic.
+
+#ifndef SHMHEAP_H
+#define SHMHEAP_H
+
+#include <stddef.h>
+
+#include "heap.h"
+
+// Create a shared heap with the given number of cells and atom buffer
+// characters, in a new shared-memory object with the given name, and attach
+// to it
+//
+// The name is as for shm_open(): a slash followed by up to 255 characters that
+// aren't slashes. Returns NULL if the object can't be created, for instance
+// because one with that name already exists. This function panics if either
+// size is more than INDEX_MAX.
+heap_p shm_heap_create(const char *name, size_t cell_count, size_t atom_buf_size);
+
+// Attach to an existing shared heap
+//
+// Returns NULL if there's no such object, or if it isn't a shared heap made by
+// a build of Poutine with the same index width.
+heap_p shm_heap_attach(const char *name);
+
+// Remove a shared heap's name, so that nothing new can attach to it
+//
+// Processes that are already attached can go on using it, and its memory is
+// freed once they've all detached. Returns 0 on failure.
+int shm_heap_unlink(const char *name);
+
+// Check whether a heap is a shared one
+int heap_is_shared(heap_p heap);
+
+// Take the lock for reading from a shared heap, picking up what other
+// processes have allocated
+void shm_heap_read_lock(heap_p heap);
+// Take the lock for changing a shared heap
+void shm_heap_write_lock(heap_p heap);
+// Release the lock, publishing any allocations made under the write lock
+void shm_heap_unlock(heap_p heap);
+
+// To detach from a shared heap, use free_heap().
+
+#endif
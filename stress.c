@@ -0,0 +1,605 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// stress.c: A randomized tester which checks a heap against a simple model
+
+// Each step picks an operation at random and does it both to a heap and to a
+// model of what the heap should contain: an array saying what each cell holds
+// and how many references there are to it. The cells the operation touched
+// are then checked against the model. Every so often every cell is checked,
+// and the heap is checked with heap_verify(). A run is determined by its seed,
+// so a failure can be reproduced by running again with the same options.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc.h"
+#include "heap.h"
+#include "nursery.h"
+#include "panic.h"
+#include "rawheap.h"
+#include "rcheap.h"
+#include "scan.h"
+#include "txn.h"
+
+// The number of different atom texts
+#define TEXT_COUNT 64
+// How often every cell is checked, in steps
+#define FULL_CHECK_INTERVAL 65536
+// How often the heap is verified, in steps
+#define VERIFY_INTERVAL 1048576
+// The default size of the heap, which in a fixed-size build has to be the
+// only size there is
+#ifdef FIXED_CELLS
+#define DEFAULT_CELLS FIXED_CELLS
+#else
+#define DEFAULT_CELLS 16384
+#endif
+
+// Panic, saying which step of which run went wrong
+#define FAIL(message, ...) \
+    PANIC("Step %ld of the run with seed %lu: " message, step, options.seed, ##__VA_ARGS__)
+
+typedef struct stress_options {
+    long steps;
+    unsigned long seed;
+    cell_index cells;
+    // The size of the nursery, or 0 for none
+    cell_index nursery;
+    // The incremental collector's slice size, or 0 to leave it off
+    int slice;
+} stress_options;
+
+// What the model expects a cell to hold
+typedef struct model_cell {
+    // TAG_ATOM or TAG_CONS, or TAG_FREED for a cell that isn't in use
+    int tag;
+    // For an atom, the number of its text, or -1 if it doesn't have any
+    int text;
+    cell_index car;
+    cell_index cdr;
+    cell_index ref_count;
+    // Where the cell is in each of the model's sets, or -1 if it isn't there
+    cell_index positions[2];
+} model_cell;
+
+// The sets of cells the model keeps: those in use, and those in use with no
+// references to them
+#define LIVE 0
+#define UNOWNED 1
+
+typedef struct model {
+    model_cell *cells;
+    // The cells in each set, in no particular order
+    cell_index *sets[2];
+    cell_index counts[2];
+} model;
+
+
+
+// Running:
+
+// Do one randomly chosen operation and check its results
+void random_step(void);
+// Get a random number
+uint64_t next_random(void);
+// Get a random cell from one of the model's sets, or -1 if it's empty
+cell_index random_cell(int set);
+
+// Operations:
+
+// Make an atom with random text
+void op_atom(void);
+// Allocate a cell without setting it
+void op_alloc(void);
+// Make a cons of two random cells
+void op_cons(void);
+// Free a random unowned cell
+void op_free(void);
+// Make a random unowned cell into an atom
+void op_setatom(void);
+// Make a random unowned cell into a cons
+void op_setcons(void);
+// Begin, commit or abort a transaction
+void op_transaction(void);
+// Collect garbage, of which there shouldn't be any
+void op_collect(void);
+
+// The model:
+
+// Make a model with every cell unused
+void model_init(model *m, cell_index cells);
+// Copy one model into another of the same size
+void model_copy(model *dest, const model *src);
+// Record that a cell is now in use
+void model_add(cell_index index, int tag, int text, cell_index car, cell_index cdr);
+// Record that a cell's value was erased, dropping its references
+void model_erase(cell_index index);
+// Record that a cell is no longer in use
+void model_remove(cell_index index);
+// Record that a reference to a cell was added
+void model_reference(cell_index index);
+// Record that a reference to a cell was dropped
+void model_unreference(cell_index index);
+// Add a cell to one of the model's sets
+void set_add(int set, cell_index index);
+// Remove a cell from one of the model's sets
+void set_remove(int set, cell_index index);
+
+// Checking:
+
+// Check that an allocation failed only if the heap is full
+void check_allocation(cell_index index);
+// Check that a cell is what the model says it should be
+void check_cell(cell_index index);
+// Check every cell
+void check_all_cells(void);
+
+// Print a summary of the command-line options
+void usage(const char *program);
+
+
+
+stress_options options = {.steps = 10000000, .seed = 1, .cells = DEFAULT_CELLS, .nursery = 0, .slice = 0};
+
+heap_p heap;
+model current;
+// The model as it was when the running transaction began
+model saved;
+
+long step;
+uint64_t random_state;
+
+char texts[TEXT_COUNT][40];
+
+// How many times each operation was done
+long counts[8];
+static const char *op_names[8] = {
+    "atom", "alloc", "cons", "free", "setatom", "setcons", "transaction", "collect",
+};
+
+
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"steps", required_argument, NULL, 'n'},
+        {"seed", required_argument, NULL, 's'},
+        {"cells", required_argument, NULL, 'c'},
+        {"nursery", required_argument, NULL, 'N'},
+        {"incremental", required_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+
+    while ((option = getopt_long(argc, argv, "n:s:c:N:i:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'n':
+            options.steps = atol(optarg);
+            break;
+        case 's':
+            options.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            options.cells = atol(optarg);
+            break;
+        case 'N':
+            options.nursery = atol(optarg);
+            break;
+        case 'i':
+            options.slice = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc || options.steps < 0 || options.cells <= 0 || options.nursery < 0
+        || options.nursery > options.cells || options.slice < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < TEXT_COUNT; i++)
+        snprintf(texts[i], sizeof(texts[i]), "%.*s%d", i % 8 * 4, "abcdefghijklmnopqrstuvwxyzabcdef", i);
+
+    // Seeds that are close together still give unrelated runs.
+    random_state = options.seed * 0x9e3779b97f4a7c15 + 1;
+
+    heap = malloc_heap(options.cells, TEXT_COUNT * sizeof(texts[0]));
+    if (options.nursery > 0 && !heap_set_nursery(heap, options.nursery))
+        PANIC("Failed to set up the nursery");
+    gc_set_incremental(heap, options.slice);
+
+    model_init(&current, options.cells);
+    model_init(&saved, options.cells);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (step = 1; step <= options.steps; step++) {
+        random_step();
+
+        if (step % FULL_CHECK_INTERVAL == 0)
+            check_all_cells();
+
+        if (step % VERIFY_INTERVAL == 0 && heap_verify(heap, stderr) != 0)
+            FAIL("The heap has problems");
+    }
+
+    if (heap_in_transaction(heap))
+        heap_commit(heap);
+
+    check_all_cells();
+    if (heap_verify(heap, stderr) != 0)
+        FAIL("The heap has problems");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    printf("%ld steps with seed %lu passed in %.1f s, with %ld cells in use at the end:\n",
+        options.steps, options.seed, seconds, (long)current.counts[LIVE]);
+    for (int i = 0; i < 8; i++)
+        printf("    %-12s %10ld\n", op_names[i], counts[i]);
+
+    free_heap(heap);
+    return 0;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--steps N] [--seed N] [--cells N] [--nursery N] [--incremental SLICE]\n",
+        program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Run N random operations (10 million by default) on a heap of --cells cells,\n");
+    fprintf(stderr, "checking the heap against a model of what it should hold. --nursery and\n");
+    fprintf(stderr, "--incremental turn on the nursery and the incremental collector.\n");
+}
+
+
+
+// Running:
+
+void random_step() {
+    // Out of every 1000 steps, roughly how many do each operation
+    uint64_t choice = next_random() % 1000;
+
+    // Cells are allocated about as often as they're freed, so the number in
+    // use wanders between none and all of them.
+    if (choice < 150)
+        op_atom();
+    else if (choice < 180)
+        op_alloc();
+    else if (choice < 450)
+        op_cons();
+    else if (choice < 900)
+        op_free();
+    else if (choice < 945)
+        op_setatom();
+    else if (choice < 990)
+        op_setcons();
+    else if (choice < 999)
+        op_transaction();
+    else
+        op_collect();
+}
+
+uint64_t next_random() {
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1d;
+}
+
+cell_index random_cell(int set) {
+    if (current.counts[set] == 0)
+        return -1;
+
+    return current.sets[set][next_random() % current.counts[set]];
+}
+
+
+
+// Operations:
+
+void op_atom() {
+    int text = next_random() % TEXT_COUNT;
+    cell_index index = rc_atom(heap, texts[text]);
+    counts[0]++;
+
+    check_allocation(index);
+    if (index == -1)
+        return;
+
+    model_add(index, TAG_ATOM, text, 0, 0);
+    check_cell(index);
+}
+
+void op_alloc() {
+    cell_index index = alloc_cell(heap);
+    counts[1]++;
+
+    check_allocation(index);
+    if (index == -1)
+        return;
+
+    model_add(index, TAG_ATOM, -1, 0, 0);
+    check_cell(index);
+}
+
+void op_cons() {
+    cell_index car = random_cell(LIVE);
+    cell_index cdr = random_cell(LIVE);
+    if (car == -1)
+        return;
+
+    cell_index index = rc_cons(heap, car, cdr);
+    counts[2]++;
+
+    check_allocation(index);
+    if (index == -1)
+        return;
+
+    model_add(index, TAG_CONS, -1, car, cdr);
+    model_reference(car);
+    model_reference(cdr);
+
+    check_cell(index);
+    check_cell(car);
+    check_cell(cdr);
+}
+
+void op_free() {
+    cell_index index = random_cell(UNOWNED);
+    if (index == -1)
+        return;
+
+    model_cell old = current.cells[index];
+    rc_free(heap, index);
+    counts[3]++;
+
+    model_erase(index);
+    model_remove(index);
+
+    check_cell(index);
+    if (old.tag == TAG_CONS) {
+        check_cell(old.car);
+        check_cell(old.cdr);
+    }
+}
+
+void op_setatom() {
+    cell_index index = random_cell(UNOWNED);
+    if (index == -1)
+        return;
+
+    model_cell old = current.cells[index];
+    int text = next_random() % TEXT_COUNT;
+    rc_setatom(heap, index, texts[text]);
+    counts[4]++;
+
+    model_erase(index);
+    current.cells[index].tag = TAG_ATOM;
+    current.cells[index].text = text;
+
+    check_cell(index);
+    if (old.tag == TAG_CONS) {
+        check_cell(old.car);
+        check_cell(old.cdr);
+    }
+}
+
+void op_setcons() {
+    cell_index index = random_cell(UNOWNED);
+    cell_index car = random_cell(LIVE);
+    cell_index cdr = random_cell(LIVE);
+
+    // Nothing refers to an unowned cell, so this can't make a cycle unless the
+    // cell is its own car or cdr.
+    if (index == -1 || car == index || cdr == index)
+        return;
+
+    model_cell old = current.cells[index];
+    rc_setcons(heap, index, car, cdr);
+    counts[5]++;
+
+    model_erase(index);
+    current.cells[index].tag = TAG_CONS;
+    current.cells[index].car = car;
+    current.cells[index].cdr = cdr;
+    model_reference(car);
+    model_reference(cdr);
+
+    check_cell(index);
+    check_cell(car);
+    check_cell(cdr);
+    if (old.tag == TAG_CONS) {
+        check_cell(old.car);
+        check_cell(old.cdr);
+    }
+}
+
+void op_transaction() {
+    counts[6]++;
+
+    if (!heap_in_transaction(heap)) {
+        // Copying the model takes a while, so transactions are only begun
+        // every few thousand steps.
+        if (next_random() % 256 == 0) {
+            heap_begin(heap);
+            model_copy(&saved, &current);
+        }
+    } else if (next_random() % 2 == 0) {
+        heap_commit(heap);
+    } else {
+        heap_abort(heap);
+        model_copy(&current, &saved);
+        check_all_cells();
+    }
+}
+
+void op_collect() {
+    if (heap_in_transaction(heap))
+        return;
+
+    counts[7]++;
+
+    // Every cell in use is unowned or referred to by another one, and there
+    // are no cycles, so nothing is garbage.
+    size_t freed = options.nursery > 0 && next_random() % 2 == 0 ? minor_collect(heap) : heap_collect(heap);
+    if (freed != 0)
+        FAIL("A collection freed %zu cells that were in use", freed);
+
+    check_all_cells();
+}
+
+
+
+// The model:
+
+void model_init(model *m, cell_index cells) {
+    m->cells = malloc(cells * sizeof(model_cell));
+    m->sets[LIVE] = malloc(cells * sizeof(cell_index));
+    m->sets[UNOWNED] = malloc(cells * sizeof(cell_index));
+    if (!m->cells || !m->sets[LIVE] || !m->sets[UNOWNED])
+        PANIC("Failed to allocate enough memory for the model");
+
+    for (cell_index i = 0; i < cells; i++)
+        m->cells[i] = (model_cell){.tag = TAG_FREED, .text = -1, .positions = {-1, -1}};
+    m->counts[LIVE] = m->counts[UNOWNED] = 0;
+}
+
+void model_copy(model *dest, const model *src) {
+    memcpy(dest->cells, src->cells, options.cells * sizeof(model_cell));
+
+    for (int set = LIVE; set <= UNOWNED; set++) {
+        memcpy(dest->sets[set], src->sets[set], src->counts[set] * sizeof(cell_index));
+        dest->counts[set] = src->counts[set];
+    }
+}
+
+void model_add(cell_index index, int tag, int text, cell_index car, cell_index cdr) {
+    model_cell *cell = &current.cells[index];
+
+    if (cell->tag != TAG_FREED)
+        FAIL("Cell %" PRI_INDEX " was handed out while it was in use", index);
+
+    *cell = (model_cell){.tag = tag, .text = text, .car = car, .cdr = cdr, .ref_count = 0,
+        .positions = {-1, -1}};
+    set_add(LIVE, index);
+    set_add(UNOWNED, index);
+}
+
+void model_erase(cell_index index) {
+    model_cell *cell = &current.cells[index];
+
+    if (cell->tag == TAG_CONS) {
+        model_unreference(cell->car);
+        model_unreference(cell->cdr);
+    }
+
+    cell->tag = TAG_ATOM;
+    cell->text = -1;
+}
+
+void model_remove(cell_index index) {
+    set_remove(LIVE, index);
+    set_remove(UNOWNED, index);
+    current.cells[index] = (model_cell){.tag = TAG_FREED, .text = -1, .positions = {-1, -1}};
+}
+
+void model_reference(cell_index index) {
+    if (current.cells[index].ref_count++ == 0)
+        set_remove(UNOWNED, index);
+}
+
+void model_unreference(cell_index index) {
+    if (--current.cells[index].ref_count == 0)
+        set_add(UNOWNED, index);
+}
+
+void set_add(int set, cell_index index) {
+    current.cells[index].positions[set] = current.counts[set];
+    current.sets[set][current.counts[set]++] = index;
+}
+
+void set_remove(int set, cell_index index) {
+    // The last cell in the set takes this one's place.
+    cell_index position = current.cells[index].positions[set];
+    cell_index last = current.sets[set][--current.counts[set]];
+
+    current.sets[set][position] = last;
+    current.cells[last].positions[set] = position;
+    current.cells[index].positions[set] = -1;
+}
+
+
+
+// Checking:
+
+void check_allocation(cell_index index) {
+    if (index == -1 && current.counts[LIVE] < options.cells) {
+        // Atoms aren't allocated in the nursery, so they can run out of
+        // cells while it still has some.
+        if (options.nursery == 0 || current.counts[LIVE] < options.cells - options.nursery)
+            FAIL("An allocation failed with only %" PRI_INDEX " of %" PRI_INDEX " cells in use",
+                current.counts[LIVE], options.cells);
+    }
+}
+
+void check_cell(cell_index index) {
+    model_cell *expected = &current.cells[index];
+
+    if (expected->tag == TAG_FREED) {
+        if (rc_is_valid(heap, index))
+            FAIL("Cell %" PRI_INDEX " should be free, but it has tag %" PRI_INDEX, index,
+                getfield(heap, FIELD_TAG, index));
+        return;
+    }
+
+    cell_index tag = getfield(heap, FIELD_TAG, index);
+    if (tag != expected->tag)
+        FAIL("Cell %" PRI_INDEX " should have tag %d, but it has tag %" PRI_INDEX, index, expected->tag, tag);
+
+    cell_index ref_count = getfield(heap, FIELD_REFCOUNT, index);
+    if (ref_count != expected->ref_count)
+        FAIL("Cell %" PRI_INDEX " should have %" PRI_INDEX " references, but it has %" PRI_INDEX, index,
+            expected->ref_count, ref_count);
+
+    if (expected->tag == TAG_CONS) {
+        cell_index car = getfield(heap, FIELD_CAR, index);
+        cell_index cdr = getfield(heap, FIELD_CDR, index);
+        if (car != expected->car || cdr != expected->cdr)
+            FAIL("Cell %" PRI_INDEX " should be (%" PRI_INDEX " . %" PRI_INDEX "), but it's (%" PRI_INDEX
+                " . %" PRI_INDEX ")", index, expected->car, expected->cdr, car, cdr);
+    } else if (expected->text == -1) {
+        if (isatom(heap, index))
+            FAIL("Cell %" PRI_INDEX " shouldn't have any text, but it has \"%s\"", index,
+                getatom(heap, index));
+    } else {
+        if (!isatom(heap, index))
+            FAIL("Cell %" PRI_INDEX " should be the atom \"%s\", but it has no text", index,
+                texts[expected->text]);
+        if (strcmp(getatom(heap, index), texts[expected->text]) != 0)
+            FAIL("Cell %" PRI_INDEX " should be the atom \"%s\", but it's \"%s\"", index,
+                texts[expected->text], getatom(heap, index));
+    }
+}
+
+void check_all_cells() {
+    for (cell_index i = 0; i < options.cells; i++)
+        check_cell(i);
+}
@@ -10,13 +10,40 @@
 
 // tests.c: Some automated tests
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "atomtext.h"
+#include "commands.h"
+#include "dump.h"
+#include "equal.h"
+#include "gc.h"
 #include "heap.h"
+#include "heapinfo.h"
+#include "histogram.h"
+#include "map.h"
+#include "nursery.h"
 #include "panic.h"
+#include "persist.h"
+#include "pipeline.h"
+#include "profile.h"
 #include "rawheap.h"
 #include "rcheap.h"
+#include "region.h"
+#include "scan.h"
+#include "server.h"
+#include "shmheap.h"
+#include "trace.h"
+#include "txn.h"
+#include "weak.h"
+#include "wire.h"
 
 
 
@@ -24,6 +51,8 @@
 void test_heap(void);
 // Try out the functions that deal with atoms.
 void test_atoms(void);
+// Try out searching atom text with each kernel.
+void test_atom_text(void);
 // Try out allocating cells.
 void test_allocate(void);
 // Try out the reference-counting heap functions.
@@ -32,6 +61,67 @@ void test_rcheap(void);
 void test_rcheap_alloc(void);
 // Try out the print function.
 void test_print(void);
+// Try out forking a heap.
+void test_fork(void);
+// Try out hash-consing.
+void test_hashcons(void);
+// Try out structural equality and hashing.
+void test_equal(void);
+// Try out maps.
+void test_map(void);
+// Try out persistent vectors.
+void test_pvec(void);
+// Try out persistent maps.
+void test_pmap(void);
+// Try out latency histograms.
+void test_histogram(void);
+// Try out the binary protocol.
+void test_wire(void);
+// Try out the server, with a text client and a binary client.
+void test_server(void);
+// Try out the pipeline, which should print just what the shell would.
+void test_pipeline(void);
+// Try out transactions.
+void test_transactions(void);
+// Try out bulk scans and heap verification.
+void test_scan(void);
+// Try out the tracing garbage collector.
+void test_gc(void);
+// Try out incremental collection.
+void test_incremental_gc(void);
+// Try out the nursery and minor collections.
+void test_nursery(void);
+// Try out regions.
+void test_regions(void);
+// Try out weak references and weak-keyed maps.
+void test_weak(void);
+// Try out a heap of more than 2^31 cells, if indexes are 64 bits wide and
+// there's enough memory.
+void test_large_heap(void);
+// Try out timing commands, on more than one thread.
+void test_profile(void);
+// Try out getting information about how a heap's memory is used.
+void test_heapinfo(void);
+// Try out recording commands and replaying them.
+void test_trace(void);
+// Try out heaps in shared memory, from two processes.
+void test_shm_heap(void);
+// Try out dumping heaps to files and loading them again.
+void test_dump(void);
+// Dump a heap and load it back, checking that the cells are the same; return
+// the size of the dump
+size_t dump_round_trip(heap_p heap, int flags, heap_p *loaded);
+// Time a command on another thread, for test_profile()
+void *record_getcar(void *arg);
+// Get what profile_dump() prints
+char *profile_text(void);
+// Connect to a server's Unix domain socket, waiting for it to start
+int connect_to_server(const char *path);
+// Read from a socket until the given number of bytes have arrived or it's
+// closed, returning them as a string which the caller frees
+char *read_bytes(int fd, size_t length);
+// Count the cells of a heap which are neither uninitialized nor freed
+int cells_in_use(heap_p heap);
 
 
 
@@ -43,18 +133,42 @@ void test_print(void);
 int main(int argc, char **argv) {
     RUN_TEST(test_heap);
     RUN_TEST(test_atoms);
+    RUN_TEST(test_atom_text);
     RUN_TEST(test_allocate);
     RUN_TEST(test_rcheap);
     RUN_TEST(test_rcheap_alloc);
     RUN_TEST(test_print);
+    RUN_TEST(test_fork);
+    RUN_TEST(test_hashcons);
+    RUN_TEST(test_equal);
+    RUN_TEST(test_map);
+    RUN_TEST(test_pvec);
+    RUN_TEST(test_pmap);
+    RUN_TEST(test_histogram);
+    RUN_TEST(test_wire);
+    RUN_TEST(test_server);
+    RUN_TEST(test_pipeline);
+    RUN_TEST(test_transactions);
+    RUN_TEST(test_scan);
+    RUN_TEST(test_gc);
+    RUN_TEST(test_incremental_gc);
+    RUN_TEST(test_nursery);
+    RUN_TEST(test_regions);
+    RUN_TEST(test_weak);
+    RUN_TEST(test_large_heap);
+    RUN_TEST(test_profile);
+    RUN_TEST(test_heapinfo);
+    RUN_TEST(test_trace);
+    RUN_TEST(test_shm_heap);
+    RUN_TEST(test_dump);
     printf("Everything looks good.\n");
 }
 
 #define EXPECT(type, expr, expected) do { \
     type EXPECT_actual = (expr); \
     if (EXPECT_actual != (expected)) { \
-        PANIC("Unexpected result from %s %s: expected %d, got %d", \
-            #type, #expr, (expected), EXPECT_actual); \
+        PANIC("Unexpected result from %s %s: expected %lld, got %lld", \
+            #type, #expr, (long long)(expected), (long long)EXPECT_actual); \
     } \
 } while (0)
 
@@ -105,6 +219,77 @@ void test_atoms() {
     free_heap(heap);
 }
 
+void test_atom_text() {
+    // Lay out enough atoms that matches fall in every lane of a vector, with
+    // some that are prefixes of each other.
+    char buf[4096];
+    size_t used = 0;
+    size_t offsets[300];
+
+    for (int i = 0; i < 300; i++) {
+        offsets[i] = used;
+        used += sprintf(buf + used, i % 3 == 0 ? "ab%d" : "b%d", i) + 1;
+    }
+
+    int original = atom_text_kernel();
+
+    for (int kernel = ATOM_KERNEL_SCALAR; kernel <= ATOM_KERNEL_AVX2; kernel++) {
+        if (!atom_text_use_kernel(kernel))
+            continue;
+
+        EXPECT(int, (int)atom_text_count(buf, used), 300);
+        EXPECT(int, (int)atom_text_count(buf, used - 1), 299);
+
+        char text[16];
+        int all_found = 1;
+        for (int i = 0; i < 300; i++) {
+            sprintf(text, i % 3 == 0 ? "ab%d" : "b%d", i);
+            if (atom_text_find(buf, used, text, strlen(text)) != offsets[i])
+                all_found = 0;
+        }
+        EXPECT(int, all_found, 1);
+
+        // Pieces of atoms and atoms that run past the end don't count.
+        EXPECT(int, atom_text_find(buf, used, "b1", 2), (int)offsets[1]);
+        EXPECT(int, atom_text_find(buf, used, "b", 1), -1);
+        EXPECT(int, atom_text_find(buf, used, "3", 1), -1);
+        EXPECT(int, atom_text_find(buf, used, "b30", 3), -1);
+        EXPECT(int, atom_text_find(buf, offsets[299] + 3, "b299", 4), -1);
+        EXPECT(int, atom_text_find(buf, used, "", 0), -1);
+
+        size_t results[8];
+        EXPECT(int, (int)atom_text_find_prefix(buf, used, "ab", 2, results, 8), 100);
+        EXPECT(int, (int)results[0], 0);
+        EXPECT(int, (int)results[7], (int)offsets[21]);
+        EXPECT(int, (int)atom_text_find_prefix(buf, used, "b29", 3, results, 8), 8);
+        EXPECT(int, (int)results[0], (int)offsets[29]);
+        EXPECT(int, (int)results[1], (int)offsets[290]);
+        EXPECT(int, (int)atom_text_find_prefix(buf, used, "b299", 4, results, 8), 1);
+        EXPECT(int, (int)atom_text_find_prefix(buf, used, "b2999", 5, results, 8), 0);
+        EXPECT(int, (int)atom_text_find_prefix(buf, used, "", 0, results, 8), 300);
+    }
+
+    atom_text_use_kernel(original);
+
+    // Atom cells sharing the same text are all found.
+    heap_p heap = malloc_heap(20, 200);
+    cell_index results[4];
+
+    int apple = rc_atom(heap, "apple");
+    rc_atom(heap, "banana");
+    int apricot = rc_atom(heap, "apricot");
+    int apple2 = rc_atom(heap, "apple");
+
+    EXPECT(int, find_atoms_with_prefix(heap, "ap", results, 4), 3);
+    EXPECT(int, results[0], apple);
+    EXPECT(int, results[1], apricot);
+    EXPECT(int, results[2], apple2);
+    EXPECT(int, find_atoms_with_prefix(heap, "apple", results, 1), 2);
+    EXPECT(int, find_atoms_with_prefix(heap, "cherry", results, 4), 0);
+
+    free_heap(heap);
+}
+
 void test_allocate() {
     heap_p heap = malloc_heap(3, 1);
 
@@ -224,6 +409,23 @@ void test_rcheap_alloc() {
     EXPECT(int, list2, -1);
 
     free_heap(heap);
+
+    // Running out of atom text fails the same way, without using up a cell.
+    heap = malloc_heap(10, 12);
+
+    nil = rc_atom(heap, "nil");
+    red = rc_atom(heap, "red");
+    orange = rc_atom(heap, "orange");
+
+    EXPECT(int, orange, -1);
+    EXPECT(int, alloc_cell(heap), 2);
+
+    // Text that's already there can still be used.
+    EXPECT(int, rc_atom(heap, "red"), 3);
+    EXPECT(int, atom_text_fits(heap, "nil"), 1);
+    EXPECT(int, atom_text_fits(heap, "orange"), 0);
+
+    free_heap(heap);
 }
 
 #define EXPECT_STR(expr, expected) do { \
@@ -255,4 +457,1962 @@ void test_print() {
     EXPECT_PRINT(red, "red");
     EXPECT_PRINT(orange, "orange");
     EXPECT_PRINT(nil, "()");
+
+    free_heap(heap);
+}
+
+void test_fork() {
+    // Big enough to span several copy-on-write chunks
+    heap_p heap = malloc_heap(20000, 100);
+
+    int nil = rc_atom(heap, "nil");
+    int red = rc_atom(heap, "red");
+    int list = rc_cons(heap, red, nil);
+
+    heap_p fork = heap_fork(heap);
+
+    EXPECT(int, rc_getfield(fork, FIELD_TAG, list), TAG_CONS);
+    EXPECT(int, rc_getfield(fork, FIELD_CAR, list), red);
+    EXPECT_STR(getatom(fork, red), "red");
+
+    // Writes to either side aren't visible in the other.
+    int orange = rc_atom(heap, "orange");
+    int yellow = rc_atom(fork, "yellow");
+
+    EXPECT(int, orange, yellow);
+    EXPECT_STR(getatom(heap, orange), "orange");
+    EXPECT_STR(getatom(fork, yellow), "yellow");
+
+    rc_setcons(fork, list, red, yellow);
+    setfield(heap, FIELD_CAR, 19999, 123);
+
+    EXPECT(int, rc_getfield(heap, FIELD_CDR, list), nil);
+    EXPECT(int, rc_getfield(fork, FIELD_CDR, list), yellow);
+    EXPECT(int, getfield(heap, FIELD_CAR, 19999), 123);
+    EXPECT(int, getfield(fork, FIELD_CAR, 19999), 0);
+
+    // A fork of a fork is independent of both.
+    heap_p fork2 = heap_fork(fork);
+    rc_free(fork, list);
+
+    EXPECT(int, rc_getfield(fork, FIELD_TAG, list), TAG_FREED);
+    EXPECT(int, rc_getfield(fork2, FIELD_TAG, list), TAG_CONS);
+    EXPECT(int, rc_getfield(heap, FIELD_TAG, list), TAG_CONS);
+
+    free_heap(heap);
+
+    EXPECT(int, rc_getfield(fork2, FIELD_CDR, list), yellow);
+    EXPECT_STR(getatom(fork2, yellow), "yellow");
+
+    free_heap(fork);
+    free_heap(fork2);
+}
+
+void test_hashcons() {
+    heap_p heap = malloc_heap(10, 30);
+
+    int nil = rc_atom(heap, "nil");
+    int red = rc_atom(heap, "red");
+    int red2 = rc_atom(heap, "red");
+
+    EXPECT(int, red2 != red, 1);
+
+    rc_set_hashcons(heap, 1);
+
+    // Cells that were already there get reused.
+    EXPECT(int, rc_atom(heap, "red"), red);
+    EXPECT(int, rc_atom(heap, "nil"), nil);
+
+    int list1 = rc_cons(heap, red, nil);
+    int list2 = rc_cons(heap, red, nil);
+    int list3 = rc_cons(heap, red2, nil);
+
+    EXPECT(int, list2, list1);
+    EXPECT(int, list3 != list1, 1);
+    EXPECT(int, rc_cons(heap, red, list1), rc_cons(heap, red, list2));
+
+    // Once a cell is freed or changed, it isn't handed out any more.
+    int outer = rc_cons(heap, red, list1);
+    rc_free(heap, outer);
+    EXPECT(int, rc_getfield(heap, FIELD_TAG, outer), TAG_FREED);
+
+    int outer2 = rc_cons(heap, red, list1);
+    EXPECT(int, rc_getfield(heap, FIELD_TAG, outer2), TAG_CONS);
+    EXPECT(int, rc_getfield(heap, FIELD_CDR, outer2), list1);
+
+    rc_setatom(heap, outer2, "blue");
+    int outer3 = rc_cons(heap, red, list1);
+    EXPECT(int, outer3 != outer2, 1);
+    EXPECT(int, rc_getfield(heap, FIELD_TAG, outer3), TAG_CONS);
+
+    // A fork keeps its own table.
+    heap_p fork = heap_fork(heap);
+    rc_free(fork, outer3);
+    EXPECT(int, rc_cons(heap, red, list1), outer3);
+
+    rc_set_hashcons(heap, 0);
+    EXPECT(int, rc_cons(heap, red, nil) != list1, 1);
+
+    free_heap(fork);
+    free_heap(heap);
+}
+
+void test_equal() {
+    heap_p heap = malloc_heap(400, 30);
+
+    int nil = rc_atom(heap, "nil");
+    int red = rc_atom(heap, "red");
+    int red2 = rc_atom(heap, "red");
+    int blue = rc_atom(heap, "blue");
+
+    EXPECT(int, heap_equal(heap, red, red2), 1);
+    EXPECT(int, heap_equal(heap, red, blue), 0);
+    EXPECT(int, heap_hash(heap, red) == heap_hash(heap, red2), 1);
+    EXPECT(int, heap_hash(heap, red) != heap_hash(heap, blue), 1);
+
+    // (red red) and (red red), built from different cells
+    int list1 = rc_cons(heap, red, rc_cons(heap, red, nil));
+    int list2 = rc_cons(heap, red2, rc_cons(heap, red, nil));
+    // (red blue)
+    int list3 = rc_cons(heap, red, rc_cons(heap, blue, nil));
+    // ((red red))
+    int list4 = rc_cons(heap, list1, nil);
+
+    EXPECT(int, heap_equal(heap, list1, list2), 1);
+    EXPECT(int, heap_equal(heap, list1, list3), 0);
+    EXPECT(int, heap_equal(heap, list1, list4), 0);
+    EXPECT(int, heap_equal(heap, list1, red), 0);
+    EXPECT(int, heap_hash(heap, list1) == heap_hash(heap, list2), 1);
+    EXPECT(int, heap_hash(heap, list1) != heap_hash(heap, list3), 1);
+    EXPECT(int, heap_hash(heap, list1) != heap_hash(heap, list4), 1);
+
+    // Hashes don't depend on the heap.
+    heap_p other = malloc_heap(10, 30);
+    int other_nil = rc_atom(other, "nil");
+    int other_red = rc_atom(other, "red");
+    int other_list = rc_cons(other, other_red, rc_cons(other, other_red, other_nil));
+    EXPECT(int, heap_hash(other, other_list) == heap_hash(heap, list1), 1);
+    free_heap(other);
+
+    // Trees with 2^100 leaves, shared down to 100 cells each
+    int levels[101];
+    int tree2 = red2;
+    levels[0] = red;
+    for (int i = 1; i <= 100; i++) {
+        levels[i] = rc_cons(heap, levels[i - 1], levels[i - 1]);
+        tree2 = rc_cons(heap, tree2, tree2);
+    }
+
+    EXPECT(int, heap_equal(heap, levels[100], tree2), 1);
+    EXPECT(int, heap_hash(heap, levels[100]) == heap_hash(heap, tree2), 1);
+
+    // The same, but with the last leaf different
+    int tree3 = rc_cons(heap, red, blue);
+    for (int i = 2; i <= 100; i++)
+        tree3 = rc_cons(heap, levels[i - 1], tree3);
+
+    EXPECT(int, heap_equal(heap, levels[100], tree3), 0);
+    EXPECT(int, heap_hash(heap, levels[100]) != heap_hash(heap, tree3), 1);
+
+    // Two-cell cycles, where every cell has one reference
+    int cycles[3];
+    for (int i = 0; i < 3; i++) {
+        int first = rc_cons(heap, red, nil);
+        int second = rc_cons(heap, i < 2 ? red : blue, first);
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, first, second);
+        inc_refcount(heap, second);
+        cycles[i] = first;
+    }
+
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, cycles[0]), 1);
+    EXPECT(int, heap_equal(heap, cycles[0], cycles[1]), 1);
+    EXPECT(int, heap_equal(heap, cycles[0], cycles[2]), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    free_heap(heap);
+}
+
+void test_map() {
+    heap_p heap = malloc_heap(1000, 2000);
+
+    int nil = rc_atom(heap, "nil");
+    int red = rc_atom(heap, "red");
+    int red2 = rc_atom(heap, "red");
+    int blue = rc_atom(heap, "blue");
+    int map = rc_map(heap);
+
+    EXPECT(int, rc_getfield(heap, FIELD_TAG, map), TAG_MAP);
+    EXPECT(int, rc_is_map(heap, map), 1);
+    EXPECT(int, rc_is_map(heap, red), 0);
+    EXPECT(int, rc_map_count(heap, map), 0);
+    EXPECT(int, rc_map_get(heap, map, red), -1);
+
+    // Atom keys are looked up by their text.
+    rc_map_put(heap, map, red, blue);
+    EXPECT(int, rc_map_get(heap, map, red), blue);
+    EXPECT(int, rc_map_get(heap, map, red2), blue);
+    EXPECT(int, rc_map_get(heap, map, blue), -1);
+    EXPECT(int, rc_is_unowned(heap, red), 0);
+    EXPECT(int, rc_is_unowned(heap, blue), 0);
+
+    rc_map_put(heap, map, red2, nil);
+    EXPECT(int, rc_map_count(heap, map), 1);
+    EXPECT(int, rc_map_get(heap, map, red), nil);
+    EXPECT(int, rc_is_unowned(heap, blue), 1);
+
+    // Other keys are looked up by their structure.
+    int list1 = rc_cons(heap, red, rc_cons(heap, blue, nil));
+    int list2 = rc_cons(heap, red2, rc_cons(heap, blue, nil));
+    rc_map_put(heap, map, list1, blue);
+    EXPECT(int, rc_map_get(heap, map, list2), blue);
+    EXPECT(int, rc_map_count(heap, map), 2);
+
+    // Including keys that hold blank cells, which are atoms without text.
+    int blanks = rc_map(heap);
+    int blank = alloc_cell(heap);
+    int pair = rc_cons(heap, blank, blank);
+    rc_map_put(heap, blanks, pair, red);
+    EXPECT(int, rc_map_get(heap, blanks, pair), red);
+    EXPECT(int, rc_map_get(heap, blanks, rc_cons(heap, alloc_cell(heap), blank)), red);
+    rc_free(heap, blanks);
+
+    // Lots of entries, so the table has to grow
+    char text[16];
+    int keys[200];
+    for (int i = 0; i < 200; i++) {
+        sprintf(text, "key%d", i);
+        keys[i] = rc_atom(heap, text);
+        rc_map_put(heap, map, keys[i], i % 2 ? red : blue);
+    }
+
+    EXPECT(int, rc_map_count(heap, map), 202);
+    for (int i = 0; i < 200; i++)
+        EXPECT(int, rc_map_get(heap, map, keys[i]), i % 2 ? red : blue);
+
+    for (int i = 0; i < 200; i += 2)
+        EXPECT(int, rc_map_delete(heap, map, keys[i]), 1);
+
+    EXPECT(int, rc_map_delete(heap, map, keys[0]), 0);
+    EXPECT(int, rc_map_count(heap, map), 102);
+    EXPECT(int, rc_map_get(heap, map, keys[0]), -1);
+    EXPECT(int, rc_map_get(heap, map, keys[1]), red);
+    EXPECT(int, rc_is_unowned(heap, keys[0]), 1);
+
+    int seen = 0;
+    cell_index position = 0, key, value;
+    while ((position = rc_map_next(heap, map, position, &key, &value)))
+        seen++;
+    EXPECT(int, seen, 102);
+
+    // A fork gets its own copy of the map.
+    heap_p fork = heap_fork(heap);
+    rc_map_delete(fork, map, keys[1]);
+    EXPECT(int, rc_map_get(heap, map, keys[1]), red);
+    EXPECT(int, rc_map_get(fork, map, keys[1]), -1);
+    free_heap(fork);
+
+    // Freeing the map lets go of everything in it.
+    rc_free(heap, map);
+    EXPECT(int, rc_is_unowned(heap, list1), 1);
+    EXPECT(int, rc_is_unowned(heap, keys[1]), 1);
+
+    free_heap(heap);
+}
+
+// Count the cells in a heap with the given tag
+int count_tag(heap_p heap, int tag) {
+    int count = 0;
+
+    for (int i = 0; i < cell_count(heap); i++) {
+        if (getfield(heap, FIELD_TAG, i) == tag)
+            count++;
+    }
+
+    return count;
+}
+
+void test_pvec() {
+    heap_p heap = malloc_heap(20000, 100);
+
+    int red = rc_atom(heap, "red");
+    int blue = rc_atom(heap, "blue");
+    int empty = rc_pvec(heap);
+
+    EXPECT(int, rc_getfield(heap, FIELD_TAG, empty), TAG_PVEC);
+    EXPECT(int, rc_pvec_count(heap, empty), 0);
+
+    // Enough items for a trie three levels deep
+    int versions[1100];
+    int vec = empty;
+    for (int i = 0; i < 1100; i++) {
+        vec = rc_pvec_push(heap, vec, i % 3 ? red : blue);
+        versions[i] = vec;
+    }
+
+    EXPECT(int, rc_pvec_count(heap, vec), 1100);
+    EXPECT(int, rc_pvec_count(heap, versions[40]), 41);
+    EXPECT(int, rc_pvec_count(heap, empty), 0);
+    for (int i = 0; i < 1100; i++)
+        EXPECT(int, rc_pvec_get(heap, vec, i), i % 3 ? red : blue);
+
+    int changed = rc_pvec_set(heap, vec, 999, red);
+    EXPECT(int, rc_pvec_get(heap, changed, 999), red);
+    EXPECT(int, rc_pvec_get(heap, vec, 999), blue);
+    EXPECT(int, rc_pvec_get(heap, changed, 1002), blue);
+
+    // Freeing every version frees every node.
+    for (int i = 0; i < 1100; i++)
+        rc_free(heap, versions[i]);
+    EXPECT(int, count_tag(heap, TAG_NODE) > 0, 1);
+    rc_free(heap, changed);
+    EXPECT(int, count_tag(heap, TAG_NODE), 0);
+    EXPECT(int, rc_is_unowned(heap, red), 1);
+    EXPECT(int, rc_is_unowned(heap, blue), 1);
+
+    // A transient vector changes in place and reuses its own nodes.
+    int transient = rc_transient(heap, empty);
+    for (int i = 0; i < 1100; i++)
+        EXPECT(int, rc_pvec_push(heap, transient, i % 2 ? red : blue), transient);
+    EXPECT(int, rc_pvec_set(heap, transient, 5, blue), transient);
+    rc_persistent(heap, transient);
+
+    // 1100 items need 35 leaves, 2 branches and a root.
+    EXPECT(int, count_tag(heap, TAG_NODE), 38);
+    EXPECT(int, rc_pvec_count(heap, transient), 1100);
+    EXPECT(int, rc_pvec_get(heap, transient, 5), blue);
+    EXPECT(int, rc_pvec_get(heap, transient, 7), red);
+
+    // Once it's persistent again, updating it makes a copy.
+    int copy = rc_pvec_set(heap, transient, 7, blue);
+    EXPECT(int, copy != transient, 1);
+    EXPECT(int, rc_pvec_get(heap, transient, 7), red);
+    EXPECT(int, rc_pvec_get(heap, copy, 7), blue);
+
+    rc_free(heap, transient);
+    rc_free(heap, copy);
+    EXPECT(int, count_tag(heap, TAG_NODE), 0);
+
+    free_heap(heap);
+}
+
+void test_pmap() {
+    heap_p heap = malloc_heap(20000, 10000);
+
+    int red = rc_atom(heap, "red");
+    int blue = rc_atom(heap, "blue");
+    int nil = rc_atom(heap, "nil");
+    int empty = rc_pmap(heap);
+
+    EXPECT(int, rc_pmap_count(heap, empty), 0);
+    EXPECT(int, rc_pmap_get(heap, empty, red), -1);
+
+    char text[16];
+    int keys[500];
+    int map = empty;
+    for (int i = 0; i < 500; i++) {
+        sprintf(text, "key%d", i);
+        keys[i] = rc_atom(heap, text);
+
+        int next = rc_pmap_put(heap, map, keys[i], i % 2 ? red : blue);
+        if (map != empty)
+            rc_free(heap, map);
+        map = next;
+    }
+
+    // A list as a key, looked up by its structure
+    int list1 = rc_cons(heap, red, nil);
+    int list2 = rc_cons(heap, red, nil);
+    int with_list = rc_pmap_put(heap, map, list1, nil);
+
+    EXPECT(int, rc_pmap_count(heap, map), 500);
+    EXPECT(int, rc_pmap_count(heap, with_list), 501);
+    EXPECT(int, rc_pmap_get(heap, with_list, list2), nil);
+    EXPECT(int, rc_pmap_get(heap, map, list2), -1);
+    for (int i = 0; i < 500; i++)
+        EXPECT(int, rc_pmap_get(heap, map, keys[i]), i % 2 ? red : blue);
+
+    // Replacing a value doesn't change the count.
+    int replaced = rc_pmap_put(heap, map, keys[3], nil);
+    EXPECT(int, rc_pmap_count(heap, replaced), 500);
+    EXPECT(int, rc_pmap_get(heap, replaced, keys[3]), nil);
+    EXPECT(int, rc_pmap_get(heap, map, keys[3]), red);
+
+    int smaller = map;
+    for (int i = 0; i < 500; i += 2) {
+        int next = rc_pmap_delete(heap, smaller, keys[i]);
+        if (smaller != map)
+            rc_free(heap, smaller);
+        smaller = next;
+    }
+
+    EXPECT(int, rc_pmap_count(heap, smaller), 250);
+    EXPECT(int, rc_pmap_get(heap, smaller, keys[0]), -1);
+    EXPECT(int, rc_pmap_get(heap, smaller, keys[1]), red);
+    EXPECT(int, rc_pmap_get(heap, map, keys[0]), blue);
+
+    // Deleting a key that isn't there changes nothing.
+    int same = rc_pmap_delete(heap, smaller, keys[0]);
+    EXPECT(int, rc_pmap_count(heap, same), 250);
+
+    rc_free(heap, same);
+    rc_free(heap, smaller);
+    rc_free(heap, replaced);
+    rc_free(heap, with_list);
+    rc_free(heap, map);
+    EXPECT(int, count_tag(heap, TAG_NODE), 0);
+    EXPECT(int, rc_is_unowned(heap, keys[1]), 1);
+    EXPECT(int, rc_is_unowned(heap, list1), 1);
+
+    // Building a map with a transient allocates each node just once.
+    int transient = rc_transient(heap, empty);
+    for (int i = 0; i < 500; i++)
+        rc_pmap_put(heap, transient, keys[i], red);
+    for (int i = 0; i < 500; i += 2)
+        rc_pmap_delete(heap, transient, keys[i]);
+    rc_persistent(heap, transient);
+
+    int nodes = count_tag(heap, TAG_NODE);
+    EXPECT(int, nodes > 0 && nodes < 100, 1);
+    EXPECT(int, rc_pmap_count(heap, transient), 250);
+    EXPECT(int, rc_pmap_get(heap, transient, keys[1]), red);
+    EXPECT(int, rc_pmap_get(heap, transient, keys[2]), -1);
+
+    rc_free(heap, transient);
+    EXPECT(int, count_tag(heap, TAG_NODE), 0);
+
+    free_heap(heap);
+}
+
+void test_histogram() {
+    histogram hist;
+    histogram_clear(&hist);
+
+    EXPECT(int, histogram_percentile(&hist, 50), 0);
+
+    // Small values are counted exactly.
+    for (int i = 1; i <= 10; i++)
+        histogram_record(&hist, i);
+    EXPECT(int, histogram_percentile(&hist, 50), 5);
+    EXPECT(int, histogram_percentile(&hist, 100), 10);
+    EXPECT(int, hist.min, 1);
+
+    // Large values are counted to within a few percent.
+    histogram_clear(&hist);
+    for (int i = 1; i <= 100000; i++)
+        histogram_record(&hist, i * 1000);
+
+    int p50 = histogram_percentile(&hist, 50) / 1000;
+    int p99 = histogram_percentile(&hist, 99) / 1000;
+    EXPECT(int, p50 > 48500 && p50 < 51500, 1);
+    EXPECT(int, p99 > 96000 && p99 < 102000, 1);
+    EXPECT(int, histogram_percentile(&hist, 100) == 100000000, 1);
+
+    histogram other;
+    histogram_clear(&other);
+    histogram_record(&other, 5);
+    histogram_merge(&hist, &other);
+    EXPECT(int, hist.count, 100001);
+    EXPECT(int, hist.min, 5);
+    EXPECT(int, histogram_percentile(&hist, 0), 5);
+}
+
+void test_wire() {
+    heap_p heap = malloc_heap(100, 1000);
+    wire_buffer request = {0}, frame = {0}, response = {0};
+    unsigned char op;
+
+    // Varints round-trip, including negative numbers.
+    int numbers[] = {0, 1, -1, 63, -64, 64, 300, -300, 2147483647, -2147483647 - 1};
+    for (int i = 0; i < 10; i++)
+        wire_put_int(&request, numbers[i]);
+
+    wire_reader reader = {(unsigned char *)request.data, (unsigned char *)request.data + request.length, 0};
+    for (int i = 0; i < 10; i++)
+        EXPECT(int, wire_get_int(&reader), numbers[i]);
+    EXPECT(int, reader.failed, 0);
+    EXPECT(int, wire_get_int(&reader), 0);
+    EXPECT(int, reader.failed, 1);
+
+    // A frame is ready only once all of it has arrived.
+    request.length = 0;
+    op = WIRE_ATOM;
+    wire_append(&request, &op, 1);
+    wire_put_string(&request, "apple", 5);
+    op = WIRE_GETATOM;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 0);
+    op = WIRE_GETCELL;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 0);
+    op = WIRE_FREE;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 1);
+    wire_put_frame(&frame, request.data, request.length);
+
+    size_t header, length;
+    EXPECT(int, wire_frame_ready(frame.data, 0, &header, &length), 0);
+    EXPECT(int, wire_frame_ready(frame.data, frame.length - 1, &header, &length), 0);
+    EXPECT(int, wire_frame_ready(frame.data, frame.length, &header, &length), 1);
+    EXPECT(int, header, 1);
+    EXPECT(int, length, (int)request.length);
+    EXPECT(int, wire_is_read_only(request.data, request.length), 0);
+
+    // Each request gets a result, in order.
+    wire_run(heap, frame.data + header, length, &response);
+
+    reader = (wire_reader){(unsigned char *)response.data, (unsigned char *)response.data + response.length, 0};
+    size_t text_length;
+    EXPECT(int, wire_get_uint(&reader), WIRE_OK);
+    EXPECT(int, wire_get_int(&reader), 0);
+    EXPECT(int, wire_get_uint(&reader), WIRE_OK);
+    EXPECT(int, strncmp(wire_get_string(&reader, &text_length), "apple", 5), 0);
+    EXPECT(int, text_length, 5);
+    EXPECT(int, wire_get_uint(&reader), WIRE_OK);
+    EXPECT(int, wire_get_int(&reader), getfield(heap, FIELD_CAR, 0));
+    EXPECT(int, wire_get_int(&reader), 0);
+    EXPECT(int, wire_get_int(&reader), TAG_ATOM);
+    EXPECT(int, wire_get_uint(&reader), WIRE_INVALID_INDEX);
+    EXPECT(int, reader.pos == reader.end, 1);
+
+    // A malformed request stops the frame.
+    request.length = 0;
+    response.length = 0;
+    op = WIRE_GETCAR;
+    wire_append(&request, &op, 1);
+    op = WIRE_CELLCOUNT;
+    wire_append(&request, &op, 1);
+    wire_run(heap, request.data, 1, &response);
+    EXPECT(int, response.length, 1);
+    EXPECT(int, response.data[0], WIRE_MALFORMED);
+    EXPECT(int, wire_is_read_only(request.data, request.length), 1);
+
+    // So does empty atom text, which the heap can't hold.
+    request.length = 0;
+    response.length = 0;
+    op = WIRE_ATOM;
+    wire_append(&request, &op, 1);
+    wire_put_string(&request, "", 0);
+    op = WIRE_SETATOM;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 0);
+    wire_put_string(&request, "", 0);
+    wire_run(heap, request.data, request.length, &response);
+    EXPECT(int, response.length, 1);
+    EXPECT(int, response.data[0], WIRE_MALFORMED);
+
+    wire_run(heap, request.data + 2, request.length - 2, &response);
+    EXPECT(int, response.length, 2);
+    EXPECT(int, response.data[1], WIRE_MALFORMED);
+    EXPECT_STR(getatom(heap, 0), "apple");
+
+    // Atom text that doesn't fit is refused.
+    heap_p full = malloc_heap(10, 6);
+    rc_atom(full, "apple");
+
+    request.length = 0;
+    response.length = 0;
+    op = WIRE_ATOM;
+    wire_append(&request, &op, 1);
+    wire_put_string(&request, "banana", 6);
+    op = WIRE_SETATOM;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 0);
+    wire_put_string(&request, "banana", 6);
+    op = WIRE_ATOM;
+    wire_append(&request, &op, 1);
+    wire_put_string(&request, "apple", 5);
+    wire_run(full, request.data, request.length, &response);
+
+    reader = (wire_reader){(unsigned char *)response.data, (unsigned char *)response.data + response.length, 0};
+    EXPECT(int, wire_get_uint(&reader), WIRE_NO_SPACE);
+    EXPECT(int, wire_get_uint(&reader), WIRE_NO_SPACE);
+    EXPECT(int, wire_get_uint(&reader), WIRE_OK);
+    EXPECT(int, wire_get_int(&reader), 1);
+    EXPECT(int, reader.pos == reader.end, 1);
+    EXPECT_STR(getatom(full, 0), "apple");
+    free_heap(full);
+
+    // A failed request aborts the frame's transaction.
+    int next_index = alloc_cell(heap);
+    free_cell(heap, next_index);
+
+    request.length = 0;
+    response.length = 0;
+    op = WIRE_BEGIN;
+    wire_append(&request, &op, 1);
+    op = WIRE_ATOM;
+    wire_append(&request, &op, 1);
+    wire_put_string(&request, "banana", 6);
+    op = WIRE_FREE;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 99);
+    op = WIRE_CELLCOUNT;
+    wire_append(&request, &op, 1);
+    op = WIRE_COMMIT;
+    wire_append(&request, &op, 1);
+    wire_run(heap, request.data, request.length, &response);
+
+    EXPECT(int, response.length, 6);
+    EXPECT(int, response.data[0], WIRE_OK);
+    EXPECT(int, response.data[1], WIRE_OK);
+    EXPECT(int, response.data[3], WIRE_INVALID_INDEX);
+    EXPECT(int, response.data[4], WIRE_ABORTED);
+    EXPECT(int, response.data[5], WIRE_ABORTED);
+    EXPECT(int, heap_in_transaction(heap), 0);
+    EXPECT(int, getfield(heap, FIELD_TAG, next_index), TAG_FREED);
+
+    free(request.data);
+    free(frame.data);
+    free(response.data);
+    free_heap(heap);
+}
+
+#define TXN_HEAP_SIZE 200
+
+void test_server() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/poutine-test-%d.sock", (int)getpid());
+
+    fflush(stdout);
+    pid_t child = fork();
+
+    if (child == 0) {
+        // The server says where it's listening on stderr. It shouldn't outlive
+        // the tests if they fail.
+        freopen("/dev/null", "w", stderr);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        heap = malloc_heap(1000, 1000);
+        server_options options = {.socket_path = path, .threads = 2};
+        _exit(server_run(&options));
+    }
+
+    int text = connect_to_server(path);
+    int binary = connect_to_server(path);
+    int greedy = connect_to_server(path);
+
+    // Commands that only read the heap alternate with ones that write it,
+    // more of them than run under one acquisition of the lock.
+    char commands[4096] = "atom apple\n";
+    char expected[4096] = "0\n\n";
+    for (int i = 1; i <= 100; i++) {
+        strcat(commands, "cons 0 0\ngetatom 0\n");
+        sprintf(expected + strlen(expected), "%d\n\napple\n\n", i);
+    }
+    strcat(commands, "begin\nfoo\n");
+    strcat(expected, "! Transactions are only available to binary clients of the server\n\n");
+    strcat(expected, "! Unrecognized command: foo\n\n");
+
+    // Clients can't have the server write or read files.
+    char dump_path[80];
+    snprintf(dump_path, sizeof(dump_path), "%s.dump", path);
+    sprintf(commands + strlen(commands), "dump %s\n load %s\n", dump_path, dump_path);
+    strcat(expected, "! Files can't be read or written by clients of the server\n\n");
+    strcat(expected, "! Files can't be read or written by clients of the server\n\n");
+
+    EXPECT(int, (int)write(text, commands, strlen(commands)), (int)strlen(commands));
+    char *response = read_bytes(text, strlen(expected));
+    EXPECT_STR(response, expected);
+    EXPECT(int, access(dump_path, F_OK), -1);
+    free(response);
+
+    // A binary client sees the same heap.
+    wire_buffer request = {0}, frame = {0};
+    unsigned char op = WIRE_HELLO;
+    wire_append(&frame, &op, 1);
+    op = WIRE_ATOM;
+    wire_append(&request, &op, 1);
+    wire_put_string(&request, "pear", 4);
+    op = WIRE_GETCAR;
+    wire_append(&request, &op, 1);
+    wire_put_int(&request, 100);
+    wire_put_frame(&frame, request.data, request.length);
+    EXPECT(int, (int)write(binary, frame.data, frame.length), (int)frame.length);
+
+    // The response's length comes first, as a varint.
+    unsigned char header[10];
+    int got = 0;
+    do {
+        EXPECT(int, (int)read(binary, header + got, 1), 1);
+    } while (header[got++] & 0x80 && got < sizeof(header));
+
+    wire_reader reader = {header, header + got, 0};
+    size_t length = wire_get_uint(&reader);
+    response = read_bytes(binary, length);
+    reader = (wire_reader){(unsigned char *)response, (unsigned char *)response + length, 0};
+    EXPECT(int, wire_get_uint(&reader), WIRE_OK);
+    EXPECT(int, wire_get_int(&reader), 101);
+    EXPECT(int, wire_get_uint(&reader), WIRE_OK);
+    EXPECT(int, wire_get_int(&reader), 0);
+    EXPECT(int, reader.pos == reader.end, 1);
+    free(response);
+
+    strcpy(commands, "getatom 101\n");
+    EXPECT(int, (int)write(text, commands, strlen(commands)), (int)strlen(commands));
+    response = read_bytes(text, 6);
+    EXPECT_STR(response, "pear\n\n");
+    free(response);
+
+    // A line too long for the shell gets an error, and the client is cut off.
+    memset(commands, 'x', 2000);
+    EXPECT(int, (int)write(greedy, commands, 2000), 2000);
+    response = read_bytes(greedy, 100);
+    EXPECT_STR(response, "! Command is too long\n\n");
+    free(response);
+
+    close(text);
+    close(binary);
+    close(greedy);
+    free(request.data);
+    free(frame.data);
+
+    int status;
+    kill(child, SIGTERM);
+    EXPECT(int, waitpid(child, &status, 0), child);
+    EXPECT(int, WIFEXITED(status) && WEXITSTATUS(status) == 0, 1);
+}
+
+int connect_to_server(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, path);
+
+    for (int tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        EXPECT(int, fd >= 0, 1);
+
+        // Don't wait forever for a response that isn't coming.
+        struct timeval timeout = {.tv_sec = 10};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+            return fd;
+
+        close(fd);
+        usleep(10000);
+    }
+
+    PANIC("The server didn't start listening on %s", path);
+}
+
+char *read_bytes(int fd, size_t length) {
+    char *data = malloc(length + 1);
+    size_t got = 0;
+
+    while (got < length) {
+        ssize_t count = read(fd, data + got, length - got);
+        if (count <= 0)
+            break;
+        got += count;
+    }
+
+    data[got] = '\0';
+    return data;
+}
+
+void test_pipeline() {
+    // Every kind of request, succeeding and failing in every way, and some
+    // commands that stay as text, including ones with bad arguments.
+    char commands[4096] =
+        "atom nil\natom apple\ncons 1 0\ngetcar 2\ngetcdr 2\ngettag 2\ngettag 0\ngetatom 1\ngetatom 2\n"
+        "getatom 50\nsetcar 50 1\nsettag 50 cons\nsettag 3 banana\nsetatom 1 cherry\ngetatom 1\n"
+        "cons 7 0\ncons 0 7\nfree 0\nfree 9\n"
+        "map\nmapput 3 1 2\nmapput 3 3 1\nmapput 3 1 9\nmapput 1 1 1\nmapget 3 1\nmapget 3 0\nmapget 3 9\n"
+        "mapcount 3\nmapdel 3 0\nmapdel 3 1\nmapcount 1\ncellcount\n"
+        "begin\nbegin\ncollect\nminor\nnursery 4\ncommit\ncommit\nabort\n"
+        "nursery -1\nincremental -1\nhashcons on\nhashcons maybe\ncons 1 0\ncons 1 0\ncollect\nminor\n"
+        "verify\nfoo\ngetcar\ngetcar 1 2\ngetcar x\n\n";
+    for (int i = 0; i < 20; i++)
+        strcat(commands, "alloc\n");
+    strcat(commands, "reinit 0\nreinit 10\ncellcount\n");
+
+    // The new heap only has room for one of these atoms.
+    strcat(commands, "atom abcdefgh\natom ijklmnop\nsetatom 0 ijklmnop\natom abcdefgh\n");
+    atom_text_size = 16;
+
+    FILE *saved_out = command_out;
+    FILE *saved_err = command_err;
+    char *output[2][2];
+    size_t length[2][2];
+
+    // First the shell's way, then the pipeline's.
+    for (int piped = 0; piped <= 1; piped++) {
+        heap = malloc_heap(20, 1000);
+        FILE *out = open_memstream(&output[piped][0], &length[piped][0]);
+        FILE *err = open_memstream(&output[piped][1], &length[piped][1]);
+
+        if (piped) {
+            int fds[2];
+            EXPECT(int, pipe(fds), 0);
+            EXPECT(int, (int)write(fds[1], commands, strlen(commands)), (int)strlen(commands));
+            close(fds[1]);
+
+            EXPECT(int, pipeline_run(fds[0], out, err, NULL), 1);
+            close(fds[0]);
+        } else {
+            FILE *in = fmemopen(commands, strlen(commands), "r");
+            char command[1024];
+
+            command_out = out;
+            command_err = err;
+            while (fgets(command, sizeof(command), in))
+                run_command(command);
+            fclose(in);
+        }
+
+        fclose(out);
+        fclose(err);
+        free_heap(heap);
+    }
+
+    EXPECT_STR(output[1][0], output[0][0]);
+    EXPECT_STR(output[1][1], output[0][1]);
+    EXPECT(int, strstr(output[0][1], "Invalid index: 7\nInvalid index: 7\n") != NULL, 1);
+    EXPECT(int, strstr(output[0][1], "No free cells\n") != NULL, 1);
+    EXPECT(int, strstr(output[0][1], "No room for the atom text\n") != NULL, 1);
+
+    for (int i = 0; i < 2; i++) {
+        free(output[i][0]);
+        free(output[i][1]);
+    }
+
+    command_out = saved_out;
+    command_err = saved_err;
+    atom_text_size = ATOM_TEXT_SIZE;
+}
+
+void test_transactions() {
+    heap_p heap = malloc_heap(TXN_HEAP_SIZE, 1000);
+    rc_set_hashcons(heap, 1);
+
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+    int list = rc_cons(heap, apple, nil);
+    int map = rc_map(heap);
+    rc_map_put(heap, map, apple, list);
+    int vec = rc_transient(heap, rc_pvec(heap));
+    for (int i = 0; i < 40; i++)
+        rc_pvec_push(heap, vec, apple);
+
+    int before[TXN_HEAP_SIZE][4];
+    for (int i = 0; i < TXN_HEAP_SIZE; i++) {
+        for (int field = 0; field < 4; field++)
+            before[i][field] = getfield(heap, field, i);
+    }
+
+    // Make a mess, running out of cells along the way, then abort.
+    heap_begin(heap);
+    EXPECT(int, heap_in_transaction(heap), 1);
+
+    int banana = rc_atom(heap, "banana");
+    rc_map_put(heap, map, banana, nil);
+    rc_map_delete(heap, map, apple);
+    rc_free(heap, list);
+    for (int i = 0; i < 100; i++)
+        rc_pvec_push(heap, vec, banana);
+    rc_pvec_set(heap, vec, 3, banana);
+
+    int cells = 0;
+    for (int chain = nil; chain != -1; chain = rc_cons(heap, banana, chain))
+        cells++;
+    EXPECT(int, cells > 10, 1);
+
+    heap_abort(heap);
+    EXPECT(int, heap_in_transaction(heap), 0);
+
+    for (int i = 0; i < TXN_HEAP_SIZE; i++) {
+        for (int field = 0; field < 4; field++)
+            EXPECT(int, getfield(heap, field, i), before[i][field]);
+    }
+
+    EXPECT(int, rc_map_count(heap, map), 1);
+    EXPECT(int, rc_map_get(heap, map, apple), list);
+    EXPECT(int, rc_pvec_count(heap, vec), 40);
+    EXPECT(int, rc_pvec_get(heap, vec, 3), apple);
+
+    // The restored cells are hash-consed again, and the aborted atom text
+    // is gone.
+    EXPECT(int, rc_cons(heap, apple, nil), list);
+    EXPECT(int, rc_atom(heap, "banana"), banana);
+    EXPECT_STR(getatom(heap, banana), "banana");
+
+    // Committed changes stay.
+    heap_begin(heap);
+    int cherry = rc_atom(heap, "cherry");
+    rc_map_put(heap, map, cherry, nil);
+    rc_pvec_push(heap, vec, cherry);
+    heap_commit(heap);
+
+    EXPECT(int, rc_map_get(heap, map, cherry), nil);
+    EXPECT(int, rc_pvec_count(heap, vec), 41);
+    EXPECT_STR(getatom(heap, cherry), "cherry");
+
+    // Aborting an empty transaction changes nothing.
+    heap_begin(heap);
+    heap_abort(heap);
+    EXPECT(int, rc_pvec_get(heap, vec, 40), cherry);
+
+    // Freeing the heap in the middle of a transaction is fine.
+    heap_begin(heap);
+    rc_map_delete(heap, map, cherry);
+    free_heap(heap);
+}
+
+void test_scan() {
+    int avx2_supported = scan_use_avx2(1);
+    scan_set_threads(3);
+
+    // The big heap is split between three threads.
+    for (int big = 0; big <= 1; big++) {
+        heap_p heap = malloc_heap(big ? 3 << 20 : 200, 1000);
+
+        int nil = rc_atom(heap, "nil");
+        int apple = rc_atom(heap, "apple");
+        int list = nil;
+        for (int i = 0; i < 50; i++)
+            list = rc_cons(heap, apple, list);
+
+        int map = rc_map(heap);
+        rc_map_put(heap, map, apple, list);
+        int blank = alloc_cell(heap);
+
+        int empty = rc_pvec(heap);
+        int vec = rc_transient(heap, empty);
+        for (int i = 0; i < 40; i++)
+            rc_pvec_push(heap, vec, nil);
+        rc_persistent(heap, vec);
+        rc_free(heap, empty);
+
+        int last = cell_count(heap) - 1;
+
+        for (int avx2 = 0; avx2 <= avx2_supported; avx2++) {
+            scan_use_avx2(avx2);
+
+            size_t counts[SCAN_TAG_COUNT];
+            scan_tag_counts(heap, counts);
+            EXPECT(int, (int)counts[TAG_ATOM], 3);
+            EXPECT(int, (int)counts[TAG_CONS], 50);
+            EXPECT(int, (int)counts[TAG_FREED], 1);
+            EXPECT(int, (int)counts[TAG_MAP], 1);
+            EXPECT(int, (int)counts[TAG_PVEC], 1);
+            EXPECT(int, (int)scan_count_tag(heap, TAG_CONS), 50);
+
+            cell_index results[4];
+            EXPECT(int, (int)scan_filter_tag(heap, TAG_ATOM, results, 2), 3);
+            EXPECT(int, results[0], nil);
+            EXPECT(int, results[1], apple);
+            EXPECT(int, (int)scan_unowned(heap, results, 4), 3);
+            EXPECT(int, results[0], map);
+            EXPECT(int, results[1], blank);
+            EXPECT(int, results[2], vec);
+            EXPECT(int, (int)scan_bad_conses(heap, results, 4), 0);
+            EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+            // Pointing a cons at a freed cell makes the cons bad, and leaves
+            // its old car with more references counted than there are.
+            setfield(heap, FIELD_CAR, list, empty);
+            EXPECT(int, (int)scan_bad_conses(heap, results, 4), 1);
+            EXPECT(int, results[0], list);
+            EXPECT(int, (int)heap_verify(heap, 0), 2);
+            setfield(heap, FIELD_CAR, list, apple);
+
+            // Cells past the initialized ones should be blank.
+            char report[256] = {0};
+            char expected[64];
+            sprintf(expected, "Cell %d is malformed", last);
+
+            setfield(heap, FIELD_CDR, last, 7);
+            FILE *out = fmemopen(report, sizeof(report), "w");
+            EXPECT(int, (int)heap_verify(heap, out), 1);
+            fclose(out);
+            EXPECT(int, strstr(report, expected) != 0, 1);
+            setfield(heap, FIELD_CDR, last, 0);
+
+            inc_refcount(heap, apple);
+            EXPECT(int, (int)heap_verify(heap, 0), 1);
+            dec_refcount(heap, apple);
+
+            // A cycle in the free list
+            setfield(heap, FIELD_CAR, empty, empty);
+            EXPECT(int, (int)heap_verify(heap, 0), 1);
+            setfield(heap, FIELD_CAR, empty, -1);
+            EXPECT(int, (int)heap_verify(heap, 0), 0);
+        }
+
+        free_heap(heap);
+    }
+
+    scan_use_avx2(avx2_supported);
+    scan_set_threads(0);
+}
+
+void test_gc() {
+    gc_set_threads(3);
+
+    // The big heap is marked and swept by three threads. Its fork shares all
+    // of its chunks, so the fork is swept on one thread.
+    for (int big = 0; big <= 1; big++) {
+        heap_p heap = malloc_heap(big ? 3 << 20 : 200, 1000);
+
+        int nil = rc_atom(heap, "nil");
+        int apple = rc_atom(heap, "apple");
+        int list = nil;
+        for (int i = 0; i < 20; i++)
+            list = rc_cons(heap, apple, list);
+
+        int live = rc_map(heap);
+        rc_map_put(heap, live, nil, list);
+
+        // Two maps holding each other
+        int first = rc_map(heap);
+        int second = rc_map(heap);
+        rc_map_put(heap, first, apple, second);
+        rc_map_put(heap, second, apple, first);
+
+        // Pairs of conses pointing at each other
+        int pairs = big ? 1 << 20 : 10;
+        for (int i = 0; i < pairs; i++) {
+            int tail = rc_cons(heap, apple, nil);
+            int head = rc_cons(heap, apple, tail);
+            dec_refcount(heap, nil);
+            setfield(heap, FIELD_CDR, tail, head);
+            inc_refcount(heap, head);
+        }
+
+        // A persistent vector holding a map which holds the vector
+        int holder = rc_map(heap);
+        int empty = rc_pvec(heap);
+        int vec = rc_pvec_push(heap, empty, holder);
+        rc_free(heap, empty);
+        rc_map_put(heap, holder, apple, vec);
+
+        EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+        // The atoms, the list and the live map are all that's left.
+        int garbage = cells_in_use(heap) - 23;
+        heap_p fork = heap_fork(heap);
+
+        for (int forked = 0; forked <= 1; forked++) {
+            heap_p h = forked ? fork : heap;
+
+            EXPECT(int, (int)heap_collect(h), garbage);
+            EXPECT(int, cells_in_use(h), 23);
+            EXPECT(int, (int)scan_count_tag(h, TAG_MAP), 1);
+            EXPECT(int, (int)scan_count_tag(h, TAG_NODE), 0);
+            EXPECT(int, rc_map_get(h, live, nil), list);
+            EXPECT(int, getfield(h, FIELD_REFCOUNT, apple), 20);
+            EXPECT(int, getfield(h, FIELD_REFCOUNT, nil), 2);
+            EXPECT(int, (int)heap_verify(h, 0), 0);
+            EXPECT(int, (int)heap_collect(h), 0);
+
+            // The freed cells can be used again.
+            int pair = rc_cons(h, apple, nil);
+            EXPECT(int, getfield(h, FIELD_TAG, pair), TAG_CONS);
+            EXPECT(int, (int)heap_verify(h, 0), 0);
+        }
+
+        free_heap(fork);
+        free_heap(heap);
+    }
+
+    gc_set_threads(0);
+}
+
+void test_incremental_gc() {
+    heap_p heap = malloc_heap(4000, 1000);
+    gc_set_incremental(heap, 20);
+
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+    int list = nil;
+    for (int i = 0; i < 20; i++)
+        list = rc_cons(heap, apple, list);
+
+    // Far more cycles than fit in the heap at once
+    for (int i = 0; i < 10000; i++) {
+        int tail = rc_cons(heap, apple, nil);
+        int head = rc_cons(heap, apple, tail);
+        EXPECT(int, head != -1, 1);
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, tail, head);
+        inc_refcount(heap, head);
+    }
+
+    EXPECT(int, gc_pauses(heap)->count > 0, 1);
+    gc_finish(heap);
+    gc_start(heap);
+    gc_finish(heap);
+    EXPECT(int, cells_in_use(heap), 22);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), 20);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    free_heap(heap);
+
+    // Move a cons from a root the collector hasn't looked at yet to one that
+    // it has. The write barrier has to keep the cons from being collected.
+    heap = malloc_heap(4000, 1000);
+    nil = rc_atom(heap, "nil");
+    apple = rc_atom(heap, "apple");
+    int early = rc_cons(heap, nil, nil);
+    for (int i = 0; i < 100; i++)
+        rc_atom(heap, "filler");
+    int moved = rc_cons(heap, apple, nil);
+    int late = rc_cons(heap, moved, nil);
+
+    gc_start(heap);
+    gc_step(heap, 40);
+    EXPECT(int, gc_running(heap), 1);
+
+    // Swapping the cars leaves the reference counts as they were.
+    setfield(heap, FIELD_CAR, early, moved);
+    setfield(heap, FIELD_CAR, late, nil);
+    rc_free(heap, late);
+
+    EXPECT(int, (int)gc_finish(heap), 0);
+    EXPECT(int, getfield(heap, FIELD_TAG, moved), TAG_CONS);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Nothing happens during a transaction, and aborting one doesn't confuse
+    // the running cycle.
+    gc_set_incremental(heap, 5);
+    gc_start(heap);
+    heap_begin(heap);
+    int pair = rc_cons(heap, apple, nil);
+    rc_free(heap, early);
+    EXPECT(int, getfield(heap, FIELD_TAG, pair), TAG_CONS);
+    heap_abort(heap);
+    EXPECT(int, gc_running(heap), 1);
+    EXPECT(int, (int)gc_finish(heap), 0);
+    EXPECT(int, getfield(heap, FIELD_TAG, early), TAG_CONS);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Stop a cycle once some of its garbage has let go of its references.
+    // Cancelling it, or forking the heap, can't leave those references to be
+    // let go of again.
+    int apples = getfield(heap, FIELD_REFCOUNT, apple);
+    for (int i = 0; i < 10; i++) {
+        int tail = rc_cons(heap, apple, nil);
+        int head = rc_cons(heap, apple, tail);
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, tail, head);
+        inc_refcount(heap, head);
+    }
+
+    gc_start(heap);
+    while (getfield(heap, FIELD_REFCOUNT, apple) == apples + 20)
+        gc_step(heap, 1);
+    EXPECT(int, gc_running(heap), 1);
+
+    heap_p fork = heap_fork(heap);
+    gc_cancel(heap);
+    EXPECT(int, gc_running(heap), 0);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), apples);
+    EXPECT(int, (int)heap_collect(heap), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    EXPECT(int, gc_running(fork), 1);
+    gc_finish(fork);
+    EXPECT(int, getfield(fork, FIELD_REFCOUNT, apple), apples);
+    EXPECT(int, (int)heap_verify(fork, 0), 0);
+
+    free_heap(fork);
+    free_heap(heap);
+}
+
+void test_nursery() {
+    heap_p heap = malloc_heap(10000, 1000);
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+
+    EXPECT(int, heap_set_nursery(heap, 20000), 0);
+    EXPECT(int, heap_set_nursery(heap, 1000), 1);
+
+    // Allocation in the nursery goes in order.
+    int first = rc_cons(heap, apple, nil);
+    EXPECT(int, first, 2);
+    EXPECT(int, rc_cons(heap, apple, nil), 3);
+
+    int list = nil;
+    for (int i = 0; i < 50; i++)
+        list = rc_cons(heap, apple, list);
+
+    // A young cons that only an old map refers to
+    int held = rc_cons(heap, apple, nil);
+    int map = rc_map(heap);
+    EXPECT(int, map >= 1002, 1);
+    rc_map_put(heap, map, apple, held);
+
+    // A young cons that only young garbage refers to
+    int dropped = rc_cons(heap, apple, nil);
+    int tail = rc_cons(heap, dropped, nil);
+    int head = rc_cons(heap, apple, tail);
+    dec_refcount(heap, nil);
+    setfield(heap, FIELD_CDR, tail, head);
+    inc_refcount(heap, head);
+
+    for (int i = 0; i < 100; i++) {
+        tail = rc_cons(heap, apple, nil);
+        head = rc_cons(heap, apple, tail);
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, tail, head);
+        inc_refcount(heap, head);
+    }
+
+    EXPECT(int, (int)minor_collect(heap), 203);
+    EXPECT(int, (int)heap_nursery_stats(heap).collections, 1);
+    EXPECT(int, (int)heap_nursery_stats(heap).promoted, 53);
+    EXPECT(int, rc_map_get(heap, map, apple), held);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), 54);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Promoted cells are old, so there's nothing more to collect, and
+    // allocation starts again with the first free cell.
+    EXPECT(int, (int)minor_collect(heap), 0);
+    EXPECT(int, rc_cons(heap, apple, nil), dropped);
+
+    // Minor collections happen by themselves once the nursery fills up.
+    for (int i = 0; i < 10000; i++) {
+        tail = rc_cons(heap, apple, nil);
+        head = rc_cons(heap, apple, tail);
+        EXPECT(int, head >= 2 && head < 1002, 1);
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, tail, head);
+        inc_refcount(heap, head);
+    }
+
+    EXPECT(int, heap_nursery_stats(heap).collections > 10, 1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Freeing a young cell leaves it blank, and aborting a transaction undoes
+    // allocation in the nursery.
+    rc_free(heap, first);
+    EXPECT(int, getfield(heap, FIELD_TAG, first), TAG_UNINIT);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    heap_begin(heap);
+    int temporary = rc_cons(heap, apple, nil);
+    heap_abort(heap);
+    EXPECT(int, getfield(heap, FIELD_TAG, temporary), TAG_UNINIT);
+    EXPECT(int, rc_cons(heap, apple, nil), temporary);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // A full collection leaves young garbage blank rather than putting it on
+    // the free list, so allocation carries on in the nursery without a minor
+    // collection each time.
+    for (int i = 0; i < 100; i++) {
+        tail = rc_cons(heap, apple, nil);
+        head = rc_cons(heap, apple, tail);
+        dec_refcount(heap, nil);
+        setfield(heap, FIELD_CDR, tail, head);
+        inc_refcount(heap, head);
+    }
+
+    EXPECT(int, heap_collect(heap) >= 200, 1);
+    EXPECT(int, getfield(heap, FIELD_TAG, head), TAG_UNINIT);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    size_t collections = heap_nursery_stats(heap).collections;
+    for (int i = 0; i < 1000; i++) {
+        int pair = rc_cons(heap, apple, nil);
+        EXPECT(int, pair >= 2 && pair < 1002, 1);
+        rc_free(heap, pair);
+    }
+
+    EXPECT(int, heap_nursery_stats(heap).collections <= collections + 1, 1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Turning the nursery off puts its free cells on the free list.
+    EXPECT(int, heap_set_nursery(heap, 0), 1);
+    EXPECT(int, getfield(heap, FIELD_TAG, first), TAG_FREED);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    free_heap(heap);
+}
+
+void test_regions() {
+    heap_p heap = malloc_heap(1000, 1000);
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+    rc_free(heap, rc_atom(heap, "stray"));
+
+    // A region's cells come from the end of the heap, not the free list, and
+    // all go away when it ends.
+    int region = heap_region_begin(heap);
+    EXPECT(int, region, 1);
+    EXPECT(int, heap_region_depth(heap), 1);
+
+    int list = nil;
+    for (int i = 0; i < 100; i++)
+        list = rc_cons(heap, apple, list);
+
+    EXPECT(int, list, 102);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), 100);
+    EXPECT(int, (int)heap_region_end(heap, region), 100);
+    EXPECT(int, heap_region_depth(heap), 0);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), 0);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, nil), 0);
+    EXPECT(int, getfield(heap, FIELD_TAG, list), TAG_UNINIT);
+    EXPECT(int, cells_in_use(heap), 2);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // A cell freed inside a region is blank until the region ends.
+    region = heap_region_begin(heap);
+    int freed = rc_cons(heap, apple, nil);
+    int kept = rc_cons(heap, apple, nil);
+    rc_free(heap, freed);
+    EXPECT(int, getfield(heap, FIELD_TAG, freed), TAG_UNINIT);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    EXPECT(int, rc_cons(heap, apple, kept), kept + 1);
+    EXPECT(int, (int)heap_region_end(heap, region), 2);
+
+    // Regions nest.
+    int outer = heap_region_begin(heap);
+    int x = rc_cons(heap, apple, nil);
+    int inner = heap_region_begin(heap);
+    EXPECT(int, inner, 2);
+    rc_cons(heap, apple, x);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, x), 1);
+    EXPECT(int, (int)heap_region_end(heap, inner), 1);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, x), 0);
+    EXPECT(int, (int)heap_region_end(heap, outer), 1);
+    EXPECT(int, cells_in_use(heap), 2);
+
+    // If something escapes, nothing is freed.
+    int map = rc_map(heap);
+    region = heap_region_begin(heap);
+    freed = rc_cons(heap, apple, nil);
+    int held = rc_cons(heap, apple, nil);
+    int other = rc_cons(heap, apple, held);
+    rc_free(heap, freed);
+    rc_map_put(heap, map, apple, held);
+    EXPECT(int, (int)heap_region_end(heap, region), -1);
+    EXPECT(int, rc_map_get(heap, map, apple), held);
+    EXPECT(int, getfield(heap, FIELD_TAG, other), TAG_CONS);
+    EXPECT(int, getfield(heap, FIELD_TAG, freed), TAG_FREED);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    rc_free(heap, other);
+
+    // Aborting a transaction gets rid of the regions begun during it, and a
+    // region begun during a transaction can end after it.
+    heap_begin(heap);
+    heap_region_begin(heap);
+    rc_cons(heap, apple, nil);
+    heap_abort(heap);
+    EXPECT(int, heap_region_depth(heap), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    heap_begin(heap);
+    region = heap_region_begin(heap);
+    rc_cons(heap, apple, nil);
+    heap_commit(heap);
+    EXPECT(int, (int)heap_region_end(heap, region), 1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Collecting garbage in a region leaves the garbage blank.
+    region = heap_region_begin(heap);
+    int tail = rc_cons(heap, apple, nil);
+    int head = rc_cons(heap, apple, tail);
+    dec_refcount(heap, nil);
+    setfield(heap, FIELD_CDR, tail, head);
+    inc_refcount(heap, head);
+    rc_cons(heap, apple, nil);
+    EXPECT(int, (int)heap_collect(heap), 2);
+    EXPECT(int, getfield(heap, FIELD_TAG, head), TAG_UNINIT);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    EXPECT(int, (int)heap_region_end(heap, region), 1);
+
+    // Regions don't use the nursery, and forget their hash-consed cells.
+    EXPECT(int, heap_set_nursery(heap, 100), 1);
+    int young = rc_cons(heap, apple, nil);
+    rc_set_hashcons(heap, 1);
+    region = heap_region_begin(heap);
+    x = rc_cons(heap, nil, apple);
+    EXPECT(int, x >= young + 100, 1);
+    EXPECT(int, rc_cons(heap, nil, apple), x);
+    EXPECT(int, (int)heap_region_end(heap, region), 1);
+    EXPECT(int, rc_cons(heap, nil, apple), young + 1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    free_heap(heap);
+}
+
+void test_weak() {
+    heap_p heap = malloc_heap(1000, 1000);
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+    rc_cons(heap, apple, nil);
+
+    // Weak references don't count as references, and are cleared when their
+    // target is freed.
+    int target = rc_cons(heap, apple, nil);
+    int weak = rc_weak(heap, target);
+    int other = rc_weak(heap, target);
+    EXPECT(int, rc_is_weak(heap, weak), 1);
+    EXPECT(int, rc_weak_get(heap, weak), target);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, target), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    rc_free(heap, target);
+    EXPECT(int, rc_weak_get(heap, weak), -1);
+    EXPECT(int, rc_weak_get(heap, other), -1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    rc_free(heap, weak);
+    rc_free(heap, other);
+
+    // Freeing a weak reference leaves the others alone.
+    target = rc_cons(heap, apple, nil);
+    weak = rc_weak(heap, target);
+    other = rc_weak(heap, target);
+    rc_free(heap, other);
+    EXPECT(int, rc_weak_get(heap, weak), target);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    rc_free(heap, target);
+    EXPECT(int, rc_weak_get(heap, weak), -1);
+    rc_free(heap, weak);
+
+    // They're cleared by collections, too.
+    int tail = rc_cons(heap, apple, nil);
+    int head = rc_cons(heap, apple, tail);
+    dec_refcount(heap, nil);
+    setfield(heap, FIELD_CDR, tail, head);
+    inc_refcount(heap, head);
+    weak = rc_weak(heap, head);
+    EXPECT(int, (int)heap_collect(heap), 2);
+    EXPECT(int, rc_weak_get(heap, weak), -1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    rc_free(heap, weak);
+
+    EXPECT(int, heap_set_nursery(heap, 100), 1);
+    tail = rc_cons(heap, apple, nil);
+    head = rc_cons(heap, apple, tail);
+    dec_refcount(heap, nil);
+    setfield(heap, FIELD_CDR, tail, head);
+    inc_refcount(heap, head);
+    weak = rc_weak(heap, tail);
+    EXPECT(int, (int)minor_collect(heap), 2);
+    EXPECT(int, rc_weak_get(heap, weak), -1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    rc_free(heap, weak);
+
+    int region = heap_region_begin(heap);
+    target = rc_cons(heap, apple, nil);
+    weak = rc_weak(heap, target);
+    EXPECT(int, (int)heap_region_end(heap, region), 2);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Aborting a transaction undoes clearing, and making weak references.
+    target = rc_atom(heap, "target");
+    weak = rc_weak(heap, target);
+    heap_begin(heap);
+    rc_weak(heap, apple);
+    rc_free(heap, target);
+    heap_abort(heap);
+    EXPECT(int, rc_weak_get(heap, weak), target);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // A fork has weak references of its own.
+    heap_p fork = heap_fork(heap);
+    rc_free(fork, target);
+    EXPECT(int, rc_weak_get(fork, weak), -1);
+    EXPECT(int, rc_weak_get(heap, weak), target);
+    EXPECT(int, (int)heap_verify(fork, 0), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+    free_heap(fork);
+
+    // A weak-keyed map doesn't keep its keys alive, and compares them by
+    // identity.
+    int map = rc_weak_map(heap);
+    int first = rc_cons(heap, apple, nil);
+    int second = rc_cons(heap, nil, apple);
+    int value = rc_atom(heap, "value");
+    rc_map_put(heap, map, first, value);
+    rc_map_put(heap, map, second, value);
+    EXPECT(int, rc_map_get(heap, map, first), value);
+    EXPECT(int, rc_map_get(heap, map, rc_cons(heap, nil, apple)), -1);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, first), 0);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, value), 2);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    rc_free(heap, first);
+    EXPECT(int, rc_map_count(heap, map), 2);
+    EXPECT(int, rc_map_prune(heap, map), 1);
+    EXPECT(int, rc_map_count(heap, map), 1);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, value), 1);
+
+    cell_index key, found;
+    cell_index position = rc_map_next(heap, map, 0, &key, &found);
+    EXPECT(int, key, second);
+    EXPECT(int, rc_map_next(heap, map, position, &key, &found), 0);
+
+    EXPECT(int, rc_map_delete(heap, map, second), 1);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, value), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    // Entries whose keys are gone are pruned as the map grows.
+    for (int i = 0; i < 100; i++) {
+        int temporary = rc_cons(heap, apple, nil);
+        rc_map_put(heap, map, temporary, value);
+        rc_free(heap, temporary);
+    }
+
+    EXPECT(int, rc_map_count(heap, map) < 10, 1);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    rc_free(heap, map);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, value), 0);
+    EXPECT(int, (int)heap_verify(heap, 0), 0);
+
+    free_heap(heap);
+}
+
+void test_large_heap() {
+    EXPECT(int, (int)sizeof(cell_index) * 8, POUTINE_INDEX_BITS);
+
+    // Each cell is four indexes wide, so this needs 64 GiB for the cells, and
+    // some room to spare.
+    size_t cells = ((size_t)1 << 31) + 2;
+    size_t memory = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+    if (cells > INDEX_MAX || memory / 6 < cells * sizeof(cell_index))
+        return;
+
+    heap_p heap = malloc_heap(cells, 1000);
+    EXPECT(int, cell_count(heap) == (cell_index)cells, 1);
+
+    cell_index last = -1;
+    for (size_t i = 0; i < cells - 2; i++)
+        last = alloc_cell(heap);
+    EXPECT(int, last == INT32_MAX, 1);
+
+    // The last two cells have indexes that don't fit in 32 bits.
+    cell_index apple = rc_atom(heap, "apple");
+    cell_index list = rc_cons(heap, apple, apple);
+    EXPECT(int, (int64_t)apple == (int64_t)INT32_MAX + 1, 1);
+    EXPECT(int, list == apple + 1, 1);
+    EXPECT(int, getfield(heap, FIELD_CDR, list) == apple, 1);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), 2);
+    EXPECT_STR(getatom(heap, getfield(heap, FIELD_CAR, list)), "apple");
+    EXPECT(int, alloc_cell(heap), -1);
+
+    // Freed cells up there are handed out again.
+    rc_free(heap, list);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, apple), 0);
+    EXPECT(int, rc_cons(heap, apple, apple) == list, 1);
+
+    free_heap(heap);
+}
+
+void test_profile() {
+    profile_start();
+    EXPECT(int, profile_running, 1);
+    for (int i = 0; i < 3; i++)
+        profile_record("getcar", 1000);
+    profile_record("cons", 50000);
+    profile_stop();
+    EXPECT(int, profile_running, 0);
+
+    // The command with the most time in total comes first.
+    char *output = profile_text();
+    EXPECT(int, strncmp(output, "cons: 1 samples", 15), 0);
+    EXPECT(int, strstr(output, "\ngetcar: 3 samples") != 0, 1);
+    free(output);
+
+    // Starting again forgets the old timings.
+    profile_start();
+    output = profile_text();
+    EXPECT_STR(output, "No commands have been timed\n");
+    free(output);
+
+    // Each thread's timings are merged.
+    pthread_t thread;
+    pthread_create(&thread, 0, record_getcar, 0);
+    pthread_join(thread, 0);
+    record_getcar(0);
+    profile_stop();
+
+    output = profile_text();
+    EXPECT(int, strncmp(output, "getcar: 2 samples", 17), 0);
+    EXPECT(int, strchr(output, '\n')[1], 0);
+    free(output);
+}
+
+void test_heapinfo() {
+    heap_p heap = malloc_heap(100, 100);
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+
+    // Cells 2 to 5 are a list, 6 and 7 are freed, 8 is a cons, and 9 is a
+    // freed atom whose text is left behind.
+    int list = nil;
+    for (int i = 0; i < 4; i++)
+        list = rc_cons(heap, apple, list);
+
+    int first = rc_cons(heap, apple, nil);
+    int second = rc_cons(heap, apple, nil);
+    rc_cons(heap, apple, nil);
+    int pear = rc_atom(heap, "pear");
+    rc_free(heap, first);
+    rc_free(heap, second);
+    rc_free(heap, pear);
+
+    heap_info info;
+    heap_get_info(heap, &info);
+    EXPECT(int, info.cells, 100);
+    EXPECT(int, info.live, 7);
+    EXPECT(int, info.freed, 3);
+    EXPECT(int, info.uninit, 90);
+
+    // The freed atom and the uninitialized cells make one run.
+    EXPECT(int, info.free_runs[1], 1);
+    EXPECT(int, info.free_runs[6], 1);
+    EXPECT(int, info.longest_free_run, 91);
+    EXPECT(int, info.top, 9);
+
+    EXPECT(int, info.atom_text_used, 15);
+    EXPECT(int, info.atom_text_live, 10);
+
+    // The cars are 1, 2, 3, 4 and 7 cells away; the cdrs 2, 1, 1, 1 and 8.
+    EXPECT(int, info.conses, 5);
+    EXPECT(int, (int)(info.car_distance * 10 + 0.5), 34);
+    EXPECT(int, (int)(info.cdr_distance * 10 + 0.5), 26);
+
+    // A map's entries are out of line.
+    EXPECT(int, info.blob_bytes, 0);
+    rc_map_put(heap, rc_map(heap), apple, nil);
+    heap_get_info(heap, &info);
+    EXPECT(int, info.blob_bytes > 0, 1);
+
+    free_heap(heap);
+}
+
+void test_trace() {
+    wire_buffer request = {0};
+
+    // Commands are encoded as binary protocol requests.
+    EXPECT(int, trace_encode("cons 3 -1\n", &request), 1);
+    EXPECT(int, request.length, 3);
+    EXPECT(int, request.data[0], WIRE_CONS);
+    EXPECT(int, request.data[1], 6);
+    EXPECT(int, request.data[2], 1);
+
+    // Those that only report, or whose arguments are wrong, aren't.
+    request.length = 0;
+    EXPECT(int, trace_encode("verify\n", &request), 0);
+    EXPECT(int, trace_encode("cons 3\n", &request), 0);
+    EXPECT(int, trace_encode("settag 3 banana\n", &request), 0);
+    EXPECT(int, trace_encode("hashcons on off\n", &request), 0);
+    EXPECT(int, request.length, 0);
+    EXPECT_STR(trace_op_name(TRACE_HASHCONS), "hashcons");
+
+    char *data;
+    size_t length;
+    FILE *file = open_memstream(&data, &length);
+
+    const char *commands[] = {
+        "atom apple\n", "atom banana\n", "cons 0 1\n", "heapinfo\n", "begin\n", "free 0\n",
+        "free 2\n", "abort\n", "hashcons on\n", "cons 0 1\n", "setatom 1 cherry\n", "collect\n",
+    };
+
+    trace_start(file, 10, 100);
+    for (int i = 0; i < 12; i++)
+        trace_record(commands[i]);
+    EXPECT(int, trace_stop(), 1);
+    EXPECT(int, trace_recording, 0);
+    fclose(file);
+
+    // Replaying gets the same results the shell would.
+    wire_reader reader = {(unsigned char *)data, (unsigned char *)data + length, 0};
+    wire_buffer response = {0};
+    cell_index cells;
+    size_t atom_text_size;
+
+    EXPECT(int, trace_read_header(&reader, &cells, &atom_text_size), 1);
+    EXPECT(int, cells, 10);
+    EXPECT(int, atom_text_size, 100);
+
+    heap_p heap = malloc_heap(cells, atom_text_size);
+    int statuses[11] = {0};
+    int hashconsed = -1;
+
+    for (int i = 0; i < 11; i++) {
+        wire_get_uint(&reader);
+        response.length = 0;
+        EXPECT(int, trace_run_request(&heap, atom_text_size, &reader, &response), 1);
+        statuses[i] = response.data[0];
+
+        if (i == 8)
+            hashconsed = response.data[1];
+    }
+
+    EXPECT(int, reader.pos == reader.end, 1);
+    EXPECT(int, statuses[4], WIRE_HAS_REFERENCES);
+    EXPECT(int, statuses[5], WIRE_OK);
+    EXPECT(int, statuses[6], WIRE_OK);
+    EXPECT(int, statuses[10], WIRE_OK);
+
+    // The abort brought back the cons, so hash-consing found it again. The
+    // result is zigzag-encoded.
+    EXPECT(int, hashconsed, 2 * 2);
+    EXPECT(int, rc_is_valid(heap, 2), 1);
+    EXPECT(int, getfield(heap, FIELD_TAG, 3), TAG_UNINIT);
+    EXPECT_STR(getatom(heap, 1), "cherry");
+
+    // A trace from another version isn't replayed.
+    data[8] = TRACE_VERSION + 1;
+    reader = (wire_reader){(unsigned char *)data, (unsigned char *)data + length, 0};
+    EXPECT(int, trace_read_header(&reader, &cells, &atom_text_size), 0);
+
+    free(request.data);
+    free(response.data);
+    free(data);
+    free_heap(heap);
+}
+
+void test_shm_heap() {
+    char name[64];
+    snprintf(name, sizeof(name), "/poutine-test-%d", (int)getpid());
+
+    heap_p heap = shm_heap_create(name, 100, 100);
+    EXPECT(int, heap != NULL, 1);
+    EXPECT(int, heap_is_shared(heap), 1);
+    EXPECT(int, shm_heap_create(name, 100, 100) == NULL, 1);
+
+    shm_heap_write_lock(heap);
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+    int list = rc_cons(heap, apple, nil);
+    shm_heap_unlock(heap);
+
+    // Another process sees the same cells, and what it allocates doesn't
+    // overlap with them.
+    pid_t child = fork();
+
+    if (child == 0) {
+        heap_p other = shm_heap_attach(name);
+        if (!other)
+            _exit(1);
+
+        shm_heap_write_lock(other);
+        int ok = getfield(other, FIELD_CAR, list) == apple && strcmp(getatom(other, apple), "apple") == 0;
+        int banana = rc_atom(other, "banana");
+        rc_cons(other, banana, list);
+        shm_heap_unlock(other);
+
+        free_heap(other);
+        _exit(ok && banana == 3 ? 0 : 1);
+    }
+
+    int status;
+    waitpid(child, &status, 0);
+    EXPECT(int, WIFEXITED(status) && WEXITSTATUS(status) == 0, 1);
+
+    // This process sees them while holding only the read lock.
+    shm_heap_read_lock(heap);
+    cell_index found;
+    EXPECT(int, (int)find_atoms_with_prefix(heap, "ban", &found, 1), 1);
+    EXPECT(int, found, 3);
+    EXPECT_STR(getatom(heap, 3), "banana");
+    EXPECT(int, getfield(heap, FIELD_CDR, 4), list);
+    EXPECT(int, getfield(heap, FIELD_REFCOUNT, list), 1);
+    shm_heap_unlock(heap);
+
+    // Taking the write lock picks up the other process's allocations.
+    shm_heap_write_lock(heap);
+    EXPECT(int, rc_atom(heap, "cherry"), 5);
+    shm_heap_unlock(heap);
+
+    // Once the name is gone, nothing new can attach, but the heap lives on.
+    EXPECT(int, shm_heap_unlink(name), 1);
+    EXPECT(int, shm_heap_attach(name) == NULL, 1);
+    EXPECT_STR(getatom(heap, 5), "cherry");
+
+    heap_p private = malloc_heap(10, 10);
+    EXPECT(int, heap_is_shared(private), 0);
+
+    free_heap(private);
+    free_heap(heap);
+}
+
+void *record_getcar(void *arg) {
+    profile_record("getcar", 2000);
+    return 0;
+}
+
+char *profile_text() {
+    char *text;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+
+    profile_dump(out);
+    fclose(out);
+    return text;
+}
+
+int cells_in_use(heap_p heap) {
+    return cell_count(heap) - scan_count_tag(heap, TAG_UNINIT) - scan_count_tag(heap, TAG_FREED);
+}
+
+void test_dump() {
+    heap_p heap = malloc_heap(100000, 1000);
+    int nil = rc_atom(heap, "nil");
+    int apple = rc_atom(heap, "apple");
+    int banana = rc_atom(heap, "banana");
+    int fruit = rc_cons(heap, apple, rc_cons(heap, banana, nil));
+
+    int freed = rc_cons(heap, apple, nil);
+    rc_free(heap, rc_cons(heap, banana, nil));
+
+    // A map, after a gap in the blob numbers.
+    int gap = rc_map(heap);
+    int map = rc_map(heap);
+    rc_map_put(heap, map, apple, banana);
+    rc_free(heap, gap);
+
+    int weak = rc_weak(heap, fruit);
+    int other = rc_weak(heap, fruit);
+
+    // Enough cells for more than one block.
+    int list = nil;
+    for (int i = 0; i < DUMP_BLOCK_CELLS + 1000; i++)
+        list = rc_cons(heap, apple, list);
+
+    // Some freed cells, so there's a free list.
+    rc_free(heap, freed);
+
+    for (int flags = 0; flags <= DUMP_COMPRESS; flags++) {
+        heap_p loaded;
+        size_t size = dump_round_trip(heap, flags, &loaded);
+
+        // Compression finds the regularity in the long list.
+        if (flags & DUMP_COMPRESS)
+            EXPECT(int, size < 1000, 1);
+
+        EXPECT(int, (int)heap_verify(loaded, 0), 0);
+        EXPECT_STR(getatom(loaded, banana), "banana");
+        EXPECT(int, rc_map_get(loaded, map, apple), banana);
+        EXPECT(int, rc_weak_get(loaded, weak), fruit);
+        EXPECT(int, rc_weak_get(loaded, other), fruit);
+
+        // The loaded heap goes on working: the free list is reused first, and
+        // the weak reference table is kept up to date.
+        EXPECT(int, rc_cons(loaded, apple, nil), freed);
+        rc_free(loaded, list);
+        rc_free(loaded, fruit);
+        EXPECT(int, rc_weak_get(loaded, weak), -1);
+        EXPECT(int, rc_weak_get(loaded, other), -1);
+        EXPECT(int, (int)heap_verify(loaded, 0), 0);
+
+        free_heap(loaded);
+    }
+
+    // A truncated dump, or something that isn't a dump, isn't loaded.
+    char *data;
+    size_t length;
+    FILE *file = open_memstream(&data, &length);
+    EXPECT(int, heap_dump(heap, file, DUMP_COMPRESS), 1);
+    fclose(file);
+
+    file = fmemopen(data, length - 1, "rb");
+    EXPECT(int, heap_load(file) == NULL, 1);
+    fclose(file);
+
+    data[0] = 'X';
+    file = fmemopen(data, length, "rb");
+    EXPECT(int, heap_load(file) == NULL, 1);
+    fclose(file);
+
+    free(data);
+    free_heap(heap);
+
+    // A blob whose length is far more than the file holds, stored as it is or
+    // compressed, isn't loaded, and nothing that big is allocated. The dump of
+    // a heap with no blobs ends with a count of 0, which is replaced.
+    heap = malloc_heap(1000, 100);
+    rc_atom(heap, "nil");
+    file = open_memstream(&data, &length);
+    EXPECT(int, heap_dump(heap, file, 0), 1);
+    fclose(file);
+
+    for (int stored_bytes = 0; stored_bytes <= 3; stored_bytes += 3) {
+        wire_buffer corrupt = {0};
+        wire_append(&corrupt, data, length - 1);
+        wire_put_uint(&corrupt, 1);
+        wire_put_uint(&corrupt, 0);
+        wire_put_uint(&corrupt, (uint64_t)1 << 40);
+        wire_put_uint(&corrupt, stored_bytes ? stored_bytes : (uint64_t)1 << 40);
+        wire_append(&corrupt, "\0\0\0", 3);
+
+        file = fmemopen(corrupt.data, corrupt.length, "rb");
+        EXPECT(int, heap_load(file) == NULL, 1);
+        fclose(file);
+        free(corrupt.data);
+    }
+
+    free(data);
+    free_heap(heap);
+
+    // A map whose blob isn't in the dump isn't loaded either. The map's blob
+    // is number 59, so the dump's blobs end with a count of 1, then 59, then
+    // the blob's column; the 59 is changed to 58.
+    heap = malloc_heap(1000, 100);
+    int maps[60];
+    for (int i = 0; i < 60; i++)
+        maps[i] = rc_map(heap);
+    for (int i = 0; i < 59; i++)
+        rc_free(heap, maps[i]);
+
+    file = open_memstream(&data, &length);
+    EXPECT(int, heap_dump(heap, file, 0), 1);
+    fclose(file);
+
+    int found = 0;
+    for (size_t i = 0; i + 2 < length && !found; i++) {
+        unsigned char *bytes = (unsigned char *)data;
+        wire_reader reader = {bytes + i + 2, bytes + length, 0};
+        uint64_t blob_length = wire_get_uint(&reader);
+        uint64_t stored = wire_get_uint(&reader);
+
+        if (bytes[i] == 1 && bytes[i + 1] == 59 && !reader.failed && stored == blob_length
+            && blob_length == (uint64_t)(reader.end - reader.pos)) {
+            bytes[i + 1] = 58;
+            found = 1;
+        }
+    }
+    EXPECT(int, found, 1);
+
+    file = fmemopen(data, length, "rb");
+    EXPECT(int, heap_load(file) == NULL, 1);
+    fclose(file);
+
+    free(data);
+    free_heap(heap);
+}
+
+size_t dump_round_trip(heap_p heap, int flags, heap_p *loaded) {
+    char *data;
+    size_t length;
+    FILE *file = open_memstream(&data, &length);
+    EXPECT(int, heap_dump(heap, file, flags), 1);
+    fclose(file);
+
+    file = fmemopen(data, length, "rb");
+    *loaded = heap_load(file);
+    fclose(file);
+    free(data);
+
+    EXPECT(int, *loaded != NULL, 1);
+    EXPECT(int, cell_count(*loaded), cell_count(heap));
+
+    for (int i = 0; i < cell_count(heap); i++) {
+        int tag = getfield(heap, FIELD_TAG, i);
+        EXPECT(int, getfield(*loaded, FIELD_TAG, i), tag);
+        EXPECT(int, getfield(*loaded, FIELD_REFCOUNT, i), getfield(heap, FIELD_REFCOUNT, i));
+
+        if (tag == TAG_ATOM) {
+            EXPECT_STR(getatom(*loaded, i), getatom(heap, i));
+        } else if (tag != TAG_UNINIT) {
+            EXPECT(int, getfield(*loaded, FIELD_CAR, i), getfield(heap, FIELD_CAR, i));
+            EXPECT(int, getfield(*loaded, FIELD_CDR, i), getfield(heap, FIELD_CDR, i));
+        }
+    }
+
+    return length;
 }
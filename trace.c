@@ -0,0 +1,366 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// trace.h: Recording the shell's commands, so they can be replayed later
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+#include "heap.h"
+#include "histogram.h"
+#include "nursery.h"
+#include "rcheap.h"
+#include "trace.h"
+#include "txn.h"
+#include "wire.h"
+
+// The longest command that's recorded, as for the shell's own buffer
+#define TRACE_MAX_COMMAND 1024
+
+// A shell command that's recorded, and how to encode its arguments, as given
+// by trace_op_arguments()
+typedef struct trace_command {
+    const char *name;
+    int op;
+    const char *arguments;
+} trace_command;
+
+// Encode one argument of a command; return 0 if it's invalid
+int encode_trace_argument(char kind, const char *word, wire_buffer *request);
+// Run one of the TRACE_ requests, whose opcode has already been read
+int run_trace_request(heap_p *heap, size_t atom_text_size, int op, wire_reader *reader,
+    wire_buffer *response);
+// Append a status byte
+void put_trace_status(wire_buffer *response, int status);
+
+
+
+int trace_recording = 0;
+
+static FILE *trace_file;
+static uint64_t trace_last_ns;
+static int trace_failed;
+static wire_buffer trace_buffer;
+
+static const trace_command trace_commands[] = {
+    {"getcar", WIRE_GETCAR, "i"},
+    {"getcdr", WIRE_GETCDR, "i"},
+    {"gettag", WIRE_GETTAG, "i"},
+    {"getatom", WIRE_GETATOM, "i"},
+    {"setcar", WIRE_SETCAR, "ii"},
+    {"setcdr", WIRE_SETCDR, "ii"},
+    {"settag", WIRE_SETTAG, "it"},
+    {"setatom", WIRE_SETATOM, "is"},
+    {"alloc", WIRE_ALLOC, ""},
+    {"atom", WIRE_ATOM, "s"},
+    {"cons", WIRE_CONS, "ii"},
+    {"free", WIRE_FREE, "i"},
+    {"map", WIRE_MAP, ""},
+    {"mapget", WIRE_MAPGET, "ii"},
+    {"mapput", WIRE_MAPPUT, "iii"},
+    {"mapdel", WIRE_MAPDEL, "ii"},
+    {"mapcount", WIRE_MAPCOUNT, "i"},
+    {"cellcount", WIRE_CELLCOUNT, ""},
+    {"begin", WIRE_BEGIN, ""},
+    {"commit", WIRE_COMMIT, ""},
+    {"abort", WIRE_ABORT, ""},
+    {"collect", TRACE_COLLECT, ""},
+    {"minor", TRACE_MINOR, ""},
+    {"nursery", TRACE_NURSERY, "i"},
+    {"incremental", TRACE_INCREMENTAL, "i"},
+    {"hashcons", TRACE_HASHCONS, "b"},
+    {"reinit", TRACE_REINIT, "i"},
+};
+
+#define TRACE_COMMAND_COUNT (sizeof(trace_commands) / sizeof(trace_commands[0]))
+
+
+
+// Recording:
+
+void trace_start(FILE *file, cell_index cells, size_t atom_text_size) {
+    trace_file = file;
+    trace_failed = 0;
+    trace_buffer.length = 0;
+
+    wire_append(&trace_buffer, TRACE_MAGIC, 8);
+    wire_put_uint(&trace_buffer, TRACE_VERSION);
+    wire_put_uint(&trace_buffer, cells);
+    wire_put_uint(&trace_buffer, atom_text_size);
+
+    if (fwrite(trace_buffer.data, 1, trace_buffer.length, file) != trace_buffer.length)
+        trace_failed = 1;
+
+    trace_last_ns = monotonic_ns();
+    trace_recording = 1;
+}
+
+int trace_stop() {
+    trace_recording = 0;
+
+    if (fflush(trace_file) != 0)
+        trace_failed = 1;
+
+    return !trace_failed;
+}
+
+void trace_record(const char *command) {
+    // The time is taken first, so that a record's delay covers encoding the
+    // one before it too.
+    uint64_t now = monotonic_ns();
+
+    trace_buffer.length = 0;
+    wire_put_uint(&trace_buffer, now - trace_last_ns);
+
+    if (!trace_encode(command, &trace_buffer))
+        return;
+
+    trace_last_ns = now;
+
+    if (fwrite(trace_buffer.data, 1, trace_buffer.length, trace_file) != trace_buffer.length)
+        trace_failed = 1;
+}
+
+void trace_record_request(const char *request, size_t length) {
+    uint64_t now = monotonic_ns();
+
+    trace_buffer.length = 0;
+    wire_put_uint(&trace_buffer, now - trace_last_ns);
+    wire_append(&trace_buffer, request, length);
+    trace_last_ns = now;
+
+    if (fwrite(trace_buffer.data, 1, trace_buffer.length, trace_file) != trace_buffer.length)
+        trace_failed = 1;
+}
+
+int trace_encode(const char *command, wire_buffer *request) {
+    char copy[TRACE_MAX_COMMAND];
+    char *state;
+
+    if (strlen(command) >= sizeof(copy))
+        return 0;
+    strcpy(copy, command);
+
+    const char *name = strtok_r(copy, " \n", &state);
+    if (!name)
+        return 0;
+
+    const trace_command *found = NULL;
+    for (size_t i = 0; i < TRACE_COMMAND_COUNT; i++) {
+        if (strcmp(name, trace_commands[i].name) == 0) {
+            found = &trace_commands[i];
+            break;
+        }
+    }
+
+    if (!found)
+        return 0;
+
+    // If anything goes wrong, the request is taken back off the end.
+    size_t start = request->length;
+    unsigned char op = found->op;
+    wire_append(request, &op, 1);
+
+    for (const char *kind = found->arguments; *kind; kind++) {
+        const char *word = strtok_r(NULL, " \n", &state);
+
+        if (!word || !encode_trace_argument(*kind, word, request)) {
+            request->length = start;
+            return 0;
+        }
+    }
+
+    if (strtok_r(NULL, " \n", &state)) {
+        request->length = start;
+        return 0;
+    }
+
+    return 1;
+}
+
+int encode_trace_argument(char kind, const char *word, wire_buffer *request) {
+    char *remainder;
+    cell_index number;
+
+    switch (kind) {
+    case 'i':
+        // This matches how the shell reads numbers, including ignoring
+        // anything after the digits.
+        number = strtoll(word, &remainder, 10);
+        if (remainder == word)
+            return 0;
+        wire_put_int(request, number);
+        return 1;
+
+    case 's':
+        wire_put_string(request, word, strlen(word));
+        return 1;
+
+    case 't':
+        if (strcmp(word, "uninit") == 0)
+            wire_put_int(request, TAG_UNINIT);
+        else if (strcmp(word, "atom") == 0)
+            wire_put_int(request, TAG_ATOM);
+        else if (strcmp(word, "cons") == 0)
+            wire_put_int(request, TAG_CONS);
+        else
+            return 0;
+        return 1;
+
+    case 'b':
+        if (strcmp(word, "on") == 0)
+            wire_put_uint(request, 1);
+        else if (strcmp(word, "off") == 0)
+            wire_put_uint(request, 0);
+        else
+            return 0;
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+const char *trace_op_name(int op) {
+    for (size_t i = 0; i < TRACE_COMMAND_COUNT; i++) {
+        if (trace_commands[i].op == op)
+            return trace_commands[i].name;
+    }
+
+    return NULL;
+}
+
+const char *trace_op_arguments(int op) {
+    for (size_t i = 0; i < TRACE_COMMAND_COUNT; i++) {
+        if (trace_commands[i].op == op)
+            return trace_commands[i].arguments;
+    }
+
+    return NULL;
+}
+
+
+
+// Replaying:
+
+int trace_read_header(wire_reader *reader, cell_index *cells, size_t *atom_text_size) {
+    if (reader->end - reader->pos < 8 || memcmp(reader->pos, TRACE_MAGIC, 8) != 0)
+        return 0;
+    reader->pos += 8;
+
+    uint64_t version = wire_get_uint(reader);
+    uint64_t cell_count = wire_get_uint(reader);
+    uint64_t atom_size = wire_get_uint(reader);
+
+    if (reader->failed || version != TRACE_VERSION || cell_count == 0 || cell_count > INDEX_MAX)
+        return 0;
+
+    *cells = cell_count;
+    *atom_text_size = atom_size;
+    return 1;
+}
+
+int trace_run_request(heap_p *heap, size_t atom_text_size, wire_reader *reader, wire_buffer *response) {
+    int op = *reader->pos;
+
+    if (op < TRACE_COLLECT)
+        return wire_run_request(*heap, reader, response);
+
+    reader->pos++;
+    return run_trace_request(heap, atom_text_size, op, reader, response);
+}
+
+int run_trace_request(heap_p *heap, size_t atom_text_size, int op, wire_reader *reader,
+    wire_buffer *response) {
+    int64_t argument = 0;
+
+    switch (op) {
+    case TRACE_COLLECT:
+    case TRACE_MINOR:
+        break;
+    case TRACE_NURSERY:
+    case TRACE_INCREMENTAL:
+    case TRACE_HASHCONS:
+    case TRACE_REINIT:
+        argument = wire_get_int(reader);
+        break;
+    default:
+        put_trace_status(response, WIRE_UNKNOWN_OP);
+        return 0;
+    }
+
+    if (reader->failed || argument < -INDEX_MAX - 1 || argument > INDEX_MAX) {
+        put_trace_status(response, WIRE_MALFORMED);
+        return 0;
+    }
+
+    // The checks are the same as the shell's.
+    switch (op) {
+    case TRACE_COLLECT:
+    case TRACE_MINOR:
+        if (heap_in_transaction(*heap)) {
+            put_trace_status(response, WIRE_BAD_TRANSACTION);
+            break;
+        }
+        put_trace_status(response, WIRE_OK);
+        wire_put_uint(response, op == TRACE_COLLECT ? heap_collect(*heap) : minor_collect(*heap));
+        break;
+
+    case TRACE_NURSERY:
+        if (argument < 0) {
+            put_trace_status(response, WIRE_OUT_OF_RANGE);
+        } else if (heap_in_transaction(*heap)) {
+            put_trace_status(response, WIRE_BAD_TRANSACTION);
+        } else if (!heap_set_nursery(*heap, argument)) {
+            put_trace_status(response, WIRE_NO_SPACE);
+        } else {
+            put_trace_status(response, WIRE_OK);
+        }
+        break;
+
+    case TRACE_INCREMENTAL:
+        if (argument < 0) {
+            put_trace_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+        gc_set_incremental(*heap, argument);
+        put_trace_status(response, WIRE_OK);
+        break;
+
+    case TRACE_HASHCONS:
+        rc_set_hashcons(*heap, argument != 0);
+        put_trace_status(response, WIRE_OK);
+        break;
+
+    case TRACE_REINIT:
+        if (argument <= 0) {
+            put_trace_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+#ifdef FIXED_CELLS
+        if (argument != FIXED_CELLS) {
+            put_trace_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+#endif
+        free_heap(*heap);
+        *heap = malloc_heap(argument, atom_text_size);
+        put_trace_status(response, WIRE_OK);
+        break;
+    }
+
+    return 1;
+}
+
+void put_trace_status(wire_buffer *response, int status) {
+    unsigned char byte = status;
+    wire_append(response, &byte, 1);
+}
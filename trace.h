@@ -0,0 +1,90 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// trace.h: Recording the shell's commands, so they can be replayed later
+
+// A trace is a record of the commands run by the shell, for replaying against
+// a heap as a benchmark (see replay.c). It starts with a header:
+//
+//     the 8 bytes TRACE_MAGIC
+//     a varint: TRACE_VERSION
+//     varints: the number of cells in the heap, and the size of its atom text
+//         buffer
+//
+// That's followed by a record for each command: a varint giving the number of
+// nanoseconds since the previous record, or since the trace began, and then
+// the command as a request in the binary protocol of wire.h. Commands that
+// the binary protocol doesn't have use the TRACE_ opcodes below.
+//
+// Commands which only report on the heap, such as verify and heapinfo, aren't
+// recorded, and neither are commands with missing or malformed arguments,
+// since neither kind changes anything. Commands which fail for other reasons,
+// such as freeing a cell that has references, are recorded, and fail again
+// when they're replayed. Neither dump nor load is recorded, since a replay
+// can't be expected to have the same files.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "heap.h"
+#include "wire.h"
+
+#define TRACE_MAGIC "POUTRACE"
+#define TRACE_VERSION 1
+
+// Opcodes for shell commands which aren't in the binary protocol, with their
+// arguments
+#define TRACE_COLLECT 64        // ->
+#define TRACE_MINOR 65          // ->
+#define TRACE_NURSERY 66        // cells ->
+#define TRACE_INCREMENTAL 67    // slice ->
+#define TRACE_HASHCONS 68       // 1 for on or 0 for off ->
+#define TRACE_REINIT 69         // cells ->
+
+// Nonzero while commands are being recorded
+extern int trace_recording;
+
+// Start recording commands to a file, writing the header for a heap of the
+// given size
+//
+// The file is only written to, not closed, so the caller closes it after
+// trace_stop().
+void trace_start(FILE *file, cell_index cells, size_t atom_text_size);
+// Stop recording commands; return 0 if writing the trace failed
+int trace_stop(void);
+// Record a command the shell is about to run
+void trace_record(const char *command);
+// Record a request made by trace_encode() that has just been run
+void trace_record_request(const char *request, size_t length);
+
+// Turn a shell command into a request; return 0 if it isn't recorded
+int trace_encode(const char *command, wire_buffer *request);
+// Get the name of the shell command for an opcode, or NULL if there isn't one
+const char *trace_op_name(int op);
+// Get the kinds of arguments the shell command for an opcode takes, one letter
+// each: i for a number, s for a word, t for a tag and b for on or off; return
+// NULL if there isn't a command
+const char *trace_op_arguments(int op);
+
+// Read a trace's header; return 0 if it isn't a trace this version can replay
+int trace_read_header(wire_reader *reader, cell_index *cells, size_t *atom_text_size);
+// Run the request at the reader's position, appending its result; return 0 if
+// it's malformed, in which case the rest of the trace can't be read
+//
+// TRACE_REINIT replaces the heap with a new one with the given atom text size.
+// In a fixed-size build, it fails with WIRE_OUT_OF_RANGE unless the new heap
+// is FIXED_CELLS cells, as in the shell.
+int trace_run_request(heap_p *heap, size_t atom_text_size, wire_reader *reader, wire_buffer *response);
+
+#endif
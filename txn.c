@@ -0,0 +1,245 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// txn.h: Transactions with all-or-nothing semantics
+
+#include <string.h>
+
+#include "hashcons.h"
+#include "heap.h"
+#include "heapimpl.h"
+#include "panic.h"
+#include "txn.h"
+
+// Add an entry to the end of the undo log
+undo_entry *push_entry(heap_p heap, int kind, cell_index index);
+// Clear the saved flag of every blob and cell the undo log mentions
+void clear_saved_flags(heap_p heap);
+
+void heap_begin(heap_p heap) {
+    undo_log *undo = &heap->undo;
+
+    if (undo->active)
+        PANIC("Tried to begin a transaction inside another one");
+
+    if (!undo->logged) {
+        undo->logged = calloc((heap->cell_count + 63) / 64, sizeof(uint64_t));
+        if (!undo->logged)
+            PANIC("Failed to allocate enough memory for the undo log");
+    }
+
+    undo->active = 1;
+    undo->count = 0;
+    undo->next_freed = heap->next_freed;
+    undo->next_uninit = heap->next_uninit;
+    undo->nursery_next = heap->nursery.next;
+    undo->nursery_limit = heap->nursery.limit;
+    undo->region_count = heap->regions.count;
+    undo->atom_text_used = heap->atom_text_next - heap->atom_text_buf;
+    undo->blob_count = heap->blob_count;
+}
+
+void heap_commit(heap_p heap) {
+    undo_log *undo = &heap->undo;
+
+    if (!undo->active)
+        PANIC("Tried to commit without a transaction");
+
+    clear_saved_flags(heap);
+
+    for (size_t i = 0; i < undo->count; i++) {
+        undo_entry *entry = &undo->entries[i];
+        if (entry->kind == UNDO_BLOB_SAVE || entry->kind == UNDO_BLOB_FREE)
+            free(entry->saved);
+    }
+
+    undo->active = 0;
+    undo->count = 0;
+}
+
+void heap_abort(heap_p heap) {
+    undo_log *undo = &heap->undo;
+
+    if (!undo->active)
+        PANIC("Tried to abort without a transaction");
+
+    // Nothing done from here on should be logged.
+    undo->active = 0;
+
+    // Cells which were never used before the transaction go back to being
+    // uninitialized, which is all zeros.
+    if (heap->next_uninit > undo->next_uninit) {
+        size_t offset = (size_t)undo->next_uninit * sizeof(cons_cell);
+        size_t length = (size_t)(heap->next_uninit - undo->next_uninit) * sizeof(cons_cell);
+        cow_region_touch(&heap->cell_region, offset, length);
+        memset(&heap->cells[undo->next_uninit], 0, length);
+    }
+
+    for (size_t i = undo->count; i-- > 0;) {
+        undo_entry *entry = &undo->entries[i];
+        cell_index number = entry->index;
+
+        switch (entry->kind) {
+        case UNDO_CELL:
+            *writable_cell(heap, entry->index) = entry->cell;
+            break;
+        case UNDO_BLOB_ALLOC:
+            free(heap->blobs[number]);
+            heap->blobs[number] = NULL;
+            break;
+        case UNDO_BLOB_SAVE:
+            free(heap->blobs[number]);
+            heap->blobs[number] = entry->saved;
+            break;
+        case UNDO_BLOB_FREE:
+            heap->blobs[number] = entry->saved;
+            break;
+        case UNDO_WEAK_HEAD:
+            cow_region_touch(&heap->weak_region, (size_t)number * sizeof(cell_index),
+                sizeof(cell_index));
+            heap->weak_heads[number] = entry->weak_head;
+            break;
+        }
+    }
+
+    heap->next_freed = undo->next_freed;
+    heap->next_uninit = undo->next_uninit;
+    heap->nursery.next = undo->nursery_next;
+    heap->nursery.limit = undo->nursery_limit;
+
+    // Regions begun during the transaction are gone, along with their cells.
+    heap->regions.count = undo->region_count;
+
+    // Atom text added since the transaction began has to go, or it would be
+    // found by try_find_atom().
+    char *old_next = heap->atom_text_buf + undo->atom_text_used;
+    if (heap->atom_text_next > old_next) {
+        cow_region_touch(&heap->atom_region, undo->atom_text_used, heap->atom_text_next - old_next);
+        memset(old_next, 0, heap->atom_text_next - old_next);
+        heap->atom_text_next = old_next;
+    }
+
+    heap->blob_count = undo->blob_count;
+    heap->free_blob_count = 0;
+    for (size_t i = 0; i < heap->blob_count; i++) {
+        if (!heap->blobs[i])
+            heap->free_blobs[heap->free_blob_count++] = i;
+    }
+
+    // The cells that were erased during the transaction have to be listed for
+    // hash-consing again. Any entries for cells as they were during the
+    // transaction no longer match, so they're harmless.
+    if (heap->hashcons) {
+        for (size_t i = 0; i < undo->count; i++) {
+            if (undo->entries[i].kind != UNDO_CELL)
+                continue;
+
+            cell_index index = undo->entries[i].index;
+            cons_cell *cell = &heap->cells[index];
+            cell_index existing;
+
+            if (cell->tag == TAG_ATOM && cell->car >= 0 && heap->atom_text_buf[cell->car] != 0)
+                existing = hashcons_find_atom(heap, cell->car);
+            else if (cell->tag == TAG_CONS)
+                existing = hashcons_find_cons(heap, cell->car, cell->cdr);
+            else
+                continue;
+
+            if (existing == -1)
+                hashcons_insert(heap, index);
+        }
+    }
+
+    clear_saved_flags(heap);
+    undo->count = 0;
+}
+
+int heap_in_transaction(heap_p heap) {
+    return heap->undo.active;
+}
+
+
+
+void undo_cell(heap_p heap, cell_index index) {
+    undo_log *undo = &heap->undo;
+
+    // A cell which was uninitialized when the transaction began doesn't need
+    // an entry, and neither does one that already has an entry.
+    if (index >= undo->next_uninit)
+        return;
+
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if (undo->logged[index / 64] & bit)
+        return;
+
+    undo->logged[index / 64] |= bit;
+    push_entry(heap, UNDO_CELL, index)->cell = heap->cells[index];
+}
+
+void undo_blob(heap_p heap, cell_index number) {
+    blob *original = heap->blobs[number];
+
+    blob *copy = malloc(sizeof(blob) + original->size);
+    if (!copy)
+        PANIC("Failed to allocate enough memory for the undo log");
+
+    memcpy(copy, original, sizeof(blob) + original->size);
+    copy->saved = 0;
+    original->saved = 1;
+
+    push_entry(heap, UNDO_BLOB_SAVE, number)->saved = copy;
+}
+
+void undo_blob_lifetime(heap_p heap, int kind, cell_index number, blob *freed) {
+    push_entry(heap, kind, number)->saved = freed;
+}
+
+void undo_weak_head(heap_p heap, cell_index index) {
+    push_entry(heap, UNDO_WEAK_HEAD, index)->weak_head = heap->weak_heads[index];
+}
+
+undo_entry *push_entry(heap_p heap, int kind, cell_index index) {
+    undo_log *undo = &heap->undo;
+
+    if (undo->count == undo->capacity) {
+        size_t capacity = undo->capacity ? undo->capacity * 2 : 256;
+
+        undo_entry *entries = realloc(undo->entries, capacity * sizeof(undo_entry));
+        if (!entries)
+            PANIC("Failed to allocate enough memory for the undo log");
+
+        undo->entries = entries;
+        undo->capacity = capacity;
+    }
+
+    undo_entry *entry = &undo->entries[undo->count++];
+    entry->kind = kind;
+    entry->index = index;
+    return entry;
+}
+
+void clear_saved_flags(heap_p heap) {
+    undo_log *undo = &heap->undo;
+
+    for (size_t i = 0; i < undo->count; i++) {
+        undo_entry *entry = &undo->entries[i];
+
+        if (entry->kind == UNDO_CELL) {
+            undo->logged[entry->index / 64] = 0;
+            continue;
+        }
+
+        if (entry->kind == UNDO_BLOB_FREE || entry->kind == UNDO_WEAK_HEAD)
+            continue;
+
+        if (entry->index < heap->blob_count && heap->blobs[entry->index])
+            heap->blobs[entry->index]->saved = 0;
+    }
+}
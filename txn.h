@@ -0,0 +1,41 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// txn.h: Transactions with all-or-nothing semantics
+
+// While a transaction is running, every change to the heap is recorded in an
+// undo log: the old contents of each cell written to, and the old contents of
+// each blob (such as a map's table) before its first change. Aborting the
+// transaction plays the log backwards, leaving the heap as it was when the
+// transaction began. Committing just throws the log away, so a series of
+// changes can be made optimistically, without checking first that there's
+// room for all of them.
+//
+// Transactions don't nest. Turning hash-consing on or off isn't undone by
+// aborting. Forking a heap in the middle of a transaction gives a heap which
+// holds the changes made so far and isn't in a transaction.
+
+#ifndef TXN_H
+#define TXN_H
+
+#include "heap.h"
+
+// Begin a transaction
+//
+// This function panics if a transaction is already running.
+void heap_begin(heap_p heap);
+// End the current transaction, keeping its changes
+void heap_commit(heap_p heap);
+// End the current transaction, undoing its changes
+void heap_abort(heap_p heap);
+// Check whether a transaction is running
+int heap_in_transaction(heap_p heap);
+
+#endif
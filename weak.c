@@ -0,0 +1,180 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// weak.h: Weak references, which don't keep their targets alive
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "heapimpl.h"
+#include "panic.h"
+#include "rawheap.h"
+#include "rcheap.h"
+#include "weak.h"
+
+// Get the first weak reference to a cell, or -1 if there aren't any
+cell_index first_weak(heap_p heap, cell_index target);
+// Set the first weak reference to a cell
+void set_first_weak(heap_p heap, cell_index target, cell_index weak);
+// Take a weak reference out of its target's chain and clear it
+void unlink_weak(heap_p heap, cell_index weak);
+
+
+
+// Weak references:
+
+cell_index rc_weak(heap_p heap, cell_index target) {
+    if (!rc_is_valid(heap, target))
+        PANIC("Tried to make a weak reference to cell %" PRI_INDEX ", which doesn't contain a value",
+            target);
+
+    cell_index index = alloc_cell(heap);
+
+    if (index == -1)
+        return -1;
+
+    if (!heap->weak_heads) {
+        check_private(heap, "Weak references");
+        cow_region_create(&heap->weak_region, heap->cell_count * sizeof(cell_index));
+        heap->weak_heads = (cell_index *)heap->weak_region.base;
+    }
+
+    cons_cell *cell = writable_cell(heap, index);
+    cell->tag = TAG_WEAK;
+    cell->car = target;
+    cell->cdr = first_weak(heap, target);
+    set_first_weak(heap, target, index);
+
+    return index;
+}
+
+int rc_is_weak(heap_p heap, cell_index index) {
+    return rc_is_valid(heap, index) && getfield(heap, FIELD_TAG, index) == TAG_WEAK;
+}
+
+cell_index rc_weak_get(heap_p heap, cell_index weak) {
+    if (!rc_is_weak(heap, weak))
+        PANIC("The cell at index %" PRI_INDEX " is not a weak reference", weak);
+
+    cell_index target = heap->cells[weak].car;
+
+    if (target == -1 || gc_found_garbage(heap, target))
+        return -1;
+
+    // Whoever gets the target is likely to store it somewhere, so it had
+    // better survive the cycle.
+    gc_shade(heap, target);
+    return target;
+}
+
+
+
+// Clearing:
+
+void weak_forget_cell(heap_p heap, cell_index index) {
+    cons_cell *cell = &heap->cells[index];
+
+    if (cell->tag == TAG_WEAK && cell->car != -1)
+        unlink_weak(heap, index);
+
+    cell_index weak = first_weak(heap, index);
+    if (weak == -1)
+        return;
+
+    while (weak != -1) {
+        cons_cell *reference = writable_cell(heap, weak);
+        weak = reference->cdr;
+        reference->car = -1;
+        reference->cdr = -1;
+    }
+
+    set_first_weak(heap, index, -1);
+}
+
+void unlink_weak(heap_p heap, cell_index weak) {
+    cell_index target = heap->cells[weak].car;
+    cell_index next = heap->cells[weak].cdr;
+    cell_index previous = first_weak(heap, target);
+
+    if (previous == weak) {
+        set_first_weak(heap, target, next);
+    } else {
+        while (heap->cells[previous].cdr != weak)
+            previous = heap->cells[previous].cdr;
+
+        writable_cell(heap, previous)->cdr = next;
+    }
+
+    cons_cell *cell = writable_cell(heap, weak);
+    cell->car = -1;
+    cell->cdr = -1;
+}
+
+cell_index first_weak(heap_p heap, cell_index target) {
+    return heap->weak_heads[target] - 1;
+}
+
+void set_first_weak(heap_p heap, cell_index target, cell_index weak) {
+    if (heap->undo.active)
+        undo_weak_head(heap, target);
+
+    cow_region_touch(&heap->weak_region, (size_t)target * sizeof(cell_index), sizeof(cell_index));
+    heap->weak_heads[target] = weak + 1;
+}
+
+void weak_fork(heap_p fork, heap_p heap) {
+    if (!heap->weak_heads)
+        return;
+
+    cow_region_fork(&fork->weak_region, &heap->weak_region);
+    fork->weak_heads = (cell_index *)fork->weak_region.base;
+}
+
+void weak_free(heap_p heap) {
+    if (heap->weak_heads)
+        cow_region_free(&heap->weak_region);
+}
+
+void weak_rebuild(heap_p heap) {
+    // A weak reference starts a chain unless another one in the chain points
+    // to it.
+    size_t words = (heap->next_uninit + 63) / 64;
+    uint64_t *linked = calloc(words ? words : 1, sizeof(uint64_t));
+    int any = 0;
+
+    if (!linked)
+        PANIC("Failed to allocate enough memory for the weak reference table");
+
+    for (cell_index i = 0; i < heap->next_uninit; i++) {
+        cons_cell *cell = &heap->cells[i];
+
+        if (cell->tag == TAG_WEAK && cell->car != -1) {
+            any = 1;
+            if (cell->cdr != -1)
+                linked[cell->cdr / 64] |= (uint64_t)1 << (cell->cdr % 64);
+        }
+    }
+
+    if (any) {
+        cow_region_create(&heap->weak_region, heap->cell_count * sizeof(cell_index));
+        heap->weak_heads = (cell_index *)heap->weak_region.base;
+
+        for (cell_index i = 0; i < heap->next_uninit; i++) {
+            cons_cell *cell = &heap->cells[i];
+
+            if (cell->tag == TAG_WEAK && cell->car != -1 && !(linked[i / 64] >> (i % 64) & 1))
+                set_first_weak(heap, cell->car, i);
+        }
+    }
+
+    free(linked);
+}
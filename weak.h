@@ -0,0 +1,44 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// weak.h: Weak references, which don't keep their targets alive
+
+// A weak reference is a cell with the tag TAG_WEAK. Its car is its target, but
+// it isn't counted in the target's reference count, and the collector doesn't
+// follow it. When the target goes away (because it's freed, by rc_free() or by
+// any kind of collection, or it's erased to make a different value, or the
+// region it's in ends), the weak reference is cleared, and its car becomes -1.
+//
+// Clearing doesn't scan the heap. Each heap has a side table, indexed by cell,
+// which gives the first weak reference to that cell; the rest are chained
+// through the cdrs of the weak references. So a cell going away costs time
+// proportional to the number of weak references to it. The table is made when
+// the first weak reference is, and it's copy-on-write like the cells, so a fork
+// shares it.
+//
+// Maps can hold their keys weakly, too; see rc_weak_map() in map.h.
+
+#ifndef WEAK_H
+#define WEAK_H
+
+#include "heap.h"
+
+// Allocate a cell as a weak reference to the given value, returning -1 on
+// insufficient space
+cell_index rc_weak(heap_p heap, cell_index target);
+// Check whether a cell is a weak reference
+int rc_is_weak(heap_p heap, cell_index index);
+// Get the target of a weak reference, or -1 if it's been cleared
+//
+// While an incremental collection cycle is running, a target it has found to
+// be garbage counts as cleared already.
+cell_index rc_weak_get(heap_p heap, cell_index weak);
+
+#endif
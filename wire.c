@@ -0,0 +1,511 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// wire.h: A compact binary protocol for heap commands
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "map.h"
+#include "panic.h"
+#include "rawheap.h"
+#include "rcheap.h"
+#include "txn.h"
+#include "wire.h"
+
+// The longest atom text accepted from a request
+#define MAX_ATOM_TEXT 1024
+
+// Read a signed varint that must fit in a cell index
+cell_index read_index_argument(wire_reader *reader);
+// Read a string argument into a NUL-terminated buffer
+void read_text_argument(wire_reader *reader, char *text);
+// Run one request, appending its result; return 0 if the rest of the payload
+// can't be read
+//
+// If the frame's transaction has been aborted, the request is only read.
+int run_request(heap_p heap, wire_reader *reader, wire_buffer *response, int aborted);
+// Append a status byte
+void put_status(wire_buffer *response, int status);
+// Check whether an index is within the heap
+int index_in_range(heap_p heap, cell_index index);
+
+
+
+// Encoding:
+
+void wire_append(wire_buffer *buf, const void *data, size_t length) {
+    // An empty buffer's data may be NULL, which memcpy() mustn't be given.
+    if (length == 0)
+        return;
+
+    if (!wire_reserve(buf, buf->length + length))
+        PANIC("Failed to allocate enough memory for a message buffer");
+
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+}
+
+int wire_reserve(wire_buffer *buf, size_t capacity) {
+    if (capacity <= buf->capacity)
+        return 1;
+
+    size_t new_capacity = buf->capacity ? buf->capacity : 4096;
+    while (new_capacity < capacity) {
+        if (new_capacity > SIZE_MAX / 2)
+            return 0;
+        new_capacity *= 2;
+    }
+
+    char *data = realloc(buf->data, new_capacity);
+    if (!data)
+        return 0;
+
+    buf->data = data;
+    buf->capacity = new_capacity;
+    return 1;
+}
+
+void wire_put_uint(wire_buffer *buf, uint64_t value) {
+    unsigned char bytes[10];
+    int count = 0;
+
+    while (value >= 0x80) {
+        bytes[count++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    bytes[count++] = value;
+
+    wire_append(buf, bytes, count);
+}
+
+void wire_put_int(wire_buffer *buf, int64_t value) {
+    wire_put_uint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+void wire_put_string(wire_buffer *buf, const char *text, size_t length) {
+    wire_put_uint(buf, length);
+    wire_append(buf, text, length);
+}
+
+void wire_put_frame(wire_buffer *buf, const char *payload, size_t length) {
+    wire_put_uint(buf, length);
+    wire_append(buf, payload, length);
+}
+
+
+
+// Decoding:
+
+uint64_t wire_get_uint(wire_reader *reader) {
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (reader->pos == reader->end) {
+            reader->failed = 1;
+            return 0;
+        }
+
+        unsigned char byte = *reader->pos++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+            return value;
+    }
+
+    reader->failed = 1;
+    return 0;
+}
+
+int64_t wire_get_int(wire_reader *reader) {
+    uint64_t value = wire_get_uint(reader);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+const char *wire_get_string(wire_reader *reader, size_t *length) {
+    uint64_t size = wire_get_uint(reader);
+
+    if (reader->failed || size > (size_t)(reader->end - reader->pos)) {
+        reader->failed = 1;
+        *length = 0;
+        return "";
+    }
+
+    const char *text = (const char *)reader->pos;
+    reader->pos += size;
+    *length = size;
+    return text;
+}
+
+int wire_frame_ready(const char *data, size_t length, size_t *header, size_t *payload) {
+    wire_reader reader = {(const unsigned char *)data, (const unsigned char *)data + length, 0};
+    uint64_t size = wire_get_uint(&reader);
+
+    if (reader.failed)
+        // Either the length itself is incomplete, or it's absurdly long.
+        return length < 10 ? 0 : -1;
+
+    if (size > WIRE_MAX_FRAME)
+        return -1;
+
+    *header = (const char *)reader.pos - data;
+    *payload = size;
+    return length - *header >= size;
+}
+
+
+
+// Running requests:
+
+int wire_is_read_only(const char *payload, size_t length) {
+    wire_reader reader = {(const unsigned char *)payload, (const unsigned char *)payload + length, 0};
+
+    while (reader.pos < reader.end) {
+        switch (*reader.pos++) {
+        case WIRE_GETCAR:
+        case WIRE_GETCDR:
+        case WIRE_GETTAG:
+        case WIRE_GETATOM:
+        case WIRE_MAPCOUNT:
+        case WIRE_GETCELL:
+            wire_get_uint(&reader);
+            break;
+        case WIRE_MAPGET:
+            wire_get_uint(&reader);
+            wire_get_uint(&reader);
+            break;
+        case WIRE_CELLCOUNT:
+            break;
+        default:
+            return 0;
+        }
+
+        // A malformed request stops the frame, so nothing after it runs.
+        if (reader.failed)
+            return 1;
+    }
+
+    return 1;
+}
+
+void wire_run(heap_p heap, const char *payload, size_t length, wire_buffer *response) {
+    wire_reader reader = {(const unsigned char *)payload, (const unsigned char *)payload + length, 0};
+
+    int aborted = 0;
+
+    while (reader.pos < reader.end) {
+        int op = *reader.pos;
+        size_t result = response->length;
+
+        if (!run_request(heap, &reader, response, aborted))
+            break;
+
+        if (op == WIRE_COMMIT || op == WIRE_ABORT) {
+            aborted = 0;
+        } else if (response->data[result] != WIRE_OK && heap_in_transaction(heap)) {
+            heap_abort(heap);
+            aborted = 1;
+        }
+    }
+
+    if (heap_in_transaction(heap))
+        heap_abort(heap);
+}
+
+int wire_run_request(heap_p heap, wire_reader *reader, wire_buffer *response) {
+    return run_request(heap, reader, response, 0);
+}
+
+int run_request(heap_p heap, wire_reader *reader, wire_buffer *response, int aborted) {
+    int op = *reader->pos++;
+    cell_index index, car, cdr, value, map, key;
+    char text[MAX_ATOM_TEXT + 1];
+
+    // Read the arguments before doing anything, so that a malformed request
+    // has no effect.
+    switch (op) {
+    case WIRE_GETCAR:
+    case WIRE_GETCDR:
+    case WIRE_GETTAG:
+    case WIRE_GETATOM:
+    case WIRE_FREE:
+    case WIRE_GETCELL:
+        index = read_index_argument(reader);
+        break;
+    case WIRE_SETCAR:
+    case WIRE_SETCDR:
+    case WIRE_SETTAG:
+        index = read_index_argument(reader);
+        value = read_index_argument(reader);
+        break;
+    case WIRE_SETATOM:
+        index = read_index_argument(reader);
+        read_text_argument(reader, text);
+        break;
+    case WIRE_ATOM:
+        read_text_argument(reader, text);
+        break;
+    case WIRE_CONS:
+        car = read_index_argument(reader);
+        cdr = read_index_argument(reader);
+        break;
+    case WIRE_MAPGET:
+    case WIRE_MAPDEL:
+        map = read_index_argument(reader);
+        key = read_index_argument(reader);
+        break;
+    case WIRE_MAPPUT:
+        map = read_index_argument(reader);
+        key = read_index_argument(reader);
+        value = read_index_argument(reader);
+        break;
+    case WIRE_MAPCOUNT:
+        map = read_index_argument(reader);
+        break;
+    case WIRE_ALLOC:
+    case WIRE_MAP:
+    case WIRE_CELLCOUNT:
+    case WIRE_BEGIN:
+    case WIRE_COMMIT:
+    case WIRE_ABORT:
+        break;
+    default:
+        put_status(response, WIRE_UNKNOWN_OP);
+        return 0;
+    }
+
+    if (reader->failed) {
+        put_status(response, WIRE_MALFORMED);
+        return 0;
+    }
+
+    if (aborted) {
+        put_status(response, op == WIRE_ABORT ? WIRE_OK : WIRE_ABORTED);
+        return 1;
+    }
+
+    switch (op) {
+    case WIRE_GETCAR:
+    case WIRE_GETCDR:
+    case WIRE_GETTAG:
+        if (!index_in_range(heap, index)) {
+            put_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+        put_status(response, WIRE_OK);
+        wire_put_int(response, getfield(heap,
+            op == WIRE_GETCAR ? FIELD_CAR : op == WIRE_GETCDR ? FIELD_CDR : FIELD_TAG, index));
+        break;
+
+    case WIRE_GETCELL:
+        if (!index_in_range(heap, index)) {
+            put_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+        put_status(response, WIRE_OK);
+        wire_put_int(response, getfield(heap, FIELD_CAR, index));
+        wire_put_int(response, getfield(heap, FIELD_CDR, index));
+        wire_put_int(response, getfield(heap, FIELD_TAG, index));
+        break;
+
+    case WIRE_GETATOM:
+        if (!index_in_range(heap, index)) {
+            put_status(response, WIRE_OUT_OF_RANGE);
+        } else if (!isatom(heap, index)) {
+            put_status(response, WIRE_NOT_AN_ATOM);
+        } else {
+            const char *atom = getatom(heap, index);
+            put_status(response, WIRE_OK);
+            wire_put_string(response, atom, strlen(atom));
+        }
+        break;
+
+    case WIRE_SETCAR:
+    case WIRE_SETCDR:
+        if (!index_in_range(heap, index)) {
+            put_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+        setfield(heap, op == WIRE_SETCAR ? FIELD_CAR : FIELD_CDR, index, value);
+        put_status(response, WIRE_OK);
+        break;
+
+    case WIRE_SETTAG:
+        if (!index_in_range(heap, index)) {
+            put_status(response, WIRE_OUT_OF_RANGE);
+        } else if (value != TAG_UNINIT && value != TAG_ATOM && value != TAG_CONS) {
+            put_status(response, WIRE_UNKNOWN_TAG);
+        } else {
+            setfield(heap, FIELD_TAG, index, value);
+            put_status(response, WIRE_OK);
+        }
+        break;
+
+    case WIRE_SETATOM:
+        if (!index_in_range(heap, index)) {
+            put_status(response, WIRE_OUT_OF_RANGE);
+            break;
+        }
+        if (!atom_text_fits(heap, text)) {
+            put_status(response, WIRE_NO_SPACE);
+            break;
+        }
+        setatom(heap, index, text);
+        put_status(response, WIRE_OK);
+        break;
+
+    case WIRE_ALLOC:
+    case WIRE_ATOM:
+    case WIRE_MAP:
+        index = op == WIRE_ALLOC ? alloc_cell(heap) : op == WIRE_ATOM ? rc_atom(heap, text) : rc_map(heap);
+        if (index < 0) {
+            put_status(response, WIRE_NO_SPACE);
+            break;
+        }
+        put_status(response, WIRE_OK);
+        wire_put_int(response, index);
+        break;
+
+    case WIRE_CONS:
+        if (!rc_is_valid(heap, car) || !rc_is_valid(heap, cdr)) {
+            put_status(response, WIRE_INVALID_INDEX);
+            break;
+        }
+        index = rc_cons(heap, car, cdr);
+        if (index < 0) {
+            put_status(response, WIRE_NO_SPACE);
+            break;
+        }
+        put_status(response, WIRE_OK);
+        wire_put_int(response, index);
+        break;
+
+    case WIRE_FREE:
+        if (!rc_is_valid(heap, index)) {
+            put_status(response, WIRE_INVALID_INDEX);
+        } else if (!rc_is_unowned(heap, index)) {
+            put_status(response, WIRE_HAS_REFERENCES);
+        } else {
+            rc_free(heap, index);
+            put_status(response, WIRE_OK);
+        }
+        break;
+
+    case WIRE_MAPGET:
+        if (!rc_is_map(heap, map)) {
+            put_status(response, WIRE_NOT_A_MAP);
+        } else if (!rc_is_valid(heap, key)) {
+            put_status(response, WIRE_INVALID_INDEX);
+        } else if ((value = rc_map_get(heap, map, key)) < 0) {
+            put_status(response, WIRE_NOT_FOUND);
+        } else {
+            put_status(response, WIRE_OK);
+            wire_put_int(response, value);
+        }
+        break;
+
+    case WIRE_MAPPUT:
+        if (!rc_is_map(heap, map)) {
+            put_status(response, WIRE_NOT_A_MAP);
+        } else if (!rc_is_valid(heap, key) || key == map || !rc_is_valid(heap, value) || value == map) {
+            put_status(response, WIRE_INVALID_INDEX);
+        } else {
+            rc_map_put(heap, map, key, value);
+            put_status(response, WIRE_OK);
+        }
+        break;
+
+    case WIRE_MAPDEL:
+        if (!rc_is_map(heap, map)) {
+            put_status(response, WIRE_NOT_A_MAP);
+        } else if (!rc_is_valid(heap, key)) {
+            put_status(response, WIRE_INVALID_INDEX);
+        } else if (!rc_map_delete(heap, map, key)) {
+            put_status(response, WIRE_NOT_FOUND);
+        } else {
+            put_status(response, WIRE_OK);
+        }
+        break;
+
+    case WIRE_MAPCOUNT:
+        if (!rc_is_map(heap, map)) {
+            put_status(response, WIRE_NOT_A_MAP);
+            break;
+        }
+        put_status(response, WIRE_OK);
+        wire_put_int(response, rc_map_count(heap, map));
+        break;
+
+    case WIRE_CELLCOUNT:
+        put_status(response, WIRE_OK);
+        wire_put_int(response, cell_count(heap));
+        break;
+
+    case WIRE_BEGIN:
+        if (heap_in_transaction(heap)) {
+            put_status(response, WIRE_BAD_TRANSACTION);
+            break;
+        }
+        heap_begin(heap);
+        put_status(response, WIRE_OK);
+        break;
+
+    case WIRE_COMMIT:
+    case WIRE_ABORT:
+        if (!heap_in_transaction(heap)) {
+            put_status(response, WIRE_BAD_TRANSACTION);
+            break;
+        }
+        if (op == WIRE_COMMIT)
+            heap_commit(heap);
+        else
+            heap_abort(heap);
+        put_status(response, WIRE_OK);
+        break;
+    }
+
+    return 1;
+}
+
+cell_index read_index_argument(wire_reader *reader) {
+    int64_t value = wire_get_int(reader);
+
+    if (value < -INDEX_MAX - 1 || value > INDEX_MAX) {
+        reader->failed = 1;
+        return 0;
+    }
+
+    return value;
+}
+
+void read_text_argument(wire_reader *reader, char *text) {
+    size_t length;
+    const char *data = wire_get_string(reader, &length);
+
+    // Atom text ends at the first NUL, so it can't contain one, and it can't
+    // be empty.
+    if (length == 0 || length > MAX_ATOM_TEXT || memchr(data, '\0', length)) {
+        reader->failed = 1;
+        length = 0;
+    }
+
+    memcpy(text, data, length);
+    text[length] = '\0';
+}
+
+void put_status(wire_buffer *response, int status) {
+    unsigned char byte = status;
+    wire_append(response, &byte, 1);
+}
+
+int index_in_range(heap_p heap, cell_index index) {
+    return index >= 0 && index < cell_count(heap);
+}
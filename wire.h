@@ -0,0 +1,151 @@
+// Copyright 2023 by Tanner Swett and Medallion Instrumentation Systems.
+//
+// This file is part of Poutine. Poutine is free software; you can redistribute
+// it and/or modify it under the terms of version 3 of the GNU General Public
+// License as published by the Free Software Foundation.
+//
+// Poutine is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+// wire.h: A compact binary protocol for heap commands
+
+// The binary protocol carries the same operations as the shell commands, for
+// clients that would rather not format and parse text.
+//
+// Everything is sent in frames. A frame is a varint giving the length of the
+// payload, followed by the payload. A request frame holds any number of
+// requests, each an opcode byte followed by its arguments; the response frame
+// holds one result for each request, in order. A result is a status byte,
+// followed by the operation's return values if the status is WIRE_OK.
+//
+// Numbers are varints: 7 bits per byte, least significant first, with the high
+// bit set on every byte but the last. Signed numbers, which include all cell
+// indices and field values, are zigzag-encoded first, so small negative numbers
+// stay short. Strings are a varint length followed by that many bytes.
+//
+// The requests in a frame are run one after another. If a request is
+// malformed, its result is WIRE_MALFORMED and the rest of the frame is skipped.
+// Atom text that's empty, contains a NUL or is longer than 1024 bytes is
+// malformed.
+//
+// WIRE_BEGIN starts a transaction (see txn.h), which lasts until WIRE_COMMIT or
+// WIRE_ABORT, or until the end of the frame, where it's aborted. If a request
+// in a transaction fails, the transaction is aborted right away, and each
+// request after it, up to and including the WIRE_COMMIT, gets WIRE_ABORTED.
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "heap.h"
+
+// Sent as the first byte of a connection to switch the server to the binary
+// protocol; it can't start a text command
+#define WIRE_HELLO 0xFF
+
+// The largest payload the server accepts in one frame
+#define WIRE_MAX_FRAME (1 << 24)
+
+// Opcodes, with their arguments and return values
+#define WIRE_GETCAR 1       // index -> car
+#define WIRE_GETCDR 2       // index -> cdr
+#define WIRE_GETTAG 3       // index -> tag
+#define WIRE_GETATOM 4      // index -> text
+#define WIRE_SETCAR 5       // index, value ->
+#define WIRE_SETCDR 6       // index, value ->
+#define WIRE_SETTAG 7       // index, tag ->
+#define WIRE_SETATOM 8      // index, text ->
+#define WIRE_ALLOC 9        // -> index
+#define WIRE_ATOM 10        // text -> index
+#define WIRE_CONS 11        // car, cdr -> index
+#define WIRE_FREE 12        // index ->
+#define WIRE_MAP 13         // -> index
+#define WIRE_MAPGET 14      // map, key -> value
+#define WIRE_MAPPUT 15      // map, key, value ->
+#define WIRE_MAPDEL 16      // map, key ->
+#define WIRE_MAPCOUNT 17    // map -> count
+#define WIRE_CELLCOUNT 18   // -> count
+#define WIRE_GETCELL 19     // index -> car, cdr, tag
+#define WIRE_BEGIN 20       // ->
+#define WIRE_COMMIT 21      // ->
+#define WIRE_ABORT 22       // ->
+
+// Result statuses
+#define WIRE_OK 0
+#define WIRE_MALFORMED 1
+#define WIRE_UNKNOWN_OP 2
+#define WIRE_OUT_OF_RANGE 3
+#define WIRE_INVALID_INDEX 4
+#define WIRE_NOT_AN_ATOM 5
+#define WIRE_NOT_A_MAP 6
+#define WIRE_HAS_REFERENCES 7
+#define WIRE_NOT_FOUND 8
+#define WIRE_NO_SPACE 9
+#define WIRE_UNKNOWN_TAG 10
+#define WIRE_ABORTED 11
+#define WIRE_BAD_TRANSACTION 12
+
+// A growable byte buffer for building messages
+typedef struct wire_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} wire_buffer;
+
+// A position in a received message
+//
+// Reading past the end sets failed and returns zero, so a message can be
+// decoded without checking every read, as long as failed is checked at the end.
+typedef struct wire_reader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    int failed;
+} wire_reader;
+
+// Append bytes to a buffer
+//
+// This function panics if it fails to allocate enough memory.
+void wire_append(wire_buffer *buf, const void *data, size_t length);
+// Make sure a buffer can hold the given number of bytes in all; return 0 if
+// there isn't enough memory
+int wire_reserve(wire_buffer *buf, size_t capacity);
+// Append an unsigned varint
+void wire_put_uint(wire_buffer *buf, uint64_t value);
+// Append a signed varint
+void wire_put_int(wire_buffer *buf, int64_t value);
+// Append a string
+void wire_put_string(wire_buffer *buf, const char *text, size_t length);
+// Append a frame holding the given payload
+void wire_put_frame(wire_buffer *buf, const char *payload, size_t length);
+
+// Read an unsigned varint
+uint64_t wire_get_uint(wire_reader *reader);
+// Read a signed varint
+int64_t wire_get_int(wire_reader *reader);
+// Read a string, returning a pointer into the message and setting *length
+const char *wire_get_string(wire_reader *reader, size_t *length);
+
+// Check whether the start of the given data is a complete frame
+//
+// Returns 1 and sets *header and *payload to the sizes of the length prefix
+// and the payload if it is, 0 if more data is needed, and -1 if the frame is
+// malformed or longer than WIRE_MAX_FRAME.
+int wire_frame_ready(const char *data, size_t length, size_t *header, size_t *payload);
+
+// Check whether every request in a payload only reads from the heap
+int wire_is_read_only(const char *payload, size_t length);
+
+// Run the requests in a payload, appending their results to the response
+// payload
+void wire_run(heap_p heap, const char *payload, size_t length, wire_buffer *response);
+// Run the request at the reader's position on its own, appending its result;
+// return 0 if the rest of the payload can't be read
+//
+// Unlike wire_run(), this leaves a transaction running after a failure, the way
+// the shell does.
+int wire_run_request(heap_p heap, wire_reader *reader, wire_buffer *response);
+
+#endif